@@ -0,0 +1,179 @@
+/*******************************************************************************************************************
+ *
+ *        dnstest - runs src/dnscache.h on linux against a fake DNS server in this program
+ *
+ *        dnscache.h is compiled unchanged with ../hoststub/hoststub.h, its queries to port 53 of WiFi.dnsIP() go
+ *        to the fake server on a free port of 127.0.0.1.  The server answers by name:
+ *
+ *              cam.example.com      CNAME (ttl 45) to web.example.com, A 10.1.2.3 (ttl 300)
+ *              missing.example.com  NXDOMAIN
+ *              flaky.example.com    ignores the first query, then A 10.4.5.6
+ *              warm.example.com     A 10.7.7.n (ttl 60) where n counts the queries
+ *
+ *        and the test checks the shortest ttl of a CNAME chain is used, that missing names are remembered, that a
+ *        lost query is sent again, and that a name in use is refreshed by the task before it expires so the
+ *        lookups never wait.  millis() is moved on 1s for every 100ms of real time (the task looks once a second
+ *        of real time, i.e. every 10s of cache time).
+ *
+ *              g++ -O2 -std=c++17 -pthread -I../hoststub -o dnstest dnstest.cpp
+ *              ./dnstest
+ *
+ *******************************************************************************************************************/
+
+#include "../hoststub/hoststub.h"
+
+#include "../../src/dnscache.h"
+
+
+// ---------------------------------------------------------------
+//                      -the fake dns server
+// ---------------------------------------------------------------
+
+std::mutex queryMutex;
+std::map<std::string, int> queries;                        // queries received for each name
+
+static int queryCount(const char *name) {
+    std::lock_guard<std::mutex> lock(queryMutex);
+    return queries[name];
+}
+
+static void putName(std::vector<uint8_t> &p, const std::string &name) {
+    size_t start = 0;
+    while (start < name.size()) {
+        size_t dot = name.find('.', start);
+        if (dot == std::string::npos) dot = name.size();
+        p.push_back(dot - start);
+        p.insert(p.end(), name.begin() + start, name.begin() + dot);
+        start = dot + 1;
+    }
+    p.push_back(0);
+}
+
+static void putRecord(std::vector<uint8_t> &p, const std::vector<uint8_t> &owner, uint16_t type, uint32_t ttl, const std::vector<uint8_t> &data) {
+    p.insert(p.end(), owner.begin(), owner.end());
+    uint8_t fixed[10] = {(uint8_t)(type >> 8), (uint8_t)type, 0, 1, (uint8_t)(ttl >> 24), (uint8_t)(ttl >> 16), (uint8_t)(ttl >> 8), (uint8_t)ttl,
+                         (uint8_t)(data.size() >> 8), (uint8_t)data.size()};
+    p.insert(p.end(), fixed, fixed + 10);
+    p.insert(p.end(), data.begin(), data.end());
+}
+
+static void serve(int fd) {
+    uint8_t q[512];
+    for (;;) {
+        struct sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        ssize_t n = recvfrom(fd, q, sizeof(q), 0, (struct sockaddr *)&from, &fromLen);
+        if (n < 12) continue;
+        std::string name;
+        size_t pos = 12;
+        while (pos < (size_t)n && q[pos]) {
+            if (!name.empty()) name += '.';
+            name.append((const char *)q + pos + 1, q[pos]);
+            pos += q[pos] + 1;
+        }
+        size_t qEnd = pos + 5;
+        int count;
+        {
+            std::lock_guard<std::mutex> lock(queryMutex);
+            count = ++queries[name];
+        }
+        if (name == "flaky.example.com" && count == 1) continue;      // lost
+
+        std::vector<uint8_t> r(q, q + qEnd);
+        r[2] = 0x81;                                       // response, recursion desired
+        r[3] = 0x80;                                       // recursion available
+        r[10] = r[11] = 0;
+        std::vector<uint8_t> self = {0xC0, 12};
+        int answers = 0;
+        if (name == "cam.example.com") {
+            std::vector<uint8_t> target;
+            putName(target, "web.example.com");
+            putRecord(r, self, 5, 45, target);
+            putRecord(r, target, 1, 300, {10, 1, 2, 3});
+            answers = 2;
+        } else if (name == "flaky.example.com") {
+            putRecord(r, self, 1, 120, {10, 4, 5, 6});
+            answers = 1;
+        } else if (name == "warm.example.com") {
+            putRecord(r, self, 1, 60, {10, 7, 7, (uint8_t)count});
+            answers = 1;
+        } else {
+            r[3] |= 3;                                     // NXDOMAIN
+        }
+        r[6] = 0;
+        r[7] = answers;
+        sendto(fd, r.data(), r.size(), 0, (struct sockaddr *)&from, fromLen);
+    }
+}
+
+
+// ---------------------------------------------------------------
+//                            -test
+// ---------------------------------------------------------------
+
+int hostByNameCalls = 0;
+static int countHostByName(const char *, IPAddress &) { hostByNameCalls++; return 0; }
+
+static uint32_t entryTtl(const char *host) {
+    for (uint8_t i = 0; i < dnsCacheSize; i++) if (strcmp(dnsCache[i].host, host) == 0) return dnsCache[i].ttl / 1000;
+    return 0;
+}
+
+int main() {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t l = sizeof(a);
+    bind(fd, (struct sockaddr *)&a, sizeof(a));
+    getsockname(fd, (struct sockaddr *)&a, &l);
+    hostPortMap[53] = ntohs(a.sin_port);
+    std::thread(serve, fd).detach();
+    hostByNameHook = countHostByName;
+
+    // CNAME chain, the shortest ttl applies
+    IPAddress ip;
+    bool found = dnsLookup("cam.example.com", ip);
+    check(found && ip == IPAddress(10, 1, 2, 3), "cam.example.com found through its CNAME (%s)", ip.toString().c_str());
+    check(entryTtl("cam.example.com") == 45, "ttl 45s, the CNAME's (%us)", entryTtl("cam.example.com"));
+    found = dnsLookup("cam.example.com", ip);
+    check(found && queryCount("cam.example.com") == 1 && dnsHits == 1, "second lookup from the cache (%d queries)", queryCount("cam.example.com"));
+
+    // NXDOMAIN remembered
+    found = dnsLookup("missing.example.com", ip);
+    found |= dnsLookup("missing.example.com", ip);
+    check(!found && queryCount("missing.example.com") == 1, "missing name looked up once for two lookups (%d queries)", queryCount("missing.example.com"));
+    check(entryTtl("missing.example.com") == dnsNegativeTtl, "and remembered for %us", entryTtl("missing.example.com"));
+
+    // query lost, sent again
+    found = dnsLookup("flaky.example.com", ip);
+    check(found && ip == IPAddress(10, 4, 5, 6) && queryCount("flaky.example.com") == 2, "lost query sent again (%d queries)", queryCount("flaky.example.com"));
+    check(hostByNameCalls == 0, "WiFi.hostByName() not needed (%d)", hostByNameCalls);
+
+    // ip address
+    uint32_t misses = dnsMisses;
+    found = dnsLookup("192.168.1.20", ip);
+    check(found && ip == IPAddress(192, 168, 1, 20) && dnsMisses == misses, "ip address not looked up");
+
+    // a name in use for 150s with a ttl of 60s, the task keeps it fresh
+    dnsSetup();
+    found = dnsLookup("warm.example.com", ip);
+    uint32_t worst = 0, hits = dnsHits;
+    misses = dnsMisses;
+    std::vector<uint8_t> seen;
+    for (int i = 0; i < 150; i++) {
+        delay(100);
+        hostAdvance(1000 - 100);                            // 1s of cache time for every 100ms
+        auto start = std::chrono::steady_clock::now();
+        found &= dnsLookup("warm.example.com", ip);
+        worst = std::max(worst, (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+        if (seen.empty() || seen.back() != ip[3]) seen.push_back(ip[3]);
+    }
+    check(found && dnsHits - hits == 150 && dnsMisses == misses, "150 lookups all answered from the cache (%u misses)", dnsMisses - misses);
+    check(worst < 1000, "slowest lookup %uus", worst);
+    int refreshed = queryCount("warm.example.com") - 1;
+    check(refreshed >= 2 && seen.size() == (size_t)refreshed + 1, "refreshed %d times in the background, each new address used (%zu seen)", refreshed, seen.size());
+    printf("%s\n", dnsStatus().c_str());
+
+    return checkResult();
+}
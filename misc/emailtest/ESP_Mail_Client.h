@@ -0,0 +1,105 @@
+/*******************************************************************************************************************
+ *
+ *        Fake ESP_Mail_Client for emailtest.cpp - the parts of the library email.h uses
+ *
+ *        Nothing is sent, MailClient.sendMail() records the message (subject, recipients, text and for each
+ *        attachment its name and the buffer it points at) in fakeMail.sent.  connect() or sendMail() can be told
+ *        to fail.
+ *
+ *******************************************************************************************************************/
+
+namespace Content_Transfer_Encoding {
+    const char enc_7bit[] = "7bit";
+    const char enc_base64[] = "base64";
+}
+enum esp_mail_smtp_priority { esp_mail_smtp_priority_high = 1, esp_mail_smtp_priority_normal = 3, esp_mail_smtp_priority_low = 5 };
+enum { esp_mail_smtp_notify_never = 0, esp_mail_smtp_notify_success = 1, esp_mail_smtp_notify_failure = 2, esp_mail_smtp_notify_delay = 4 };
+
+struct ESP_Mail_Session {
+    struct { std::string host_name; uint16_t port = 0; } server;
+    struct { std::string email, password, user_domain; } login;
+};
+
+struct SMTP_Attachment {
+    struct { std::string filename, mime, transfer_encoding; } descr;
+    struct { const uint8_t *data = NULL; size_t size = 0; } blob;
+};
+
+struct SMTP_Message {
+    struct { std::string name, email; } sender;
+    std::string subject;
+    std::vector<std::string> recipients;
+    struct { std::string content, charSet, transfer_encoding; } text;
+    int priority = 0;
+    struct { int notify = 0; } response;
+    std::vector<SMTP_Attachment> attachments;
+    void addRecipient(const char *, const char *email) { recipients.push_back(email); }
+    void addAttachment(SMTP_Attachment &att) { attachments.push_back(att); }
+};
+
+struct SMTP_Result { bool completed; const char *recipients; const char *subject; uint32_t timestamp; };
+struct SMTP_Status {
+    const char *info() { return ""; }
+    bool success() { return true; }
+    int completedCount() { return 1; }
+    int failedCount() { return 0; }
+};
+
+// a sent email, with the attachments as they were when it was sent
+struct FakeMail {
+    std::string subject, body, host;
+    std::vector<std::string> recipients;
+    std::vector<std::string> names;
+    std::vector<const uint8_t *> buffers;
+    std::vector<std::string> contents;
+    uint32_t time;
+};
+
+struct {
+    std::mutex m;
+    std::vector<FakeMail> sent;
+    int failConnect = 0;                                   // fail this many connects
+    std::string lastHost;                                  // host name the session connected to
+} fakeMail;
+
+class SMTPSession {
+    public:
+    struct {
+        size_t size() { return 0; }
+        SMTP_Result getItem(size_t) { return SMTP_Result{true, "", "", 0}; }
+    } sendingResult;
+    void debug(int) {}
+    void callback(void (*)(SMTP_Status)) {}
+    bool connect(ESP_Mail_Session *session) {
+        std::lock_guard<std::mutex> lock(fakeMail.m);
+        fakeMail.lastHost = session->server.host_name;
+        if (fakeMail.failConnect) {
+            fakeMail.failConnect--;
+            _error = "could not connect to server";
+            return false;
+        }
+        return true;
+    }
+    String errorReason() { return String(_error.c_str()); }
+    private:
+    std::string _error;
+};
+
+struct {
+    bool sendMail(SMTPSession *, SMTP_Message *msg, bool) {
+        FakeMail mail;
+        mail.subject = msg->subject;
+        mail.body = msg->text.content;
+        mail.recipients = msg->recipients;
+        for (auto &att : msg->attachments) {
+            mail.names.push_back(att.descr.filename);
+            mail.buffers.push_back(att.blob.data);
+            mail.contents.push_back(std::string((const char *)att.blob.data, att.blob.size));
+        }
+        mail.time = millis();
+        std::lock_guard<std::mutex> lock(fakeMail.m);
+        mail.host = fakeMail.lastHost;
+        fakeMail.sent.push_back(mail);
+        return true;
+    }
+} MailClient;
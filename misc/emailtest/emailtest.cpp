@@ -0,0 +1,117 @@
+/*******************************************************************************************************************
+ *
+ *        emailtest - runs the email queue of src/email.h on linux with a fake mail library
+ *
+ *        email.h is compiled unchanged with ../hoststub/hoststub.h and the fake ESP_Mail_Client.h in this folder,
+ *        which records each email instead of sending it (there is no SMTP here, the library only runs on the
+ *        esp32).  millis() is moved on rather than waiting for the digest and retry times.  Checks:
+ *
+ *              triggers close together become one digest listing them all with the first photos attached
+ *              the photos are attached from the caller's buffers (not copied) and each is released once sent
+ *              a photo given without a release function is copied, and the copy freed
+ *              a trigger within EmailLimitTime of the last email waits for the limit to pass
+ *              a failed send is retried after EmailAttemptTime
+ *              the smtp server is connected to by name (emailUseDnsCache off) so TLS gets its name
+ *
+ *              g++ -O2 -std=c++17 -pthread -I. -o emailtest emailtest.cpp
+ *              ./emailtest
+ *
+ *******************************************************************************************************************/
+
+#include "../hoststub/hoststub.h"
+
+// from main.cpp, net.h, outbound.h and dnscache.h
+uint32_t EMAILtimer = 0;
+uint16_t EmailLimitTime = 60;
+#define _SenderName "ESP"
+#define OUT_EVENT 0
+void outboundAcquire(uint8_t, size_t) {}
+void outboundRelease(uint8_t, size_t) {}
+bool dnsLookup(const char *host, IPAddress &ip) { return ip.fromString("127.0.0.1"); }
+void dnsPrefetch(const char *) {}
+
+#define EMAIL_ENABLED
+#include "../../src/email.h"
+
+
+// ---------------------------------------------------------------
+//                            -test
+// ---------------------------------------------------------------
+
+struct photo_t {
+    std::vector<uint8_t> buf;
+    int released = 0;
+};
+static void releasePhoto(void *ctx) { ((photo_t *)ctx)->released++; }
+
+// wait until cond() or the time is up (real time, the email task looks at the queue every 250ms)
+template <typename F> static bool waitFor(F cond, uint32_t ms = 2000) {
+    for (uint32_t waited = 0; !cond(); waited += 20) {
+        if (waited > ms) return false;
+        delay(20);
+    }
+    return true;
+}
+
+static size_t sentCount() {
+    std::lock_guard<std::mutex> lock(fakeMail.m);
+    return fakeMail.sent.size();
+}
+
+int main() {
+    emailSetup();
+
+    // five triggers close together, each with its photo
+    photo_t photo[5];
+    int kept = 0;
+    for (int i = 0; i < 5; i++) {
+        photo[i].buf.assign(10000 + i, (uint8_t)('a' + i));
+        kept += emailTrigger("12:00:0" + String(i), photo[i].buf.data(), photo[i].buf.size(), "photo" + String(i) + ".jpg", releasePhoto, &photo[i]);
+    }
+    check(kept == emailMaxAttachments, "%u photos kept, the rest given back (%d)", emailMaxAttachments, kept);
+    delay(600);
+    check(sentCount() == 0, "digest waits emailDigestWait for more triggers");
+    hostAdvance(emailDigestWait);
+    check(waitFor([] { return sentCount() == 1; }), "one email for 5 triggers");
+    FakeMail digest = fakeMail.sent[0];
+    check(digest.subject == "ESPcamera - 5 triggers", "subject '%s'", digest.subject.c_str());
+    check(digest.host == _SMTP, "connected to the smtp server by name, so TLS can check it ('%s')", digest.host.c_str());
+    check(digest.body.find("12:00:00") != std::string::npos && digest.body.find("12:00:04") != std::string::npos, "all triggers listed");
+    bool same = digest.buffers.size() == emailMaxAttachments;
+    for (size_t i = 0; same && i < digest.buffers.size(); i++) same = digest.buffers[i] == photo[i].buf.data() && digest.names[i] == "photo" + std::to_string(i) + ".jpg";
+    check(same, "first %u photos attached straight from their buffers (%zu attached)", emailMaxAttachments, digest.buffers.size());
+    int releasedOnce = 0;
+    for (int i = 0; i < 5; i++) releasedOnce += photo[i].released == (i < emailMaxAttachments ? 1 : 0);
+    check(releasedOnce == 5, "attached photos released once, others not at all");
+    check(EMAILtimer != 0 && emailTriggersSent == 5 && emailDigests == 1, "EMAILtimer set, 5 triggers in 1 digest counted");
+
+    // a trigger straight after has to wait for EmailLimitTime, its photo is copied as there is no release
+    uint32_t lastEmail = EMAILtimer;
+    std::vector<uint8_t> copied(5000, 'z');
+    kept = emailTrigger("12:00:10", copied.data(), copied.size(), "photo5.jpg", NULL, NULL);
+    check(kept == 0, "photo without a release function is not kept");
+    copied.assign(copied.size(), 'x');                     // caller reuses its buffer
+    hostAdvance(emailDigestWait + 1000);
+    delay(600);
+    check(sentCount() == 1, "not sent within EmailLimitTime of the last email");
+    hostAdvance(EmailLimitTime * 1000);
+    check(waitFor([] { return sentCount() == 2; }), "sent once EmailLimitTime has passed");
+    FakeMail later = fakeMail.sent[1];
+    check(later.time - lastEmail >= EmailLimitTime * 1000u, "%.1fs after the last email", (later.time - lastEmail) / 1000.0);
+    check(later.contents.size() == 1 && later.buffers[0] != copied.data() && later.contents[0] == std::string(5000, 'z'),
+          "photo attached from a copy made when it was queued");
+
+    // failed send, retried
+    fakeMail.failConnect = 1;
+    size_t logFrom = hostLogSize();
+    emailQueue("test message", "this is a test email");
+    check(waitFor([&] { return hostLogged("Sending email 'test message' failed, SMTP: could not connect", logFrom); }), "failure logged");
+    delay(600);
+    check(sentCount() == 2, "not retried straight away");
+    hostAdvance(EmailAttemptTime * 1000);
+    check(waitFor([] { return sentCount() == 3; }), "sent on the retry");
+    check(fakeMail.sent[2].subject == "test message" && emailSent == 3 && emailFailed == 0 && emailCount == 0, "3 sent, none failed, queue empty");
+    printf("%s\n", emailStatus().c_str());
+
+    return checkResult();
+}
@@ -0,0 +1,215 @@
+/*******************************************************************************************************************
+ *
+ *        ftptest - runs src/ftp.h on linux against a small ftp server in this program
+ *
+ *        ftp.h is compiled unchanged with ../hoststub/hoststub.h (WiFiClient as real sockets).  The server
+ *        answers USER, PASS, TYPE, CWD, PASV, STOR, NOOP and QUIT, keeps what is stored in memory and can be
+ *        told to close the session every n files, to time it out while idle or to refuse files.  Checks:
+ *
+ *              the session is logged in once and reused for every image, which arrives intact
+ *              a session closed by the server is noticed and logged in again without losing the image
+ *              an idle session is checked with NOOP and reopened if the server has dropped it
+ *              a refused file and a server which is not running are failures, reported in the log
+ *
+ *              g++ -O2 -std=c++17 -pthread -o ftptest ftptest.cpp
+ *              ./ftptest
+ *
+ *******************************************************************************************************************/
+
+#include "../hoststub/hoststub.h"
+
+bool dnsLookup(const char *host, IPAddress &ip) { return ip.fromString(host); }       // dnscache.h
+
+#define FTP_ENABLED
+#include "../../src/ftp.h"
+
+
+// ---------------------------------------------------------------
+//                        -the ftp server
+// ---------------------------------------------------------------
+
+struct {
+    std::mutex m;
+    std::map<std::string, std::string> files;              // name (with folder) -> contents
+    int logins = 0;
+    int closeEvery = 0;                                    // close the session after this many files (0 = never)
+    bool refuse = 0;                                       // reply 553 to STOR
+    bool dropIdle = 0;                                     // reply 421 to NOOP and close (session timed out)
+} server;
+
+static int listenOn(uint16_t &port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    a.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&a, sizeof(a)) != 0 || listen(fd, 4) != 0) { close(fd); return -1; }
+    socklen_t l = sizeof(a);
+    getsockname(fd, (struct sockaddr *)&a, &l);
+    port = ntohs(a.sin_port);
+    return fd;
+}
+
+static void say(int fd, const std::string &text) { send(fd, text.data(), text.size(), MSG_NOSIGNAL); }
+
+static bool readCommand(int fd, std::string &line) {
+    line.clear();
+    char c;
+    while (recv(fd, &c, 1, 0) == 1) {
+        if (c == '\n') {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            return true;
+        }
+        line += c;
+    }
+    return false;
+}
+
+static void session(int fd) {
+    say(fd, "220-test ftp server\r\n220-second line of the greeting\r\n220 ready\r\n");
+    std::string line, user, folder = "/";
+    int stored = 0, dataListen = -1;
+    while (readCommand(fd, line)) {
+        std::string cmd = line.substr(0, line.find(' ')), arg = line.find(' ') == std::string::npos ? "" : line.substr(line.find(' ') + 1);
+        if (cmd == "USER") { user = arg; say(fd, "331 password please\r\n"); }
+        else if (cmd == "PASS") {
+            std::lock_guard<std::mutex> lock(server.m);
+            server.logins++;
+            say(fd, "230-welcome\r\n 230 lines of text can follow\r\n230 logged in\r\n");
+        }
+        else if (cmd == "TYPE") say(fd, "200 type set\r\n");
+        else if (cmd == "CWD") { folder = arg; say(fd, "250 folder changed\r\n"); }
+        else if (cmd == "NOOP") {
+            if (server.dropIdle) { say(fd, "421 timeout\r\n"); break; }
+            say(fd, "200 ok\r\n");
+        }
+        else if (cmd == "PASV") {
+            uint16_t port = 0;
+            if (dataListen >= 0) close(dataListen);
+            dataListen = listenOn(port);
+            char reply[80];
+            snprintf(reply, sizeof(reply), "227 Entering Passive Mode (10,9,8,7,%d,%d)\r\n", port >> 8, port & 0xFF);   // address is ignored
+            say(fd, reply);
+        }
+        else if (cmd == "STOR") {
+            if (server.refuse || dataListen < 0) { say(fd, "553 not allowed\r\n"); continue; }
+            say(fd, "150 send it\r\n");
+            int data = accept(dataListen, NULL, NULL);
+            close(dataListen);
+            dataListen = -1;
+            std::string contents;
+            char buf[16384];
+            ssize_t n;
+            while ((n = recv(data, buf, sizeof(buf), 0)) > 0) contents.append(buf, n);
+            close(data);
+            {
+                std::lock_guard<std::mutex> lock(server.m);
+                server.files[folder + arg] = contents;
+            }
+            say(fd, "226 stored\r\n");
+            if (server.closeEvery && ++stored % server.closeEvery == 0) break;
+        }
+        else if (cmd == "QUIT") { say(fd, "221 bye\r\n"); break; }
+        else say(fd, "502 not implemented\r\n");
+    }
+    if (dataListen >= 0) close(dataListen);
+    close(fd);
+}
+
+static void serve(int listenFd) {
+    for (;;) {
+        int fd = accept(listenFd, NULL, NULL);
+        if (fd < 0) return;
+        std::thread(session, fd).detach();
+    }
+}
+
+
+// ---------------------------------------------------------------
+//                            -tests
+// ---------------------------------------------------------------
+
+static std::vector<uint8_t> image(int n) {
+    std::vector<uint8_t> buf(30000 + n * 777);
+    for (size_t i = 0; i < buf.size(); i++) buf[i] = (uint8_t)(i * 31 + n);
+    return buf;
+}
+
+// send images first..first+count-1, returns how many the server holds intact
+static int sendImages(int first, int count) {
+    int ok = 0;
+    for (int n = first; n < first + count; n++) {
+        std::vector<uint8_t> buf = image(n);
+        bool sent = uploadImageByFTP(buf.data(), buf.size(), "img" + String(n));
+        std::lock_guard<std::mutex> lock(server.m);
+        auto it = server.files.find(std::string(ftp_folder) + "img" + std::to_string(n) + ".jpg");
+        if (sent && it != server.files.end() && it->second == std::string(buf.begin(), buf.end())) ok++;
+    }
+    return ok;
+}
+
+static void resetCounts() {
+    std::lock_guard<std::mutex> lock(server.m);
+    server.logins = 0;
+    server.files.clear();
+    ftpLogins = ftpStale = ftpUploads = ftpFailures = 0;
+}
+
+int main() {
+    uint16_t port = 0;
+    int listenFd = listenOn(port);
+    hostPortMap[ftp_port] = port;
+    strcpy(ftp_server, "127.0.0.1");
+    std::thread(serve, listenFd).detach();
+
+    // session kept open
+    int ok = sendImages(0, 20);
+    check(ok == 20, "20 of 20 images stored intact (%d)", ok);
+    check(server.logins == 1 && ftpLogins == 1, "one login for 20 images (%d)", server.logins);
+
+    // server closes the session every 3 files
+    resetCounts();
+    ftpControl.stop();
+    ftpLoggedIn = 0;
+    server.closeEvery = 3;
+    ok = sendImages(100, 10);
+    check(ok == 10, "10 of 10 stored with the server closing the session every 3 files (%d)", ok);
+    check(server.logins == 4, "4 logins (%d), %u seen as closed by the server", server.logins, ftpStale);
+    check(ftpFailures == 0, "no failures (%u)", ftpFailures);
+    server.closeEvery = 0;
+
+    // idle longer than ftpCheckIdle, the server has timed the session out (says so to the NOOP)
+    resetCounts();
+    ok = sendImages(200, 1);
+    hostAdvance(ftpCheckIdle + 1000);
+    server.dropIdle = 1;
+    ok += sendImages(201, 1);
+    server.dropIdle = 0;
+    check(ok == 2, "image after a long idle time stored (%d of 2)", ok);
+    check(ftpStale == 1 && server.logins == 1, "stale session found by NOOP and logged in again (%u stale, %d logins)", ftpStale, server.logins);
+
+    // file refused, not retried
+    resetCounts();
+    server.refuse = 1;
+    size_t logFrom = hostLogSize();
+    ok = sendImages(300, 1);
+    server.refuse = 0;
+    check(ok == 0 && ftpFailures == 1, "refused file is a failure (%u)", ftpFailures);
+    check(hostLogged("STOR refused - 553", logFrom), "refusal and the server's reply logged");
+
+    // no server
+    resetCounts();
+    shutdown(listenFd, SHUT_RDWR);
+    close(listenFd);
+    ftpControl.stop();
+    ftpLoggedIn = 0;
+    logFrom = hostLogSize();
+    ok = sendImages(400, 1);
+    check(ok == 0 && ftpFailures == 1, "no server is a failure (%u)", ftpFailures);
+    check(hostLogged("connection to 127.0.0.1 failed", logFrom), "failed connection logged");
+    printf("%s\n", ftpStatus().c_str());
+
+    return checkResult();
+}
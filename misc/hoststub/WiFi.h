@@ -0,0 +1 @@
+// WiFiClient, WiFiServer and WiFi are in hoststub.h
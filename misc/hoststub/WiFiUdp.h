@@ -0,0 +1 @@
+// WiFiUDP is in hoststub.h
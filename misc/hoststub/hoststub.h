@@ -0,0 +1,450 @@
+/*******************************************************************************************************************
+ *
+ *        hoststub.h - just enough of Arduino, the esp32 and FreeRTOS to compile the sketch's modules on linux
+ *
+ *        Used by the host tests in misc/ (ftptest, emailtest, dnstest...), which include this and then the module
+ *        from src/ unchanged.  The network classes are real sockets, tasks are threads and millis() can be moved
+ *        on with hostAdvance() so timeouts can be tested without waiting for them.  Ports the sketch has fixed
+ *        (21 for ftp, 53 for dns) can be sent somewhere else with hostPortMap[21] = 2121.
+ *
+ *        A test then uses check(ok, "what %d", n) for each result and returns checkResult() from main().
+ *
+ *******************************************************************************************************************/
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+// ---------------------------------------------------------------
+//                       -String and time
+// ---------------------------------------------------------------
+
+class String {
+    std::string s;
+    public:
+    String() {}
+    String(const char *p) : s(p ? p : "") {}
+    String(const std::string &v) : s(v) {}
+    String(char c) : s(1, c) {}
+    template <typename T, typename = std::enable_if_t<std::is_integral<T>::value && !std::is_same<T, char>::value>>
+    String(T v) : s(std::to_string(v)) {}
+    String(double v, int decimals = 2) { char b[40]; snprintf(b, sizeof(b), "%.*f", decimals, v); s = b; }
+    const char *c_str() const { return s.c_str(); }
+    const std::string &str() const { return s; }
+    size_t length() const { return s.size(); }
+    char operator[](size_t i) const { return i < s.size() ? s[i] : 0; }
+    bool startsWith(const char *b) const { return s.compare(0, strlen(b), b) == 0; }
+    bool endsWith(const char *e) const { size_t n = strlen(e); return s.size() >= n && s.compare(s.size() - n, n, e) == 0; }
+    int indexOf(const char *t, size_t from = 0) const { size_t p = s.find(t, from); return p == std::string::npos ? -1 : (int)p; }
+    int indexOf(char ch, size_t from = 0) const { size_t p = s.find(ch, from); return p == std::string::npos ? -1 : (int)p; }
+    int lastIndexOf(char ch) const { size_t p = s.rfind(ch); return p == std::string::npos ? -1 : (int)p; }
+    String substring(size_t from, size_t to = std::string::npos) const {
+        if (from > s.size()) return String();
+        return s.substr(from, to == std::string::npos ? to : std::max(to, from) - from);
+    }
+    long toInt() const { return atol(s.c_str()); }
+    bool equals(const char *o) const { return s == o; }
+    bool operator==(const char *o) const { return s == o; }
+    bool operator==(const String &o) const { return s == o.s; }
+    bool operator!=(const char *o) const { return s != o; }
+    String &operator+=(const String &o) { s += o.s; return *this; }
+    String &operator+=(const char *o) { s += o; return *this; }
+    String &operator+=(char c) { s += c; return *this; }
+    friend String operator+(const String &a, const String &b) { return String(a.s + b.s); }
+    friend String operator+(const char *a, const String &b) { return String(a + b.s); }
+    friend String operator+(const String &a, const char *b) { return String(a.s + b); }
+};
+
+template <typename T> T min(T a, T b) { return a < b ? a : b; }
+template <typename T> T max(T a, T b) { return a > b ? a : b; }
+template <typename T> T constrain(T v, T lo, T hi) { return v < lo ? lo : (v > hi ? hi : v); }
+
+static const auto hostStart = std::chrono::steady_clock::now();
+std::atomic<uint32_t> hostClockOffset{1000};                // added to millis() (starts at 1s, as if booted), see hostAdvance()
+uint32_t millis() {
+    return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - hostStart).count() + hostClockOffset;
+}
+void hostAdvance(uint32_t ms) { hostClockOffset += ms; }   // as if ms had passed
+void delay(uint32_t ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+
+size_t strlcpy(char *dst, const char *src, size_t size) {
+    size_t n = strlen(src);
+    if (size) {
+        size_t c = std::min(n, size - 1);
+        memcpy(dst, src, c);
+        dst[c] = 0;
+    }
+    return n;
+}
+
+void (*hostSerialHook)(const uint8_t *, size_t) = NULL;     // gets what is written with Serial.write() if set
+struct {
+    size_t write(const uint8_t *buf, size_t len) {
+        if (hostSerialHook) hostSerialHook(buf, len);
+        else fwrite(buf, 1, len, stdout);
+        return len;
+    }
+    void print(const String &t) { fputs(t.c_str(), stdout); }
+    void println(const String &t = "") { puts(t.c_str()); }
+    void printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+        va_list args;
+        va_start(args, fmt);
+        vprintf(fmt, args);
+        va_end(args);
+    }
+} Serial __attribute__((unused));
+
+
+// ---------------------------------------------------------------
+//                   -log (logring.h / logtx.h)
+// ---------------------------------------------------------------
+
+uint8_t serialDebug = 0;
+std::mutex hostLogMutex;
+std::vector<std::string> hostLog;                          // everything logged, for the tests to look at
+
+#ifndef HOST_LOGRING                                       // the test compiles logring.h itself
+#define LOG_ERROR 1
+#define LOG_WARN  2
+#define LOG_INFO  3
+#define LOG_DEBUG 4
+#ifndef LOG_COMPILED
+#define LOG_COMPILED LOG_DEBUG
+#endif
+uint8_t logLevel = LOG_INFO;
+
+void log_system_message(String m) {
+    std::lock_guard<std::mutex> lock(hostLogMutex);
+    printf("  %7.2fs  %s\n", millis() / 1000.0, m.c_str());
+    hostLog.push_back(m.str());
+}
+void logPrintf(uint8_t level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void logPrintf(uint8_t level, const char *fmt, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    log_system_message(buf);
+}
+#define LOG_AT(level, ...)  do { if ((level) <= LOG_COMPILED && (level) <= logLevel) logPrintf((level), __VA_ARGS__); } while (0)
+#define LOGE(...)           LOG_AT(LOG_ERROR, __VA_ARGS__)
+#define LOGW(...)           LOG_AT(LOG_WARN, __VA_ARGS__)
+#define LOGI(...)           LOG_AT(LOG_INFO, __VA_ARGS__)
+#define LOGD(...)           LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define DBG(...)            do { if (LOG_COMPILED >= LOG_DEBUG && serialDebug) txPrintf(__VA_ARGS__); } while (0)
+#define DBG_ON              (LOG_COMPILED >= LOG_DEBUG && serialDebug)
+#endif
+
+#ifndef HOST_LOGTX                                         // the test compiles logtx.h itself
+void txPrintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void txPrintf(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+}
+#endif
+
+// was text containing "what" logged since entry "from" of hostLog
+bool hostLogged(const char *what, size_t from = 0) {
+    std::lock_guard<std::mutex> lock(hostLogMutex);
+    for (size_t i = from; i < hostLog.size(); i++) if (hostLog[i].find(what) != std::string::npos) return true;
+    return false;
+}
+size_t hostLogSize() {
+    std::lock_guard<std::mutex> lock(hostLogMutex);
+    return hostLog.size();
+}
+
+
+// ---------------------------------------------------------------
+//                   -FreeRTOS and esp32 bits
+// ---------------------------------------------------------------
+
+typedef std::recursive_timed_mutex *SemaphoreHandle_t;
+struct hostTask_t {                                        // a task's notification count
+    std::mutex m;
+    std::condition_variable cv;
+    uint32_t count = 0;
+};
+typedef hostTask_t *TaskHandle_t;
+thread_local hostTask_t *hostCurrentTask = NULL;
+typedef int BaseType_t;
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS 1
+#define portMAX_DELAY 0xFFFFFFFF
+#define pdMS_TO_TICKS(ms) (ms)
+SemaphoreHandle_t xSemaphoreCreateMutex() { return new std::recursive_timed_mutex; }
+int xSemaphoreTake(SemaphoreHandle_t m, uint32_t ms) {
+    if (ms == portMAX_DELAY) { m->lock(); return pdTRUE; }
+    return m->try_lock_for(std::chrono::milliseconds(ms));
+}
+void xSemaphoreGive(SemaphoreHandle_t m) { m->unlock(); }
+void vTaskDelay(uint32_t ms) { delay(ms); }
+bool hostTasks = 1;                                        // 0 = xTaskCreate does not start the task
+int xTaskCreate(void (*fn)(void *), const char *, int, void *param, int, TaskHandle_t *handle) {
+    if (handle) *handle = NULL;
+    if (!hostTasks) return pdPASS;
+    hostTask_t *task = new hostTask_t;
+    if (handle) *handle = task;
+    std::thread([=] { hostCurrentTask = task; fn(param); }).detach();
+    return pdPASS;
+}
+void xTaskNotifyGive(TaskHandle_t task) {
+    std::lock_guard<std::mutex> lock(task->m);
+    task->count++;
+    task->cv.notify_one();
+}
+uint32_t ulTaskNotifyTake(BaseType_t clear, uint32_t ms) {
+    hostTask_t *task = hostCurrentTask;
+    if (!task) { delay(ms == portMAX_DELAY ? 1000 : ms); return 0; }
+    std::unique_lock<std::mutex> lock(task->m);
+    auto ready = [&] { return task->count > 0; };
+    if (ms == portMAX_DELAY) task->cv.wait(lock, ready);
+    else task->cv.wait_for(lock, std::chrono::milliseconds(ms), ready);
+    uint32_t n = task->count;
+    task->count = clear ? 0 : (n ? n - 1 : 0);
+    return n;
+}
+
+typedef std::recursive_mutex portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {}
+#define portENTER_CRITICAL(m) (m)->lock()
+#define portEXIT_CRITICAL(m) (m)->unlock()
+
+#define MALLOC_CAP_SPIRAM 1
+#define MALLOC_CAP_8BIT 2
+void *heap_caps_malloc(size_t n, int) { return malloc(n); }
+void heap_caps_free(void *p) { free(p); }
+bool psramFound() { return 0; }
+uint32_t esp_random() {
+    static std::mt19937 rng(std::random_device{}());
+    return rng();
+}
+
+
+// ---------------------------------------------------------------
+//                         -network
+// ---------------------------------------------------------------
+
+std::map<uint16_t, uint16_t> hostPortMap;                   // port the sketch uses -> port actually used
+static uint16_t hostPort(uint16_t port) {
+    auto it = hostPortMap.find(port);
+    return it == hostPortMap.end() ? port : it->second;
+}
+
+class IPAddress {
+    uint8_t b[4] = {0, 0, 0, 0};
+    public:
+    IPAddress() {}
+    IPAddress(uint8_t a, uint8_t b1, uint8_t c, uint8_t d) : b{a, b1, c, d} {}
+    uint8_t operator[](int i) const { return b[i]; }
+    bool operator==(const IPAddress &o) const { return memcmp(b, o.b, 4) == 0; }
+    bool fromString(const char *t) {
+        unsigned v[4];
+        char end;
+        if (sscanf(t, "%u.%u.%u.%u%c", &v[0], &v[1], &v[2], &v[3], &end) != 4) return false;
+        for (int i = 0; i < 4; i++) {
+            if (v[i] > 255) return false;
+            b[i] = v[i];
+        }
+        return true;
+    }
+    String toString() const { char t[16]; snprintf(t, sizeof(t), "%u.%u.%u.%u", b[0], b[1], b[2], b[3]); return String(t); }
+    struct in_addr addr() const { struct in_addr a; memcpy(&a.s_addr, b, 4); return a; }
+    static IPAddress from(struct in_addr a) { IPAddress ip; memcpy(ip.b, &a.s_addr, 4); return ip; }
+};
+
+class WiFiClient {                                         // copies share the socket, as in the esp32 library
+    struct socket_t {
+        int fd;
+        ~socket_t() { if (fd >= 0) close(fd); }
+    };
+    std::shared_ptr<socket_t> sock;
+    public:
+    WiFiClient() {}
+    explicit WiFiClient(int accepted) : sock(new socket_t{accepted}) {}
+    int fd() const { return sock ? sock->fd : -1; }
+    bool connect(IPAddress ip, uint16_t port) {
+        stop();
+        sock.reset(new socket_t{socket(AF_INET, SOCK_STREAM, 0)});
+        struct sockaddr_in a = {};
+        a.sin_family = AF_INET;
+        a.sin_port = htons(hostPort(port));
+        a.sin_addr = ip.addr();
+        if (::connect(fd(), (struct sockaddr *)&a, sizeof(a)) != 0) { stop(); return false; }
+        return true;
+    }
+    bool connect(const char *host, uint16_t port) {
+        IPAddress ip;
+        return ip.fromString(host) && connect(ip, port);
+    }
+    void setNoDelay(bool on) { int v = on; if (fd() >= 0) setsockopt(fd(), IPPROTO_TCP, TCP_NODELAY, &v, sizeof(v)); }
+    int available() {
+        if (fd() < 0) return 0;
+        char t[4096];
+        ssize_t n = recv(fd(), t, sizeof(t), MSG_PEEK | MSG_DONTWAIT);
+        return n > 0 ? (int)n : 0;
+    }
+    uint8_t connected() {                                  // open, or data still to read (as the esp32 library)
+        if (fd() < 0) return 0;
+        char t;
+        ssize_t n = recv(fd(), &t, 1, MSG_PEEK | MSG_DONTWAIT);
+        return n > 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+    }
+    int read() { uint8_t c; return (fd() >= 0 && recv(fd(), &c, 1, MSG_DONTWAIT) == 1) ? c : -1; }
+    int read(uint8_t *buf, size_t len) { ssize_t n = fd() >= 0 ? recv(fd(), buf, len, MSG_DONTWAIT) : -1; return n > 0 ? (int)n : -1; }
+    size_t write(const uint8_t *buf, size_t len) {
+        ssize_t n = fd() >= 0 ? send(fd(), buf, len, MSG_NOSIGNAL) : -1;
+        return n > 0 ? n : 0;
+    }
+    size_t print(const String &t) { return write((const uint8_t *)t.c_str(), t.length()); }
+    size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3))) {
+        char buf[256];
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(buf, sizeof(buf), fmt, args);
+        va_end(args);
+        return n > 0 ? write((const uint8_t *)buf, std::min((size_t)n, sizeof(buf) - 1)) : 0;
+    }
+    IPAddress remoteIP() {
+        struct sockaddr_in a = {};
+        socklen_t l = sizeof(a);
+        getpeername(fd(), (struct sockaddr *)&a, &l);
+        return IPAddress::from(a.sin_addr);
+    }
+    void stop() {                                          // closes it for the copies as well
+        if (sock && sock->fd >= 0) close(sock->fd);
+        if (sock) sock->fd = -1;
+        sock.reset();
+    }
+    explicit operator bool() { return connected(); }
+};
+
+class WiFiServer {
+    uint16_t port;
+    int listener = -1;
+    public:
+    WiFiServer(uint16_t p) : port(p) {}
+    void begin() {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        int on = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+        struct sockaddr_in a = {};
+        a.sin_family = AF_INET;
+        a.sin_port = htons(hostPort(port));
+        a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        bind(listener, (struct sockaddr *)&a, sizeof(a));
+        listen(listener, 4);
+        fcntl(listener, F_SETFL, O_NONBLOCK);
+    }
+    WiFiClient available() {                               // a new connection, without waiting
+        int fd = listener >= 0 ? accept(listener, NULL, NULL) : -1;
+        if (fd < 0) return WiFiClient();
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        return WiFiClient(fd);
+    }
+};
+
+class WiFiUDP {
+    int fd = -1;
+    std::vector<uint8_t> out, in;
+    struct sockaddr_in to = {};
+    size_t inPos = 0;
+    public:
+    ~WiFiUDP() { stop(); }
+    uint8_t begin(uint16_t port) {
+        fd = socket(AF_INET, SOCK_DGRAM, 0);
+        struct sockaddr_in a = {};
+        a.sin_family = AF_INET;
+        a.sin_port = htons(port);
+        return fd >= 0 && bind(fd, (struct sockaddr *)&a, sizeof(a)) == 0;
+    }
+    int beginPacket(IPAddress ip, uint16_t port) {
+        out.clear();
+        to.sin_family = AF_INET;
+        to.sin_port = htons(hostPort(port));
+        to.sin_addr = ip.addr();
+        return 1;
+    }
+    size_t write(const uint8_t *buf, size_t len) { out.insert(out.end(), buf, buf + len); return len; }
+    int endPacket() { return sendto(fd, out.data(), out.size(), 0, (struct sockaddr *)&to, sizeof(to)) == (ssize_t)out.size(); }
+    int parsePacket() {
+        in.resize(1500);
+        ssize_t n = recv(fd, in.data(), in.size(), MSG_DONTWAIT);
+        in.resize(n > 0 ? n : 0);
+        inPos = 0;
+        return n > 0 ? (int)n : 0;
+    }
+    int read(uint8_t *buf, size_t len) {
+        size_t n = std::min(len, in.size() - inPos);
+        memcpy(buf, in.data() + inPos, n);
+        inPos += n;
+        return (int)n;
+    }
+    void stop() { if (fd >= 0) close(fd); fd = -1; }
+};
+
+#define WL_CONNECTED 3
+int (*hostByNameHook)(const char *, IPAddress &) = NULL;   // replaces WiFi.hostByName() if set
+struct {
+    int status() { return WL_CONNECTED; }
+    IPAddress dnsIP() { return IPAddress(127, 0, 0, 1); }
+    IPAddress localIP() { return IPAddress(127, 0, 0, 1); }
+    int hostByName(const char *host, IPAddress &ip) {
+        if (hostByNameHook) return hostByNameHook(host, ip);
+        struct addrinfo hints = {}, *res = NULL;
+        hints.ai_family = AF_INET;
+        if (getaddrinfo(host, NULL, &hints, &res) != 0 || !res) return 0;
+        ip = IPAddress::from(((struct sockaddr_in *)res->ai_addr)->sin_addr);
+        freeaddrinfo(res);
+        return 1;
+    }
+} WiFi __attribute__((unused));
+
+
+// ---------------------------------------------------------------
+//                        -test results
+// ---------------------------------------------------------------
+
+static int checkFailures = 0;
+static void check(bool ok, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+static void check(bool ok, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    printf("%s ", ok ? "ok  " : "FAIL");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+    if (!ok) checkFailures++;
+}
+static int checkResult() {
+    printf("%s\n", checkFailures ? "FAILED" : "passed");
+    return checkFailures ? 1 : 0;
+}
@@ -0,0 +1 @@
+// the sockets are the linux ones, included by hoststub.h
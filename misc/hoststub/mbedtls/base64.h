@@ -0,0 +1,23 @@
+// mbedtls_base64_encode as in the esp32's mbedtls (for the websocket handshake in logtx.h)
+
+#define MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL -0x002A
+
+static int mbedtls_base64_encode(unsigned char *dst, size_t dlen, size_t *olen, const unsigned char *src, size_t slen) {
+    static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t need = (slen + 2) / 3 * 4;
+    if (dlen < need + 1) {
+        *olen = need + 1;
+        return MBEDTLS_ERR_BASE64_BUFFER_TOO_SMALL;
+    }
+    size_t o = 0;
+    for (size_t i = 0; i < slen; i += 3) {
+        uint32_t v = (uint32_t)src[i] << 16 | (i + 1 < slen ? (uint32_t)src[i + 1] << 8 : 0) | (i + 2 < slen ? src[i + 2] : 0);
+        dst[o++] = table[(v >> 18) & 63];
+        dst[o++] = table[(v >> 12) & 63];
+        dst[o++] = i + 1 < slen ? table[(v >> 6) & 63] : '=';
+        dst[o++] = i + 2 < slen ? table[v & 63] : '=';
+    }
+    dst[o] = 0;
+    *olen = o;
+    return 0;
+}
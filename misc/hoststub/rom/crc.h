@@ -0,0 +1,9 @@
+// crc32_le as in the esp32 rom (reflected, polynomial 0xEDB88320)
+static uint32_t crc32_le(uint32_t crc, const uint8_t *buf, size_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
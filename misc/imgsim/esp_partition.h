@@ -0,0 +1,99 @@
+/*******************************************************************************************************************
+ *
+ *        Simulated flash partition for imgsim.cpp - the esp_partition calls imgstore.h uses, on NOR flash rules
+ *
+ *        Writing can only clear bits (the new data is ANDed with what is there), erasing sets a whole 4K sector
+ *        to 0xFF.  Every byte written and every sector erased uses up flashPowerLeft (a sector counts as 4096),
+ *        when it runs out the power is cut: the operation is left half done and PowerCut is thrown.  The power can
+ *        also be cut during the n'th write of a given length (to hit the short header writes).
+ *
+ *              cut while writing   the bytes before the cut are written, the byte at the cut only has some of its
+ *                                  bits cleared, the rest is not touched
+ *              cut while erasing   the sectors before are erased, the one being erased ends up with a random mix
+ *                                  of erased bytes, its old bytes and garbage
+ *
+ *******************************************************************************************************************/
+
+#pragma once
+
+typedef int esp_err_t;
+#define ESP_OK 0
+#define ESP_ERR_INVALID_ARG 0x102
+#define ESP_ERR_INVALID_SIZE 0x104
+
+typedef enum { ESP_PARTITION_TYPE_APP = 0, ESP_PARTITION_TYPE_DATA = 1 } esp_partition_type_t;
+typedef int esp_partition_subtype_t;
+
+typedef struct {
+    esp_partition_type_t type;
+    esp_partition_subtype_t subtype;
+    uint32_t address;
+    uint32_t size;
+    char label[17];
+} esp_partition_t;
+
+struct PowerCut {};
+
+std::vector<uint8_t> flash;                                // contents of the partition
+std::vector<uint32_t> flashErases;                         // times each sector has been erased
+int64_t flashPowerLeft = -1;                               // bytes written / sectors erased (as 4096) before the power goes, -1 = never
+size_t flashCutWrite = 0;                                  // length of the write the power was cut in (0 = it was cut while erasing)
+size_t flashCutSize = 0;                                   // or cut it part way through a write of this length...
+int flashCutAfter = 0;                                     //   ...after this many writes of that length
+std::mt19937 flashRng(1);
+esp_partition_t flashPart = {ESP_PARTITION_TYPE_DATA, 0x40, 0x290000, 0, "images"};
+
+void flashCreate(uint32_t size) {
+    flash.assign(size, 0xFF);
+    flashErases.assign(size / 4096, 0);
+    flashPart.size = size;
+}
+
+const esp_partition_t *esp_partition_find_first(esp_partition_type_t type, esp_partition_subtype_t subtype, const char *label) {
+    if (flash.empty() || type != flashPart.type || subtype != flashPart.subtype || strcmp(label, flashPart.label) != 0) return NULL;
+    return &flashPart;
+}
+
+esp_err_t esp_partition_read(const esp_partition_t *, size_t offset, void *dst, size_t size) {
+    if (offset + size > flash.size()) return ESP_ERR_INVALID_SIZE;
+    memcpy(dst, flash.data() + offset, size);
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_write(const esp_partition_t *, size_t offset, const void *src, size_t size) {
+    if (offset + size > flash.size()) return ESP_ERR_INVALID_SIZE;
+    const uint8_t *p = (const uint8_t *)src;
+    if (flashCutSize && size == flashCutSize && flashCutAfter-- == 0) flashPowerLeft = flashRng() % size;
+    for (size_t i = 0; i < size; i++) {
+        if (flashPowerLeft >= 0 && flashPowerLeft-- == 0) {
+            flash[offset + i] &= p[i] | (uint8_t)flashRng();    // some of the bits of the byte being written
+            flashCutWrite = size;
+            throw PowerCut();
+        }
+        flash[offset + i] &= p[i];
+    }
+    return ESP_OK;
+}
+
+esp_err_t esp_partition_erase_range(const esp_partition_t *, size_t offset, size_t size) {
+    if (offset % 4096 || size % 4096) return ESP_ERR_INVALID_ARG;
+    if (offset + size > flash.size()) return ESP_ERR_INVALID_SIZE;
+    for (size_t s = offset; s < offset + size; s += 4096) {
+        if (flashPowerLeft >= 0) {
+            if (flashPowerLeft < 4096) {
+                for (size_t i = s; i < s + 4096; i++) {
+                    uint32_t r = flashRng() % 3;
+                    if (r == 0) flash[i] = 0xFF;
+                    else if (r == 1) flash[i] = (uint8_t)flashRng();
+                }
+                flashPowerLeft = -1;
+                flashCutWrite = 0;
+                throw PowerCut();
+            }
+            flashPowerLeft -= 4096;
+        }
+        memset(flash.data() + s, 0xFF, 4096);
+        flashErases[s / 4096]++;
+    }
+    return ESP_OK;
+}
@@ -0,0 +1,144 @@
+/*******************************************************************************************************************
+ *
+ *        imgsim - cuts the power to src/imgstore.h again and again in a simulated flash partition
+ *
+ *        imgstore.h is compiled unchanged with ../hoststub/hoststub.h and the simulated partition in
+ *        esp_partition.h (NOR flash: writes only clear bits, erase is per 4K sector).  Each "boot" runs
+ *        imgStoreSetup() on what is left in the flash and checks the store, then writes images of random size
+ *        under the names the camera uses ("1".."8" and "1s".."8s") until the power is cut at a random point -
+ *        while erasing, while writing a jpg or while writing a header.  After each boot it checks:
+ *
+ *              every image the store can find reads back exactly as it was written (no partial or mixed records)
+ *              the newest image whose write finished is still there (or a newer one of the same name)
+ *              the sequence numbers carry on from the newest record
+ *
+ *        At the end it prints how often the sectors were erased.  The log wraps so this is even, apart from the
+ *        sectors at the end which are skipped when the next image does not fit before the end.
+ *
+ *              g++ -O2 -std=c++17 -pthread -I. -I../hoststub -o imgsim imgsim.cpp
+ *              ./imgsim [boots (2000)] [seed]
+ *
+ *******************************************************************************************************************/
+
+#include "../hoststub/hoststub.h"
+#include <cstddef>
+
+#include "esp_partition.h"
+
+// TimeLib
+int year() { return 2023; }
+uint32_t now() { return 1700000000 + millis() / 1000; }
+
+#include "../../src/imgstore.h"
+
+
+// ---------------------------------------------------------------
+//                            -test
+// ---------------------------------------------------------------
+
+std::map<uint32_t, std::vector<uint8_t>> written;          // contents of every image by sequence no. (those being written included)
+
+static std::vector<uint8_t> makeImage(uint32_t seq) {
+    std::vector<uint8_t> buf(2000 + flashRng() % 70000);
+    buf[0] = 0xFF;
+    buf[1] = 0xD8;
+    for (size_t i = 2; i < buf.size(); i++) buf[i] = (uint8_t)(seq * 7 + i * 13 + (i >> 9));
+    return buf;
+}
+
+static String imageName(uint32_t n) {
+    return String(n % 8 + 1) + ((n / 8) % 2 ? "s" : "");
+}
+
+// check every name the store can find reads back as written, returns the number found
+static int checkStore(int boot, uint32_t &bad) {
+    int found = 0;
+    for (uint32_t n = 0; n < 16; n++) {
+        imgRecord_t rec;
+        if (!imgStoreFind(imageName(n), &rec)) continue;
+        found++;
+        auto it = written.find(rec.h.seq);
+        std::vector<uint8_t> buf(rec.h.len);
+        bool ok = it != written.end() && it->second.size() == rec.h.len && imgStoreRead(rec, 0, buf.data(), buf.size()) && buf == it->second;
+        if (!ok) {
+            bad++;
+            printf("boot %d: image '%s' seq %u does not match what was written\n", boot, rec.h.name, rec.h.seq);
+        }
+    }
+    return found;
+}
+
+int main(int argc, char **argv) {
+    int boots = argc > 1 ? atoi(argv[1]) : 2000;
+    if (argc > 2) flashRng.seed(atoi(argv[2]));
+    flashCreate(832 * 1024);
+
+    uint32_t bad = 0, lost = 0, seqErrors = 0, cuts[3] = {0, 0, 0}, images = 0, minFound = 16;
+    uint32_t lastDone = 0;                                 // seq of the newest image whose write returned ok
+    String lastDoneName;
+    for (int boot = 0; boot < boots; boot++) {
+        // boot: the ram is gone, only the flash is left
+        imgMutex = NULL;                                   // (the old one may have been held when the power went)
+        imgPart = NULL;
+        uint32_t highest = written.empty() ? 0 : written.rbegin()->first;
+        {
+            std::lock_guard<std::mutex> lock(hostLogMutex);
+            hostLog.clear();
+        }
+        if (!imgStoreSetup()) { printf("no partition\n"); return 1; }
+
+        // the newest finished image survived, sequence numbers carry on
+        if (lastDone) {
+            imgRecord_t rec;
+            bool ok = imgStoreFind(lastDoneName, &rec) && rec.h.seq >= lastDone;
+            if (!ok) {
+                lost++;
+                printf("boot %d: newest finished image '%s' seq %u lost\n", boot, lastDoneName.c_str(), lastDone);
+            }
+            if (imgSeq < lastDone + 1 || imgSeq > highest + 1) {
+                seqErrors++;
+                printf("boot %d: next seq %u, expected %u..%u\n", boot, imgSeq, lastDone + 1, highest + 1);
+            }
+        }
+        uint32_t found = checkStore(boot, bad);
+        if (boot > 20) minFound = std::min(minFound, found);
+
+        // write images until the power goes, somewhere in the next 0 - 400K of flash work or (1 boot in 4) while
+        // writing one of the next few headers
+        flashCutSize = 0;
+        flashPowerLeft = -1;
+        if (flashRng() % 4 == 0) {
+            flashCutSize = sizeof(imgHeader_t);
+            flashCutAfter = flashRng() % 4;
+        } else {
+            flashPowerLeft = flashRng() % (400 * 1024);
+        }
+        try {
+            for (;;) {
+                uint32_t seq = imgSeq;
+                written[seq] = makeImage(seq);
+                String name = imageName(seq);
+                if (!imgStoreWrite(name, written[seq].data(), written[seq].size())) { printf("write failed\n"); return 1; }
+                lastDone = seq;
+                lastDoneName = name;
+                images++;
+                checkStore(boot, bad);
+            }
+        } catch (PowerCut &) {
+            cuts[flashCutWrite == 0 ? 0 : (flashCutWrite == sizeof(imgHeader_t) ? 2 : 1)]++;
+        }
+    }
+
+    uint32_t lo = UINT32_MAX, hi = 0;
+    double mean = 0;
+    for (uint32_t e : flashErases) { lo = std::min(lo, e); hi = std::max(hi, e); mean += e; }
+    mean /= flashErases.size();
+    printf("%d boots, %u images written, power cut %u times while erasing, %u while writing a jpg, %u while writing a header\n",
+           boots, images, cuts[0], cuts[1], cuts[2]);
+    printf("sectors erased %u to %u times (mean %.0f), at least %u images found after each boot\n", lo, hi, mean, minFound);
+    check(bad == 0, "every image found read back as written (%u did not)", bad);
+    check(lost == 0, "newest finished image there after every power cut (%u lost)", lost);
+    check(seqErrors == 0, "sequence numbers carried on (%u wrong)", seqErrors);
+    check(lo >= mean * 0.7 && hi <= mean * 1.3, "erases spread across the partition (within 30%% of the mean)");
+    return checkResult();
+}
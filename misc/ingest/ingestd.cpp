@@ -0,0 +1,708 @@
+/*******************************************************************************************************************
+ *
+ *        ingestd - receives the images POSTed by the cameras (a replacement for the PHP script in src/post.h)
+ *
+ *        Speaks the same protocol as the PHP script: HTTP/1.1 POST of multipart/form-data with the image in a
+ *        part named "imageFile", or several images in parts named "imageFile[]" (batched uploads, see batch.h).
+ *        Request bodies can be sent with Content-Length or chunked transfer encoding and connections are kept
+ *        open between requests.  Replies use the status code (200 = all images stored) and the text
+ *        "has been uploaded" so older camera firmware is happy too.
+ *
+ *        Images are stored in a tree sharded by the time they were received (UTC):
+ *              <root>/YYYY/MM/DD/HH/<file name from the camera>
+ *
+ *        Where a part says how long it is (the cameras send a Content-Length header in each part) the image is
+ *        moved from the socket to the file with splice() so it never passes through this program, otherwise
+ *        the part is scanned for the boundary.  Each connection has its own thread so many cameras can upload
+ *        at once.  Needs nothing but Linux and a C++17 compiler:
+ *
+ *              g++ -O2 -std=c++17 -pthread -o ingestd ingestd.cpp
+ *              ./ingestd -p 8080 -d /srv/camera-images
+ *
+ *        Options:  -p port (8080)  -d image folder (./images)  -m max image size in bytes (4MB)
+ *                  -t idle connection timeout in seconds (30)  -c max connections (1024)
+ *                  -l delay before replying in ms (0, for testing how the cameras cope with a slow server)
+ *                  -f 503|drop  start off failing uploads (reply 503, or close the connection without a reply)
+ *                  -T  accept GET /fail?... (below), for testing only
+ *                  -v log every image
+ *
+ *        GET /stats returns counters as text.  See loadgen.cpp for a benchmark.
+ *
+ *        To test how cameras cope with the server failing it can be made to fail uploads on demand when it is
+ *        started with -T (there is no authentication, without -T these return 404 so anyone who can reach the
+ *        port can not stop the uploads):
+ *              curl http://server:8080/fail?503      reply "503 Service Unavailable" to uploads
+ *              curl http://server:8080/fail?drop     close the connection as soon as an upload starts
+ *              curl http://server:8080/fail?off      back to normal
+ *
+ *******************************************************************************************************************/
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <thread>
+
+
+// ---------------------------------------------------------------
+//                       - S E T T I N G S -
+// ---------------------------------------------------------------
+
+struct Config {
+    int port = 8080;
+    std::string root = "images";
+    size_t maxImage = 4 * 1024 * 1024;
+    int idleTimeout = 30;
+    int maxConnections = 1024;
+    int replyDelay = 0;
+    bool testing = false;                            // GET /fail?... accepted
+    bool verbose = false;
+};
+Config cfg;
+
+#define FAIL_OFF  0
+#define FAIL_503  1
+#define FAIL_DROP 2
+std::atomic<int> failMode{FAIL_OFF};                 // failing uploads on purpose (set with -f or GET /fail?...)
+static const char *failNames[] = {"off", "503", "drop"};
+
+// counters
+std::atomic<uint64_t> statConnections{0}, statActive{0}, statRequests{0}, statImages{0}, statBytes{0},
+                      statSpliced{0}, statRejected{0}, statErrors{0}, statFailed{0};
+const auto startTime = std::chrono::steady_clock::now();
+
+
+// ---------------------------------------------------------------
+//                   -buffered socket reading
+// ---------------------------------------------------------------
+
+// headers are read in small pieces so an image following them is left in the socket, to be spliced
+const size_t headRead = 2048;
+
+class Conn {
+
+    public:
+    int fd;
+    char buf[64 * 1024];
+    size_t start = 0, end = 0;                   // unread data is buf[start..end)
+
+    explicit Conn(int sock) : fd(sock) {}
+
+    size_t buffered() const { return end - start; }
+
+    // read more from the socket (at most "most" bytes), returns false on close/error/timeout
+    bool fill(size_t most = sizeof(buf)) {
+        if (start == end) start = end = 0;
+        if (end == sizeof(buf)) {
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            start = 0;
+        }
+        if (end == sizeof(buf)) return false;
+        ssize_t n = recv(fd, buf + end, std::min(sizeof(buf) - end, most), 0);
+        if (n <= 0) return false;
+        end += n;
+        return true;
+    }
+
+    // read a line ending in \n (without \r\n), returns false if longer than max or closed
+    bool readLine(std::string &line, size_t max = 8192) {
+        line.clear();
+        for (;;) {
+            char *nl = (char *)memchr(buf + start, '\n', end - start);
+            if (nl) {
+                line.append(buf + start, nl - (buf + start));
+                start = nl - buf + 1;
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                return true;
+            }
+            line.append(buf + start, end - start);
+            start = end;
+            if (line.size() > max || !fill(headRead)) return false;
+        }
+    }
+
+    bool sendAll(const char *data, size_t len) {
+        while (len) {
+            ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+            if (n <= 0) return false;
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+};
+
+
+// ---------------------------------------------------------------
+//            -request body (Content-Length or chunked)
+// ---------------------------------------------------------------
+
+class Body {
+
+    public:
+    Body(Conn &conn, bool chunked, uint64_t length) : c(conn), _chunked(chunked), _left(length) {
+        if (!chunked && length == 0) _done = true;
+    }
+
+    bool done() const { return _done; }
+    bool failed() const { return _failed; }
+
+    // bytes of body available in the connection buffer (reads up to "most" more if none), 0 = end of body or error
+    size_t peek(const char **p, size_t most = sizeof(Conn::buf)) {
+        if (!ready()) return 0;
+        if (c.buffered() == 0 && !c.fill(most)) return fail();
+        *p = c.buf + c.start;
+        return (size_t)std::min<uint64_t>(c.buffered(), _left);
+    }
+
+    void consume(size_t n) {
+        c.start += n;
+        _left -= n;
+        if (_left == 0 && !_chunked) _done = true;
+    }
+
+    // read exactly len bytes
+    bool read(char *out, size_t len) {
+        while (len) {
+            const char *p;
+            size_t n = std::min(peek(&p), len);
+            if (n == 0) return false;
+            memcpy(out, p, n);
+            consume(n);
+            out += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // read a line of the body (for multipart headers)
+    bool readLine(std::string &line, size_t max = 4096) {
+        line.clear();
+        for (;;) {
+            const char *p;
+            size_t n = peek(&p, headRead);
+            if (n == 0) return false;
+            const char *nl = (const char *)memchr(p, '\n', n);
+            size_t take = nl ? (nl - p + 1) : n;
+            line.append(p, take);
+            consume(take);
+            if (nl) {
+                line.pop_back();
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+                return true;
+            }
+            if (line.size() > max) return false;
+        }
+    }
+
+    // move len bytes of the body in to a file, using splice() for anything not already buffered
+    //    returns false if the body ended early or the file could not be written
+    bool toFile(int file, uint64_t len, int pipefd[2]) {
+        while (len) {
+            if (!ready()) return false;
+            if (c.buffered()) {                  // already read in to the buffer
+                size_t n = (size_t)std::min<uint64_t>(std::min<uint64_t>(c.buffered(), _left), len);
+                if (!writeAll(file, c.buf + c.start, n)) return false;
+                consume(n);
+                len -= n;
+                continue;
+            }
+            size_t want = (size_t)std::min<uint64_t>(std::min<uint64_t>(_left, len), 1 << 20);
+            ssize_t n = splice(c.fd, NULL, pipefd[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n < 0 && errno == EINVAL) {      // splice not supported here, read it the normal way
+                if (!c.fill()) return fail();
+                continue;
+            }
+            if (n <= 0) return fail();
+            for (ssize_t moved = 0; moved < n; ) {
+                ssize_t m = splice(pipefd[0], NULL, file, NULL, n - moved, SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (m <= 0) return fail();
+                moved += m;
+            }
+            statSpliced += n;
+            _left -= n;
+            if (_left == 0 && !_chunked) _done = true;
+            len -= n;
+        }
+        return true;
+    }
+
+    // read and discard the rest of the body
+    bool drain() {
+        const char *p;
+        size_t n;
+        while ((n = peek(&p)) > 0) consume(n);
+        return _done && !_failed;
+    }
+
+    private:
+    Conn &c;
+    bool _chunked;
+    uint64_t _left;                              // bytes left in the body (or current chunk)
+    bool _done = false;
+    bool _failed = false;
+    bool _firstChunk = true;
+
+    size_t fail() { _failed = true; return 0; }
+
+    static bool writeAll(int fd, const char *p, size_t n) {
+        while (n) {
+            ssize_t w = write(fd, p, n);
+            if (w <= 0) return false;
+            p += w;
+            n -= w;
+        }
+        return true;
+    }
+
+    // make sure there is body data left to read in the current chunk (reads the next chunk header if required)
+    bool ready() {
+        if (_done || _failed) return false;
+        if (_left > 0) return true;
+        if (!_chunked) { _done = true; return false; }
+        std::string line;
+        if (!_firstChunk && (!c.readLine(line) || !line.empty())) return fail();     // CRLF after chunk data
+        _firstChunk = false;
+        if (!c.readLine(line)) return fail();
+        char *endp;
+        _left = strtoull(line.c_str(), &endp, 16);
+        if (endp == line.c_str()) return fail();
+        if (_left == 0) {                        // last chunk, skip any trailers
+            do { if (!c.readLine(line)) return fail(); } while (!line.empty());
+            _done = true;
+            return false;
+        }
+        return true;
+    }
+};
+
+
+// ---------------------------------------------------------------
+//                        -storing images
+// ---------------------------------------------------------------
+
+// keep only safe characters of the file name the camera gave
+static std::string cleanName(const std::string &name) {
+    std::string base = name.substr(name.find_last_of("/\\") == std::string::npos ? 0 : name.find_last_of("/\\") + 1);
+    std::string out;
+    for (char ch : base) out += (isalnum((unsigned char)ch) || ch == '-' || ch == '_' || ch == '.') ? ch : '_';
+    if (out.empty() || out[0] == '.') out = "image" + out;
+    return out.substr(0, 128);
+}
+
+static bool makeDirs(const std::string &path) {
+    for (size_t pos = 1; pos <= path.size(); pos++) {
+        if (pos == path.size() || path[pos] == '/') {
+            std::string dir = path.substr(0, pos);
+            if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+        }
+    }
+    return true;
+}
+
+// folder for images received now
+static std::string shardDir() {
+    time_t now = time(NULL);
+    struct tm t;
+    gmtime_r(&now, &t);
+    char dir[64];
+    snprintf(dir, sizeof(dir), "/%04d/%02d/%02d/%02d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour);
+    return cfg.root + dir;
+}
+
+// an image being received, written to a temporary file and renamed when complete
+class ImageFile {
+
+    public:
+    std::string dir, name, temp;
+    int fd = -1;
+    uint64_t size = 0;
+
+    bool open(const std::string &fileName) {
+        dir = shardDir();
+        name = cleanName(fileName);
+        if (!makeDirs(dir)) return false;
+        static std::atomic<uint64_t> tempCounter{0};
+        temp = dir + "/.incoming-" + std::to_string(getpid()) + "-" + std::to_string(tempCounter++);
+        fd = ::open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        return fd >= 0;
+    }
+
+    // check it looks like a jpg and give it its real name, returns the name used ("" if rejected)
+    std::string finish() {
+        unsigned char soi[2] = {0, 0};
+        bool ok = size > 4 && pread(fd, soi, 2, 0) == 2 && soi[0] == 0xFF && soi[1] == 0xD8;
+        close(fd);
+        fd = -1;
+        if (!ok) {
+            unlink(temp.c_str());
+            return "";
+        }
+        std::string final = dir + "/" + name;
+        for (int n = 1; link(temp.c_str(), final.c_str()) != 0; n++) {     // do not replace an existing image
+            if (errno != EEXIST || n > 999) {
+                unlink(temp.c_str());
+                return "";
+            }
+            size_t dot = name.find_last_of('.');
+            final = dir + "/" + name.substr(0, dot) + "-" + std::to_string(n) + (dot == std::string::npos ? "" : name.substr(dot));
+        }
+        unlink(temp.c_str());
+        return final;
+    }
+
+    void abort() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+        if (!temp.empty()) unlink(temp.c_str());
+    }
+};
+
+
+// ---------------------------------------------------------------
+//                     -multipart form data
+// ---------------------------------------------------------------
+
+static std::string headerValue(const std::string &line, const char *name) {
+    size_t n = strlen(name);
+    if (line.size() <= n || strncasecmp(line.c_str(), name, n) != 0 || line[n] != ':') return "";
+    size_t v = line.find_first_not_of(' ', n + 1);
+    return v == std::string::npos ? "" : line.substr(v);
+}
+
+static std::string param(const std::string &value, const char *name) {     // e.g. filename="x.jpg"
+    std::string key = std::string(name) + "=";
+    size_t pos = 0;
+    while ((pos = value.find(key, pos)) != std::string::npos) {
+        if (pos == 0 || value[pos - 1] == ' ' || value[pos - 1] == ';') break;
+        pos++;
+    }
+    if (pos == std::string::npos) return "";
+    pos += key.size();
+    if (pos < value.size() && value[pos] == '"') {
+        size_t end = value.find('"', pos + 1);
+        return value.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1);
+    }
+    return value.substr(pos, value.find_first_of("; ", pos) - pos);
+}
+
+struct UploadResult {
+    int status = 200;
+    int stored = 0;
+    std::string message;
+};
+
+// read all the parts of a multipart body, storing each file
+static UploadResult receiveMultipart(Body &body, const std::string &boundary) {
+    UploadResult res;
+    int pipefd[2];
+    if (pipe2(pipefd, O_CLOEXEC) != 0) return {500, 0, "server error"};
+    const std::string delim = "\r\n--" + boundary;
+    std::string window = "\r\n";                 // so the first boundary (at the very start) is found like the others
+    bool last = false;
+
+    // skip anything before the first boundary, consuming only up to its end so the part that follows
+    // is still in the connection buffer (and can be spliced)
+    for (;;) {
+        const char *p;
+        size_t n = body.peek(&p, headRead);
+        if (n == 0) { close(pipefd[0]); close(pipefd[1]); return {400, 0, "no multipart boundary"}; }
+        size_t kept = window.size();
+        window.append(p, n);
+        size_t found = window.find(delim);
+        if (found != std::string::npos) {
+            body.consume(found + delim.size() - kept);
+            window.clear();
+            break;
+        }
+        body.consume(n);
+        if (window.size() >= delim.size()) window.erase(0, window.size() - delim.size() + 1);
+    }
+
+    while (!last) {
+        // after a boundary comes "--" (end) or CRLF then the part headers
+        while (window.size() < 2) {
+            const char *p;
+            size_t n = body.peek(&p, headRead);
+            if (n == 0) { res = {400, res.stored, "truncated body"}; goto done; }
+            size_t take = std::min(n, (size_t)2);
+            window.append(p, take);
+            body.consume(take);
+        }
+        if (window.compare(0, 2, "--") == 0) break;
+        if (window.compare(0, 2, "\r\n") != 0) { res = {400, res.stored, "bad multipart boundary"}; goto done; }
+        window.erase(0, 2);
+
+        // part headers (window may hold the start of them)
+        std::string fileName;
+        long long partLength = -1;
+        for (;;) {
+            std::string line;
+            size_t nl = window.find('\n');
+            if (nl != std::string::npos) {
+                line = window.substr(0, nl);
+                window.erase(0, nl + 1);
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+            } else {
+                std::string rest;
+                if (!body.readLine(rest)) { res = {400, res.stored, "truncated part headers"}; goto done; }
+                line = window + rest;
+                window.clear();
+                if (!line.empty() && line.back() == '\r') line.pop_back();
+            }
+            if (line.empty()) break;
+            std::string v;
+            if (!(v = headerValue(line, "Content-Disposition")).empty()) fileName = param(v, "filename");
+            else if (!(v = headerValue(line, "Content-Length")).empty()) partLength = atoll(v.c_str());
+        }
+
+        bool isFile = !fileName.empty();
+        ImageFile image;
+        if (isFile && !image.open(fileName)) { res = {500, res.stored, "unable to create file"}; goto done; }
+        int out = isFile ? image.fd : -1;
+
+        if (partLength >= 0 && window.empty()) {
+            // length known - splice straight to the file then expect the boundary
+            if ((uint64_t)partLength > cfg.maxImage) { image.abort(); res = {413, res.stored, "image too large"}; goto done; }
+            bool ok = isFile ? body.toFile(out, partLength, pipefd) : true;
+            if (!isFile) for (long long left = partLength; left > 0; ) {
+                const char *p;
+                size_t n = std::min<long long>(body.peek(&p), left);
+                if (n == 0) { ok = false; break; }
+                body.consume(n);
+                left -= n;
+            }
+            image.size = partLength;
+            char check[256];
+            if (!ok || delim.size() > sizeof(check) || !body.read(check, delim.size()) || memcmp(check, delim.data(), delim.size()) != 0) {
+                image.abort();
+                res = {400, res.stored, "bad part length"};
+                goto done;
+            }
+        } else {
+            // length not known - scan for the boundary
+            for (;;) {
+                size_t found = window.find(delim);
+                size_t safe = (found != std::string::npos) ? found : (window.size() > delim.size() ? window.size() - delim.size() : 0);
+                if (safe && isFile) {
+                    if (write(out, window.data(), safe) != (ssize_t)safe) { image.abort(); res = {500, res.stored, "write failed"}; goto done; }
+                }
+                image.size += safe;
+                window.erase(0, safe);
+                if (image.size > cfg.maxImage) { image.abort(); res = {413, res.stored, "image too large"}; goto done; }
+                if (found != std::string::npos) { window.erase(0, delim.size()); break; }
+                const char *p;
+                size_t n = body.peek(&p);
+                if (n == 0) { image.abort(); res = {400, res.stored, "truncated part"}; goto done; }
+                window.append(p, n);
+                body.consume(n);
+            }
+        }
+
+        if (isFile) {
+            std::string stored = image.finish();
+            if (stored.empty()) {
+                statRejected++;
+                res.status = 422;
+                res.message += "Sorry, " + cleanName(fileName) + " was not uploaded.\n";
+            } else {
+                res.stored++;
+                statImages++;
+                statBytes += image.size;
+                if (cfg.verbose) printf("stored %s (%llu bytes)\n", stored.c_str(), (unsigned long long)image.size);
+            }
+        }
+    }
+done:
+    close(pipefd[0]);
+    close(pipefd[1]);
+    if (res.status == 200 && !body.drain()) res = {400, res.stored, "truncated body"};
+    return res;
+}
+
+
+// ---------------------------------------------------------------
+//                       -HTTP connection
+// ---------------------------------------------------------------
+
+static bool reply(Conn &c, int status, const std::string &text, bool keepAlive) {
+    const char *reason = status == 200 ? "OK" : status == 400 ? "Bad Request" : status == 404 ? "Not Found" :
+                         status == 413 ? "Payload Too Large" : status == 422 ? "Unprocessable Entity" :
+                         status == 100 ? "Continue" : status == 503 ? "Service Unavailable" : "Internal Server Error";
+    std::string head = "HTTP/1.1 " + std::to_string(status) + " " + reason + "\r\n"
+                       "Content-Type: text/plain\r\n"
+                       "Content-Length: " + std::to_string(text.size()) + "\r\n"
+                       "Connection: " + (keepAlive ? "keep-alive" : "close") + "\r\n\r\n" + text;
+    return c.sendAll(head.data(), head.size());
+}
+
+static std::string statsText() {
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    char text[512];
+    snprintf(text, sizeof(text),
+             "uptime %.0fs\nconnections %llu (%llu open)\nrequests %llu\nimages %llu\nbytes %llu (%llu spliced)\n"
+             "rejected %llu\nerrors %llu\nfailing %s (%llu failed on purpose)\nimages/s %.1f\n",
+             secs, (unsigned long long)statConnections, (unsigned long long)statActive, (unsigned long long)statRequests,
+             (unsigned long long)statImages, (unsigned long long)statBytes, (unsigned long long)statSpliced,
+             (unsigned long long)statRejected, (unsigned long long)statErrors, failNames[failMode], (unsigned long long)statFailed,
+             statImages / (secs > 0 ? secs : 1));
+    return text;
+}
+
+static void serveConnection(int fd) {
+    Conn c(fd);
+    for (;;) {
+        // request line and headers
+        std::string line;
+        if (!c.readLine(line)) break;
+        if (line.empty()) continue;
+        char method[16], path[1024], version[16];
+        if (sscanf(line.c_str(), "%15s %1023s %15s", method, path, version) != 3) { reply(c, 400, "bad request line", false); break; }
+        bool keepAlive = strcmp(version, "HTTP/1.1") == 0;
+        bool chunked = false, expectContinue = false;
+        uint64_t length = 0;
+        std::string contentType;
+        bool headersOk = true;
+        for (;;) {
+            if (!c.readLine(line)) { headersOk = false; break; }
+            if (line.empty()) break;
+            std::string v;
+            if (!(v = headerValue(line, "Content-Length")).empty()) length = strtoull(v.c_str(), NULL, 10);
+            else if (!(v = headerValue(line, "Transfer-Encoding")).empty()) chunked = strcasestr(v.c_str(), "chunked") != NULL;
+            else if (!(v = headerValue(line, "Content-Type")).empty()) contentType = v;
+            else if (!(v = headerValue(line, "Connection")).empty()) {
+                if (strcasestr(v.c_str(), "close")) keepAlive = false;
+                else if (strcasestr(v.c_str(), "keep-alive")) keepAlive = true;
+            }
+            else if (!(v = headerValue(line, "Expect")).empty()) expectContinue = strcasestr(v.c_str(), "100-continue") != NULL;
+        }
+        if (!headersOk) break;
+        statRequests++;
+
+        Body body(c, chunked, length);
+        if (strcmp(method, "GET") == 0) {
+            if (!body.drain()) break;
+            if (strcmp(path, "/stats") == 0) reply(c, 200, statsText(), keepAlive);
+            else if (strcmp(path, "/") == 0) reply(c, 200, "ingestd\n", keepAlive);
+            else if (cfg.testing && strncmp(path, "/fail?", 6) == 0) {
+                int mode = -1;
+                for (int i = 0; i < 3; i++) if (strcmp(path + 6, failNames[i]) == 0) mode = i;
+                if (mode >= 0) failMode = mode;
+                printf("failing uploads: %s\n", failNames[failMode]);
+                reply(c, mode >= 0 ? 200 : 400, std::string("failing ") + failNames[failMode] + "\n", keepAlive);
+            }
+            else reply(c, 404, "not found\n", keepAlive);
+            if (!keepAlive) break;
+            continue;
+        }
+        if (strcmp(method, "POST") != 0) { reply(c, 400, "only GET and POST\n", false); break; }
+        if (failMode == FAIL_DROP) {
+            statFailed++;
+            break;
+        }
+        if (failMode == FAIL_503) {
+            statFailed++;
+            if (expectContinue || !body.drain()) break;
+            reply(c, 503, "failing on purpose\n", keepAlive);
+            if (!keepAlive) break;
+            continue;
+        }
+
+        std::string boundary = param(contentType, "boundary");
+        if (strncasecmp(contentType.c_str(), "multipart/form-data", 19) != 0 || boundary.empty()) {
+            reply(c, 400, "expected multipart/form-data\n", false);
+            break;
+        }
+        if (expectContinue) reply(c, 100, "", true);
+        UploadResult res = receiveMultipart(body, boundary);
+        if (res.status != 200 && res.status != 422) {
+            statErrors++;
+            if (cfg.verbose) printf("upload error %d: %s\n", res.status, res.message.c_str());
+            reply(c, res.status, res.message + "\n", false);      // the body may not have been read to the end
+            break;
+        }
+        if (cfg.replyDelay) std::this_thread::sleep_for(std::chrono::milliseconds(cfg.replyDelay));
+        std::string text = res.message;
+        if (res.status == 200) {
+            text = (res.stored == 1) ? "The file has been uploaded." : std::to_string(res.stored) + " files have been uploaded.";
+        }
+        if (!reply(c, res.status, text, keepAlive) || !keepAlive) break;
+    }
+    close(fd);
+    statActive--;
+}
+
+
+// ---------------------------------------------------------------
+//                            -main
+// ---------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "p:d:m:t:c:l:f:Tv")) != -1) {
+        switch (opt) {
+            case 'p': cfg.port = atoi(optarg); break;
+            case 'd': cfg.root = optarg; break;
+            case 'm': cfg.maxImage = strtoull(optarg, NULL, 10); break;
+            case 't': cfg.idleTimeout = atoi(optarg); break;
+            case 'c': cfg.maxConnections = atoi(optarg); break;
+            case 'l': cfg.replyDelay = atoi(optarg); break;
+            case 'f': failMode = strcmp(optarg, "drop") == 0 ? FAIL_DROP : FAIL_503; break;
+            case 'T': cfg.testing = true; break;
+            case 'v': cfg.verbose = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-p port] [-d folder] [-m max image bytes] [-t idle secs] [-c max connections] [-l reply delay ms] [-f 503|drop] [-T] [-v]\n", argv[0]);
+                return 1;
+        }
+    }
+    while (cfg.root.size() > 1 && cfg.root.back() == '/') cfg.root.pop_back();
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    int listener = socket(AF_INET6, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int on = 1, off = 0;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    struct sockaddr_in6 addr = {};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(cfg.port);
+    if (listener < 0 || bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, 256) != 0) {
+        perror("ingestd: unable to listen");
+        return 1;
+    }
+    printf("ingestd listening on port %d, storing images in %s\n", cfg.port, cfg.root.c_str());
+
+    for (;;) {
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EINTR) perror("ingestd: accept");
+            continue;
+        }
+        if (statActive >= (uint64_t)cfg.maxConnections) {
+            close(fd);
+            statErrors++;
+            continue;
+        }
+        struct timeval tv = {cfg.idleTimeout, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        statConnections++;
+        statActive++;
+        std::thread(serveConnection, fd).detach();
+    }
+}
@@ -0,0 +1,248 @@
+/*******************************************************************************************************************
+ *
+ *        loadgen - simulates cameras uploading images, to benchmark ingestd (or any server taking the POSTs)
+ *
+ *        Each simulated camera has its own connection (kept open) and sends requests the way post.h does:
+ *        multipart/form-data with one image ("imageFile") or a batch ("imageFile[]"), each part with its
+ *        Content-Length, or optionally with chunked transfer encoding or without the part lengths.  At the end
+ *        it reports requests, images and MB per second and the request latency.
+ *
+ *              g++ -O2 -std=c++17 -pthread -o loadgen loadgen.cpp
+ *              ./loadgen -h 127.0.0.1 -p 8080 -c 32 -n 200 -b 4 -s 60000
+ *
+ *        Options:  -h server (127.0.0.1)  -p port (8080)  -u path (/upload)  -c cameras (8)
+ *                  -n requests per camera (100)  -b images per request (1)  -s image size in bytes (50000)
+ *                  -k send chunked  -x leave out the part lengths (server has to scan for the boundary)
+ *                  -1 new connection for each request (as postImage() did before the connection pool)
+ *
+ *        Keep-alive pool against a new connection per image (post.h), ingestd on the same linux box,
+ *        50000 byte images, 1 camera x 2000 requests (latency includes connecting when -1 is given):
+ *
+ *              ./loadgen -c 1 -n 2000              4300-5300 uploads/s   p50 0.17ms  p99 0.7-0.8ms
+ *              ./loadgen -c 1 -n 2000 -1           1900-2400 uploads/s   p50 0.34ms  p99 1.4-2.7ms
+ *
+ *        The loopback has no round trip time to speak of, over wifi each new connection also costs a DNS
+ *        lookup (without dnscache.h), the TCP handshake and slow start so the difference on a camera is larger.
+ *
+ *******************************************************************************************************************/
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+
+// ---------------------------------------------------------------
+//                       - S E T T I N G S -
+// ---------------------------------------------------------------
+
+struct Config {
+    std::string host = "127.0.0.1";
+    int port = 8080;
+    std::string path = "/upload";
+    int cameras = 8;
+    int requests = 100;
+    int batch = 1;
+    size_t imageSize = 50000;
+    bool chunked = false;
+    bool partLengths = true;
+    bool newConn = false;
+};
+Config cfg;
+
+const char boundary[] = "1234567890009876564321";    // same as post.h
+
+std::atomic<uint64_t> statRequests{0}, statImages{0}, statBytes{0}, statErrors{0};
+std::mutex latencyMutex;
+std::vector<double> latencies;                       // ms per request
+
+
+static bool sendAll(int fd, const char *data, size_t len) {
+    while (len) {
+        ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+static int connectServer() {
+    struct addrinfo hints = {}, *res;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(cfg.host.c_str(), std::to_string(cfg.port).c_str(), &hints, &res) != 0) return -1;
+    int fd = socket(res->ai_family, res->ai_socktype, 0);
+    if (fd >= 0 && connect(fd, res->ai_addr, res->ai_addrlen) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+        struct timeval tv = {30, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    }
+    return fd;
+}
+
+// read a reply (status line, headers and Content-Length body), returns the status (0 = failed)
+static int readReply(int fd, std::string &pending, bool &keepAlive) {
+    size_t headEnd;
+    char buf[4096];
+    while ((headEnd = pending.find("\r\n\r\n")) == std::string::npos) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) return 0;
+        pending.append(buf, n);
+    }
+    int status = atoi(pending.c_str() + 9);
+    std::string head = pending.substr(0, headEnd);
+    for (char &ch : head) ch = tolower(ch);
+    size_t cl = head.find("content-length:");
+    size_t bodyLen = (cl == std::string::npos) ? 0 : strtoul(head.c_str() + cl + 15, NULL, 10);
+    keepAlive = head.find("connection: close") == std::string::npos;
+    while (pending.size() < headEnd + 4 + bodyLen) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) return 0;
+        pending.append(buf, n);
+    }
+    pending.erase(0, headEnd + 4 + bodyLen);
+    if (status / 100 == 1) return readReply(fd, pending, keepAlive);     // 100 continue
+    return status;
+}
+
+
+// ---------------------------------------------------------------
+//                      -one simulated camera
+// ---------------------------------------------------------------
+
+static void camera(int id) {
+    // a fake jpg (start and end markers with random data between)
+    std::vector<char> image(std::max(cfg.imageSize, (size_t)4));
+    unsigned seed = id * 7919 + 1;
+    for (char &ch : image) ch = (char)rand_r(&seed);
+    image[0] = (char)0xFF; image[1] = (char)0xD8;
+    image[image.size() - 2] = (char)0xFF; image[image.size() - 1] = (char)0xD9;
+
+    int fd = -1;
+    std::string pending;
+    std::vector<double> myLatencies;
+    const char *field = (cfg.batch > 1) ? "imageFile[]" : "imageFile";
+    for (int r = 0; r < cfg.requests; r++) {
+        auto start = std::chrono::steady_clock::now();
+        if (fd < 0 && (fd = connectServer()) < 0) {
+            statErrors++;
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            continue;
+        }
+        // body as a list of pieces so the image data is not copied
+        std::vector<std::string> heads;
+        for (int i = 0; i < cfg.batch; i++) {
+            char head[256];
+            snprintf(head, sizeof(head), "--%s\r\nContent-Disposition: form-data; name=\"%s\"; filename=\"lg%d-%d-%d.jpg\"\r\n"
+                     "Content-Type: image/jpeg\r\n", boundary, field, id, r, i);
+            heads.push_back(std::string(head) + (cfg.partLengths ? "Content-Length: " + std::to_string(image.size()) + "\r\n" : "") + "\r\n");
+        }
+        std::string tail = std::string("--") + boundary + "--\r\n";
+        size_t total = tail.size();
+        for (auto &h : heads) total += h.size() + image.size() + 2;
+
+        std::string request = "POST " + cfg.path + " HTTP/1.1\r\nHost: " + cfg.host + "\r\nConnection: " + (cfg.newConn ? "close" : "keep-alive") + "\r\n"
+                              "Content-Type: multipart/form-data; boundary=" + boundary + "\r\n" +
+                              (cfg.chunked ? std::string("Transfer-Encoding: chunked\r\n") : "Content-Length: " + std::to_string(total) + "\r\n") + "\r\n";
+        auto piece = [&](const char *p, size_t n) {            // send part of the body
+            if (cfg.chunked) {
+                char size[16];
+                snprintf(size, sizeof(size), "%zx\r\n", n);
+                return sendAll(fd, size, strlen(size)) && sendAll(fd, p, n) && sendAll(fd, "\r\n", 2);
+            }
+            return sendAll(fd, p, n);
+        };
+
+        bool ok = sendAll(fd, request.data(), request.size());
+        for (int i = 0; ok && i < cfg.batch; i++) {
+            ok = piece(heads[i].data(), heads[i].size());
+            for (size_t off = 0; ok && off < image.size(); off += 16384)        // chunks of 16K like a camera would
+                ok = piece(image.data() + off, std::min((size_t)16384, image.size() - off));
+            ok = ok && piece("\r\n", 2);
+        }
+        ok = ok && piece(tail.data(), tail.size());
+        if (ok && cfg.chunked) ok = sendAll(fd, "0\r\n\r\n", 5);
+        bool keepAlive = false;
+        int status = ok ? readReply(fd, pending, keepAlive) : 0;
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        if (status / 100 == 2) {
+            statRequests++;
+            statImages += cfg.batch;
+            statBytes += (uint64_t)cfg.batch * image.size();
+            myLatencies.push_back(ms);
+        } else {
+            statErrors++;
+            if (statErrors < 10) fprintf(stderr, "camera %d request %d failed (status %d)\n", id, r, status);
+        }
+        if (status == 0 || !keepAlive || cfg.newConn) {
+            close(fd);
+            fd = -1;
+            pending.clear();
+        }
+    }
+    if (fd >= 0) close(fd);
+    std::lock_guard<std::mutex> lock(latencyMutex);
+    latencies.insert(latencies.end(), myLatencies.begin(), myLatencies.end());
+}
+
+
+// ---------------------------------------------------------------
+//                            -main
+// ---------------------------------------------------------------
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:u:c:n:b:s:kx1")) != -1) {
+        switch (opt) {
+            case 'h': cfg.host = optarg; break;
+            case 'p': cfg.port = atoi(optarg); break;
+            case 'u': cfg.path = optarg; break;
+            case 'c': cfg.cameras = atoi(optarg); break;
+            case 'n': cfg.requests = atoi(optarg); break;
+            case 'b': cfg.batch = std::max(1, atoi(optarg)); break;
+            case 's': cfg.imageSize = strtoul(optarg, NULL, 10); break;
+            case 'k': cfg.chunked = true; break;
+            case 'x': cfg.partLengths = false; break;
+            case '1': cfg.newConn = true; break;
+            default:
+                fprintf(stderr, "usage: %s [-h server] [-p port] [-u path] [-c cameras] [-n requests] [-b images per request] [-s image bytes] [-k] [-x] [-1]\n", argv[0]);
+                return 1;
+        }
+    }
+    printf("%d cameras x %d requests of %d x %zu byte images%s%s%s\n", cfg.cameras, cfg.requests, cfg.batch, cfg.imageSize,
+           cfg.chunked ? ", chunked" : "", cfg.partLengths ? "" : ", no part lengths", cfg.newConn ? ", new connection each" : "");
+
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < cfg.cameras; i++) threads.emplace_back(camera, i);
+    for (auto &t : threads) t.join();
+    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::sort(latencies.begin(), latencies.end());
+    auto pct = [](double p) { return latencies.empty() ? 0.0 : latencies[std::min(latencies.size() - 1, (size_t)(p * latencies.size()))]; };
+    printf("%.2fs: %llu requests %.0f/s, %llu images %.0f/s, %.1f MB/s, %llu errors\n", secs,
+           (unsigned long long)statRequests, statRequests / secs, (unsigned long long)statImages, statImages / secs,
+           statBytes / secs / 1e6, (unsigned long long)statErrors);
+    printf("latency ms: p50 %.2f  p99 %.2f  max %.2f\n", pct(0.5), pct(0.99), latencies.empty() ? 0.0 : latencies.back());
+    return statErrors ? 2 : 0;
+}
@@ -0,0 +1,272 @@
+/*******************************************************************************************************************
+ *
+ *        jrndump - prints the journal a camera keeps in Spiffs (see src/journal.h)
+ *
+ *        The journal is a set of segment files each holding binary records (log messages, boots and motion
+ *        triggers) with a crc.  Get them all from the camera in one file with:
+ *
+ *              curl -o cam.jrn http://x.x.x.x/journal
+ *
+ *        or give the segment files themselves (/jrn0.bin... copied out of Spiffs), in any order.  Segments are
+ *        sorted by their number and records printed oldest first, damaged records are skipped and reported.
+ *        Needs nothing but a C++17 compiler:
+ *
+ *              g++ -O2 -std=c++17 -o jrndump jrndump.cpp
+ *              ./jrndump cam.jrn
+ *
+ *        Options:  -b n   only records from boot n          -l n   only log messages up to level n (1 = errors)
+ *                  -t     only boots and motion triggers    -c     counts per boot instead of the records
+ *                  -v     also print where each record is and the damaged bytes skipped
+ *
+ *******************************************************************************************************************/
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <map>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+// these must match src/journal.h
+#define JRN_SEG_MAGIC 0x3147534A                 // "JSG1"
+#define JRN_REC_MAGIC 0x524A                     // "JR"
+#define JRN_MAX_DATA 256
+
+#define JRN_BOOT   1
+#define JRN_LOG    2
+#define JRN_MOTION 3
+
+struct jrnSegment_t {
+    uint32_t magic;
+    uint32_t segment;
+    uint32_t firstSeq;
+    uint16_t boot;
+    uint16_t spare;
+    uint32_t crc;
+} __attribute__((packed));
+
+struct jrnRecord_t {
+    uint16_t magic;
+    uint8_t type;
+    uint8_t level;
+    uint16_t len;
+    uint16_t boot;
+    uint32_t seq;
+    uint32_t ms;
+    uint32_t time;
+} __attribute__((packed));
+
+struct jrnMotion_t {
+    uint16_t changes;
+    uint16_t blocks;
+    uint16_t brightness;
+    uint16_t spare;
+} __attribute__((packed));
+
+struct Segment {
+    jrnSegment_t h;
+    std::string file;
+    size_t offset;                               // of the header in the file
+    const uint8_t *data;                         // the records
+    size_t len;
+};
+
+struct BootCount {
+    uint32_t records = 0, errors = 0, warnings = 0, motion = 0;
+    uint32_t lastMs = 0;
+    std::string reason;
+};
+
+static int onlyBoot = -1;
+static int maxLevel = 9;
+static bool triggersOnly = 0;
+static bool counts = 0;
+static bool verbose = 0;
+static uint32_t damaged = 0;                     // bytes skipped
+
+
+// crc32_le as in the esp32 rom (reflected, polynomial 0xEDB88320)
+static uint32_t crc32_le(uint32_t crc, const uint8_t *buf, size_t len) {
+    crc = ~crc;
+    while (len--) {
+        crc ^= *buf++;
+        for (int k = 0; k < 8; k++) crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+
+static bool segmentValid(const uint8_t *p, size_t left) {
+    if (left < sizeof(jrnSegment_t)) return 0;
+    jrnSegment_t h;
+    memcpy(&h, p, sizeof(h));
+    return h.magic == JRN_SEG_MAGIC && h.crc == crc32_le(0, p, offsetof(jrnSegment_t, crc));
+}
+
+
+// length of a valid record at p (0 if there is not one)
+static size_t recordLength(const uint8_t *p, size_t left) {
+    if (left < sizeof(jrnRecord_t) + 4) return 0;
+    jrnRecord_t r;
+    memcpy(&r, p, sizeof(r));
+    size_t size = sizeof(r) + r.len + 4;
+    if (r.magic != JRN_REC_MAGIC || r.len > JRN_MAX_DATA || size > left) return 0;
+    uint32_t crc;
+    memcpy(&crc, p + sizeof(r) + r.len, 4);
+    return (crc == crc32_le(0, p, sizeof(r) + r.len)) ? size : 0;
+}
+
+
+// split a file in to segments (a download from /journal has them one after the other)
+static void findSegments(const std::string &name, const std::vector<uint8_t> &buf, std::vector<Segment> &segs) {
+    size_t pos = 0;
+    while (pos < buf.size()) {
+        if (!segmentValid(&buf[pos], buf.size() - pos)) {
+            pos++;
+            damaged++;
+            continue;
+        }
+        Segment s;
+        memcpy(&s.h, &buf[pos], sizeof(s.h));
+        s.file = name;
+        s.offset = pos;
+        pos += sizeof(jrnSegment_t);
+        s.data = &buf[pos];
+        size_t end = pos;
+        while (end < buf.size() && !segmentValid(&buf[end], buf.size() - end)) end++;     // up to the next segment
+        s.len = end - pos;
+        segs.push_back(s);
+        pos = end;
+    }
+}
+
+
+static const char *levelName(uint8_t level) {
+    switch (level) {
+        case 1:  return "E";
+        case 2:  return "W";
+        case 3:  return "I";
+        default: return "D";
+    }
+}
+
+
+static void printRecord(const jrnRecord_t &r, const uint8_t *data, const Segment &s, size_t offset) {
+    char when[40];
+    if (r.time) {
+        time_t t = r.time;
+        strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime(&t));
+    } else {
+        snprintf(when, sizeof(when), "boot+%u.%03us", r.ms / 1000, r.ms % 1000);
+    }
+    printf("%8u  %4u  %-20s ", r.seq, r.boot, when);
+    if (r.type == JRN_MOTION && r.len >= sizeof(jrnMotion_t)) {
+        jrnMotion_t m;
+        memcpy(&m, data, sizeof(m));
+        printf("MOTION  %u of %u blocks changed, brightness %u", m.changes, m.blocks, m.brightness);
+    } else if (r.type == JRN_BOOT) {
+        printf("BOOT    %.*s", (int)r.len, (const char *)data);
+    } else if (r.type == JRN_LOG) {
+        printf("%s       %.*s", levelName(r.level), (int)r.len, (const char *)data);
+    } else {
+        printf("type %u, %u bytes", r.type, r.len);
+    }
+    if (verbose) printf("   [%s segment %u +%zu]", s.file.c_str(), s.h.segment, offset);
+    printf("\n");
+}
+
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "b:l:tcv")) != -1) {
+        switch (opt) {
+            case 'b': onlyBoot = atoi(optarg); break;
+            case 'l': maxLevel = atoi(optarg); break;
+            case 't': triggersOnly = 1; break;
+            case 'c': counts = 1; break;
+            case 'v': verbose = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-b boot] [-l level] [-t] [-c] [-v] file...\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "usage: %s [-b boot] [-l level] [-t] [-c] [-v] file...\n", argv[0]);
+        return 1;
+    }
+
+    // read the files and find the segments in them
+    std::vector<std::vector<uint8_t>> files;
+    files.reserve(argc - optind);
+    std::vector<Segment> segs;
+    for (int i = optind; i < argc; i++) {
+        FILE *f = fopen(argv[i], "rb");
+        if (!f) {
+            perror(argv[i]);
+            return 1;
+        }
+        files.emplace_back();
+        uint8_t chunk[65536];
+        size_t n;
+        while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) files.back().insert(files.back().end(), chunk, chunk + n);
+        fclose(f);
+        findSegments(argv[i], files.back(), segs);
+    }
+    std::map<uint32_t, Segment> ordered;         // by segment no. (a later copy of the same one replaces it)
+    for (const Segment &s : segs) ordered[s.h.segment] = s;
+
+    // the records
+    std::map<uint16_t, BootCount> boots;
+    uint32_t records = 0, lastSeq = 0, gaps = 0;
+    for (const auto &it : ordered) {
+        const Segment &s = it.second;
+        size_t pos = 0;
+        while (pos < s.len) {
+            size_t size = recordLength(s.data + pos, s.len - pos);
+            if (!size) {
+                if (verbose) fprintf(stderr, "%s segment %u: damaged byte at +%zu\n", s.file.c_str(), s.h.segment, pos);
+                damaged++;
+                pos++;
+                continue;
+            }
+            jrnRecord_t r;
+            memcpy(&r, s.data + pos, sizeof(r));
+            const uint8_t *data = s.data + pos + sizeof(r);
+            if (lastSeq && r.seq != lastSeq + 1) gaps++;
+            lastSeq = r.seq;
+            records++;
+
+            BootCount &b = boots[r.boot];
+            b.records++;
+            b.lastMs = r.ms;
+            if (r.type == JRN_MOTION) b.motion++;
+            if (r.type == JRN_LOG && r.level == 1) b.errors++;
+            if (r.type == JRN_LOG && r.level == 2) b.warnings++;
+            if (r.type == JRN_BOOT && b.reason.empty()) b.reason.assign((const char *)data, r.len);
+
+            bool show = (onlyBoot < 0 || r.boot == onlyBoot) && (r.type != JRN_LOG || r.level <= maxLevel) &&
+                        (!triggersOnly || r.type != JRN_LOG);
+            if (show && !counts) printRecord(r, data, s, pos);
+            pos += size;
+        }
+    }
+
+    if (counts) {
+        printf("boot  records  errors  warnings  motion  last record      first boot record\n");
+        for (const auto &it : boots) {
+            const BootCount &b = it.second;
+            char last[24];
+            snprintf(last, sizeof(last), "boot+%us", b.lastMs / 1000);
+            printf("%4u  %7u  %6u  %8u  %6u  %-15s  %s\n", it.first, b.records, b.errors, b.warnings, b.motion, last, b.reason.c_str());
+        }
+    }
+    fprintf(stderr, "%zu segments, %u records", ordered.size(), records);
+    if (gaps) fprintf(stderr, ", %u gaps in the record numbers", gaps);
+    if (damaged) fprintf(stderr, ", %u damaged bytes skipped", damaged);
+    fprintf(stderr, "\n");
+    return 0;
+}
@@ -0,0 +1,245 @@
+/*******************************************************************************************************************
+ *
+ *        jrntest - runs the journal (src/journal.h) on linux with Spiffs kept in memory, and loses the power
+ *
+ *        journal.h is compiled unchanged with ../hoststub/hoststub.h and a Spiffs in this file which keeps the files
+ *        in memory.  The power is "cut" by taking a copy of the files as they are at that moment (anything still
+ *        in ram is lost), the esp32 is then "restarted" from the copy and journalSetup() finds the end again.
+ *        It checks:
+ *
+ *              an info message waits up to journalFlushDelay to be written, with those after it
+ *              errors, warnings and motion triggers are in Spiffs straight away (and take any waiting with them)
+ *              after a power cut these are all there, the boot no. goes up and the record nos. carry on
+ *              a record cut short by the power going is found, skipped and a new segment started after it
+ *              the segments are reused oldest first and never use more than journalSegments * journalSegmentSize
+ *
+ *              g++ -O2 -std=c++17 -pthread -I. -I../hoststub -o jrntest jrntest.cpp
+ *              ./jrntest
+ *
+ *******************************************************************************************************************/
+
+#include "../hoststub/hoststub.h"
+#include <cstddef>
+
+// ---------------------------------------------------------------
+//                     -Spiffs in memory
+// ---------------------------------------------------------------
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+#define FILE_APPEND "a"
+
+std::mutex spiffsMutex;
+std::map<std::string, std::vector<uint8_t>> spiffsFiles;
+
+class File {
+    public:
+    File() {}
+    File(const std::string &path, size_t pos) : _path(path), _pos(pos), _open(true) {}
+    explicit operator bool() const { return _open; }
+    size_t size() {
+        std::lock_guard<std::mutex> lock(spiffsMutex);
+        return _open ? spiffsFiles[_path].size() : 0;
+    }
+    size_t read(uint8_t *buf, size_t len) {
+        std::lock_guard<std::mutex> lock(spiffsMutex);
+        if (!_open) return 0;
+        std::vector<uint8_t> &f = spiffsFiles[_path];
+        size_t n = _pos < f.size() ? std::min(len, f.size() - _pos) : 0;
+        memcpy(buf, f.data() + _pos, n);
+        _pos += n;
+        return n;
+    }
+    size_t write(const uint8_t *buf, size_t len) {
+        std::lock_guard<std::mutex> lock(spiffsMutex);
+        if (!_open) return 0;
+        std::vector<uint8_t> &f = spiffsFiles[_path];
+        if (f.size() < _pos + len) f.resize(_pos + len);
+        memcpy(f.data() + _pos, buf, len);
+        _pos += len;
+        return len;
+    }
+    void close() { _open = false; }
+    private:
+    std::string _path;
+    size_t _pos = 0;
+    bool _open = false;
+};
+
+struct {
+    File open(const String &path, const char *mode = FILE_READ) {
+        std::lock_guard<std::mutex> lock(spiffsMutex);
+        auto it = spiffsFiles.find(path.str());
+        if (mode[0] == 'w') spiffsFiles[path.str()].clear();
+        else if (it == spiffsFiles.end() && mode[0] == 'r') return File();
+        return File(path.str(), mode[0] == 'a' ? spiffsFiles[path.str()].size() : 0);
+    }
+    bool remove(const String &path) {
+        std::lock_guard<std::mutex> lock(spiffsMutex);
+        return spiffsFiles.erase(path.str()) > 0;
+    }
+} SPIFFS;
+
+static size_t spiffsUsed() {
+    std::lock_guard<std::mutex> lock(spiffsMutex);
+    size_t n = 0;
+    for (auto &f : spiffsFiles) n += f.second.size();
+    return n;
+}
+
+// is this text in any of the files
+static bool spiffsHas(const char *text) {
+    std::lock_guard<std::mutex> lock(spiffsMutex);
+    for (auto &f : spiffsFiles) {
+        if (std::search(f.second.begin(), f.second.end(), text, text + strlen(text)) != f.second.end()) return true;
+    }
+    return false;
+}
+
+// TimeLib
+int year() { return 2026; }
+uint32_t now() { return 1792300000 + millis() / 1000; }
+
+#include "../../src/journal.h"
+
+
+// ---------------------------------------------------------------
+//                            -test
+// ---------------------------------------------------------------
+
+struct record_t {
+    jrnRecord_t r;
+    std::string text;
+};
+
+static bool collect(const jrnRecord_t &r, const uint8_t *data, void *ctx) {
+    ((std::vector<record_t> *)ctx)->push_back({r, std::string((const char *)data, r.len)});
+    return true;
+}
+
+static std::vector<record_t> readJournal() {
+    std::vector<record_t> records;
+    journalEach(collect, &records);
+    return records;
+}
+
+static bool hasRecord(const std::vector<record_t> &records, uint8_t type, const char *text) {
+    for (auto &rec : records) if (rec.r.type == type && (!text || rec.text == text)) return true;
+    return false;
+}
+
+// record nos. carry on by one and boot nos. never go down
+static bool inOrder(const std::vector<record_t> &records) {
+    for (size_t i = 1; i < records.size(); i++) {
+        if (records[i].r.seq != records[i - 1].r.seq + 1 || records[i].r.boot < records[i - 1].r.boot) return false;
+    }
+    return !records.empty();
+}
+
+// ms until the text is in Spiffs (-1 = not within ms)
+static int waitWritten(const char *text, int ms) {
+    auto start = std::chrono::steady_clock::now();
+    for (;;) {
+        int waited = (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        if (spiffsHas(text)) return waited;
+        if (waited > ms) return -1;
+        delay(5);
+    }
+}
+
+// the power goes: only what is in Spiffs now is left, cut = bytes of the newest segment which did not get written
+static std::map<std::string, std::vector<uint8_t>> powerCut(size_t cut = 0) {
+    jrnLock(jrnFileMutex);
+    std::lock_guard<std::mutex> lock(spiffsMutex);
+    auto files = spiffsFiles;
+    std::vector<uint8_t> &newest = files[jrnPath(jrnSegment).str()];
+    newest.resize(newest.size() - std::min(cut, newest.size()));
+    xSemaphoreGive(jrnFileMutex);
+    return files;
+}
+
+// start again from what was left in Spiffs (the old journal task never hears from us again)
+static void restart(const std::map<std::string, std::vector<uint8_t>> &files, esp_reset_reason_t reason) {
+    jrnLock(jrnFileMutex);
+    jrnLock(jrnMutex);
+    {
+        std::lock_guard<std::mutex> lock(spiffsMutex);
+        spiffsFiles = files;
+    }
+    jrnTaskHandle = NULL;
+    jrnReady = 0;
+    jrnBufLen = 0;
+    jrnUrgent = 0;
+    jrnSegment = 0;
+    jrnSegBytes = 0;
+    jrnNewNeeded = 1;
+    jrnSeq = 1;
+    jrnBoot = 0;
+    jrnRecords = jrnDropped = jrnFailures = 0;
+    jrnDamaged = 0;
+    xSemaphoreGive(jrnMutex);
+    xSemaphoreGive(jrnFileMutex);
+    hostResetReason = reason;
+    journalSetup();
+}
+
+int main() {
+    check(journalSetup() && spiffsHas("Started, reset reason: power on"), "boot record written by journalSetup()");
+
+    // an info message waits for more, an error goes straight away and takes it along
+    journalLog(LOG_INFO, "info one", 8);
+    delay(300);
+    check(!spiffsHas("info one"), "info message not written straight away");
+    int waited = waitWritten("info one", journalFlushDelay + 1000);
+    check(waited > 0, "written %ums later (journalFlushDelay %ums)", waited + 300, journalFlushDelay);
+
+    journalLog(LOG_INFO, "info two", 8);
+    journalLog(LOG_ERROR, "Error: camera failed", 20);
+    waited = waitWritten("Error: camera failed", 200);
+    check(waited >= 0 && spiffsHas("info two"), "error written in %dms, with the info message before it", waited);
+    journalLog(LOG_WARN, "Warning: low memory", 19);
+    waited = waitWritten("Warning: low memory", 200);
+    check(waited >= 0, "warning written in %dms", waited);
+    size_t before = spiffsUsed();
+    journalMotion(120, 400, 87);
+    waited = -1;
+    for (int ms = 0; ms < 200 && waited < 0; ms += 5, delay(5)) if (spiffsUsed() > before) waited = ms;
+    check(waited >= 0, "motion trigger written in %dms", waited);
+
+    // power cut, anything still in ram is lost but the error and the trigger are not
+    journalLog(LOG_INFO, "info lost", 9);
+    restart(powerCut(), ESP_RST_BROWNOUT);
+    std::vector<record_t> records = readJournal();
+    check(hasRecord(records, JRN_LOG, "Error: camera failed") && hasRecord(records, JRN_LOG, "Warning: low memory") &&
+          hasRecord(records, JRN_MOTION, NULL), "error, warning and motion trigger there after the power cut");
+    check(!hasRecord(records, JRN_LOG, "info lost"), "info message from just before it lost (it was only in ram)");
+    check(hasRecord(records, JRN_BOOT, "Started, reset reason: brownout") && jrnBoot == 2, "restart recorded as boot %u", jrnBoot);
+    check(inOrder(records), "%zu records, numbered in order across the restart", records.size());
+
+    // power cut part way through writing a record
+    journalLog(LOG_ERROR, "Error: half written", 19);
+    check(waitWritten("Error: half written", 200) >= 0, "error written");
+    uint32_t segment = jrnSegment;
+    restart(powerCut(7), ESP_RST_PANIC);
+    records = readJournal();
+    check(jrnDamaged && jrnSegment == segment + 1, "damaged record found, segment %u started after it", jrnSegment);
+    check(!hasRecord(records, JRN_LOG, "Error: half written") && hasRecord(records, JRN_LOG, "Error: camera failed"),
+          "record cut short skipped, those before it kept");
+    check(hasRecord(records, JRN_BOOT, "Started, reset reason: panic") && jrnBoot == 3, "restart recorded as boot %u", jrnBoot);
+
+    // the segments are reused
+    char text[100];
+    for (int i = 0; i < 1000; i++) {
+        int len = snprintf(text, sizeof(text), "Message %04d, long enough to fill the segments quite quickly", i);
+        journalWrite(JRN_LOG, LOG_INFO, text, len);
+        if (i % 10 == 9) journalFlush();
+    }
+    journalFlush();
+    records = readJournal();
+    check(spiffsUsed() <= journalSegments * journalSegmentSize, "%zu bytes of Spiffs used (limit %u)", spiffsUsed(), journalSegments * journalSegmentSize);
+    check(inOrder(records) && records.back().text.find("Message 0999") != std::string::npos && records.front().r.seq > 1,
+          "oldest records dropped, %zu left in order (records %u to %u)", records.size(), records.front().r.seq, records.back().r.seq);
+    check(jrnDropped == 0 && jrnFailures == 0, "none dropped, no write failures");
+    printf("%s\n", journalStatus().c_str());
+
+    return checkResult();
+}
@@ -0,0 +1,10 @@
+// TimeLib for logbench.cpp - the time is never set, so logring.h shows times as "+seconds since start"
+
+int year() { return 1970; }
+long now() { return millis() / 1000; }
+int year(long) { return 1970; }
+int month(long) { return 1; }
+int day(long) { return 1; }
+int hour(long) { return 0; }
+int minute(long) { return 0; }
+int second(long) { return 0; }
@@ -0,0 +1,74 @@
+/*******************************************************************************************************************
+ *
+ *        logbench - what a log / debug call site costs at each LOG_COMPILED level, against the String version
+ *
+ *        src/logring.h and src/logtx.h are compiled unchanged with ../hoststub/hoststub.h.  Two versions of a
+ *        typical call site (a warning for the log and a debug line for the serial port, as the capture retry
+ *        in main.cpp) are each called a million times with serialDebug off, the default at run time:
+ *
+ *              stringSite()   as it was:  log_system_message("Warning: ..." + String(n)) and
+ *                                         if (serialDebug) Serial.println("..." + String(n))
+ *              macroSite()    now:        LOGW("...%u", n) and DBG("...%u\n", n)
+ *
+ *        This is the host (x86-64), not the esp32 - no xtensa compiler here - so only the difference between
+ *        the two and between the levels means anything.  Build it at each level, the size of each site's code
+ *        is shown by nm:
+ *
+ *              for l in 1 2 3 4; do
+ *                  g++ -Os -std=c++17 -pthread -I. -I../hoststub -DLOG_COMPILED=$l -o logbench logbench.cpp
+ *                  ./logbench; nm -S -C logbench | grep Site
+ *              done
+ *
+ *******************************************************************************************************************/
+
+#define HOST_LOGRING
+#define HOST_LOGTX
+#include "../hoststub/hoststub.h"
+
+const char *stitle = "ESPcamera";
+const char *sversion = "bench";
+void journalLog(uint8_t, const char *, uint16_t) {}
+
+#include "../../src/logtx.h"
+#include "../../src/logring.h"
+
+// as standard.h
+void log_system_message(String smes) {
+    uint8_t level = LOG_INFO;
+    if (smes.startsWith("Error")) level = LOG_ERROR;
+    else if (smes.startsWith("Warning")) level = LOG_WARN;
+    logPrintf(level, "%s", smes.c_str());
+}
+
+
+// ---------------------------------------------------------------
+//                        -the call sites
+// ---------------------------------------------------------------
+
+__attribute__((noinline)) void stringSite(unsigned n) {
+    log_system_message("Warning: camera capture failed, attempt " + String(n));
+    if (serialDebug) Serial.println("Taking a photo... attempt #" + String(n));
+}
+
+__attribute__((noinline)) void macroSite(unsigned n) {
+    LOGW("Warning: camera capture failed, attempt %u", n);
+    DBG("Taking a photo... attempt #%u\n", n);
+}
+
+template <typename F> static double nsPerCall(F site) {
+    const unsigned calls = 1000000;
+    auto start = std::chrono::steady_clock::now();
+    for (unsigned i = 0; i < calls; i++) site(i & 3);
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / calls;
+}
+
+int main() {
+    serialDebug = 0;
+    nsPerCall(stringSite);                                 // warm up (the log fills and then drops its oldest)
+    double before = nsPerCall(stringSite);
+    double after = nsPerCall(macroSite);
+    uint32_t messages = logMessages;
+    printf("LOG_COMPILED %d, logLevel %u:  String version %.0fns/call,  macro version %.0fns/call  (%u messages logged)\n",
+           LOG_COMPILED, logLevel, before, after, messages);
+    return 0;
+}
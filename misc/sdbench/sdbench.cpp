@@ -0,0 +1,580 @@
+/*******************************************************************************************************************
+ *
+ *        sdbench - benchmark of saving images to a FAT32 sd card image, the way the sketch does it (sdcard.h)
+ *
+ *        Formats a FAT32 image file and saves images to it through a small FAT driver which works the way FatFs
+ *        (as used by the esp32) does: one sector window shared by the FAT and the folders, a sector buffer per
+ *        file, whole sectors written straight from the caller's buffer, a file name search of the whole folder
+ *        when a file is created plus one for each short (8.3) name tried.  Every sector read/written goes to
+ *        the image file and is counted, the time the card would take is worked out from the number of commands
+ *        and sectors (an sd card takes much longer for many single sector writes than for one multi-sector one).
+ *
+ *        It compares the layouts and ways of writing:
+ *              flat   - all images in the root folder (as before)
+ *              hour   - a folder for each hour  /YYYY/MM/DD/HH/
+ *              psram  - the image written straight from psram, the esp32 sd driver can not DMA from psram so it
+ *                       writes one sector per command
+ *              chunk  - copied to a dma capable buffer and written -k bytes at a time (multi-sector writes)
+ *
+ *              g++ -O2 -std=c++17 -o sdbench sdbench.cpp
+ *              ./sdbench -l flat -w psram -n 5000
+ *              ./sdbench -l hour -w chunk -n 5000
+ *
+ *        Options:  -i image file (/tmp/sdbench.img)  -s image size MB (2048)  -c cluster size KB (32)
+ *                  -n images (5000)  -z average image size (60000)  -r images per hour (240)
+ *                  -l layout flat|hour (hour)  -w write psram|chunk (chunk)  -k chunk size (8192)
+ *                  -p report every n images (1000)
+ *                  card model:  -R read command us (150)  -W write command us (800)  -B bus MB/s (5, 1 bit mode)
+ *
+ *******************************************************************************************************************/
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <random>
+#include <string>
+#include <vector>
+
+
+// ---------------------------------------------------------------
+//                       - S E T T I N G S -
+// ---------------------------------------------------------------
+
+const char *imagePath = "/tmp/sdbench.img";
+uint32_t imageMB = 2048;
+uint32_t clusterKB = 32;
+uint32_t images = 5000;
+uint32_t imageSize = 60000;
+uint32_t perHour = 240;
+bool hourly = true;
+bool chunked = true;
+uint32_t chunkSize = 8192;
+uint32_t reportEvery = 1000;
+double readCmdUs = 150, writeCmdUs = 800, busMBs = 5;
+
+// ---------------------------------------------------------------
+
+#define SS 512                                   // sector size
+
+
+// ---------------------------------------------------------------
+//                  -the card (image file + time model)
+// ---------------------------------------------------------------
+
+struct Card {
+    uint8_t *img = nullptr;
+    uint64_t sectors = 0;
+    uint64_t readCmds = 0, writeCmds = 0, readSectors = 0, writeSectors = 0;
+    double us = 0;                               // modelled card time
+
+    void read(uint64_t sect, uint32_t n, uint8_t *buf) {
+        memcpy(buf, img + sect * SS, (size_t)n * SS);
+        readCmds++;
+        readSectors += n;
+        us += readCmdUs + n * SS / busMBs;
+    }
+
+    // dma = buffer the sd driver can use directly, otherwise it is written a sector at a time
+    void write(uint64_t sect, uint32_t n, const uint8_t *buf, bool dma = true) {
+        memcpy(img + sect * SS, buf, (size_t)n * SS);
+        uint32_t cmds = dma ? 1 : n;
+        writeCmds += cmds;
+        writeSectors += n;
+        us += cmds * writeCmdUs + n * SS / busMBs;
+    }
+} card;
+
+
+static void put16(uint8_t *p, uint16_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(uint8_t *p, uint32_t v) { put16(p, v); put16(p + 2, v >> 16); }
+static uint16_t get16(const uint8_t *p) { return p[0] | p[1] << 8; }
+static uint32_t get32(const uint8_t *p) { return get16(p) | (uint32_t)get16(p + 2) << 16; }
+
+
+// ---------------------------------------------------------------
+//                       -FAT32 volume
+// ---------------------------------------------------------------
+
+struct Volume {
+    uint32_t csize;                              // sectors per cluster
+    uint32_t fatStart, fatSize, dataStart, clusters, rootClus = 2, lastClus = 2;
+    uint8_t win[SS];                             // shared window for the FAT and folders
+    uint64_t winSect = UINT64_MAX;
+    bool winDirty = false;
+    uint64_t entriesScanned = 0;
+
+    void format() {
+        csize = clusterKB * 1024 / SS;
+        uint64_t total = (uint64_t)imageMB * 1024 * 1024 / SS;
+        fatStart = 32;
+        fatSize = 1;
+        for (;;) {                               // FAT size for the clusters left after it
+            clusters = (total - fatStart - 2 * fatSize) / csize;
+            uint32_t need = ((clusters + 2) * 4 + SS - 1) / SS;
+            if (need <= fatSize) break;
+            fatSize = need;
+        }
+        dataStart = fatStart + 2 * fatSize;
+        uint8_t s[SS] = {0};
+        s[0] = 0xEB; s[1] = 0x58; s[2] = 0x90;
+        memcpy(s + 3, "SDBENCH ", 8);
+        put16(s + 11, SS); s[13] = csize; put16(s + 14, fatStart); s[16] = 2; s[21] = 0xF8;
+        put16(s + 24, 63); put16(s + 26, 255); put32(s + 32, total); put32(s + 36, fatSize);
+        put32(s + 44, rootClus); put16(s + 48, 1); put16(s + 50, 6); s[64] = 0x80; s[66] = 0x29;
+        put32(s + 67, 0x12345678); memcpy(s + 71, "NO NAME    FAT32   ", 19);
+        s[510] = 0x55; s[511] = 0xAA;
+        memcpy(card.img, s, SS);
+        memcpy(card.img + 6 * SS, s, SS);
+        memset(s, 0, SS);                        // FSInfo (free counts not kept)
+        put32(s, 0x41615252); put32(s + 484, 0x61417272); put32(s + 488, 0xFFFFFFFF); put32(s + 492, 0xFFFFFFFF);
+        put32(s + 508, 0xAA550000);
+        memcpy(card.img + SS, s, SS);
+        for (int f = 0; f < 2; f++) {
+            uint8_t *fat = card.img + (uint64_t)(fatStart + f * fatSize) * SS;
+            put32(fat, 0x0FFFFFF8); put32(fat + 4, 0x0FFFFFFF); put32(fat + 8, 0x0FFFFFFF);
+        }
+        memset(card.img + clust2sect(rootClus) * SS, 0, csize * SS);
+    }
+
+    uint64_t clust2sect(uint32_t c) { return dataStart + (uint64_t)(c - 2) * csize; }
+
+    void syncWindow() {
+        if (!winDirty) return;
+        card.write(winSect, 1, win);
+        if (winSect >= fatStart && winSect < fatStart + fatSize) card.write(winSect + fatSize, 1, win);     // second FAT
+        winDirty = false;
+    }
+
+    void moveWindow(uint64_t sect) {
+        if (sect == winSect) return;
+        syncWindow();
+        card.read(sect, 1, win);
+        winSect = sect;
+    }
+
+    uint32_t getFat(uint32_t c) {
+        moveWindow(fatStart + c / (SS / 4));
+        return get32(win + c % (SS / 4) * 4) & 0x0FFFFFFF;
+    }
+
+    void putFat(uint32_t c, uint32_t v) {
+        moveWindow(fatStart + c / (SS / 4));
+        put32(win + c % (SS / 4) * 4, v);
+        winDirty = true;
+    }
+
+    // add a cluster after prev (0 = start a new chain), free clusters are searched for from the last one used
+    uint32_t createChain(uint32_t prev) {
+        for (uint32_t n = 0, c = lastClus; n < clusters; n++) {
+            if (++c >= clusters + 2) c = 2;
+            if (getFat(c) != 0) continue;
+            putFat(c, 0x0FFFFFFF);
+            if (prev) putFat(prev, c);
+            lastClus = c;
+            return c;
+        }
+        fprintf(stderr, "card full\n");
+        exit(1);
+    }
+
+    // new folder cluster is cleared through the window a sector at a time
+    void clearCluster(uint32_t c) {
+        syncWindow();
+        memset(win, 0, SS);
+        uint64_t s = clust2sect(c);
+        for (uint32_t i = 0; i < csize; i++) card.write(s + i, 1, win);
+        winSect = s + csize - 1;
+    }
+} vol;
+
+
+// ---------------------------------------------------------------
+//                           -folders
+// ---------------------------------------------------------------
+
+// steps through the 32 byte entries of a folder
+struct DirIter {
+    uint32_t clus, index = 0;
+    DirIter(uint32_t start) : clus(start) {}
+    uint8_t *entry() {
+        uint32_t inClus = index % (vol.csize * SS / 32);
+        vol.moveWindow(vol.clust2sect(clus) + inClus * 32 / SS);
+        vol.entriesScanned++;
+        return vol.win + (inClus * 32) % SS;
+    }
+    // returns false at the end of the folder (extend = add a cluster)
+    bool next(bool extend = false) {
+        index++;
+        if (index % (vol.csize * SS / 32)) return true;
+        uint32_t n = vol.getFat(clus);
+        if (n >= 0x0FFFFFF8) {
+            if (!extend) return false;
+            n = vol.createChain(clus);
+            vol.clearCluster(n);
+        }
+        clus = n;
+        return true;
+    }
+};
+
+struct DirPos {
+    uint32_t clus, index;
+};
+
+static uint8_t sfnSum(const uint8_t *sfn) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) sum = ((sum & 1) << 7) + (sum >> 1) + sfn[i];
+    return sum;
+}
+
+static const int lfnOffsets[13] = {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+// find a long name (lfn) or a short name (sfn, 11 bytes), the whole folder is read if it is not there
+static bool dirFind(uint32_t dir, const std::string &lfn, const uint8_t *sfn, DirPos *pos) {
+    DirIter it(dir);
+    std::string name;                            // long name collected from the entries before a short one
+    uint8_t sum = 0;
+    do {
+        uint8_t *e = it.entry();
+        if (e[0] == 0) return false;             // end of the folder
+        if (e[0] == 0xE5) { name.clear(); continue; }
+        if (e[11] == 0x0F) {
+            if (e[0] & 0x40) name.assign(((e[0] & 0x3F)) * 13, '\0');
+            sum = e[13];
+            uint32_t ord = (e[0] & 0x3F) - 1;
+            for (int i = 0; i < 13; i++) {
+                uint16_t c = get16(e + lfnOffsets[i]);
+                if (ord * 13 + i < name.size()) name[ord * 13 + i] = (c == 0xFFFF) ? 0 : (char)c;
+            }
+            continue;
+        }
+        bool match = sfn ? memcmp(e, sfn, 11) == 0
+                         : (!name.empty() && sum == sfnSum(e) && strcasecmp(name.c_str(), lfn.c_str()) == 0);
+        if (!match && !sfn && name.empty()) {    // name stored as a short name only
+            char s[13]; int n = 0;
+            for (int i = 0; i < 8 && e[i] != ' '; i++) s[n++] = e[i];
+            if (e[8] != ' ') { s[n++] = '.'; for (int i = 8; i < 11 && e[i] != ' '; i++) s[n++] = e[i]; }
+            s[n] = 0;
+            match = strcasecmp(s, lfn.c_str()) == 0;
+        }
+        if (match) {
+            *pos = {it.clus, it.index};
+            return true;
+        }
+        name.clear();
+    } while (it.next());
+    return false;
+}
+
+// short name for a long one, false if it had to be shortened (and needs a ~n tail and lfn entries)
+static bool makeSfn(const std::string &lfn, uint8_t *sfn) {
+    memset(sfn, ' ', 11);
+    size_t dot = lfn.rfind('.');
+    std::string body = lfn.substr(0, dot), ext = (dot == std::string::npos) ? "" : lfn.substr(dot + 1);
+    bool exact = body.size() <= 8 && ext.size() <= 3;
+    int n = 0;
+    for (char c : body) {
+        if (c == '.' || c == ' ') { exact = false; continue; }
+        if (islower(c)) exact = false;
+        if (n < 8) sfn[n++] = toupper(c);
+    }
+    for (size_t i = 0; i < ext.size() && i < 3; i++) sfn[8 + i] = toupper(ext[i]);
+    return exact;
+}
+
+// numbered short name as FatFs makes it (a hash of the long name after 5 tries)
+static void numberedSfn(uint8_t *dst, const uint8_t *src, const std::string &lfn, uint32_t seq) {
+    memcpy(dst, src, 11);
+    if (seq > 5) {
+        uint32_t sreg = seq;
+        for (char ch : lfn) {
+            uint16_t wc = (uint8_t)ch;
+            for (int i = 0; i < 16; i++) {
+                sreg = (sreg << 1) + (wc & 1);
+                wc >>= 1;
+                if (sreg & 0x10000) sreg ^= 0x11021;
+            }
+        }
+        seq = sreg & 0xFFFF;
+    }
+    char ns[8];
+    int i = 7;
+    do {
+        char c = (seq % 16) + '0';
+        seq /= 16;
+        if (c > '9') c += 7;
+        ns[i--] = c;
+    } while (i && seq);
+    ns[i] = '~';
+    int j;
+    for (j = 0; j < i && dst[j] != ' '; j++) {}
+    do { dst[j++] = (i < 8) ? ns[i++] : ' '; } while (j < 8);
+}
+
+// add an entry for a new file/folder, returns where its short entry is
+static DirPos dirRegister(uint32_t dir, const std::string &lfn, uint8_t attr, uint32_t clus) {
+    uint8_t base[11], sfn[11];
+    bool exact = makeSfn(lfn, base);
+    memcpy(sfn, base, 11);
+    DirPos pos;
+    if (!exact) {
+        for (uint32_t n = 1; n < 100; n++) {     // first short name not in use
+            numberedSfn(sfn, base, lfn, n);
+            if (!dirFind(dir, "", sfn, &pos)) break;
+        }
+    }
+    uint32_t lfnEntries = exact ? 0 : (lfn.size() + 12) / 13;
+    uint32_t need = lfnEntries + 1;
+
+    // find enough free entries in a row
+    DirIter it(dir);
+    uint32_t run = 0, startClus = dir, startIndex = 0;
+    for (;;) {
+        uint8_t *e = it.entry();
+        if (e[0] == 0 || e[0] == 0xE5) {
+            if (run++ == 0) { startClus = it.clus; startIndex = it.index; }
+            if (run == need) break;
+        } else {
+            run = 0;
+        }
+        it.next(true);
+    }
+
+    // write them
+    DirIter w(startClus);
+    w.index = startIndex;
+    uint8_t sum = sfnSum(sfn);
+    for (uint32_t k = lfnEntries; k > 0; k--) {
+        uint8_t *e = w.entry();
+        memset(e, 0, 32);
+        e[0] = k | (k == lfnEntries ? 0x40 : 0);
+        e[11] = 0x0F;
+        e[13] = sum;
+        for (int i = 0; i < 13; i++) {
+            size_t ci = (k - 1) * 13 + i;
+            uint16_t c = ci < lfn.size() ? (uint8_t)lfn[ci] : (ci == lfn.size() ? 0 : 0xFFFF);
+            put16(e + lfnOffsets[i], c);
+        }
+        vol.winDirty = true;
+        w.next(true);
+    }
+    uint8_t *e = w.entry();
+    memset(e, 0, 32);
+    memcpy(e, sfn, 11);
+    e[11] = attr;
+    put16(e + 20, clus >> 16);
+    put16(e + 26, clus);
+    put16(e + 24, (46 << 9) | (10 << 5) | 18);   // 2026-10-18
+    vol.winDirty = true;
+    return {w.clus, w.index};
+}
+
+// find or create a sub folder
+static uint32_t folder(uint32_t dir, const std::string &name) {
+    DirPos pos;
+    if (dirFind(dir, name, nullptr, &pos)) {
+        DirIter it(pos.clus);
+        it.index = pos.index;
+        uint8_t *e = it.entry();
+        return get16(e + 20) << 16 | get16(e + 26);
+    }
+    uint32_t c = vol.createChain(0);
+    vol.clearCluster(c);
+    DirIter it(c);                               // . and ..
+    uint8_t *e = it.entry();
+    memcpy(e, ".          ", 11); e[11] = 0x10; put16(e + 20, c >> 16); put16(e + 26, c);
+    it.next();
+    e = it.entry();
+    uint32_t parent = (dir == vol.rootClus) ? 0 : dir;
+    memcpy(e, "..         ", 11); e[11] = 0x10; put16(e + 20, parent >> 16); put16(e + 26, parent);
+    vol.winDirty = true;
+    dirRegister(dir, name, 0x10, c);
+    vol.syncWindow();
+    return c;
+}
+
+
+// ---------------------------------------------------------------
+//                             -files
+// ---------------------------------------------------------------
+
+struct FileW {
+    DirPos entry;
+    uint32_t start = 0, clus = 0, fptr = 0;
+    uint8_t buf[SS];
+    uint64_t bufSect = 0;
+    bool bufDirty = false;
+
+    void open(uint32_t dir, const std::string &name) {
+        DirPos pos;
+        if (dirFind(dir, name, nullptr, &pos)) { fprintf(stderr, "%s already exists\n", name.c_str()); exit(1); }
+        entry = dirRegister(dir, name, 0x20, 0);
+    }
+
+    // as f_write: whole sectors go straight from the caller's buffer (within one cluster per write)
+    void write(const uint8_t *data, uint32_t n, bool dma) {
+        while (n) {
+            if (fptr % SS == 0) {
+                uint32_t csect = (fptr / SS) & (vol.csize - 1);
+                if (csect == 0) {
+                    clus = vol.createChain(fptr ? clus : 0);
+                    if (!start) start = clus;
+                }
+                if (bufDirty) { card.write(bufSect, 1, buf); bufDirty = false; }
+                uint64_t sect = vol.clust2sect(clus) + csect;
+                uint32_t cc = n / SS;
+                if (cc) {
+                    if (csect + cc > vol.csize) cc = vol.csize - csect;
+                    card.write(sect, cc, data, dma);
+                    fptr += cc * SS; data += cc * SS; n -= cc * SS;
+                    continue;
+                }
+                bufSect = sect;                  // at the end of the file so nothing to read first
+            }
+            uint32_t w = std::min(SS - fptr % SS, n);
+            memcpy(buf + fptr % SS, data, w);
+            bufDirty = true;
+            fptr += w; data += w; n -= w;
+        }
+    }
+
+    void close() {
+        if (bufDirty) card.write(bufSect, 1, buf);
+        DirIter it(entry.clus);
+        it.index = entry.index;
+        uint8_t *e = it.entry();
+        put16(e + 20, start >> 16);
+        put16(e + 26, start);
+        put32(e + 28, fptr);
+        vol.winDirty = true;
+        vol.syncWindow();
+    }
+};
+
+
+// ---------------------------------------------------------------
+//                           -benchmark
+// ---------------------------------------------------------------
+
+static double pct(std::vector<double> v, double p) {
+    if (v.empty()) return 0;
+    std::sort(v.begin(), v.end());
+    return v[std::min(v.size() - 1, (size_t)(p * v.size()))];
+}
+
+static void usage() {
+    fprintf(stderr, "usage: sdbench [-i image] [-s MB] [-c clusterKB] [-n images] [-z size] [-r perHour] [-l flat|hour]\n"
+                    "               [-w psram|chunk] [-k chunk] [-p reportEvery] [-R readCmdUs] [-W writeCmdUs] [-B busMB/s]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+    while ((opt = getopt(argc, argv, "i:s:c:n:z:r:l:w:k:p:R:W:B:")) != -1) {
+        switch (opt) {
+            case 'i': imagePath = optarg; break;
+            case 's': imageMB = atoi(optarg); break;
+            case 'c': clusterKB = atoi(optarg); break;
+            case 'n': images = atoi(optarg); break;
+            case 'z': imageSize = atoi(optarg); break;
+            case 'r': perHour = atoi(optarg); break;
+            case 'l': hourly = strcmp(optarg, "flat") != 0; break;
+            case 'w': chunked = strcmp(optarg, "psram") != 0; break;
+            case 'k': chunkSize = atoi(optarg); break;
+            case 'p': reportEvery = atoi(optarg); break;
+            case 'R': readCmdUs = atof(optarg); break;
+            case 'W': writeCmdUs = atof(optarg); break;
+            case 'B': busMBs = atof(optarg); break;
+            default: usage();
+        }
+    }
+    if (perHour == 0 || perHour > 3600 || chunkSize % SS || clusterKB * 1024 % SS) usage();
+
+    // sparse image file
+    int fd = open(imagePath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    uint64_t bytes = (uint64_t)imageMB * 1024 * 1024;
+    if (fd < 0 || ftruncate(fd, bytes) != 0) { perror(imagePath); return 1; }
+    card.img = (uint8_t *)mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (card.img == MAP_FAILED) { perror("mmap"); return 1; }
+    card.sectors = bytes / SS;
+    vol.format();
+
+    printf("%s layout, %s writes, %u images of ~%u bytes, %u per hour, %uK clusters\n", hourly ? "hour" : "flat",
+           chunked ? ("chunk " + std::to_string(chunkSize)).c_str() : "psram", images, imageSize, perHour, clusterKB);
+
+    std::mt19937 rng(1);
+    std::vector<uint8_t> jpg(imageSize * 2), chunk(chunkSize);
+    for (auto &b : jpg) b = rng();
+    std::vector<double> lat, hostLat, part;
+    uint64_t totalBytes = 0;
+    double cardStart = card.us;
+    auto hostStart = std::chrono::steady_clock::now();
+    uint64_t scanStart = vol.entriesScanned;
+    std::string lastFolder;
+    uint32_t lastFolderClus = 0;
+    time_t t0 = 1792281600;                      // 2026-10-18 00:00 UTC
+
+    for (uint32_t i = 0; i < images; i++) {
+        time_t t = t0 + (time_t)i * 3600 / perHour;
+        struct tm tm;
+        gmtime_r(&t, &tm);
+        char name[40], dir[24];
+        strftime(name, sizeof(name), "%Y-%m-%dT%H_%M_%SZ-L.jpg", &tm);
+        strftime(dir, sizeof(dir), "%Y/%m/%d/%H", &tm);
+        uint32_t len = imageSize / 2 + rng() % imageSize;
+
+        double cardBefore = card.us;
+        auto hostBefore = std::chrono::steady_clock::now();
+        uint32_t d = vol.rootClus;
+        if (hourly) {                            // folders looked up once per hour (sdLastFolder)
+            if (lastFolder != dir) {
+                char *p = dir;
+                for (char *s; (s = strtok_r(p, "/", &p)); ) d = folder(d, s);
+                strftime(dir, sizeof(dir), "%Y/%m/%d/%H", &tm);
+                lastFolder = dir;
+                lastFolderClus = d;
+            }
+            d = lastFolderClus;
+        }
+        FileW f;
+        f.open(d, name);
+        if (chunked) {
+            for (uint32_t pos = 0; pos < len; pos += chunkSize) {
+                uint32_t n = std::min(chunkSize, len - pos);
+                memcpy(chunk.data(), jpg.data() + pos, n);
+                f.write(chunk.data(), n, true);
+            }
+        } else {
+            f.write(jpg.data(), len, false);
+        }
+        f.close();
+        double ms = (card.us - cardBefore) / 1000;
+        lat.push_back(ms);
+        part.push_back(ms);
+        hostLat.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - hostBefore).count());
+        totalBytes += len;
+
+        if ((i + 1) % reportEvery == 0) {
+            printf("  images %6u-%-6u  card latency p50 %7.1fms p99 %7.1fms\n", i + 1 - reportEvery, i, pct(part, 0.5), pct(part, 0.99));
+            part.clear();
+        }
+    }
+
+    double cardSec = (card.us - cardStart) / 1e6;
+    double hostSec = std::chrono::duration<double>(std::chrono::steady_clock::now() - hostStart).count();
+    printf("card:  %.2f MB/s sustained, latency p50 %.1fms p99 %.1fms max %.1fms\n", totalBytes / 1e6 / cardSec,
+           pct(lat, 0.5), pct(lat, 0.99), pct(lat, 1.0));
+    printf("host:  %.1f MB/s, latency p50 %.3fms p99 %.3fms\n", totalBytes / 1e6 / hostSec, pct(hostLat, 0.5), pct(hostLat, 0.99));
+    printf("per image: %.1f read cmds, %.1f write cmds, %.0f folder entries read\n", (double)card.readCmds / images,
+           (double)card.writeCmds / images, (double)(vol.entriesScanned - scanStart) / images);
+    munmap(card.img, bytes);
+    close(fd);
+    return 0;
+}
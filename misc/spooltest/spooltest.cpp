@@ -0,0 +1,347 @@
+/*******************************************************************************************************************
+ *
+ *        spooltest - runs the upload spool (src/spool.h) on linux against ingestd made to fail on demand
+ *
+ *        spool.h is compiled unchanged with small stand-ins for the Arduino parts it uses (String, the sd card
+ *        file system as a folder, FreeRTOS tasks and mutexes as threads).  Images are POSTed for real to an
+ *        ingestd started by the test (misc/ingest/ingestd.cpp), which is switched between failing with 503,
+ *        dropping the connection and working, with GET /fail?... (ingestd -T).  It checks that:
+ *
+ *              failed uploads are spooled and are found again after a restart
+ *              nothing is sent while the server fails, and the wait between attempts doubles
+ *              nothing is sent while a live upload is in progress
+ *              once the server works all images arrive, oldest first, at most one per spoolDrainInterval
+ *              an image the server rejects (413, too large) is dropped and does not hold up those behind it,
+ *              and is not spooled when a live upload is rejected
+ *
+ *        Takes about 30 seconds (the spool's own backoff times are used):
+ *
+ *              g++ -O2 -std=c++17 -pthread -o ingestd ../ingest/ingestd.cpp
+ *              g++ -O2 -std=c++17 -pthread -o spooltest spooltest.cpp
+ *              ./spooltest ./ingestd
+ *
+ *******************************************************************************************************************/
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace stdfs = std::filesystem;
+
+
+// ---------------------------------------------------------------
+//                 -stand-ins for the Arduino parts
+// ---------------------------------------------------------------
+
+class String {
+    std::string s;
+    public:
+    String() {}
+    String(const char *p) : s(p ? p : "") {}
+    String(const std::string &v) : s(v) {}
+    template <typename T, typename = std::enable_if_t<std::is_integral<T>::value>> String(T v) : s(std::to_string(v)) {}
+    String(double v, int decimals) { char b[32]; snprintf(b, sizeof(b), "%.*f", decimals, v); s = b; }
+    const char *c_str() const { return s.c_str(); }
+    size_t length() const { return s.size(); }
+    bool endsWith(const char *e) const { size_t n = strlen(e); return s.size() >= n && s.compare(s.size() - n, n, e) == 0; }
+    int lastIndexOf(char ch) const { size_t p = s.rfind(ch); return p == std::string::npos ? -1 : (int)p; }
+    String substring(int from) const { return s.substr(std::min((size_t)from, s.size())); }
+    long toInt() const { return atol(s.c_str()); }
+    bool operator==(const char *o) const { return s == o; }
+    bool operator!=(const char *o) const { return s != o; }
+    String &operator+=(const String &o) { s += o.s; return *this; }
+    friend String operator+(const String &a, const String &b) { return String(a.s + b.s); }
+    friend String operator+(const char *a, const String &b) { return String(a + b.s); }
+    friend String operator+(const String &a, const char *b) { return String(a.s + b); }
+};
+
+template <typename T> T min(T a, T b) { return a < b ? a : b; }
+template <typename T> T max(T a, T b) { return a > b ? a : b; }
+
+static const auto testStart = std::chrono::steady_clock::now();
+uint32_t millis() { return (uint32_t)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - testStart).count(); }
+
+#define FILE_READ "r"
+#define FILE_WRITE "w"
+
+namespace fs {
+class File {
+    public:
+    File() {}
+    File(const std::string &path, FILE *f) : _path(path), _f(f) {}
+    File(const std::string &path, std::vector<std::string> entries) : _path(path), _dir(true), _entries(entries) {}
+    explicit operator bool() const { return _f || _dir; }
+    bool isDirectory() const { return _dir; }
+    const char *name() const { return _path.c_str(); }
+    size_t size() { long p = ftell(_f); fseek(_f, 0, SEEK_END); long n = ftell(_f); fseek(_f, p, SEEK_SET); return n; }
+    size_t position() { return ftell(_f); }
+    size_t read(uint8_t *buf, size_t len) { return fread(buf, 1, len, _f); }
+    size_t write(const uint8_t *buf, size_t len) { return fwrite(buf, 1, len, _f); }
+    size_t print(const String &t) { return fwrite(t.c_str(), 1, t.length(), _f); }
+    String readStringUntil(char end) { std::string r; int ch; while ((ch = fgetc(_f)) != EOF && ch != end) r += (char)ch; return String(r); }
+    File openNextFile() {
+        if (_next >= _entries.size()) return File();
+        std::string p = _entries[_next++];
+        return File(p, fopen(p.c_str(), "rb"));
+    }
+    void close() { if (_f) fclose(_f); _f = NULL; }
+    private:
+    std::string _path;
+    FILE *_f = NULL;
+    bool _dir = false;
+    std::vector<std::string> _entries;
+    size_t _next = 0;
+};
+
+class FS {                                                 // a folder on the linux box
+    public:
+    std::string root;
+    File open(const String &path, const char *mode = FILE_READ) {
+        std::string p = root + path.c_str();
+        if (stdfs::is_directory(p)) {
+            std::vector<std::string> entries;
+            for (auto &e : stdfs::directory_iterator(p)) entries.push_back(e.path().string());
+            std::sort(entries.begin(), entries.end());
+            return File(p, entries);
+        }
+        FILE *f = fopen(p.c_str(), strcmp(mode, "w") == 0 ? "wb" : "rb");
+        return f ? File(p, f) : File();
+    }
+    bool remove(const String &path) { return ::remove((root + path.c_str()).c_str()) == 0; }
+    bool mkdir(const char *path) { return stdfs::create_directories(root + path) || stdfs::is_directory(root + path); }
+};
+}
+using fs::File;
+fs::FS SD_MMC, SPIFFS;
+bool SD_Present = 1;
+
+// FreeRTOS
+typedef std::timed_mutex *SemaphoreHandle_t;
+#define pdTRUE 1
+#define pdPASS 1
+#define portMAX_DELAY 0xFFFFFFFF
+#define pdMS_TO_TICKS(ms) (ms)
+SemaphoreHandle_t xSemaphoreCreateMutex() { return new std::timed_mutex; }
+int xSemaphoreTake(SemaphoreHandle_t m, uint32_t ms) {
+    if (ms == portMAX_DELAY) { m->lock(); return pdTRUE; }
+    return m->try_lock_for(std::chrono::milliseconds(ms));
+}
+void xSemaphoreGive(SemaphoreHandle_t m) { m->unlock(); }
+void vTaskDelay(uint32_t ms) { std::this_thread::sleep_for(std::chrono::milliseconds(ms)); }
+bool tasksRun = 0;                                         // off while simulating the first boot
+int xTaskCreate(void (*fn)(void *), const char *, int, void *param, int, void *) {
+    if (tasksRun) std::thread(fn, param).detach();
+    return pdPASS;
+}
+
+// memory, wifi, log
+#define MALLOC_CAP_SPIRAM 1
+#define MALLOC_CAP_8BIT 2
+void *heap_caps_malloc(size_t n, int) { return malloc(n); }
+void heap_caps_free(void *p) { free(p); }
+bool psramFound() { return 0; }
+#define WL_CONNECTED 3
+struct { int status() { return WL_CONNECTED; } } WiFi;
+void log_system_message(String m) { printf("  %6.1fs  %s\n", millis() / 1000.0, m.c_str()); }
+
+// post.h / sinks.h
+#define OUT_BACKLOG 2
+bool PostImages = 1;
+volatile uint8_t postActive = 0;
+struct { uint8_t waiting() { return 0; } } postSink;
+int serverPort = 0;
+
+std::mutex sentMutex;
+std::vector<std::pair<std::string, uint32_t>> sentOk;     // backlog images the server stored, and when
+
+// POST an image to ingestd the way post.h does (one multipart part with its length), returns the status (0 = no reply)
+int postImage(uint8_t *buf, size_t len, String fName, uint8_t prio) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(serverPort);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&a, sizeof(a)) != 0) { close(fd); return 0; }
+    std::string head = std::string("--B0UNDARY\r\nContent-Disposition: form-data; name=\"imageFile\"; filename=\"") + fName.c_str() +
+                       "\"\r\nContent-Type: image/jpeg\r\nContent-Length: " + std::to_string(len) + "\r\n\r\n";
+    std::string tail = "\r\n--B0UNDARY--\r\n";
+    std::string req = "POST /upload HTTP/1.1\r\nHost: test\r\nConnection: close\r\nContent-Type: multipart/form-data; boundary=B0UNDARY\r\n"
+                      "Content-Length: " + std::to_string(head.size() + len + tail.size()) + "\r\n\r\n" + head;
+    send(fd, req.data(), req.size(), MSG_NOSIGNAL);
+    send(fd, buf, len, MSG_NOSIGNAL);
+    send(fd, tail.data(), tail.size(), MSG_NOSIGNAL);
+    char reply[256] = {0};
+    ssize_t n = recv(fd, reply, sizeof(reply) - 1, 0);
+    close(fd);
+    int status = (n > 12) ? atoi(reply + 9) : 0;
+    if (prio == OUT_BACKLOG && status == 200) {
+        std::lock_guard<std::mutex> lock(sentMutex);
+        sentOk.push_back({fName.c_str(), millis()});
+    }
+    return status;
+}
+
+#include "../../src/spool.h"
+
+
+// ---------------------------------------------------------------
+//                            -test
+// ---------------------------------------------------------------
+
+static int failures = 0;
+static void check(bool ok, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    printf("%s ", ok ? "ok  " : "FAIL");
+    vprintf(fmt, args);
+    printf("\n");
+    va_end(args);
+    if (!ok) failures++;
+}
+
+static void serverFail(const char *mode) {
+    uint8_t none = 0;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(serverPort);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    connect(fd, (struct sockaddr *)&a, sizeof(a));
+    std::string req = std::string("GET /fail?") + mode + " HTTP/1.1\r\nConnection: close\r\n\r\n";
+    send(fd, req.data(), req.size(), MSG_NOSIGNAL);
+    while (recv(fd, &none, 1, 0) > 0) {}
+    close(fd);
+    printf("  %6.1fs  server failing: %s\n", millis() / 1000.0, mode);
+}
+
+// wait until cond() or the time is up
+template <typename F> static bool waitFor(F cond, uint32_t ms) {
+    uint32_t start = millis();
+    while (!cond()) {
+        if (millis() - start > ms) return false;
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return true;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s path/to/ingestd\n", argv[0]);
+        return 1;
+    }
+    char tmpl[] = "/tmp/spooltestXXXXXX";
+    std::string dir = mkdtemp(tmpl);
+    SD_MMC.root = dir + "/sd";
+    SPIFFS.root = dir + "/spiffs";
+    stdfs::create_directories(SD_MMC.root);
+    stdfs::create_directories(SPIFFS.root);
+
+    // server, failing from the start
+    serverPort = 20000 + getpid() % 20000;
+    pid_t server = fork();
+    if (server == 0) {
+        std::string port = std::to_string(serverPort), images = dir + "/received";
+        freopen("/dev/null", "w", stdout);
+        execl(argv[1], argv[1], "-p", port.c_str(), "-d", images.c_str(), "-m", "100000", "-f", "503", "-T", (char *)NULL);
+        _exit(127);
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+
+    // first boot: the uploads fail and are spooled
+    const int images = 8;
+    std::vector<std::vector<uint8_t>> jpg(images);
+    std::vector<uint8_t> big(200000, 0);                   // more than ingestd's -m, it will be rejected with 413
+    big[0] = 0xFF;
+    big[1] = 0xD8;
+    int refused = 0;
+    spoolSetup();
+    for (int i = 0; i < images; i++) {
+        jpg[i].assign(20000 + i * 1000, (uint8_t)i);
+        jpg[i][0] = 0xFF;                                  // ingestd only keeps jpegs
+        jpg[i][1] = 0xD8;
+        String name = "img" + String(i) + ".jpg";
+        int status = postImage(jpg[i].data(), jpg[i].size(), name, 0);
+        if (status == 503) refused++;
+        spoolFailed(jpg[i].data(), jpg[i].size(), name, status);
+        if (i == 2) spoolFailed(big.data(), big.size(), "big.jpg", postImage(big.data(), big.size(), "big.jpg", 0));
+    }
+    check(refused == images, "server refused all %d live uploads (%d)", images, refused);
+    check(spoolCount() == images + 1, "%d images spooled (%u)", images + 1, spoolCount());
+
+    // restart: the spool is found again in the folder and the task started
+    spoolHead = spoolTail = 1;
+    spoolBytes = 0;
+    tasksRun = 1;
+    spoolSetup();
+    check(spoolCount() == images + 1, "%d images found in the spool after a restart (%u)", images + 1, spoolCount());
+
+    // server still failing, then down altogether: nothing sent, backoff doubles
+    check(waitFor([] { return spoolSendFailures >= 1; }, 3000), "send attempted and failed (503)");
+    check(spoolBackoff == spoolMinBackoff, "waiting %ums after the first failure (%u)", spoolMinBackoff, spoolBackoff);
+    serverFail("drop");
+    check(waitFor([] { return spoolSendFailures >= 2; }, spoolMinBackoff + 3000), "send attempted and failed (connection dropped)");
+    check(spoolBackoff == spoolMinBackoff * 2, "wait doubled to %ums (%u)", spoolMinBackoff * 2, spoolBackoff);
+    check(spoolSent == 0 && spoolCount() == images + 1, "nothing sent while failing (%u sent, %u waiting)", spoolSent, spoolCount());
+
+    // server back: sends resume at the next attempt
+    serverFail("off");
+    check(waitFor([] { return spoolSent >= 2; }, spoolMinBackoff * 2 + 4000), "sending resumed once the server works");
+
+    // a live upload in progress holds the spool back
+    postActive = 1;
+    uint32_t sentBefore = spoolSent;
+    std::this_thread::sleep_for(std::chrono::milliseconds(spoolDrainInterval * 3));
+    uint32_t sentDuring = spoolSent - sentBefore;
+    postActive = 0;
+    check(sentDuring <= 1, "at most the send already started went while a live upload was in progress (%u)", sentDuring);
+
+    bool emptied = waitFor([] { return spoolCount() == 0; }, (images + 1) * spoolDrainInterval + 5000);
+    check(emptied, "spool emptied (%u waiting)", spoolCount());
+    check(spoolRejected == 1 && spoolBackoff == 0, "image rejected by the server dropped without waiting (%u rejected)", spoolRejected);
+
+    // a live upload the server rejects is not spooled
+    int status = postImage(big.data(), big.size(), "big.jpg", 0);
+    bool spooled = spoolFailed(big.data(), big.size(), "big.jpg", status);
+    check(status == 413 && !spooled && spoolCount() == 0 && spoolRejected == 2, "rejected live upload not spooled (status %d)", status);
+    std::lock_guard<std::mutex> lock(sentMutex);
+    bool inOrder = sentOk.size() == (size_t)images;
+    uint32_t minGap = 0xFFFFFFFF;
+    for (size_t i = 0; i < sentOk.size(); i++) {
+        if (sentOk[i].first != "img" + std::to_string(i) + ".jpg") inOrder = false;
+        if (i) minGap = std::min(minGap, sentOk[i].second - sentOk[i - 1].second);
+    }
+    check(inOrder, "all %d images sent once each, oldest first (%zu sent)", images, sentOk.size());
+    check(minGap + 50 >= spoolDrainInterval, "at most one image per %ums (closest %ums apart)", spoolDrainInterval, minGap);
+
+    size_t stored = 0;
+    for (auto &e : stdfs::recursive_directory_iterator(dir + "/received")) {
+        if (!e.is_regular_file()) continue;
+        int i = atoi(e.path().filename().string().c_str() + 3);
+        if (i >= 0 && i < images && stdfs::file_size(e.path()) == jpg[i].size()) stored++;
+    }
+    check(stored == (size_t)images, "server stored %d images of the right size (%zu)", images, stored);
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    stdfs::remove_all(dir);
+    printf("%s\n", failures ? "FAILED" : "passed");
+    return failures ? 1 : 0;
+}
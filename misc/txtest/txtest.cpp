@@ -0,0 +1,207 @@
+/*******************************************************************************************************************
+ *
+ *        txtest - runs the log transport (src/logtx.h) on linux, with several threads writing at once
+ *
+ *        logtx.h is compiled unchanged with ../hoststub/hoststub.h, what its task writes to the serial port is
+ *        kept by the test and its websocket port is a real one on 127.0.0.1.  It checks:
+ *
+ *              txThreads threads writing txLines lines each at once: no line is torn, mixed with another or out
+ *              of order, and the bytes received plus those counted as dropped are all that were written
+ *              a connection to the websocket port which sends nothing does not hold up the output
+ *              a handshake request sent in pieces is answered once it is all there (the RFC 6455 example key)
+ *              the text then arrives as websocket frames
+ *              a connection which never finishes its request is closed after txWsHandshakeTime
+ *
+ *        Also worth building with -fsanitize=thread (no races should be reported):
+ *
+ *              g++ -O2 -std=c++17 -pthread -I../hoststub -o txtest txtest.cpp
+ *              g++ -O1 -g -std=c++17 -pthread -fsanitize=thread -I../hoststub -o txtest txtest.cpp
+ *              ./txtest
+ *
+ *******************************************************************************************************************/
+
+#define HOST_LOGTX
+#include "../hoststub/hoststub.h"
+
+const char *stitle = "ESPcamera";
+const char *sversion = "test";
+
+#include "../../src/logtx.h"
+
+const int txThreads = 4;
+const int txLines = 200000;
+
+
+// ---------------------------------------------------------------
+//                   -what reaches the serial port
+// ---------------------------------------------------------------
+
+std::mutex serialMutex;
+std::string serialOut;
+
+static void keepSerial(const uint8_t *buf, size_t len) {
+    std::lock_guard<std::mutex> lock(serialMutex);
+    serialOut.append((const char *)buf, len);
+}
+
+static bool serialHas(const char *text) {
+    std::lock_guard<std::mutex> lock(serialMutex);
+    return serialOut.find(text) != std::string::npos;
+}
+
+// ms until the text reaches the serial port (-1 = not within ms)
+static int waitSerial(const char *text, int ms) {
+    for (int waited = 0; waited <= ms; waited += 2) {
+        if (serialHas(text)) return waited;
+        delay(2);
+    }
+    return -1;
+}
+
+static void writer(int thread) {
+    char line[40];
+    for (int i = 0; i < txLines; i++) {
+        snprintf(line, sizeof(line), "<%d:%07d:abcdefghijklmnop>\n", thread, i);
+        txPrintf("%s", line);
+    }
+}
+
+
+// ---------------------------------------------------------------
+//                         -websocket
+// ---------------------------------------------------------------
+
+static int freePort() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t l = sizeof(a);
+    bind(fd, (struct sockaddr *)&a, sizeof(a));
+    getsockname(fd, (struct sockaddr *)&a, &l);
+    close(fd);
+    return ntohs(a.sin_port);
+}
+
+static int wsConnect() {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in a = {};
+    a.sin_family = AF_INET;
+    a.sin_port = htons(hostPortMap[txWsPort]);
+    a.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    connect(fd, (struct sockaddr *)&a, sizeof(a));
+    return fd;
+}
+
+static void sendText(int fd, const char *text) {
+    send(fd, text, strlen(text), MSG_NOSIGNAL);
+}
+
+// what arrives within ms (stops early once it has 'until')
+static std::string receive(int fd, int ms, const char *until = NULL) {
+    std::string got;
+    for (int waited = 0; waited <= ms; waited += 5) {
+        char buf[512];
+        ssize_t n;
+        while ((n = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) got.append(buf, n);
+        if (until && got.find(until) != std::string::npos) break;
+        delay(5);
+    }
+    return got;
+}
+
+// has the other end closed the connection
+static bool closedWithin(int fd, int ms) {
+    for (int waited = 0; waited <= ms; waited += 5) {
+        char buf[512];
+        if (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) == 0) return true;
+        delay(5);
+    }
+    return false;
+}
+
+
+// ---------------------------------------------------------------
+//                            -test
+// ---------------------------------------------------------------
+
+int main() {
+    hostPortMap[txTcpPort] = freePort();
+    hostPortMap[txWsPort] = freePort();
+    hostSerialHook = keepSerial;
+    txSetup();
+
+    // several threads at once
+    std::vector<std::thread> threads;
+    for (int t = 0; t < txThreads; t++) threads.emplace_back(writer, t);
+    for (auto &t : threads) t.join();
+    for (int waited = 0; __atomic_load_n(&txTail, __ATOMIC_ACQUIRE) != __atomic_load_n(&txHead, __ATOMIC_ACQUIRE) && waited < 2000; waited++) delay(1);
+    delay(50);
+
+    std::string out;
+    {
+        std::lock_guard<std::mutex> lock(serialMutex);
+        out.swap(serialOut);
+    }
+    size_t lineLen = strlen("<0:0000000:abcdefghijklmnop>\n");
+    int next[txThreads] = {0};
+    size_t received = 0, bad = 0, outOfOrder = 0;
+    for (size_t pos = 0; pos < out.size(); pos += lineLen) {
+        int thread, n;
+        char end;
+        if (out.size() - pos < lineLen || sscanf(out.c_str() + pos, "<%d:%7d:abcdefghijklmnop%c", &thread, &n, &end) != 3 || end != '>' ||
+            out[pos + lineLen - 1] != '\n' || thread < 0 || thread >= txThreads) {
+            bad++;
+            break;
+        }
+        if (n < next[thread]) outOfOrder++;
+        next[thread] = n + 1;
+        received++;
+    }
+    size_t total = (size_t)txThreads * txLines * lineLen;
+    printf("%zu of %d lines received, %u bytes dropped as the ring was full\n", received, txThreads * txLines, txDropped);
+    check(bad == 0, "no line torn or mixed with another");
+    check(outOfOrder == 0, "the lines of each thread in order");
+    check(received * lineLen + txDropped == total && txBytes == received * lineLen, "bytes received + dropped = bytes written (%zu + %u of %zu)",
+          received * lineLen, txDropped, total);
+
+    // a connection which sends nothing does not hold up the output
+    int idle = wsConnect();
+    delay(50);
+    txPrintf("after the idle connection\n");
+    int waited = waitSerial("after the idle connection", 500);
+    check(waited >= 0, "output carries on with a silent websocket connection (%dms)", waited);
+
+    // its request arrives in pieces
+    sendText(idle, "GET /console HTTP/1.1\r\nHost: 127.0.0.1:81\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n");
+    delay(100);
+    txPrintf("between the pieces\n");
+    check(waitSerial("between the pieces", 500) >= 0 && receive(idle, 100).empty(), "not answered before the request is all there");
+    sendText(idle, "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n");
+    std::string reply = receive(idle, 500, "\r\n\r\n");
+    check(reply.find("HTTP/1.1 101") == 0 && reply.find("Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n") != std::string::npos,
+          "handshake answered with the RFC 6455 accept key");
+    txPrintf("hello websocket\n");
+    std::string frame = receive(idle, 500, "hello websocket\n");
+    check(frame.size() == 2 + 16 && (uint8_t)frame[0] == 0x81 && frame[1] == 16 && frame.substr(2) == "hello websocket\n",
+          "text sent as a websocket frame (%zu bytes)", frame.size());
+
+    // a new connection replaces it, and is closed if it never finishes its request
+    int slow = wsConnect();
+    sendText(slow, "GET /console HTTP/1.1\r\n");
+    check(closedWithin(idle, 500), "new connection replaces the old one");
+    delay(100);
+    hostAdvance(txWsHandshakeTime);
+    check(closedWithin(slow, 500), "unfinished request closed after txWsHandshakeTime");
+
+    // a request without a key
+    int nokey = wsConnect();
+    sendText(nokey, "GET /console HTTP/1.1\r\nHost: 127.0.0.1\r\n\r\n");
+    check(closedWithin(nokey, 500), "request without a Sec-WebSocket-Key closed");
+    close(idle);
+    close(slow);
+    close(nokey);
+    int result = checkResult();
+    fflush(stdout);
+    _exit(result);                                         // the task is still running, do not destroy what it uses
+}
@@ -0,0 +1,138 @@
+/**************************************************************************************************
+ *
+ *                   Batched stream uploads - several frames per POST request
+ *
+ *      Sending each frame of a POST stream as its own request and waiting for the reply means the frame rate
+ *      is set by the round trip time to the server rather than the bandwidth.  With postBatchFrames > 1
+ *      (requires psram) the stream frames are copied in to a batch and postBatchFrames at a time are sent in
+ *      one multipart request (see postImages in post.h) by a background task.  There are two batches, while
+ *      one is being sent the stream carries on filling the other, it only has to wait if the upload can not
+ *      keep up.  If a batch fails its frames go to the upload spool (unless the server rejected them with a 4xx,
+ *      see spool.h) and the stream is stopped.
+ *
+ *      Note: the server needs to accept several files per request - see the scripts at the bottom of post.h
+ *
+ **************************************************************************************************/
+
+// forward declarations
+bool batchSetup();
+bool batchReady();
+void batchStart();
+bool batchAdd(camera_fb_t *fb, String fName);
+bool batchFinish();
+
+
+FrameRing batchStore[2];                                   // frames of the two batches (FrameRing - see preroll.h)
+String batchNames[2][postMaxBatch];                        // file names of the frames
+uint8_t batchFill = 0;                                     // batch being filled by the stream
+uint8_t batchSending = 0;                                  // batch being sent by the task
+volatile bool batchBusy = 0;                               // set while a batch is being sent
+volatile bool batchFailed = 0;                             // a batch has failed since batchStart()
+TaskHandle_t batchTaskHandle = NULL;
+uint32_t batchSent = 0;                                    // batches sent ok
+uint32_t batchFramesSent = 0;                              // frames in those batches
+uint32_t batchWaitTime = 0;                                // time the stream had to wait for the previous batch (ms)
+
+
+// ----------------------------------------------------------------
+//               -background task sending the batches
+// ----------------------------------------------------------------
+static void batchTask(void *) {
+    uint8_t *bufs[postMaxBatch];
+    size_t lens[postMaxBatch];
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        FrameRing &store = batchStore[batchSending];
+        uint8_t count = store.count();
+        for (uint8_t i = 0; i < count; i++) {
+            const uint8_t *buf;
+            uint32_t ms;
+            store.get(i, &buf, &lens[i], &ms);
+            bufs[i] = (uint8_t *)buf;
+        }
+        int status = postImages(bufs, lens, batchNames[batchSending], count, OUT_STREAM);
+        if (status / 100 == 2) {
+            batchSent++;
+            batchFramesSent += count;
+        } else {
+            for (uint8_t i = 0; i < count; i++) spoolFailed(bufs[i], lens[i], batchNames[batchSending][i], status);     // keep them to send later
+            batchFailed = 1;
+        }
+        store.clear();
+        batchBusy = 0;
+    }
+}
+
+
+// allocate the batches and start the task, called from setup before the camera is started
+bool batchSetup() {
+    if (postBatchFrames < 2) return 0;
+    if (!psramFound()) {
+        log_system_message("Batched uploads disabled as no psram");
+        return 0;
+    }
+    if (!batchStore[0].begin(postBatchMemory) || !batchStore[1].begin(postBatchMemory)) {
+        log_system_message("Error: Unable to allocate batched upload store");
+        return 0;
+    }
+    if (xTaskCreate(batchTask, "batch", 6144, NULL, 1, &batchTaskHandle) != pdPASS) {
+        log_system_message("Error: Unable to start batched upload task");
+        return 0;
+    }
+    log_system_message("Batched stream uploads of " + String(min(postBatchFrames, postMaxBatch)) + " frames enabled");
+    return 1;
+}
+
+
+bool batchReady() {
+    return batchTaskHandle != NULL;
+}
+
+
+// start of a stream
+void batchStart() {
+    batchFailed = 0;
+}
+
+
+// hand the batch being filled to the task (waits for the previous one to finish)
+static void batchSubmit() {
+    if (batchStore[batchFill].count() == 0) return;
+    uint32_t startTime = millis();
+    while (batchBusy) delay(2);
+    batchWaitTime += millis() - startTime;
+    batchSending = batchFill;
+    batchBusy = 1;
+    xTaskNotifyGive(batchTaskHandle);
+    batchFill ^= 1;
+    batchStore[batchFill].clear();
+}
+
+
+// ----------------------------------------------------------------
+//                   -add a stream frame to a batch
+// ----------------------------------------------------------------
+// the frame is copied so fb can be returned straight away, returns 0 if a batch has failed (stop the stream)
+bool batchAdd(camera_fb_t *fb, String fName) {
+    if (batchFailed) return 0;
+    FrameRing *store = &batchStore[batchFill];
+    size_t overhead = (store->count() + 1) * 12;           // record headers and alignment
+    if (store->count() >= min(postBatchFrames, postMaxBatch) || store->used() + fb->len + overhead > store->size()) {
+        batchSubmit();                                     // batch full
+        store = &batchStore[batchFill];
+    }
+    uint16_t n = store->count();
+    if (fb->len + 12 > store->size() || !store->push(fb->buf, fb->len, millis())) return 0;
+    batchNames[batchFill][n] = fName;
+    return 1;
+}
+
+
+// send any frames left and wait for all to be sent (end of a stream), returns 0 if a batch failed
+bool batchFinish() {
+    batchSubmit();
+    while (batchBusy) delay(2);
+    return !batchFailed;
+}
+
+// ---------------------------------------------- end ----------------------------------------------
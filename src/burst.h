@@ -0,0 +1,122 @@
+/**************************************************************************************************
+ *
+ *            Burst capture - several full resolution photos per trigger at the sensors full rate
+ *
+ *      With burstFrames > 1 (requires psram) a motion trigger captures burstFrames photos back to back in to a
+ *      psram store (a FrameRing - see preroll.h) with the camera in fifo grab mode, each frame buffer is copied and
+ *      handed straight back to the camera so it never waits.  Only once the last photo has been captured are they
+ *      handed to the image sinks (sinks.h) to be saved to Spiffs / sd card and sent via FTP / POST in the
+ *      background so motion detection restarts straight away.  The store is reused once the sinks have finished.
+ *
+ *      The first photo of the burst is stored in Spiffs as the trigger image, all are saved/sent as <event>-B<n>.jpg
+ *
+ **************************************************************************************************/
+
+// forward declarations
+bool burstSetup();
+bool burstReady();
+bool burstCapture();
+static void burstRelease(ImageJob *);
+
+
+FrameRing burstStore;                                      // photos waiting to be saved
+bool burstEnabled = 0;
+volatile uint16_t burstPending = 0;                        // photos of the last burst still being saved by the sinks
+uint32_t burstStart = 0;                                   // time the last burst was handed to the sinks
+uint32_t burstInterval = 0;                                // average time between photos in the last burst (ms)
+uint32_t burstLatency = 0;                                 // time from motion trigger to the last photo being captured (ms)
+
+
+// allocate the store, called from setup before the camera is started
+bool burstSetup() {
+    if (burstFrames < 2) return 0;
+    if (!psramFound()) {
+        log_system_message("Burst capture disabled as no psram");
+        return 0;
+    }
+    if (!burstStore.begin(burstMemory)) {
+        log_system_message("Error: Unable to allocate burst capture store");
+        return 0;
+    }
+    burstEnabled = 1;
+    log_system_message("Burst capture of " + String(burstFrames) + " photos enabled");
+    return 1;
+}
+
+
+// if a burst can be captured (enabled and previous burst has been saved)
+bool burstReady() {
+    return burstEnabled && !burstPending;
+}
+
+
+// ----------------------------------------------------------------
+//                      -capture a burst of photos
+// ----------------------------------------------------------------
+// camera must already be in jpg mode using CAMERA_GRAB_WHEN_EMPTY
+bool burstCapture() {
+    String EventName = currentTime(0);
+    bool useFlash = UseFlash && (flashMode == 2 || (flashMode == 1 && cameraImageGain > 0));
+    if (useFlash) digitalWrite(Illumination_led, ledON);
+
+    uint32_t firstFrame = 0;
+    uint32_t lastFrame = 0;
+    uint8_t frames = 0;
+    burstStore.clear();
+    while (frames < burstFrames) {
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) break;
+        bool stored = burstStore.tryPush(fb->buf, fb->len, millis());      // push() would make room by dropping the first photos
+        esp_camera_fb_return(fb);                          // give buffer straight back so the sensor carries on
+        if (!stored) {                                     // store is full, keep the photos taken so far
+            logPrintf(LOG_WARN, "Burst store full after %u of %u photos (burstMemory too small)", frames, burstFrames);
+            break;
+        }
+        lastFrame = millis();
+        if (frames++ == 0) firstFrame = lastFrame;
+    }
+    if (useFlash) digitalWrite(Illumination_led, ledOFF);
+    if (frames == 0) {
+        log_system_message("Error: Burst capture failed");
+        return 0;
+    }
+
+    camFpsRecord(frames - 1, lastFrame - firstFrame);
+    burstInterval = (frames > 1) ? (lastFrame - firstFrame) / (frames - 1) : 0;
+    burstLatency = lastFrame - TriggerMillis;
+    logPrintf(LOG_INFO, "Burst of %u photos %ums apart, last photo %ums after trigger", frames, burstInterval, burstLatency);
+
+    prerollFlush(EventName);                               // frames from before the trigger
+
+    // hand the photos to the sinks, the first is the trigger image in Spiffs
+    burstStart = millis();
+    burstPending = frames + 1;                             // held until all photos have been dispatched
+    for (uint16_t n = 0; n < frames; n++) {
+        const uint8_t *buf;
+        size_t len;
+        uint32_t ms;
+        burstStore.get(n, &buf, &len, &ms);
+        ImageJob *job = imageJob(buf, len, EventName + "-B" + String(n + 1), (n == 0) ? SINK_ALL : SINK_ALL & ~SINK_EMAIL);
+        if (n == 0) job->spiffsName = String(SpiffsFileCounter);
+        job->release = burstRelease;
+        imageDispatch(job);
+    }
+    burstRelease(NULL);
+    return 1;
+}
+
+
+// called by the sinks as they finish with each photo, the last one frees the store for the next burst
+static void burstRelease(ImageJob *) {
+    portENTER_CRITICAL(&sinkMux);
+    bool last = (burstPending == 1);
+    if (!last) burstPending--;
+    portEXIT_CRITICAL(&sinkMux);
+    if (!last) return;
+    uint16_t frames = burstStore.count();
+    burstStore.clear();
+    burstPending = 0;
+    logPrintf(LOG_INFO, "Burst of %u photos saved in %lums", frames, millis() - burstStart);
+}
+
+// ---------------------------------------------- end ----------------------------------------------
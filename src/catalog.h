@@ -0,0 +1,330 @@
+/**************************************************************************************************
+ *
+ *            Image catalog - list of the stored images kept in ram and in an index file
+ *
+ *      Each image saved to the image store (imgstore.h) or the sd card gets a catalog entry: sequence no.,
+ *      time, size, motion score and where it is stored.  The entries are kept in a ring in psram so the web
+ *      pages can page through thousands of images without reading a directory, and appended to an index
+ *      file (on the sd card, or Spiffs if there is none) as they change.  At boot the ring is filled from
+ *      this file, the directories are never scanned.
+ *
+ *      The index file only grows, an entry which changes (e.g. the sd card copy is added after the flash
+ *      one) is written again and the later copy wins when it is read back.  Each record has a crc, if one
+ *      was left half written by a restart the file is rewritten at boot.  Once it holds twice as many
+ *      records as the ring it is also rewritten with just the current entries.  The rewrite goes to a new
+ *      file which replaces the old one once it is complete, and takes the entries from the ring a few at a
+ *      time so catalogAdd() on the capture path is never held up by it.  catMutex guards the ring and
+ *      catFileMutex the index file, where both are needed catFileMutex is taken first.
+ *
+ *      An image in the image store is eventually overwritten by newer ones, catalogInFlash() checks the
+ *      store still has it.
+ *
+ **************************************************************************************************/
+
+// usage:   uint32_t seq = catalogAdd("2026-10-18T12:00:00Z-L", "3", len, score);
+//          catalogStored(seq, CAT_SD, 0);                  // once saved
+//          catEntry_t e;
+//          for (uint32_t s = catalogLast(); s >= catalogFirst() && s; s--) if (catalogGet(s, &e)) ...
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const uint16_t catalogSize = 8192;               // entries kept in psram (images older than this are removed from the sd card, see retention.h)
+const uint16_t catalogSizeSmall = 128;           // entries kept if there is no psram or no sd card (the index file is then in Spiffs)
+const char catalogFile[] = "/catalog.idx";
+const uint8_t catalogChunk = 16;                 // entries copied from the ring at a time when the index file is rewritten
+//  ------------------------------------------------------------------
+
+// where an image is stored
+#define CAT_FLASH 0x01                           // image store (imgstore.h)
+#define CAT_SD    0x02                           // sd card
+
+struct catEntry_t {
+    uint32_t seq;                                // catalog no. (increases by one for each image, 0 = unused entry)
+    uint32_t time;                               // when captured (unix time, 0 = time not known)
+    uint32_t size;                               // jpg length
+    uint32_t flashSeq;                           // sequence no. of the image store record
+    uint16_t score;                              // motion detected (changed blocks, 0 = not motion triggered)
+    uint8_t where;                               // CAT_xxx flags
+    uint8_t spare;
+    char slot[4];                                // name in the image store  e.g. "3s"
+    char name[28];                               // file name without extension  e.g. "2026-10-18T12:00:00Z-L"
+    uint32_t crc;                                // crc32 of the above (index file only)
+};
+
+// forward declarations
+bool catalogSetup();
+uint32_t catalogAdd(String name, String slot, size_t size, uint16_t score);
+void catalogStored(uint32_t seq, uint8_t where, uint32_t flashSeq);
+void catalogRemoved(uint32_t seq, uint8_t where);
+bool catalogGet(uint32_t seq, catEntry_t *e);
+bool catalogInFlash(const catEntry_t &e);
+uint32_t catalogFirst();
+uint32_t catalogLast();
+String catalogStatus();
+
+
+catEntry_t *catRing = NULL;
+uint16_t catCapacity = 0;
+SemaphoreHandle_t catMutex = NULL;               // guards the ring
+SemaphoreHandle_t catFileMutex = NULL;           // guards the index file (and catFileRecords, catFileDamaged)
+uint32_t catNext = 1;                            // catalog no. for the next image
+uint32_t catFileRecords = 0;                     // records in the index file
+bool catFileDamaged = 0;                         // index file ends in part of a record, it is rewritten before anything more is added
+uint16_t catalogScore = 0;                       // motion score given to images captured now (set during a motion trigger)
+
+// stats
+uint32_t catLoadTime = 0;                        // time taken to read the index file at boot (ms)
+uint32_t catBadRecords = 0;                      // records skipped when reading it
+uint32_t catWriteFailures = 0;
+
+
+static fs::FS &catalogFS() {
+    if (SD_Present) return SD_MMC;
+    return SPIFFS;
+}
+
+
+static uint32_t catalogCrc(const catEntry_t &e) {
+    return crc32_le(0, (const uint8_t *)&e, offsetof(catEntry_t, crc));
+}
+
+
+static bool catalogCompact();
+
+
+// append the entry as it is in the ring now to the index file (catFileMutex must be held), as the entry is
+//   copied here the last copy written is always the newest even if two tasks changed it one after the other
+static void catalogAppend(uint32_t seq) {
+    if (catFileDamaged) {                        // rewriting the file from the ring also writes this entry
+        if (!catalogCompact()) catWriteFailures++;
+        return;
+    }
+    xSemaphoreTake(catMutex, portMAX_DELAY);
+    catEntry_t e = catRing[seq % catCapacity];
+    xSemaphoreGive(catMutex);
+    if (e.seq != seq) return;                    // no longer in the ring
+    e.crc = catalogCrc(e);
+    File file = catalogFS().open(catalogFile, FILE_APPEND);
+    size_t written = file ? file.write((const uint8_t *)&e, sizeof(e)) : 0;
+    if (file) file.close();
+    if (written == sizeof(e)) {
+        catFileRecords++;
+        return;
+    }
+    catWriteFailures++;
+    if (catWriteFailures == 1) log_system_message("Error: unable to write to the image catalog " + String(catalogFile));
+    // part of a record would put every one appended after it out of step, so rewrite the file without it
+    if (written) {
+        catFileDamaged = 1;
+        catalogCompact();
+    }
+}
+
+
+// rewrite the index file with just the entries in the ring (catFileMutex must be held), returns 0 if it failed
+//   The new file is written as catalogFile.tmp, the old one is only removed once that is complete so if
+//   writing it fails the old one is left as it was.  If the rename after that fails (or the power goes in
+//   between) there is no index file until the next rewrite, catFileDamaged makes sure it is not appended
+//   to meanwhile, and catalogSetup() renames the .tmp file into place at the next boot.
+//   catMutex is only held while catalogChunk entries are copied from the ring, an entry changed after it
+//   has been copied is appended again once this returns (catalogAppend waits for catFileMutex).
+static bool catalogCompact() {
+    String tmp = String(catalogFile) + ".tmp";
+    File file = catalogFS().open(tmp, FILE_WRITE);
+    if (!file) return 0;
+    catEntry_t buf[catalogChunk];
+    uint32_t records = 0;
+    bool ok = 1;
+    xSemaphoreTake(catMutex, portMAX_DELAY);
+    uint32_t seq = catalogFirst();
+    uint32_t last = catNext;                     // entries added from now on are appended once they are stored
+    xSemaphoreGive(catMutex);
+    while (ok) {
+        uint8_t n = 0;
+        xSemaphoreTake(catMutex, portMAX_DELAY);
+        if (seq < catalogFirst()) seq = catalogFirst();     // the ring has moved on meanwhile
+        for (; seq < last && n < catalogChunk; seq++) {
+            if (catRing[seq % catCapacity].seq == seq) buf[n++] = catRing[seq % catCapacity];
+        }
+        xSemaphoreGive(catMutex);
+        if (n == 0) break;
+        for (uint8_t i = 0; i < n; i++) buf[i].crc = catalogCrc(buf[i]);
+        ok = (file.write((const uint8_t *)buf, n * sizeof(catEntry_t)) == n * sizeof(catEntry_t));
+        records += n;
+    }
+    file.close();
+    if (!ok) {
+        catalogFS().remove(tmp);
+        return 0;
+    }
+    catalogFS().remove(catalogFile);
+    if (!catalogFS().rename(tmp, catalogFile)) {
+        catFileDamaged = 1;
+        return 0;
+    }
+    catFileRecords = records;
+    catFileDamaged = 0;
+    return 1;
+}
+
+
+// ----------------------------------------------------------------
+//                  -load the catalog at boot
+// ----------------------------------------------------------------
+// called from setup once the sd card has been found
+
+bool catalogSetup() {
+    if (!catRing) {
+        catCapacity = (psramFound() && SD_Present) ? catalogSize : catalogSizeSmall;
+        size_t bytes = catCapacity * sizeof(catEntry_t);
+        catRing = (catEntry_t *)(psramFound() ? heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM) : malloc(bytes));
+        if (!catRing) {
+            log_system_message("Error: no memory for the image catalog");
+            return 0;
+        }
+        catMutex = xSemaphoreCreateMutex();
+        catFileMutex = xSemaphoreCreateMutex();
+    }
+    memset(catRing, 0, catCapacity * sizeof(catEntry_t));
+    catNext = 1;
+    catFileRecords = 0;
+
+    uint32_t startTime = millis();
+    // a rewrite cut short by a restart: the new file is complete if the old one has already been removed
+    String tmp = String(catalogFile) + ".tmp";
+    if (catalogFS().exists(tmp)) {
+        if (catalogFS().exists(catalogFile)) catalogFS().remove(tmp);
+        else if (catalogFS().rename(tmp, catalogFile)) log_system_message("Image catalog: index restored from " + tmp);
+    }
+    File file = catalogFS().open(catalogFile, "r");
+    bool damaged = 0;
+    if (file) {
+        damaged = (file.size() % sizeof(catEntry_t) != 0);
+        catEntry_t buf[16];
+        size_t n;
+        while ((n = file.read((uint8_t *)buf, sizeof(buf)) / sizeof(catEntry_t)) > 0) {
+            for (size_t i = 0; i < n; i++) {
+                const catEntry_t &e = buf[i];
+                catFileRecords++;
+                if (e.seq == 0 || e.crc != catalogCrc(e)) {
+                    catBadRecords++;
+                    continue;
+                }
+                catEntry_t &r = catRing[e.seq % catCapacity];
+                if (e.seq >= r.seq) r = e;       // a later copy of the same entry replaces it
+                if (e.seq >= catNext) catNext = e.seq + 1;
+            }
+        }
+        file.close();
+    }
+    // a record left half written would put the ones appended after it out of step
+    xSemaphoreTake(catFileMutex, portMAX_DELAY);
+    catFileDamaged = damaged;
+    if (damaged || catBadRecords) catalogCompact();
+    xSemaphoreGive(catFileMutex);
+    catLoadTime = millis() - startTime;
+    log_system_message("Image catalog: " + String(catalogLast()) + " images, index loaded in " + String(catLoadTime) + "ms" +
+                       (catBadRecords ? ", " + String(catBadRecords) + " bad records" : ""));
+    return 1;
+}
+
+
+// ----------------------------------------------------------------
+//                       -add/update entries
+// ----------------------------------------------------------------
+
+// new image being saved, returns its catalog no. (0 if there is no catalog), it is written to the index once stored
+uint32_t catalogAdd(String name, String slot, size_t size, uint16_t score) {
+    if (!catRing) return 0;
+    catEntry_t e;
+    memset(&e, 0, sizeof(e));
+    e.time = (year() >= 2021) ? now() : 0;
+    e.size = size;
+    e.score = score;
+    strlcpy(e.slot, slot.c_str(), sizeof(e.slot));
+    strlcpy(e.name, name.c_str(), sizeof(e.name));
+    xSemaphoreTake(catMutex, portMAX_DELAY);
+    e.seq = catNext++;
+    catRing[e.seq % catCapacity] = e;
+    xSemaphoreGive(catMutex);
+    return e.seq;
+}
+
+
+// write an entry which has changed to the index file, rewriting it if it has grown too big
+static void catalogWrite(uint32_t seq) {
+    xSemaphoreTake(catFileMutex, portMAX_DELAY);
+    catalogAppend(seq);
+    if (catFileRecords > 2 * (uint32_t)catCapacity) catalogCompact();
+    xSemaphoreGive(catFileMutex);
+}
+
+
+// an image has been saved to 'where' (CAT_xxx), flashSeq = its image store record
+void catalogStored(uint32_t seq, uint8_t where, uint32_t flashSeq) {
+    if (!catRing || seq == 0) return;
+    xSemaphoreTake(catMutex, portMAX_DELAY);
+    catEntry_t &e = catRing[seq % catCapacity];
+    bool changed = (e.seq == seq);
+    if (changed) {
+        e.where |= where;
+        if (where & CAT_FLASH) e.flashSeq = flashSeq;
+    }
+    xSemaphoreGive(catMutex);
+    if (changed) catalogWrite(seq);
+}
+
+
+// an image has been removed from 'where' (CAT_xxx)
+void catalogRemoved(uint32_t seq, uint8_t where) {
+    if (!catRing || seq == 0) return;
+    xSemaphoreTake(catMutex, portMAX_DELAY);
+    catEntry_t &e = catRing[seq % catCapacity];
+    bool changed = (e.seq == seq && (e.where & where));
+    if (changed) e.where &= ~where;
+    xSemaphoreGive(catMutex);
+    if (changed) catalogWrite(seq);
+}
+
+
+// ----------------------------------------------------------------
+//                          -read entries
+// ----------------------------------------------------------------
+
+// returns 0 if the entry is no longer in the catalog (or was never stored)
+bool catalogGet(uint32_t seq, catEntry_t *e) {
+    if (!catRing || seq == 0) return 0;
+    xSemaphoreTake(catMutex, portMAX_DELAY);
+    *e = catRing[seq % catCapacity];
+    xSemaphoreGive(catMutex);
+    return (e->seq == seq && e->where);
+}
+
+
+// if the image store still has this image
+bool catalogInFlash(const catEntry_t &e) {
+    imgRecord_t rec;
+    return (e.where & CAT_FLASH) && imgStoreFind(e.slot, &rec) && rec.h.seq == e.flashSeq;
+}
+
+
+// oldest and newest catalog numbers which may be in the ring
+uint32_t catalogFirst() {
+    return (catNext > catCapacity) ? catNext - catCapacity : 1;
+}
+
+uint32_t catalogLast() {
+    return catNext - 1;
+}
+
+
+// catalog status for the root web page
+String catalogStatus() {
+    if (!catRing || catNext == 1) return "";
+    String reply = "Image catalog: " + String(catalogLast()) + " images, index " + String(catFileRecords * sizeof(catEntry_t) / 1024) + "K";
+    reply += " on " + String(SD_Present ? "sd card" : "Spiffs") + " loaded in " + String(catLoadTime) + "ms";
+    if (catWriteFailures) reply += " <font color='#FF0000'>" + String(catWriteFailures) + " index writes failed</font>";
+    return reply;
+}
+
+// ---------------------------------------------- end ----------------------------------------------
@@ -0,0 +1,281 @@
+/**************************************************************************************************
+ *
+ *                  DNS cache - host name lookups for POST, FTP, email and NTP
+ *
+ *      Looking up a host name can take hundreds of ms and it was done for every upload, right in the path from
+ *      a trigger to the photo being sent.  Names are now looked up once and kept for as long as the DNS
+ *      server says the address is valid (the TTL of the reply, limited to dnsMinTtl - dnsMaxTtl).  A background
+ *      task looks up names again shortly before they expire so uploads always find a current address in the
+ *      cache.  Names which could not be found are remembered for dnsNegativeTtl so a missing server does not
+ *      cost a lookup every time, and if a refresh fails the previous address is kept.
+ *
+ *      The lookup is a standard DNS query sent to the DNS server wifi was given (so the TTL is known), if that
+ *      gets no reply WiFi.hostByName() is used instead with a TTL of dnsDefaultTtl.
+ *
+ **************************************************************************************************/
+
+// usage:   IPAddress ip;
+//          if (dnsLookup(PostServerName.c_str(), ip)) client.connect(ip, PostServerPort);
+//          dnsPrefetch("pool.ntp.org");               // keep this name in the cache from startup
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const uint8_t dnsCacheSize = 8;                  // host names which can be cached
+const uint32_t dnsMinTtl = 30;                   // limits on how long an address is kept (seconds)
+const uint32_t dnsMaxTtl = 86400;
+const uint32_t dnsDefaultTtl = 300;              // when the TTL is not known (seconds)
+const uint32_t dnsNegativeTtl = 30;              // how long a failed lookup is remembered (seconds)
+const uint32_t dnsKeepWarm = 3600;               // names are refreshed in the background if used within this time (seconds)
+const uint32_t dnsTimeout = 1500;                // wait for a reply from the DNS server (ms)
+//  ------------------------------------------------------------------
+
+#include <WiFiUdp.h>
+
+// forward declarations
+bool dnsLookup(const char *host, IPAddress &ip);
+void dnsPrefetch(const char *host);
+bool dnsSetup();
+String dnsStatus();
+void log_system_message(String smes);            // standard.h
+
+
+struct dnsEntry_t {
+    char host[64];                               // "" = unused
+    IPAddress ip;
+    bool found;                                  // 0 = the name could not be looked up (negative entry)
+    bool pinned;                                 // kept warm even if not used (see dnsPrefetch)
+    uint32_t resolved;                           // millis() of the lookup
+    uint32_t ttl;                                // ms
+    uint32_t lastUsed;
+};
+
+dnsEntry_t dnsCache[dnsCacheSize];
+portMUX_TYPE dnsMux = portMUX_INITIALIZER_UNLOCKED;
+
+// stats
+uint32_t dnsHits = 0;                            // lookups answered from the cache
+uint32_t dnsMisses = 0;                          // lookups which had to wait for the DNS server
+uint32_t dnsRefreshes = 0;                       // background lookups
+uint32_t dnsFailures = 0;                        // lookups which failed
+uint32_t dnsMissTime = 0;                        // total time of the lookups which had to wait (ms)
+
+
+// ----------------------------------------------------------------
+//                 -ask the DNS server for an address
+// ----------------------------------------------------------------
+// returns 1 = found (ip and ttl set), 0 = no such host, -1 = no usable reply
+static int dnsQuery(const char *host, IPAddress &ip, uint32_t &ttl) {
+    uint8_t pkt[512];
+    uint16_t id = esp_random() & 0xFFFF;
+    // header: id, flags (recursion desired), 1 question
+    memset(pkt, 0, 12);
+    pkt[0] = id >> 8; pkt[1] = id & 0xFF;
+    pkt[2] = 0x01;
+    pkt[5] = 1;
+    // question: name as length prefixed labels, type A, class IN
+    size_t len = 12;
+    const char *label = host;
+    while (*label) {
+        const char *dot = strchr(label, '.');
+        size_t n = dot ? (size_t)(dot - label) : strlen(label);
+        if (n == 0 || n > 63 || len + n + 6 > sizeof(pkt)) return -1;
+        pkt[len++] = n;
+        memcpy(pkt + len, label, n);
+        len += n;
+        label += n + (dot ? 1 : 0);
+    }
+    pkt[len++] = 0;
+    pkt[len++] = 0; pkt[len++] = 1;              // type A
+    pkt[len++] = 0; pkt[len++] = 1;              // class IN
+    size_t qEnd = len;
+
+    WiFiUDP udp;
+    if (!udp.begin(0)) return -1;
+    udp.beginPacket(WiFi.dnsIP(), 53);
+    udp.write(pkt, len);
+    if (!udp.endPacket()) { udp.stop(); return -1; }
+    uint32_t startTime = millis();
+    int got = 0;
+    while ((got = udp.parsePacket()) <= 0 && (unsigned long)(millis() - startTime) < dnsTimeout) delay(5);
+    if (got > 0) got = udp.read(pkt, sizeof(pkt));
+    udp.stop();
+    if (got < (int)qEnd || pkt[0] != (id >> 8) || pkt[1] != (id & 0xFF) || !(pkt[2] & 0x80)) return -1;
+    uint8_t rcode = pkt[3] & 0x0F;
+    if (rcode == 3) return 0;                    // NXDOMAIN
+    if (rcode != 0) return -1;
+
+    // answers (may be a chain of CNAMEs before the address, the shortest TTL applies)
+    uint16_t answers = (pkt[6] << 8) | pkt[7];
+    size_t pos = qEnd;
+    uint32_t minTtl = UINT32_MAX;
+    for (uint16_t a = 0; a < answers; a++) {
+        while (pos < (size_t)got && pkt[pos] && (pkt[pos] & 0xC0) != 0xC0) pos += pkt[pos] + 1;    // skip name
+        pos += (pos < (size_t)got && pkt[pos]) ? 2 : 1;
+        if (pos + 10 > (size_t)got) return -1;
+        uint16_t type = (pkt[pos] << 8) | pkt[pos + 1];
+        uint32_t recTtl = ((uint32_t)pkt[pos + 4] << 24) | ((uint32_t)pkt[pos + 5] << 16) | (pkt[pos + 6] << 8) | pkt[pos + 7];
+        uint16_t rdLen = (pkt[pos + 8] << 8) | pkt[pos + 9];
+        pos += 10;
+        if (pos + rdLen > (size_t)got) return -1;
+        if (recTtl < minTtl) minTtl = recTtl;
+        if (type == 1 && rdLen == 4) {
+            ip = IPAddress(pkt[pos], pkt[pos + 1], pkt[pos + 2], pkt[pos + 3]);
+            ttl = minTtl;
+            return 1;
+        }
+        pos += rdLen;
+    }
+    return 0;                                    // name exists but has no address
+}
+
+
+// look up a name (waits for the reply), returns 1 if found
+static bool dnsResolve(const char *host, IPAddress &ip, uint32_t &ttl) {
+    int result = dnsQuery(host, ip, ttl);
+    if (result == -1) result = dnsQuery(host, ip, ttl);                   // udp, so try again
+    if (result == -1) {                                                   // use the wifi library instead
+        result = WiFi.hostByName(host, ip) ? 1 : 0;
+        ttl = dnsDefaultTtl;
+    }
+    if (result != 1) {
+        dnsFailures++;
+        ttl = dnsNegativeTtl;
+        return 0;
+    }
+    ttl = constrain(ttl, dnsMinTtl, dnsMaxTtl);
+    return 1;
+}
+
+
+// store the result of a lookup, if a refresh failed the previous address is kept for now
+static void dnsStore(const char *host, bool found, IPAddress ip, uint32_t ttl) {
+    portENTER_CRITICAL(&dnsMux);
+    dnsEntry_t *e = NULL;
+    for (uint8_t i = 0; i < dnsCacheSize && !e; i++) if (strcmp(dnsCache[i].host, host) == 0) e = &dnsCache[i];
+    if (!e) {                                    // new entry, replaces an unused or the least recently used one
+        e = &dnsCache[0];
+        for (uint8_t i = 0; i < dnsCacheSize; i++) {
+            if (dnsCache[i].host[0] == 0) { e = &dnsCache[i]; break; }
+            if (!dnsCache[i].pinned && (e->pinned || (int32_t)(dnsCache[i].lastUsed - e->lastUsed) < 0)) e = &dnsCache[i];
+        }
+        strlcpy(e->host, host, sizeof(e->host));
+        e->found = 0;
+        e->pinned = 0;
+        e->lastUsed = millis();
+    }
+    if (found || !e->found) {
+        e->ip = ip;
+        e->found = found;
+    }
+    e->resolved = millis();
+    e->ttl = ttl * 1000;
+    portEXIT_CRITICAL(&dnsMux);
+}
+
+
+// ----------------------------------------------------------------
+//                     -look up a host name
+// ----------------------------------------------------------------
+// returns 1 with the address in ip, the host can also be an ip address e.g. "192.168.1.10"
+bool dnsLookup(const char *host, IPAddress &ip) {
+    if (ip.fromString(host)) return 1;
+    if (strlen(host) >= sizeof(dnsCache[0].host)) return WiFi.hostByName(host, ip);
+    bool cached = 0, found = 0;
+    portENTER_CRITICAL(&dnsMux);
+    for (uint8_t i = 0; i < dnsCacheSize; i++) {
+        dnsEntry_t &e = dnsCache[i];
+        if (strcmp(e.host, host) != 0) continue;
+        e.lastUsed = millis();
+        if (e.resolved && (unsigned long)(millis() - e.resolved) < e.ttl) {
+            cached = 1;
+            found = e.found;
+            ip = e.ip;
+        }
+        break;
+    }
+    portEXIT_CRITICAL(&dnsMux);
+    if (cached) {
+        dnsHits++;
+        return found;
+    }
+
+    // not in the cache (or expired) so wait for a lookup
+    uint32_t startTime = millis();
+    uint32_t ttl;
+    found = dnsResolve(host, ip, ttl);
+    dnsMisses++;
+    dnsMissTime += millis() - startTime;
+    dnsStore(host, found, ip, ttl);
+    if (!found) log_system_message("Error: unable to find address of " + String(host));
+    else DBG("DNS: %s = %u.%u.%u.%u ttl %us\n", host, ip[0], ip[1], ip[2], ip[3], ttl);
+    return found;
+}
+
+
+// add a name to the cache which is kept up to date even if not used, called from setup for the servers used
+void dnsPrefetch(const char *host) {
+    IPAddress ip;
+    if (ip.fromString(host) || strlen(host) >= sizeof(dnsCache[0].host) || host[0] == '<') return;     // address or not set up
+    bool exists = 0;
+    portENTER_CRITICAL(&dnsMux);
+    for (uint8_t i = 0; i < dnsCacheSize; i++) if (strcmp(dnsCache[i].host, host) == 0) exists = dnsCache[i].pinned = 1;
+    portEXIT_CRITICAL(&dnsMux);
+    if (exists) return;
+    dnsStore(host, 0, ip, 0);                    // expired entry, looked up by the task
+    portENTER_CRITICAL(&dnsMux);
+    for (uint8_t i = 0; i < dnsCacheSize; i++) if (strcmp(dnsCache[i].host, host) == 0) {
+        dnsCache[i].pinned = 1;
+        dnsCache[i].resolved = 0;
+    }
+    portEXIT_CRITICAL(&dnsMux);
+}
+
+
+// ----------------------------------------------------------------
+//         -background task refreshing names before they expire
+// ----------------------------------------------------------------
+static void dnsTask(void *) {
+    char host[sizeof(dnsCache[0].host)];
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(1000));
+        if (WiFi.status() != WL_CONNECTED) continue;
+        for (uint8_t i = 0; i < dnsCacheSize; i++) {
+            // due once 80% of its ttl has gone (negative entries once expired) and still wanted
+            portENTER_CRITICAL(&dnsMux);
+            dnsEntry_t &e = dnsCache[i];
+            uint32_t age = millis() - e.resolved;
+            bool wanted = e.pinned || (unsigned long)(millis() - e.lastUsed) < dnsKeepWarm * 1000;
+            bool due = e.host[0] && wanted && (e.resolved == 0 || age >= (e.found ? e.ttl / 5 * 4 : e.ttl));
+            if (due) strcpy(host, e.host);
+            portEXIT_CRITICAL(&dnsMux);
+            if (!due) continue;
+            IPAddress ip;
+            uint32_t ttl;
+            bool found = dnsResolve(host, ip, ttl);
+            dnsStore(host, found, ip, ttl);
+            dnsRefreshes++;
+        }
+    }
+}
+
+
+bool dnsSetup() {
+    if (xTaskCreate(dnsTask, "dns", 3072, NULL, 1, NULL) != pdPASS) {
+        log_system_message("Error: Unable to start dns task");
+        return 0;
+    }
+    return 1;
+}
+
+
+// status for the root web page
+String dnsStatus() {
+    if (dnsHits + dnsMisses == 0) return "";
+    String reply = "DNS cache: " + String(dnsHits) + " hits " + String(dnsMisses) + " misses";
+    if (dnsMisses) reply += " (avg " + String(dnsMissTime / dnsMisses) + "ms)";
+    reply += " - " + String(dnsRefreshes) + " refreshed";
+    if (dnsFailures) reply += " <font color='#FF0000'>" + String(dnsFailures) + " failed</font>";
+    return reply;
+}
+
+// ---------------------------------------------- end ----------------------------------------------
@@ -18,19 +18,23 @@
 
  Usage:
 
-  In main code include:      #include "email.h"
+  In main code include:      #include "email.h"      and call emailSetup() from setup
 
 
-  Using char arrays: // https://www.tutorialspoint.com/arduino/arduino_strings.htm
-
+  Emails are queued and sent by a background task so nothing waits for the SMTP session.
 
   Send a test email:
-      _message[0]=0; _subject[0]=0;          // clear any existing text
-      strcat(_subject,"test message");
-      strcat(_message,"this is a test email from the esp");
-      sendEmail(_emailReceiver, _subject, _message);
+      emailQueue("test message", "this is a test email from the esp");
+
+      Note: To also send an sms along with the email use:     emailQueue(subject, message, 1);
+
+  Motion triggers (with the photo attached, see emailWrite in sinks.h):
+      emailTrigger("2023-02-16T12:00:00Z", buf, len, "photo.jpg", release, ctx);
 
-      Note: To also send an sms along with the email use:     sendSMSflag = 1;
+      Triggers which happen close together (or within EmailLimitTime of the last email) are gathered in to
+      one digest email listing them all with the first few photos attached.  The photos are attached straight
+      from their buffers (the library base64 encodes them as it sends), release(ctx) is called once the email
+      has gone so the buffer can be freed.
 
 
  **************************************************************************************************/
@@ -49,64 +53,173 @@ const int MaxEmailAttempts = 5;                           // maximum email send
 #define _mailPassword "<email password>"                  // email password
 #define _SMTP "<smtp server>"                             // smtp server address
 #define _SMTP_Port 587                                    // port to use (gmail: Port for SSL: 465, Port for TLS/STARTTLS: 587)
+const bool emailUseDnsCache = 0;                          // connect to the cached address of the smtp server - only for servers without
+                                                          //   TLS, connecting by address sends no server name (SNI) and the certificate
+                                                          //   name is not checked
 
 
-const int maxMessageLength = 500;                         // maximum length of email message
-const int maxSubjectLength = 150;                         // maximum length of email subject
+const uint8_t emailQueueLength = 6;                       // emails which can be waiting to be sent
+const uint8_t emailMaxAttachments = 3;                    // max photos attached to a digest email
+const uint8_t emailMaxDigestLines = 20;                   // max triggers listed in a digest email
+const uint32_t emailDigestWait = 3000;                    // time to wait for more triggers before sending a digest (ms)
 
+bool sendSMSflag = 0;                                     // if set then also send sms along with trigger emails
 
-//  ----------------------------------------------------------------------------------------
 
+//  ----------------------------------------------------------------------------------------
 
-bool sendSMSflag = 0;                                       // if set then also send sms when any email is sent
-bool emailToSend = 0;                                       // flag if there is an email waiting to be sent
-uint32_t lastEmailAttempt = 0;                              // last time sending of an email was attempted
-int emailAttemptCounter = 0;                                // counter for failed email attempts
 
 #include <ESP_Mail_Client.h>
 
-// stores for email messages
-char _message[maxMessageLength];
-char _subject[maxSubjectLength];
-char _recepient[80];
+// a photo attached to an email
+struct emailImage_t {
+    const uint8_t *buf;
+    size_t len;
+    String name;                                          // file name in the email
+    void (*release)(void *);                              // called when the email has been sent (NULL = buf was copied and is freed here)
+    void *ctx;
+};
+
+// a queued email
+struct emailItem_t {
+    String subject;
+    String body;
+    bool sms;                                             // also send to _smsReceiver
+    bool busy;                                            // being sent by the task
+    uint8_t attempts;                                     // failed attempts to send it
+    uint32_t ready;                                       // millis() when it may be sent (digest wait / retry wait)
+    uint16_t triggers;                                    // motion triggers in this digest (0 = not a digest)
+    uint8_t images;
+    emailImage_t image[emailMaxAttachments];
+};
 
 // forward declarations
 void smtpCallback(SMTP_Status status);
-bool sendEmail(char*, char* , char*);
-void EMAILloop();
+bool emailSetup();
+bool emailQueue(String subject, String body, bool sms = 0);
+bool emailTrigger(String eventTime, const uint8_t *buf, size_t len, String fName, void (*release)(void *), void *ctx);
+String emailStatus();
 
 /* The SMTP Session object used for Email sending */
 SMTPSession smtp;
 
+emailItem_t emailItems[emailQueueLength];                 // queue (circular)
+uint8_t emailHead = 0;                                    // oldest email
+uint8_t emailCount = 0;
+SemaphoreHandle_t emailMutex = NULL;
+
+// stats
+uint32_t emailSent = 0;
+uint32_t emailFailed = 0;                                 // emails given up on (or dropped as the queue was full)
+uint32_t emailDigests = 0;                                // emails which covered more than one trigger
+uint32_t emailTriggersSent = 0;                           // triggers covered by the emails sent
+
+
+// release the photos of an email (emailMutex held or item no longer in the queue)
+static void emailReleaseImages(emailItem_t &item) {
+    for (uint8_t i = 0; i < item.images; i++) {
+        emailImage_t &img = item.image[i];
+        if (img.release) img.release(img.ctx);
+        else heap_caps_free((void *)img.buf);
+        img.buf = NULL;
+    }
+    item.images = 0;
+}
+
+
+// add an empty email to the end of the queue (emailMutex must be held), NULL if full
+static emailItem_t *emailNewItem() {
+    if (emailCount >= emailQueueLength) return NULL;
+    emailItem_t &item = emailItems[(emailHead + emailCount++) % emailQueueLength];
+    item.subject = "";
+    item.body = "";
+    item.sms = 0;
+    item.busy = 0;
+    item.attempts = 0;
+    item.ready = millis();
+    item.triggers = 0;
+    item.images = 0;
+    return &item;
+}
 
-// ----------------------------------------------------------------------------------------
 
+// ----------------------------------------------------------------------------------------
+//                                  -queue an email
+// ----------------------------------------------------------------------------------------
 
-// Called from LOOP to handle emails
-void EMAILloop() {
-    if (!emailToSend || emailAttemptCounter >= MaxEmailAttempts) return;
+bool emailQueue(String subject, String body, bool sms) {
+    if (!emailMutex) return 0;
+    xSemaphoreTake(emailMutex, portMAX_DELAY);
+    emailItem_t *item = emailNewItem();
+    if (item) {
+        item->subject = subject;
+        item->body = body;
+        item->sms = sms;
+    }
+    xSemaphoreGive(emailMutex);
+    if (!item) {
+        emailFailed++;
+        log_system_message("Error: email queue full, email '" + subject + "' dropped");
+    }
+    return item != NULL;
+}
 
-    if (lastEmailAttempt > 0 && (unsigned long)(millis() - lastEmailAttempt) < (EmailAttemptTime * 1000)) return;
 
-    // try to send the email
-    if (sendEmail(_recepient, _subject, _message)) {
-        // email sent ok
-        emailToSend = 0;                                  // clear flag that there is an email waiting to be sent
-        sendSMSflag = 0;                                  // clear sms flag
-        _recepient[0]=0; _message[0]=0; _subject[0]=0;    // clear all stored email text
-        emailAttemptCounter = 0;                          // reset attempt counter
-    } else {
-      // email failed to send
-        // log_system_message("Email send attempt failed, will retry in " + String(EmailAttemptTime) + " seconds");
-        lastEmailAttempt = millis();                      // update time of last attempt
-        emailAttemptCounter ++;                           // increment attempt counter
-        if (emailAttemptCounter >= MaxEmailAttempts) {
-          log_system_message("Error: Max email attempts exceded, email send has failed");
-          emailToSend = 0;                                // clear flag that there is an email waiting to be sent
-          sendSMSflag = 0;                                // clear sms flag
+// ----------------------------------------------------------------------------------------
+//                       -add a motion trigger to the digest email
+// ----------------------------------------------------------------------------------------
+// eventTime = time of the trigger, buf/len = photo to attach (NULL = none), fName = its file name
+//   release(ctx) is called once the photo is no longer needed, if release is NULL the photo is copied
+//   returns 1 if the photo was kept (release will be called later), 0 if not (caller still owns it)
+
+bool emailTrigger(String eventTime, const uint8_t *buf, size_t len, String fName, void (*release)(void *), void *ctx) {
+    if (!emailMutex) return 0;
+    xSemaphoreTake(emailMutex, portMAX_DELAY);
+    // add to the newest email if it is a digest which has not started sending yet
+    emailItem_t *item = NULL;
+    if (emailCount) {
+        emailItem_t &last = emailItems[(emailHead + emailCount - 1) % emailQueueLength];
+        if (last.triggers && !last.busy && last.attempts == 0) item = &last;
+    }
+    if (!item && (item = emailNewItem())) {
+        item->sms = sendSMSflag;
+        uint32_t limitEnd = EMAILtimer + EmailLimitTime * 1000;           // not before EmailLimitTime since the last one
+        item->ready = millis() + emailDigestWait;
+        if (EMAILtimer && (int32_t)(limitEnd - item->ready) > 0) item->ready = limitEnd;
+    }
+    bool kept = 0;
+    if (item) {
+        item->triggers++;
+        if (item->triggers <= emailMaxDigestLines) item->body += "Camera triggered at " + eventTime + "\n";
+        if (buf && item->images < emailMaxAttachments) {
+            emailImage_t &img = item->image[item->images];
+            img.buf = buf;
+            img.len = len;
+            img.name = fName;
+            img.release = release;
+            img.ctx = ctx;
+            if (!release) {                                 // caller needs its buffer back so keep a copy
+                uint8_t *copy = (uint8_t *)heap_caps_malloc(len, psramFound() ? (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) : MALLOC_CAP_8BIT);
+                if (copy) memcpy(copy, buf, len);
+                img.buf = copy;
+            }
+            if (img.buf) {
+                item->images++;
+                kept = (release != NULL);
+            }
         }
+        uint16_t extra = (item->triggers > emailMaxDigestLines) ? item->triggers - emailMaxDigestLines : 0;
+        item->subject = "ESPcamera";
+        if (item->triggers > 1) item->subject += " - " + String(item->triggers) + " triggers";
+        if (extra) item->subject += " (" + String(extra) + " not listed)";
+    }
+    xSemaphoreGive(emailMutex);
+    if (!item) {
+        emailFailed++;
+        log_system_message("Error: email queue full, trigger at " + eventTime + " not emailed");
     }
-}  // EMAILloop
+    return kept;
+}
 
 
 // ----------------------------------------------------------------------------------------
@@ -115,12 +228,12 @@ void EMAILloop() {
 // Function send an email
 //   see full example: https://github.com/mobizt/ESP-Mail-Client/blob/master/examples/Send_Text/Send_Text.ino
 
-bool sendEmail(char* emailTo, char* emailSubject, char* emailBody) {
+static bool sendEmail(emailItem_t &item) {
 
-    if (serialDebug) Serial.println("----- sending an email -------");
+    DBG("----- sending an email -------\n");
 
     // enable debug info on serial port
-    if (serialDebug) {
+    if (DBG_ON) {
         smtp.debug(1);                       // turn debug reporting on
         smtp.callback(smtpCallback);         // Set the callback function to get the sending results
     }
@@ -129,7 +242,10 @@ bool sendEmail(char* emailTo, char* emailSubject, char* emailBody) {
     ESP_Mail_Session session;
 
     // Set the session config
-    session.server.host_name =  _SMTP;
+    String smtpHost = _SMTP;
+    IPAddress smtpIP;
+    if (emailUseDnsCache && dnsLookup(_SMTP, smtpIP)) smtpHost = smtpIP.toString();      // cached address (see dnscache.h)
+    session.server.host_name =  smtpHost.c_str();
     session.server.port = _SMTP_Port;
     session.login.email = _mailUser;
     session.login.password = _mailPassword;
@@ -142,14 +258,14 @@ bool sendEmail(char* emailTo, char* emailSubject, char* emailBody) {
     // Set the message headers
     message.sender.name = _SenderName;
     message.sender.email = _mailUser;
-    message.subject = emailSubject;
-    message.addRecipient("receiver", emailTo);
-    if (sendSMSflag) message.addRecipient("name2", _smsReceiver);
+    message.subject = item.subject.c_str();
+    message.addRecipient("receiver", _emailReceiver);
+    if (item.sms) message.addRecipient("name2", _smsReceiver);
     // message.addCc("email3");
     // message.addBcc("email4");
 
     // Set the message content
-    message.text.content = emailBody;
+    message.text.content = item.body.c_str();
 
     // Misc settings
     message.text.charSet = "us-ascii";
@@ -158,54 +274,136 @@ bool sendEmail(char* emailTo, char* emailSubject, char* emailBody) {
     message.response.notify = esp_mail_smtp_notify_success | esp_mail_smtp_notify_failure | esp_mail_smtp_notify_delay;
     // message.addHeader("Message-ID: <abcde.fghij@gmail.com>");    // custom message header
 
-    // Add attachment to the message
-    //message.addAttachment(att);
+    // Add the photos - sent straight from their buffers as blobs (base64 encoded by the library as it sends)
+    SMTP_Attachment att[emailMaxAttachments];
+    size_t bytes = item.body.length();
+    for (uint8_t i = 0; i < item.images; i++) {
+        att[i].descr.filename = item.image[i].name.c_str();
+        att[i].descr.mime = "image/jpeg";
+        att[i].descr.transfer_encoding = Content_Transfer_Encoding::enc_base64;
+        att[i].blob.data = item.image[i].buf;
+        att[i].blob.size = item.image[i].len;
+        message.addAttachment(att[i]);
+        bytes += item.image[i].len * 4 / 3;
+    }
+
+    outboundAcquire(OUT_EVENT, bytes);       // wait for any higher priority uploads and the bandwidth limit
 
     // Connect to server with the session config
-    if (!smtp.connect(&session)) {
-        log_system_message("Sending email '" + String(_subject) +"' failed, SMTP: " + smtp.errorReason());
-        return 0;
+    bool ok = smtp.connect(&session);
+    if (!ok) {
+        log_system_message("Sending email '" + item.subject +"' failed, SMTP: " + smtp.errorReason());
     }
 
     // Start sending Email and close the session
-    if (!MailClient.sendMail(&smtp, &message, true)) {
-        log_system_message("Sending email '" + String(_subject) +"' failed, Send: " + smtp.errorReason());
-        return 0;
+    else if (!MailClient.sendMail(&smtp, &message, true)) {
+        log_system_message("Sending email '" + item.subject +"' failed, Send: " + smtp.errorReason());
+        ok = 0;
     } else {
-        log_system_message("Email '" + String(_subject) +"' sent ok");
-        return 1;
+        log_system_message("Email '" + item.subject +"' sent ok");
+    }
+    outboundRelease(OUT_EVENT, ok ? bytes : 0);
+    return ok;
+}
+
+
+// ----------------------------------------------------------------------------------------
+//                            -background task sending the emails
+// ----------------------------------------------------------------------------------------
+
+static void emailTask(void *) {
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(250));
+        if (WiFi.status() != WL_CONNECTED) continue;
+
+        // oldest email, if it is ready to go
+        xSemaphoreTake(emailMutex, portMAX_DELAY);
+        emailItem_t *item = emailCount ? &emailItems[emailHead] : NULL;
+        if (item && (int32_t)(millis() - item->ready) < 0) item = NULL;
+        if (item) item->busy = 1;                         // no more triggers can be added to it
+        xSemaphoreGive(emailMutex);
+        if (!item) continue;
+
+        bool ok = sendEmail(*item);
+        if (!ok && ++item->attempts < MaxEmailAttempts) {
+            // log_system_message("Email send attempt failed, will retry in " + String(EmailAttemptTime) + " seconds");
+            item->ready = millis() + EmailAttemptTime * 1000;
+            item->busy = 0;
+            continue;
+        }
+        if (ok) {
+            emailSent++;
+            if (item->triggers) {
+                EMAILtimer = millis();                    // time of the last trigger email for EmailLimitTime
+                emailTriggersSent += item->triggers;
+                if (item->triggers > 1) emailDigests++;
+            }
+        } else {
+            emailFailed++;
+            log_system_message("Error: Max email attempts exceded, email send has failed");
+        }
+        xSemaphoreTake(emailMutex, portMAX_DELAY);
+        emailReleaseImages(*item);
+        item->subject = "";                               // free the text
+        item->body = "";
+        emailHead = (emailHead + 1) % emailQueueLength;
+        emailCount--;
+        xSemaphoreGive(emailMutex);
     }
 }
 
 
+// start the email task, called from setup
+bool emailSetup() {
+    if (emailUseDnsCache) dnsPrefetch(_SMTP);
+    emailMutex = xSemaphoreCreateMutex();
+    if (!emailMutex || xTaskCreate(emailTask, "email", 16384, NULL, 1, NULL) != pdPASS) {
+        log_system_message("Error: Unable to start email task");
+        return 0;
+    }
+    return 1;
+}
+
+
+// email status for the root web page
+String emailStatus() {
+    if (emailSent + emailFailed + emailCount == 0) return "";
+    String reply = "Email: " + String(emailSent) + " sent";
+    if (emailDigests) reply += " (" + String(emailDigests) + " digests covering " + String(emailTriggersSent) + " triggers)";
+    if (emailCount) reply += " - " + String(emailCount) + " waiting";
+    if (emailFailed) reply += " <font color='#FF0000'>" + String(emailFailed) + " failed</font>";
+    return reply;
+}
+
+
 // ----------------------------------------------------------------------------------------
 
 /* Callback function to get the Email sending status */
 void smtpCallback(SMTP_Status status) {
-    if (!serialDebug) return;
+    if (!DBG_ON) return;
 
     /* Print the current status */
-    Serial.println(status.info());
+    txPrintf("%s\n", status.info());
 
     /* Print the sending result */
     if (status.success()) {
-        Serial.println("----------------");
-        Serial.printf("Message sent success: %d\n", status.completedCount());
-        Serial.printf("Message sent failled: %d\n", status.failedCount());
-        Serial.println("----------------\n");
+        txPrintf("----------------\n");
+        txPrintf("Message sent success: %d\n", status.completedCount());
+        txPrintf("Message sent failled: %d\n", status.failedCount());
+        txPrintf("----------------\n\n");
         struct tm dt;
         for (size_t i = 0; i < smtp.sendingResult.size(); i++) {
             /* Get the result item */
             SMTP_Result result = smtp.sendingResult.getItem(i);
             time_t ts = (time_t)result.timestamp;
             localtime_r(&ts, &dt);
-            Serial.printf("Message No: %d\n", i + 1);
-            Serial.printf("Status: %s\n", result.completed ? "success" : "failed");
-            Serial.printf("Date/Time: %d/%d/%d %d:%d:%d\n", dt.tm_year + 1900, dt.tm_mon + 1, dt.tm_mday, dt.tm_hour, dt.tm_min, dt.tm_sec);
-            Serial.printf("Recipient: %s\n", result.recipients);
-            Serial.printf("Subject: %s\n", result.subject);
+            txPrintf("Message No: %d\n", (int)i + 1);
+            txPrintf("Status: %s\n", result.completed ? "success" : "failed");
+            txPrintf("Date/Time: %d/%d/%d %d:%d:%d\n", dt.tm_year + 1900, dt.tm_mon + 1, dt.tm_mday, dt.tm_hour, dt.tm_min, dt.tm_sec);
+            txPrintf("Recipient: %s\n", result.recipients);
+            txPrintf("Subject: %s\n", result.subject);
         }
-        Serial.println("----------------\n");
+        txPrintf("----------------\n\n");
     }
 }
 #endif
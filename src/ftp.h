@@ -2,14 +2,14 @@
  *
  *                        FTP images to server - 02Jan22
  *
- *                        library used: https://github.com/ldab/ESP32_FTPClient
+ *      The FTP session (control connection) is logged in once and kept open between images, only the passive
+ *      mode data connection is opened for each file.  The reply code of every command is checked so the sketch
+ *      knows if the upload worked.  If the session has been closed by the server (e.g. idle timeout) this is
+ *      found when the next image is sent and it logs in again.
  *
  **************************************************************************************************/
 
-// Note: this library does not provide any feedback so the sketch does not know if the FTP actually worked ok or not
-
 #ifdef FTP_ENABLED
-#include <ESP32_FTPClient.h>
 
 // **************************************** S e t t i n g s ****************************************
 
@@ -17,36 +17,198 @@
 char ftp_server[] = "<ftp servers ip address>";
 char ftp_user[]   = "<ftp user name>";
 char ftp_pass[]   = "<ftp password>";
+const uint16_t ftp_port = 21;
+const char ftp_folder[] = "/";                   // folder on the server to store the images in
+const uint32_t ftpTimeout = 5000;                // max time to wait for a reply from the server (ms)
+const uint32_t ftpCheckIdle = 30000;             // check the session is still open (NOOP) before use if idle longer than this (ms)
 
 
 // *************************************************************************************************
 
 
-ESP32_FTPClient ftp (ftp_server,ftp_user,ftp_pass, 5000, 2);             // timeout and debbug mode on the last 2 arguments
-
 // forward declarations
-void uploadImageByFTP(uint8_t*, size_t, String);
+bool uploadImageByFTP(uint8_t*, size_t, String);
+String ftpStatus();
+
+
+WiFiClient ftpControl;                           // control connection
+bool ftpLoggedIn = 0;
+uint32_t ftpLastUsed = 0;                        // millis() the session was last used
+char ftpReplyText[96] = "";                      // last reply from the server (start of)
+
+// stats
+uint32_t ftpUploads = 0;                         // images sent ok
+uint32_t ftpFailures = 0;
+uint32_t ftpLogins = 0;                          // sessions opened
+uint32_t ftpStale = 0;                           // times the session had been closed by the server
+uint32_t ftpKBytes = 0;                          // data sent (KB)
+uint32_t ftpSendTime = 0;                        // time spent sending files until the server confirmed them (ms)
+String ftpLastError = "";
 
 
 // ----------------------------------------------------------------
-//                         upload image via ftp
+//                      -FTP commands and replies
 // ----------------------------------------------------------------
-// pass image frame buffer pointer, length, file name to use
+// read a reply from the server, returns the reply code (0 = no reply)
+//   a multi-line reply starts "123-" and ends with a line starting "123 "
+static int ftpReply() {
+    char line[sizeof(ftpReplyText)];
+    uint8_t len = 0;
+    int code = 0;                                // code of a multi-line reply in progress
+    uint32_t lastData = millis();
+    while ((unsigned long)(millis() - lastData) < ftpTimeout) {
+        if (!ftpControl.available()) {
+            if (!ftpControl.connected()) break;
+            delay(2);
+            continue;
+        }
+        char c = ftpControl.read();
+        lastData = millis();
+        if (c == '\r') continue;
+        if (c != '\n') {
+            if (len < sizeof(line) - 1) line[len++] = c;
+            continue;
+        }
+        line[len] = 0;
+        len = 0;
+        if (!isdigit(line[0]) || !isdigit(line[1]) || !isdigit(line[2])) continue;     // text of a multi-line reply
+        int lineCode = atoi(line);
+        if (line[3] == '-') {
+            if (!code) code = lineCode;
+            continue;
+        }
+        if (code && lineCode != code) continue;
+        strcpy(ftpReplyText, line);
+        DBG("FTP: %s\n", ftpReplyText);
+        return lineCode;
+    }
+    strcpy(ftpReplyText, "no reply");
+    return 0;
+}
 
-void uploadImageByFTP(uint8_t* buf, size_t len, String fName) {
-    if (serialDebug) Serial.println("FTP image");
 
-    ftp.OpenConnection();
+// send a command and return the reply code
+static int ftpCommand(String cmd) {
+    DBG("FTP> %s\n", cmd.startsWith("PASS ") ? "PASS ****" : cmd.c_str());
+    ftpControl.print(cmd + "\r\n");
+    return ftpReply();
+}
 
-    //Create a file and write the image data to it;
-    ftp.ChangeWorkDir("/");
-    ftp.InitFile("Type I");
+
+// record an error, closes the session, returns 0
+static bool ftpError(String what) {
+    ftpLastError = what;
+    if (ftpReplyText[0]) ftpLastError += " - " + String(ftpReplyText);
+    ftpControl.stop();
+    ftpLoggedIn = 0;
+    return 0;
+}
+
+
+// ----------------------------------------------------------------
+//                         -open the session
+// ----------------------------------------------------------------
+static bool ftpLogin() {
+    ftpControl.stop();
+    ftpLoggedIn = 0;
+    strcpy(ftpReplyText, "");
+    DBG("FTP connecting to %s\n", ftp_server);
+    IPAddress ip;
+    if (!dnsLookup(ftp_server, ip)) return ftpError("unable to find address of " + String(ftp_server));
+    if (!ftpControl.connect(ip, ftp_port)) return ftpError("connection to " + String(ftp_server) + " failed");
+    ftpControl.setNoDelay(true);
+    if (ftpReply() != 220) return ftpError("no greeting from server");
+    int code = ftpCommand("USER " + String(ftp_user));
+    if (code == 331) code = ftpCommand("PASS " + String(ftp_pass));
+    if (code != 230) return ftpError("login failed");
+    if (ftpCommand("TYPE I") != 200) return ftpError("binary mode refused");
+    if (ftpCommand("CWD " + String(ftp_folder)) != 250) return ftpError("unable to change to folder " + String(ftp_folder));
+    ftpLoggedIn = 1;
+    ftpLogins++;
+    return 1;
+}
+
+
+// ----------------------------------------------------------------
+//                 -send a file over a data connection
+// ----------------------------------------------------------------
+// returns 1 = sent ok, 0 = failed, -1 = no reply (the session has probably been closed)
+static int ftpStore(const uint8_t* buf, size_t len, String fName) {
+    int code = ftpCommand("PASV");
+    if (code == 0) return -1;
+    if (code != 227) return ftpError("PASV refused");
+    // reply e.g. "227 Entering Passive Mode (192,168,1,10,195,149)" - the address is ignored and the server's
+    // address used instead as servers behind a router often give their local address
+    int h[6];
+    const char *p = strchr(ftpReplyText, '(');
+    if (!p || sscanf(p + 1, "%d,%d,%d,%d,%d,%d", &h[0], &h[1], &h[2], &h[3], &h[4], &h[5]) != 6) return ftpError("bad PASV reply");
+    WiFiClient data;
+    if (!data.connect(ftpControl.remoteIP(), (uint16_t)(h[4] * 256 + h[5]))) return ftpError("data connection failed");
+
+    code = ftpCommand("STOR " + fName);
+    if (code != 150 && code != 125) {
+        data.stop();
+        return (code == 0) ? -1 : ftpError("STOR refused");
+    }
+    uint32_t startTime = millis();
+    size_t sent = 0;
+    while (sent < len) {
+        size_t n = data.write(buf + sent, len - sent);
+        if (n == 0) break;
+        sent += n;
+    }
+    data.stop();                                 // closing the data connection marks the end of the file
+    code = ftpReply();
+    ftpSendTime += millis() - startTime;
+    if (sent < len) return ftpError("data connection closed after " + String(sent) + " of " + String(len) + " bytes");
+    if (code != 226 && code != 250) return ftpError("file not stored");
+    ftpKBytes += len / 1024;
+    return 1;
+}
+
+
+// ----------------------------------------------------------------
+//                         upload image via ftp
+// ----------------------------------------------------------------
+// pass image frame buffer pointer, length, file name to use (without .jpg), returns 1 if the server stored it
+
+bool uploadImageByFTP(uint8_t* buf, size_t len, String fName) {
+    DBG("FTP image %s\n", fName.c_str());
     fName += ".jpg";
-    ftp.NewFile( fName.c_str() );
-    ftp.WriteData(buf, len);
-    ftp.CloseFile();
 
-    ftp.CloseConnection();
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool reused = ftpLoggedIn;
+        if (reused && (!ftpControl.connected() ||
+                      ((unsigned long)(millis() - ftpLastUsed) > ftpCheckIdle && ftpCommand("NOOP") != 200))) {
+            reused = 0;                          // server has closed the session
+            ftpStale++;
+        }
+        if (!reused && !ftpLogin()) break;
+        int result = ftpStore(buf, len, fName);
+        ftpLastUsed = millis();
+        if (result == 1) {
+            ftpUploads++;
+            return 1;
+        }
+        if (result == -1) ftpError("no reply from server");
+        if (result == 0 || !reused) break;       // on a new session it is a real failure
+        ftpStale++;                              // session closed while idle, log in again and retry
+    }
+    ftpFailures++;
+    logPrintf(LOG_ERROR, "Error sending image '%s' via FTP: %s", fName.c_str(), ftpLastError.c_str());
+    return 0;
+}
+
+
+// FTP status for the root web page
+String ftpStatus() {
+    if (ftpUploads + ftpFailures == 0) return "";
+    String reply = "FTP: " + String(ftpUploads) + " sent " + String(ftpKBytes) + "K";
+    if (ftpSendTime) reply += " at " + String(ftpKBytes * 1000.0 / ftpSendTime, 1) + "K/s";
+    reply += " - " + String(ftpLogins) + (ftpLogins == 1 ? " login" : " logins");
+    if (ftpStale) reply += " (" + String(ftpStale) + " closed by server)";
+    if (ftpFailures) reply += " <font color='#FF0000'>" + String(ftpFailures) + " failed: " + ftpLastError + "</font>";
+    return reply;
 }
 
 #endif
@@ -0,0 +1,172 @@
+/**************************************************************************************************
+ *
+ *                          HTTP reply parser - used by post.h and net.h
+ *
+ *      Reads a complete HTTP/1.x reply from a WiFiClient: status line, the headers needed to find the end of
+ *      the reply (Content-Length, Transfer-Encoding: chunked, Connection) and the body.  Nothing is allocated,
+ *      the body is stored in a buffer supplied by the caller (anything which does not fit is read and
+ *      discarded) so the connection is left ready for the next request when the server keeps it open.
+ *
+ **************************************************************************************************/
+
+// usage:   char body[256];
+//          HttpReply reply(body, sizeof(body));
+//          if (reply.read(client, 5000) && reply.status == 200) Serial.println(body);
+//          if (!reply.keepAlive) client.stop();
+
+
+class HttpReply {
+
+    public:
+    int status = 0;                                // HTTP status code (0 = no valid reply received)
+    long contentLength = -1;                       // body length from the headers (-1 = not given)
+    bool chunked = 0;                              // body sent with chunked transfer encoding
+    bool keepAlive = 0;                            // the server will keep the connection open for another request
+    bool complete = 0;                             // the whole reply has been received
+    size_t bodyLen = 0;                            // bytes of body stored in the buffer
+    size_t bodyTotal = 0;                          // bytes of body received (may be more than was stored)
+
+    HttpReply(char *bodyBuf, size_t bodySize) {
+        _body = bodyBuf;
+        _bodySize = bodySize;
+        reset();
+    }
+
+    void reset() {
+        status = 0;
+        contentLength = -1;
+        chunked = 0;
+        keepAlive = 0;
+        complete = 0;
+        bodyLen = bodyTotal = 0;
+        _state = S_STATUS;
+        _lineLen = 0;
+        _chunkLeft = 0;
+        if (_bodySize) _body[0] = 0;
+    }
+
+    // read the reply, waiting up to 'timeout' ms for more data to arrive (returns 1 if the whole reply was received)
+    bool read(WiFiClient &client, uint32_t timeout) {
+        uint8_t buf[128];
+        uint32_t lastData = millis();
+        while (!complete) {
+            int avail = client.available();
+            if (avail > 0) {
+                int n = client.read(buf, min(avail, (int)sizeof(buf)));
+                if (n > 0) {
+                    feed(buf, n);
+                    lastData = millis();
+                }
+                continue;
+            }
+            if (!client.connected()) {
+                if (_state == S_BODY && contentLength < 0 && !chunked) complete = 1;     // body ends when the connection closes
+                break;
+            }
+            if ((unsigned long)(millis() - lastData) > timeout) break;
+            delay(2);
+        }
+        if (!complete || (contentLength < 0 && !chunked)) keepAlive = 0;              // can not tell where the next reply would start
+        return complete;
+    }
+
+    // process received data
+    void feed(const uint8_t *data, size_t len) {
+        for (size_t i = 0; i < len && !complete; i++) {
+            char c = data[i];
+            switch (_state) {
+                case S_BODY:
+                    store(c);
+                    if (contentLength >= 0 && bodyTotal >= (size_t)contentLength) complete = 1;
+                    break;
+                case S_CHUNK_DATA:
+                    store(c);
+                    if (--_chunkLeft == 0) _state = S_CHUNK_END;
+                    break;
+                default:                           // line based states
+                    if (c == '\n') {
+                        _line[_lineLen] = 0;
+                        line();
+                        _lineLen = 0;
+                    } else if (c != '\r' && _lineLen < sizeof(_line) - 1) {
+                        _line[_lineLen++] = c;     // long lines are truncated, only the start of a header is needed
+                    }
+            }
+        }
+    }
+
+    // find text in the body
+    bool contains(const char *text) {
+        return _bodySize && strstr(_body, text) != NULL;
+    }
+
+    private:
+    enum state_t { S_STATUS, S_HEADER, S_BODY, S_CHUNK_SIZE, S_CHUNK_DATA, S_CHUNK_END, S_TRAILER };
+    state_t _state = S_STATUS;
+    char *_body;
+    size_t _bodySize;
+    char _line[96];
+    uint8_t _lineLen = 0;
+    size_t _chunkLeft = 0;
+
+    void store(char c) {
+        bodyTotal++;
+        if (bodyLen + 1 < _bodySize) {
+            _body[bodyLen++] = c;
+            _body[bodyLen] = 0;
+        }
+    }
+
+    // header name matches (case insensitive), returns pointer to the value
+    const char *header(const char *name) {
+        size_t n = strlen(name);
+        if (strncasecmp(_line, name, n) != 0 || _line[n] != ':') return NULL;
+        const char *v = _line + n + 1;
+        while (*v == ' ') v++;
+        return v;
+    }
+
+    // a complete line has been received
+    void line() {
+        switch (_state) {
+            case S_STATUS:                         // e.g. "HTTP/1.1 200 OK"
+                if (_lineLen == 0) return;         // ignore blank lines before the reply
+                if (strncmp(_line, "HTTP/1.", 7) != 0) return;
+                keepAlive = (_line[7] == '1');     // HTTP/1.1 connections stay open unless the server says otherwise
+                status = atoi(_line + 9);
+                _state = S_HEADER;
+                return;
+            case S_HEADER: {
+                if (_lineLen == 0) {               // end of headers
+                    if (status / 100 == 1) { _state = S_STATUS; return; }        // 100 continue, real reply follows
+                    if (chunked) _state = S_CHUNK_SIZE;
+                    else if (contentLength == 0 || status == 204 || status == 304) complete = 1;
+                    else _state = S_BODY;
+                    return;
+                }
+                const char *v;
+                if ((v = header("Content-Length"))) contentLength = atol(v);
+                else if ((v = header("Transfer-Encoding"))) chunked = (strcasestr(v, "chunked") != NULL);
+                else if ((v = header("Connection"))) {
+                    if (strcasestr(v, "close")) keepAlive = 0;
+                    else if (strcasestr(v, "keep-alive")) keepAlive = 1;
+                }
+                return;
+            }
+            case S_CHUNK_SIZE:                     // size in hex (possibly followed by extensions)
+                _chunkLeft = strtoul(_line, NULL, 16);
+                _state = _chunkLeft ? S_CHUNK_DATA : S_TRAILER;
+                return;
+            case S_CHUNK_END:                      // blank line after the chunk data
+                _state = S_CHUNK_SIZE;
+                return;
+            case S_TRAILER:                        // trailer headers (ignored) until a blank line
+                if (_lineLen == 0) complete = 1;
+                return;
+            default:
+                return;
+        }
+    }
+};
+
+// ---------------------------------------------- end ----------------------------------------------
@@ -0,0 +1,321 @@
+/**************************************************************************************************
+ *
+ *              Image store - the stored images kept as a circular log in a flash partition
+ *
+ *      The trigger and pre capture images used to be Spiffs files which were removed and written again for
+ *      each photo, this gets slow (seconds) as Spiffs fills up and has to garbage collect, and a write error
+ *      formatted everything.  They are now written one after the other into the "images" partition (see
+ *      esp32cam-custom.csv), each as a record starting on an erase block (4K sector):
+ *
+ *          header (magic, sequence no., time, length, crc of the jpg, name, crc of the header) followed by the jpg
+ *
+ *      At the end of the partition it carries on from the start erasing the oldest records as it goes, so all
+ *      the sectors are erased the same number of times.  The jpg is written before its header so if the power
+ *      fails part way through a record it has no valid header and is ignored.  At boot the first bytes of each
+ *      sector are read to find the newest record (highest sequence no.), the next one is written after it.
+ *
+ *      Images are stored by name ("3" = trigger image 3, "3s" = its pre capture image) and reading a name gives
+ *      the newest record with it, an index in ram holds where these are so nothing has to be searched for.
+ *
+ *      If there is no "images" partition (an older partition table on the esp32) they are stored in Spiffs.
+ *
+ **************************************************************************************************/
+
+// usage:   imgStoreWrite("3", buf, len);
+//          imgRecord_t rec;
+//          if (imgStoreFind("3", &rec)) imgStoreRead(rec, 0, buf, rec.h.len);
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const char imgStoreLabel[] = "images";           // name of the partition in esp32cam-custom.csv
+const uint8_t imgStoreSubtype = 0x40;            // its subtype (custom data partition)
+const uint32_t imgStoreEraseAhead = 64 * 1024;   // erase this much beyond each new image so the next is only written (0 = erase when needed)
+//  ------------------------------------------------------------------
+
+#include <esp_partition.h>
+#include <rom/crc.h>
+
+#define IMGSTORE_SECTOR 4096                     // flash erase block
+#define IMGSTORE_MAGIC 0x31474D49                // "IMG1"
+#define IMGSTORE_INDEX 16                        // names held in the index (2 per stored image)
+
+struct imgHeader_t {                             // start of each record
+    uint32_t magic;
+    uint32_t seq;                                // increases by one for each image written
+    uint32_t time;                               // when the image was stored (unix time, 0 = time not known)
+    uint32_t len;                                // jpg length
+    uint32_t crc;                                // crc32 of the jpg
+    char name[12];
+    uint32_t hdrCrc;                             // crc32 of the above
+};
+
+struct imgRecord_t {
+    imgHeader_t h;
+    uint32_t addr;                               // offset of the record in the partition
+};
+
+// forward declarations
+bool imgStoreSetup();
+bool imgStoreReady();
+bool imgStoreWrite(String name, const uint8_t *buf, size_t len, uint32_t *seq = NULL);
+bool imgStoreFind(String name, imgRecord_t *rec);
+bool imgStoreRead(const imgRecord_t &rec, uint32_t offset, uint8_t *buf, size_t len);
+String imgStoreStatus();
+void log_system_message(String smes);
+
+
+const esp_partition_t *imgPart = NULL;
+SemaphoreHandle_t imgMutex = NULL;
+uint32_t imgSize = 0;                            // usable size of the partition (whole sectors)
+uint32_t imgHead = 0;                            // where the next record goes
+uint32_t imgErasedTo = 0;                        // sectors from imgHead up to here are known to be erased
+uint32_t imgSeq = 1;                             // sequence no. of the next record
+imgRecord_t imgIndex[IMGSTORE_INDEX];            // newest record of each name (h.magic = 0 for an unused entry)
+
+// stats
+uint32_t imgWrites = 0;
+uint32_t imgFailures = 0;
+uint32_t imgWraps = 0;                           // times the end of the partition has been reached
+uint32_t imgWriteTime = 0;                       // time spent writing images (ms)
+uint32_t imgEraseTime = 0;                       // of which erasing (ms)
+uint32_t imgKBytes = 0;
+
+
+// sectors used by a record holding an image of this length
+static uint32_t imgRecordSize(uint32_t len) {
+    return (sizeof(imgHeader_t) + len + IMGSTORE_SECTOR - 1) / IMGSTORE_SECTOR * IMGSTORE_SECTOR;
+}
+
+
+// read and check the header of a record at addr
+static bool imgReadHeader(uint32_t addr, imgHeader_t *h) {
+    if (esp_partition_read(imgPart, addr, h, sizeof(imgHeader_t)) != ESP_OK) return 0;
+    if (h->magic != IMGSTORE_MAGIC) return 0;
+    if (h->hdrCrc != crc32_le(0, (const uint8_t *)h, offsetof(imgHeader_t, hdrCrc))) return 0;
+    return (addr + imgRecordSize(h->len) <= imgSize);
+}
+
+
+// check the jpg of a record is complete (part of it may have been erased or the power lost while writing it)
+static bool imgCheckData(const imgRecord_t &rec) {
+    uint8_t buf[256];
+    uint32_t crc = 0;
+    for (uint32_t pos = 0; pos < rec.h.len; pos += sizeof(buf)) {
+        uint32_t n = min((uint32_t)sizeof(buf), rec.h.len - pos);
+        if (esp_partition_read(imgPart, rec.addr + sizeof(imgHeader_t) + pos, buf, n) != ESP_OK) return 0;
+        crc = crc32_le(crc, buf, n);
+    }
+    return (crc == rec.h.crc);
+}
+
+
+// if a sector is all 0xFF
+static bool imgSectorErased(uint32_t addr) {
+    uint32_t buf[64];
+    for (uint32_t pos = 0; pos < IMGSTORE_SECTOR; pos += sizeof(buf)) {
+        if (esp_partition_read(imgPart, addr + pos, buf, sizeof(buf)) != ESP_OK) return 0;
+        for (uint8_t i = 0; i < 64; i++) if (buf[i] != 0xFFFFFFFF) return 0;
+    }
+    return 1;
+}
+
+
+// ----------------------------------------------------------------
+//                            -index
+// ----------------------------------------------------------------
+
+static imgRecord_t *imgIndexFind(const char *name) {
+    for (uint8_t i = 0; i < IMGSTORE_INDEX; i++) {
+        if (imgIndex[i].h.magic && strcmp(imgIndex[i].h.name, name) == 0) return &imgIndex[i];
+    }
+    return NULL;
+}
+
+
+// add a record unless there is a newer one with its name, if the index is full the oldest entry is replaced
+static void imgIndexAdd(const imgRecord_t &rec) {
+    imgRecord_t *e = imgIndexFind(rec.h.name);
+    if (e && e->h.seq > rec.h.seq) return;
+    if (!e) {
+        e = &imgIndex[0];
+        for (uint8_t i = 0; i < IMGSTORE_INDEX && e->h.magic; i++) {
+            if (!imgIndex[i].h.magic || imgIndex[i].h.seq < e->h.seq) e = &imgIndex[i];
+        }
+    }
+    *e = rec;
+}
+
+
+// drop records which have a sector between from and to
+static void imgIndexDrop(uint32_t from, uint32_t to) {
+    for (uint8_t i = 0; i < IMGSTORE_INDEX; i++) {
+        imgRecord_t &e = imgIndex[i];
+        if (e.h.magic && e.addr < to && e.addr + imgRecordSize(e.h.len) > from) e.h.magic = 0;
+    }
+}
+
+
+// erase the sectors from imgErasedTo (or imgHead) up to 'to'
+static bool imgEraseTo(uint32_t to) {
+    uint32_t from = max(imgHead, imgErasedTo);
+    if (to <= from) return 1;
+    imgIndexDrop(from, to);
+    uint32_t startTime = millis();
+    bool ok = (esp_partition_erase_range(imgPart, from, to - from) == ESP_OK);
+    imgEraseTime += millis() - startTime;
+    imgErasedTo = ok ? to : imgHead;
+    return ok;
+}
+
+
+// ----------------------------------------------------------------
+//              -find the partition and the newest record
+// ----------------------------------------------------------------
+// called from setup, returns 0 if there is no image partition (images are then stored in Spiffs)
+
+bool imgStoreSetup() {
+    imgPart = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, (esp_partition_subtype_t)imgStoreSubtype, imgStoreLabel);
+    if (!imgPart) {
+        log_system_message("No '" + String(imgStoreLabel) + "' partition, images will be stored in Spiffs");
+        return 0;
+    }
+    if (!imgMutex) imgMutex = xSemaphoreCreateMutex();
+    imgSize = imgPart->size / IMGSTORE_SECTOR * IMGSTORE_SECTOR;
+    memset(imgIndex, 0, sizeof(imgIndex));
+    imgHead = 0;
+    imgSeq = 1;
+
+    // a sector which starts with a valid header starts a record, the newest one is followed by the next to be written
+    uint32_t records = 0;
+    for (uint32_t addr = 0; addr < imgSize; addr += IMGSTORE_SECTOR) {
+        imgRecord_t rec;
+        if (!imgReadHeader(addr, &rec.h)) continue;
+        rec.addr = addr;
+        records++;
+        if (rec.h.seq >= imgSeq) {
+            imgSeq = rec.h.seq + 1;
+            imgHead = addr + imgRecordSize(rec.h.len);
+        }
+        imgIndexAdd(rec);
+    }
+    if (imgHead >= imgSize) imgHead = 0;
+
+    // sectors erased ahead before the restart do not need erasing again
+    imgErasedTo = imgHead;
+    while (imgErasedTo < min(imgHead + imgStoreEraseAhead, imgSize) && imgSectorErased(imgErasedTo)) imgErasedTo += IMGSTORE_SECTOR;
+
+    // an older record may have lost its end to the sectors erased for a newer one
+    uint8_t bad = 0;
+    for (uint8_t i = 0; i < IMGSTORE_INDEX; i++) {
+        if (imgIndex[i].h.magic && !imgCheckData(imgIndex[i])) {
+            imgIndex[i].h.magic = 0;
+            bad++;
+        }
+    }
+    log_system_message("Image store: " + String(imgSize / 1024) + "K, " + String(records) + " records found" +
+                       (bad ? ", " + String(bad) + " incomplete" : ""));
+    return 1;
+}
+
+
+// if images are being kept in the image store
+bool imgStoreReady() {
+    return (imgPart != NULL);
+}
+
+
+// ----------------------------------------------------------------
+//                         -store an image
+// ----------------------------------------------------------------
+// returns 1 if stored, it replaces any image with the same name, seq is set to the sequence no. of its record
+
+bool imgStoreWrite(String name, const uint8_t *buf, size_t len, uint32_t *seq) {
+    if (!imgPart) return 0;
+    uint32_t need = imgRecordSize(len);
+    if (need > imgSize || name.length() >= sizeof(imgHeader_t::name)) {
+        imgFailures++;
+        log_system_message("Error: image '" + name + "' can not be put in the image store");
+        return 0;
+    }
+
+    imgRecord_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.h.magic = IMGSTORE_MAGIC;
+    rec.h.time = (year() >= 2021) ? now() : 0;
+    rec.h.len = len;
+    rec.h.crc = crc32_le(0, buf, len);
+    strcpy(rec.h.name, name.c_str());
+
+    xSemaphoreTake(imgMutex, portMAX_DELAY);
+    uint32_t startTime = millis();
+    if (imgHead + need > imgSize) {              // does not fit before the end so start again at the beginning
+        imgHead = 0;
+        imgErasedTo = 0;
+        imgWraps++;
+    }
+    rec.addr = imgHead;
+    rec.h.seq = imgSeq;
+    rec.h.hdrCrc = crc32_le(0, (const uint8_t *)&rec.h, offsetof(imgHeader_t, hdrCrc));
+    // the header goes last, until then the record is not valid
+    bool ok = imgEraseTo(imgHead + need) &&
+              esp_partition_write(imgPart, imgHead + sizeof(imgHeader_t), buf, len) == ESP_OK &&
+              esp_partition_write(imgPart, imgHead, &rec.h, sizeof(imgHeader_t)) == ESP_OK;
+    if (ok) {
+        if (seq) *seq = rec.h.seq;
+        imgIndexAdd(rec);
+        imgSeq++;
+        imgHead += need;
+        imgEraseTo(min(imgHead + imgStoreEraseAhead, imgSize));
+        imgWrites++;
+        imgKBytes += len / 1024;
+    } else {
+        imgErasedTo = imgHead;                   // erased again before the next attempt
+        imgFailures++;
+    }
+    imgWriteTime += millis() - startTime;
+    xSemaphoreGive(imgMutex);
+
+    if (!ok) log_system_message("Error: writing image '" + name + "' to the image store failed");
+    return ok;
+}
+
+
+// ----------------------------------------------------------------
+//                         -read an image
+// ----------------------------------------------------------------
+
+// the newest record with this name, returns 0 if there is none
+bool imgStoreFind(String name, imgRecord_t *rec) {
+    if (!imgPart) return 0;
+    xSemaphoreTake(imgMutex, portMAX_DELAY);
+    imgRecord_t *e = imgIndexFind(name.c_str());
+    if (e) *rec = *e;
+    xSemaphoreGive(imgMutex);
+    return (e != NULL);
+}
+
+
+// read part of the jpg of a record, returns 0 if it has been overwritten since it was found
+bool imgStoreRead(const imgRecord_t &rec, uint32_t offset, uint8_t *buf, size_t len) {
+    if (!imgPart || offset + len > rec.h.len) return 0;
+    xSemaphoreTake(imgMutex, portMAX_DELAY);
+    imgRecord_t *e = imgIndexFind(rec.h.name);
+    bool ok = e && e->h.seq == rec.h.seq &&
+              esp_partition_read(imgPart, rec.addr + sizeof(imgHeader_t) + offset, buf, len) == ESP_OK;
+    xSemaphoreGive(imgMutex);
+    return ok;
+}
+
+
+// image store status for the root web page
+String imgStoreStatus() {
+    if (!imgPart) return "";
+    String reply = "Image store: " + String(imgWrites) + " written " + String(imgKBytes) + "K";
+    if (imgWrites) reply += " (avg " + String(imgWriteTime / imgWrites) + "ms, erasing " + String(imgEraseTime / imgWrites) + "ms)";
+    reply += " - next at " + String(imgHead * 100 / imgSize) + "% of " + String(imgSize / 1024) + "K";
+    if (imgWraps) reply += ", wrapped " + String(imgWraps) + (imgWraps == 1 ? " time" : " times");
+    if (imgFailures) reply += " <font color='#FF0000'>" + String(imgFailures) + " failed</font>";
+    return reply;
+}
+
+// ---------------------------------------------- end ----------------------------------------------
@@ -0,0 +1,388 @@
+/**************************************************************************************************
+ *
+ *          Journal - system log messages, boots and motion triggers kept in Spiffs over restarts
+ *
+ *      The system log (logring.h) is only in ram and is lost whenever the esp32 restarts, and bootlog.txt
+ *      grew for ever.  Log messages (up to journalLevel), boots and motion triggers are now also written
+ *      as binary records to a set of journalSegments files in Spiffs (/jrn0.bin, /jrn1.bin...), each up
+ *      to journalSegmentSize bytes.  When one is full the oldest is removed and started again, so it never
+ *      uses more than journalSegments * journalSegmentSize of Spiffs.
+ *
+ *          segment:  header (magic "JSG1", segment no., first record no., boot no., crc) then records
+ *          record:   magic "JR", type, level, length, boot no., record no., millis(), time, data, crc
+ *
+ *      Records are gathered in ram and written by a background task a couple of seconds later (and straight
+ *      away before a restart).  Errors, warnings, motion triggers and boot records are written as soon as the
+ *      task can run, as they are often the last thing before a crash, a watchdog reset or a brownout which
+ *      would lose what was still in ram.  Each record has a crc so a record left half written is found.  At boot only the
+ *      first bytes of each segment are read to find the newest one, and only that one is read through to
+ *      find where it ends.  If it ends with a damaged record a new segment is started after it.
+ *
+ *      http://x.x.x.x/journal sends all the segments oldest first, misc/journal/jrndump.cpp decodes them:
+ *              curl -o cam.jrn http://x.x.x.x/journal && ./jrndump cam.jrn
+ *
+ **************************************************************************************************/
+
+// usage:   journalWrite(JRN_LOG, LOG_INFO, text, strlen(text));
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const uint8_t journalSegments = 4;               // number of segment files
+const uint32_t journalSegmentSize = 16384;       // max size of each (bytes)
+const uint8_t journalLevel = LOG_INFO;           // log messages up to this level are journaled (LOG_xxx)
+const uint32_t journalFlushDelay = 2000;         // write records to Spiffs this long after the first is added (ms)
+const uint8_t journalUrgentLevel = LOG_WARN;     // log messages up to this level are written straight away
+const uint16_t journalBufSize = 2048;            // records waiting to be written (bytes)
+//  ------------------------------------------------------------------
+
+#include <rom/crc.h>
+#include <esp_system.h>                          // esp_reset_reason()
+
+#define JRN_SEG_MAGIC 0x3147534A                 // "JSG1"
+#define JRN_REC_MAGIC 0x524A                     // "JR"
+#define JRN_MAX_DATA 256                         // longest record data (bytes)
+
+// record types
+#define JRN_BOOT   1                             // esp32 started, or a boot log event (text)
+#define JRN_LOG    2                             // system log message (text)
+#define JRN_MOTION 3                             // motion trigger (jrnMotion_t)
+
+struct jrnSegment_t {
+    uint32_t magic;
+    uint32_t segment;                            // increases by one for each new segment
+    uint32_t firstSeq;                           // record no. of its first record
+    uint16_t boot;                               // boot no. when it was started
+    uint16_t spare;
+    uint32_t crc;                                // crc32 of the above
+} __attribute__((packed));
+
+struct jrnRecord_t {
+    uint16_t magic;
+    uint8_t type;                                // JRN_xxx
+    uint8_t level;                               // LOG_xxx
+    uint16_t len;                                // bytes of data after the record header
+    uint16_t boot;                               // boot no. (increases by one each time the esp32 starts)
+    uint32_t seq;                                // record no.
+    uint32_t ms;                                 // millis() when added
+    uint32_t time;                               // unix time when added (0 = time not known)
+} __attribute__((packed));                       // followed by the data then a crc32 of the header and data
+
+struct jrnMotion_t {
+    uint16_t changes;                            // changed blocks
+    uint16_t blocks;                             // blocks being monitored
+    uint16_t brightness;                         // average brightness of the image
+    uint16_t spare;
+} __attribute__((packed));
+
+// forward declarations
+bool journalSetup();
+void journalWrite(uint8_t type, uint8_t level, const void *data, uint16_t len);
+void journalLog(uint8_t level, const char *text, uint16_t len);
+void journalMotion(uint16_t changes, uint16_t blocks, uint16_t brightness);
+void journalFlush();
+bool journalEach(bool (*fn)(const jrnRecord_t &r, const uint8_t *data, void *ctx), void *ctx);
+void journalSend(WiFiClient &client);
+String journalStatus();
+void log_system_message(String smes);            // standard.h
+
+
+static uint8_t jrnBuf[journalBufSize];           // records waiting to be written
+static uint8_t jrnOut[journalBufSize];           // records being written
+static uint16_t jrnBufLen = 0;
+static volatile bool jrnUrgent = 0;              // a record is waiting which should be written straight away
+static SemaphoreHandle_t jrnMutex = NULL;        // jrnBuf
+static SemaphoreHandle_t jrnFileMutex = NULL;    // the segment files
+TaskHandle_t jrnTaskHandle = NULL;
+bool jrnReady = 0;
+uint32_t jrnSegment = 0;                         // segment being written
+uint32_t jrnSegBytes = 0;                        // its size
+bool jrnNewNeeded = 1;                           // start a new segment before the next record
+uint32_t jrnSeq = 1;                             // record no. of the next record
+uint16_t jrnBoot = 0;                            // this boot
+
+// stats
+uint32_t jrnRecords = 0;                         // records written since boot
+uint32_t jrnDropped = 0;                         // records dropped as the buffer was full
+uint32_t jrnFailures = 0;                        // failed writes to Spiffs
+uint32_t jrnRecoverTime = 0;                     // time taken to find the end of the journal at boot (ms)
+bool jrnDamaged = 0;                             // the newest segment ended with a damaged record
+
+
+static String jrnPath(uint32_t segment) {
+    return "/jrn" + String(segment % journalSegments) + ".bin";
+}
+
+
+static uint32_t jrnRecordCrc(const uint8_t *rec) {
+    return crc32_le(0, rec, sizeof(jrnRecord_t) + ((const jrnRecord_t *)rec)->len);
+}
+
+
+static bool jrnLock(SemaphoreHandle_t &mutex) {
+    if (!mutex) mutex = xSemaphoreCreateMutex();
+    return mutex && xSemaphoreTake(mutex, portMAX_DELAY) == pdTRUE;
+}
+
+
+// ----------------------------------------------------------------
+//                         -add records
+// ----------------------------------------------------------------
+// the record no., boot no. and crc are filled in when it is written to Spiffs
+
+void journalWrite(uint8_t type, uint8_t level, const void *data, uint16_t len) {
+    if (len > JRN_MAX_DATA) len = JRN_MAX_DATA;
+    uint16_t size = sizeof(jrnRecord_t) + len + 4;
+    if (!jrnLock(jrnMutex)) return;
+    if (jrnBufLen + size > journalBufSize) {
+        jrnDropped++;
+        xSemaphoreGive(jrnMutex);
+        return;
+    }
+    jrnRecord_t r;
+    r.magic = JRN_REC_MAGIC;
+    r.type = type;
+    r.level = level;
+    r.len = len;
+    r.boot = 0;
+    r.seq = 0;
+    r.ms = millis();
+    r.time = (year() >= 2021) ? now() : 0;
+    memcpy(jrnBuf + jrnBufLen, &r, sizeof(r));
+    memcpy(jrnBuf + jrnBufLen + sizeof(r), data, len);
+    bool first = (jrnBufLen == 0);
+    bool urgent = (type != JRN_LOG || level <= journalUrgentLevel);
+    jrnBufLen += size;
+    if (urgent) jrnUrgent = 1;
+    xSemaphoreGive(jrnMutex);
+    if ((first || urgent) && jrnTaskHandle) xTaskNotifyGive(jrnTaskHandle);
+}
+
+
+// called by logring.h for each log message
+void journalLog(uint8_t level, const char *text, uint16_t len) {
+    if (level <= journalLevel) journalWrite(JRN_LOG, level, text, len);
+}
+
+
+void journalMotion(uint16_t changes, uint16_t blocks, uint16_t brightness) {
+    jrnMotion_t m = {changes, blocks, brightness, 0};
+    journalWrite(JRN_MOTION, LOG_INFO, &m, sizeof(m));
+}
+
+
+// ----------------------------------------------------------------
+//                   -write the records to Spiffs
+// ----------------------------------------------------------------
+
+// remove the oldest segment and start it again as the newest (jrnFileMutex must be held)
+static bool jrnStartSegment() {
+    jrnSegment++;
+    String path = jrnPath(jrnSegment);
+    SPIFFS.remove(path);
+    File file = SPIFFS.open(path, FILE_WRITE);
+    jrnSegment_t h = {JRN_SEG_MAGIC, jrnSegment, jrnSeq, jrnBoot, 0, 0};
+    h.crc = crc32_le(0, (const uint8_t *)&h, offsetof(jrnSegment_t, crc));
+    bool ok = file && file.write((const uint8_t *)&h, sizeof(h)) == sizeof(h);
+    file.close();
+    jrnSegBytes = sizeof(h);
+    jrnNewNeeded = !ok;
+    return ok;
+}
+
+
+static bool jrnAppend(const uint8_t *buf, size_t len) {
+    File file = SPIFFS.open(jrnPath(jrnSegment), FILE_APPEND);
+    bool ok = file && file.write(buf, len) == len;
+    file.close();
+    if (ok) jrnSegBytes += len;
+    else jrnNewNeeded = 1;                       // do not append after a part written record
+    return ok;
+}
+
+
+void journalFlush() {
+    if (!jrnReady || !jrnLock(jrnFileMutex)) return;
+    uint32_t failures = jrnFailures;
+    jrnLock(jrnMutex);
+    uint16_t len = jrnBufLen;
+    memcpy(jrnOut, jrnBuf, len);
+    jrnBufLen = 0;
+    jrnUrgent = 0;
+    xSemaphoreGive(jrnMutex);
+
+    // number the records, and write them a segment at a time
+    uint16_t start = 0;
+    for (uint16_t pos = 0; pos < len; ) {
+        jrnRecord_t *r = (jrnRecord_t *)(jrnOut + pos);
+        uint16_t size = sizeof(jrnRecord_t) + r->len + 4;
+        if (jrnNewNeeded || jrnSegBytes + (pos - start) + size > journalSegmentSize) {
+            if (pos > start && !jrnAppend(jrnOut + start, pos - start)) jrnFailures++;
+            start = pos;
+            if (!jrnStartSegment()) {
+                jrnFailures++;
+                break;
+            }
+        }
+        r->seq = jrnSeq++;
+        r->boot = jrnBoot;
+        uint32_t crc = jrnRecordCrc(jrnOut + pos);
+        memcpy(jrnOut + pos + size - 4, &crc, 4);
+        jrnRecords++;
+        pos += size;
+        if (pos >= len && !jrnAppend(jrnOut + start, pos - start)) jrnFailures++;
+    }
+    xSemaphoreGive(jrnFileMutex);
+    if (jrnFailures && !failures) log_system_message("Error: unable to write to the journal in Spiffs");
+}
+
+
+static void jrnTask(void *) {
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        uint32_t startTime = millis();                    // gather the records added meanwhile, unless one is urgent
+        while (!jrnUrgent && (unsigned long)(millis() - startTime) < journalFlushDelay) {
+            ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(journalFlushDelay - (millis() - startTime)));
+        }
+        journalFlush();
+    }
+}
+
+
+// ----------------------------------------------------------------
+//                    -find the end of the journal
+// ----------------------------------------------------------------
+// called from setup once Spiffs is mounted, records added before this are kept until it is
+
+static bool jrnReadSegment(File &file, jrnSegment_t *h) {
+    return file && file.read((uint8_t *)h, sizeof(*h)) == sizeof(*h) && h->magic == JRN_SEG_MAGIC &&
+           h->crc == crc32_le(0, (const uint8_t *)h, offsetof(jrnSegment_t, crc));
+}
+
+
+// read the next record of a segment in to buf (returns 0 at the end or if it is damaged)
+static bool jrnReadRecord(File &file, uint8_t *buf, size_t bufSize) {
+    jrnRecord_t *r = (jrnRecord_t *)buf;
+    if (file.read(buf, sizeof(jrnRecord_t)) != sizeof(jrnRecord_t)) return 0;
+    if (r->magic != JRN_REC_MAGIC || sizeof(jrnRecord_t) + r->len + 4 > bufSize) return 0;
+    if (file.read(buf + sizeof(jrnRecord_t), (size_t)r->len + 4) != (size_t)r->len + 4) return 0;
+    uint32_t crc;
+    memcpy(&crc, buf + sizeof(jrnRecord_t) + r->len, 4);
+    return crc == jrnRecordCrc(buf);
+}
+
+
+bool journalSetup() {
+    uint32_t startTime = millis();
+    jrnLock(jrnFileMutex);
+
+    // newest segment
+    jrnSegment_t newest;
+    bool found = 0;
+    for (uint8_t i = 0; i < journalSegments; i++) {
+        jrnSegment_t h;
+        File file = SPIFFS.open("/jrn" + String(i) + ".bin", "r");
+        if (jrnReadSegment(file, &h) && h.segment % journalSegments == i && (!found || h.segment > newest.segment)) {
+            newest = h;
+            found = 1;
+        }
+        file.close();
+    }
+
+    // read through it to find its last record
+    if (found) {
+        jrnSegment = newest.segment;
+        jrnSeq = newest.firstSeq;
+        jrnBoot = newest.boot;
+        File file = SPIFFS.open(jrnPath(jrnSegment), "r");
+        jrnReadSegment(file, &newest);
+        size_t fileSize = file.size();
+        jrnSegBytes = sizeof(jrnSegment_t);
+        uint8_t buf[sizeof(jrnRecord_t) + JRN_MAX_DATA + 4];
+        while (jrnReadRecord(file, buf, sizeof(buf))) {
+            const jrnRecord_t *r = (const jrnRecord_t *)buf;
+            jrnSeq = r->seq + 1;
+            if (r->boot > jrnBoot) jrnBoot = r->boot;
+            jrnSegBytes += sizeof(jrnRecord_t) + r->len + 4;
+        }
+        file.close();
+        jrnDamaged = (jrnSegBytes != fileSize);
+        jrnNewNeeded = jrnDamaged;
+    }
+    jrnBoot++;
+    jrnReady = 1;
+    xSemaphoreGive(jrnFileMutex);
+    jrnRecoverTime = millis() - startTime;
+
+    // why the esp32 restarted
+    const char *reasons[] = {"unknown", "power on", "external pin", "software", "panic", "interrupt watchdog", "task watchdog",
+                             "watchdog", "deep sleep", "brownout", "sdio"};
+    esp_reset_reason_t reason = esp_reset_reason();
+    char text[64];
+    int len = snprintf(text, sizeof(text), "Started, reset reason: %s", (reason < 11) ? reasons[reason] : "other");
+    journalWrite(JRN_BOOT, LOG_INFO, text, len);
+    journalFlush();
+
+    if (xTaskCreate(jrnTask, "journal", 3072, NULL, 1, &jrnTaskHandle) != pdPASS) {
+        log_system_message("Error: Unable to start journal task");
+        return 0;
+    }
+    if (jrnDamaged) log_system_message("Journal ended with a damaged record, starting a new segment");
+    return 1;
+}
+
+
+// ----------------------------------------------------------------
+//                       -read the journal
+// ----------------------------------------------------------------
+
+// call fn for each record, oldest first (stops if it returns 0)
+bool journalEach(bool (*fn)(const jrnRecord_t &r, const uint8_t *data, void *ctx), void *ctx) {
+    if (!jrnReady) return 0;
+    journalFlush();
+    jrnLock(jrnFileMutex);
+    bool more = 1;
+    uint8_t buf[sizeof(jrnRecord_t) + JRN_MAX_DATA + 4];
+    uint32_t first = (jrnSegment >= journalSegments) ? jrnSegment - journalSegments + 1 : 1;
+    for (uint32_t seg = first; seg <= jrnSegment && more; seg++) {
+        File file = SPIFFS.open(jrnPath(seg), "r");
+        jrnSegment_t h;
+        if (jrnReadSegment(file, &h) && h.segment == seg) {
+            while (more && jrnReadRecord(file, buf, sizeof(buf))) {
+                more = fn(*(const jrnRecord_t *)buf, buf + sizeof(jrnRecord_t), ctx);
+            }
+        }
+        file.close();
+    }
+    xSemaphoreGive(jrnFileMutex);
+    return 1;
+}
+
+
+// send all the segments oldest first (for jrndump)
+void journalSend(WiFiClient &client) {
+    journalFlush();
+    jrnLock(jrnFileMutex);
+    uint8_t buf[1024];
+    uint32_t first = (jrnSegment >= journalSegments) ? jrnSegment - journalSegments + 1 : 1;
+    for (uint32_t seg = first; seg <= jrnSegment && jrnReady; seg++) {
+        File file = SPIFFS.open(jrnPath(seg), "r");
+        size_t n;
+        while (file && (n = file.read(buf, sizeof(buf))) > 0) {
+            if (client.write(buf, n) != n) break;
+        }
+        file.close();
+    }
+    xSemaphoreGive(jrnFileMutex);
+}
+
+
+// journal status for the root web page
+String journalStatus() {
+    if (!jrnReady) return "";
+    String reply = "Journal: boot " + String(jrnBoot) + ", " + String(jrnRecords) + " records written, segment " + String(jrnSegment) +
+                   " " + String(jrnSegBytes / 1024) + "K, found end in " + String(jrnRecoverTime) + "ms";
+    if (jrnDropped || jrnFailures) reply += " <font color='#FF0000'>" + String(jrnDropped) + " dropped, " + String(jrnFailures) + " write failures</font>";
+    return reply;
+}
+
+// ---------------------------------------------- end ----------------------------------------------
@@ -0,0 +1,226 @@
+/**************************************************************************************************
+ *
+ *                  System log - messages kept in a fixed block of ram with a level and time
+ *
+ *      log_system_message() used to join the time and message into a new String and keep the last 30 in an
+ *      array of Strings, each message logged allocated and freed memory.  The messages are now formatted
+ *      with printf straight into a fixed block of ram (logArenaSize bytes), one after the other, as:
+ *
+ *          size of the entry, where the one before it starts, millis() when logged, level, text (null ended)
+ *
+ *      when there is no room left the oldest messages are dropped, so it holds as many as fit rather than a
+ *      fixed number.  Logging a message does not allocate any memory, the log page takes a copy of the
+ *      block (logCopy) and sends that so a slow client does not hold up logging.  The time kept is millis()
+ *      so it always goes up, it is shown as the time of day once the time is known.
+ *
+ *      log_system_message(String) still works, messages starting "Error" are logged as LOG_ERROR and
+ *      "Warning" as LOG_WARN, those logged often use logPrintf() so no String is built for them at all.
+ *
+ *      LOGE/LOGW/LOGI/LOGD(fmt, ...) log at a level and DBG(fmt, ...) sends debug text to the serial port
+ *      (when serialDebug is set).  Levels above LOG_COMPILED (a build flag, e.g. -DLOG_COMPILED=2) are left
+ *      out of the firmware altogether, the format string and the arguments as well, and the levels kept
+ *      only work out their arguments once the level test has passed.
+ *
+ **************************************************************************************************/
+
+// usage:   logPrintf(LOG_INFO, "Image '%s' sent in %ums", name, ms);
+//          LOGW("Camera capture failed - attempt %u", tries);          DBG("Connected to %s\n", host);
+//          n = logCopy(buf, logArenaSize);  for (size_t p = 0; p < n; p += e->size) { e = (const logEntry_t *)(buf + p); ... }
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const uint16_t logArenaSize = 4096;              // bytes of ram for the log
+const uint16_t logLineMax = 160;                 // longest message (longer ones are cut short)
+uint8_t logLevel = 3;                            // messages above this level are not logged (LOG_xxx)
+//  ------------------------------------------------------------------
+
+#include <stdarg.h>
+#include <TimeLib.h>
+
+// levels
+#define LOG_ERROR 1
+#define LOG_WARN  2
+#define LOG_INFO  3
+#define LOG_DEBUG 4
+
+// highest level built in to the firmware (set with a build flag)
+#ifndef LOG_COMPILED
+#define LOG_COMPILED LOG_DEBUG
+#endif
+
+// a test of constants is removed by the compiler along with everything in the if
+#define LOG_AT(level, ...)  do { if ((level) <= LOG_COMPILED && (level) <= logLevel) logPrintf((level), __VA_ARGS__); } while (0)
+#define LOGE(...)           LOG_AT(LOG_ERROR, __VA_ARGS__)
+#define LOGW(...)           LOG_AT(LOG_WARN, __VA_ARGS__)
+#define LOGI(...)           LOG_AT(LOG_INFO, __VA_ARGS__)
+#define LOGD(...)           LOG_AT(LOG_DEBUG, __VA_ARGS__)
+#define DBG(...)            do { if (LOG_COMPILED >= LOG_DEBUG && serialDebug) txPrintf(__VA_ARGS__); } while (0)
+#define DBG_ON              (LOG_COMPILED >= LOG_DEBUG && serialDebug)      // for debug output that is more than a line
+
+struct logEntry_t {
+    uint16_t size;                               // bytes used by this entry (a multiple of 4)
+    uint16_t prev;                               // position of the entry logged before it
+    uint32_t ms;                                 // millis() when logged
+    uint8_t level;                               // LOG_xxx
+    uint8_t spare;
+    char text[];                                 // the message (null ended)
+};
+
+// forward declarations
+void logPrintf(uint8_t level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+void logVPrintf(uint8_t level, const char *fmt, va_list args);
+void logLock();
+void logUnlock();
+const logEntry_t *logNewest();
+const logEntry_t *logOlder(const logEntry_t *e);
+size_t logCopy(uint8_t *buf, size_t len);
+const char *logTime(const logEntry_t *e, char *buf, size_t len);
+const char *logLevelName(uint8_t level);
+void journalLog(uint8_t level, const char *text, uint16_t len);      // journal.h
+
+
+static uint8_t logArena[logArenaSize] __attribute__((aligned(4)));
+static uint16_t logHead = 0;                     // where the next entry goes
+static uint16_t logTail = 0;                     // the oldest entry
+static uint16_t logLast = 0;                     // the newest entry
+static uint16_t logWrapAt = logArenaSize;        // end of the entries before the head went back to the start
+static uint16_t logCount = 0;                    // entries in the log
+static SemaphoreHandle_t logMutex = NULL;        // the log is also written to from background tasks (e.g. burst.h)
+
+// stats
+uint32_t logMessages = 0;                        // messages logged
+uint32_t logDropped = 0;                         // dropped to make room
+
+
+static inline logEntry_t *logAt(uint16_t pos) {
+    return (logEntry_t *)(logArena + pos);
+}
+
+
+void logLock() {
+    if (!logMutex) logMutex = xSemaphoreCreateMutex();
+    xSemaphoreTake(logMutex, portMAX_DELAY);
+}
+
+void logUnlock() {
+    xSemaphoreGive(logMutex);
+}
+
+
+static void logDropOldest() {
+    logTail += logAt(logTail)->size;
+    logCount--;
+    logDropped++;
+    if (logTail >= logWrapAt) {                              // the next one is at the start
+        logTail = 0;
+        logWrapAt = logArenaSize;
+    }
+}
+
+
+// make room for an entry of up to 'need' bytes at the head, dropping the oldest entries (mutex must be held)
+static void logMakeRoom(uint16_t need) {
+    if (logHead + need > logArenaSize) {                     // not enough room before the end, go back to the start
+        while (logCount && logTail >= logHead) logDropOldest();
+        logWrapAt = logHead;
+        logHead = 0;
+    }
+    while (logCount && logTail >= logHead && logTail < logHead + need) logDropOldest();
+    if (logCount == 0) logTail = logHead;
+}
+
+
+// ----------------------------------------------------------------
+//                        -log a message
+// ----------------------------------------------------------------
+
+void logVPrintf(uint8_t level, const char *fmt, va_list args) {
+    if (level > logLevel) return;
+    logLock();
+    const uint16_t need = (sizeof(logEntry_t) + logLineMax + 3) & ~3;
+    logMakeRoom(need);
+    logEntry_t *e = logAt(logHead);
+    int len = vsnprintf(e->text, logLineMax, fmt, args);
+    if (len < 0) len = 0;
+    if (len > logLineMax - 1) len = logLineMax - 1;          // it was cut short
+    e->size = (sizeof(logEntry_t) + len + 1 + 3) & ~3;
+    e->prev = logLast;
+    e->ms = millis();
+    e->level = level;
+    logLast = logHead;
+    logHead += e->size;
+    logCount++;
+    logMessages++;
+    journalLog(level, e->text, len);                         // also keep it over restarts
+
+    // also send the message to serial
+    if (serialDebug) {
+        char tbuf[24];
+        txPrintf("Log:%s - %s\n", logTime(e, tbuf, sizeof(tbuf)), e->text);         // logtx.h
+    }
+    logUnlock();
+}
+
+
+void logPrintf(uint8_t level, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    logVPrintf(level, fmt, args);
+    va_end(args);
+}
+
+
+// ----------------------------------------------------------------
+//                        -read the log
+// ----------------------------------------------------------------
+// logLock() must be held while reading with logNewest()/logOlder(), the entries are not copied
+
+// newest entry (NULL if the log is empty)
+const logEntry_t *logNewest() {
+    return logCount ? logAt(logLast) : NULL;
+}
+
+
+// entry before this one (NULL if it is the oldest)
+const logEntry_t *logOlder(const logEntry_t *e) {
+    if ((const uint8_t *)e == logArena + logTail) return NULL;
+    return logAt(e->prev);
+}
+
+
+// copy the entries in to buf newest first, one after the other (step through them by e->size), so they can be
+//   sent on without holding the log while the client takes them, returns the bytes copied (those that fit)
+size_t logCopy(uint8_t *buf, size_t len) {
+    size_t used = 0;
+    logLock();
+    for (const logEntry_t *e = logNewest(); e && used + e->size <= len; e = logOlder(e)) {
+        memcpy(buf + used, e, e->size);
+        used += e->size;
+    }
+    logUnlock();
+    return used;
+}
+
+
+// time an entry was logged   e.g. "2026-10-18T12:00:00Z", or the time since the esp32 started "+123.456s"
+const char *logTime(const logEntry_t *e, char *buf, size_t len) {
+    if (year() < 2021) {
+        snprintf(buf, len, "+%u.%03us", e->ms / 1000, e->ms % 1000);
+    } else {
+        time_t t = now() - (millis() - e->ms) / 1000;
+        snprintf(buf, len, "%04d-%02d-%02dT%02d:%02d:%02dZ", year(t), month(t), day(t), hour(t), minute(t), second(t));
+    }
+    return buf;
+}
+
+
+const char *logLevelName(uint8_t level) {
+    switch (level) {
+        case LOG_ERROR: return "error";
+        case LOG_WARN:  return "warning";
+        case LOG_INFO:  return "info";
+        default:        return "debug";
+    }
+}
+
+// ---------------------------------------------- end ----------------------------------------------
@@ -0,0 +1,318 @@
+/**************************************************************************************************
+ *
+ *          Log transport - debug text sent to the serial port, a tcp console or a websocket
+ *
+ *      Debug output (the system log echo, the motion detection diagnostics when serialDebug > 1 and the
+ *      frame dumps) was written straight to the serial port, at 115200 baud each line held up the loop for
+ *      about 90us per character.  It now goes in to a ring (txRingSize bytes) and a background task sends
+ *      it on to:
+ *
+ *          the serial port                              (txSerial)
+ *          a tcp console   e.g.  nc x.x.x.x 23          (txTcpPort)
+ *          a websocket     shown by http://x.x.x.x/console   (txWsPort)
+ *
+ *      Adding text never waits: space in the ring is claimed with an atomic compare and swap on its head so
+ *      several tasks can add text at once without a mutex, the text is copied in and its header written
+ *      last to show it is complete.  If the ring is full the text is dropped and counted.  The tcp console
+ *      and websocket are sent to without waiting as well, text they have no room for is dropped.
+ *
+ *      The websocket handshake is read a little at a time as it arrives, between sending the text, so a
+ *      browser (or anything else) that connects and is slow to send it does not hold up the output.
+ *
+ *      Until txSetup() has started the task (early in setup) text is written to the serial port directly.
+ *
+ **************************************************************************************************/
+
+// usage:   txPrintf("Changed %u out of %u\n", changes, blocks);
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const uint16_t txRingSize = 4096;                // bytes (a power of 2)
+const uint16_t txLineMax = 160;                  // longest text added at once
+bool txSerial = 1;                               // send to the serial port
+const uint16_t txTcpPort = 23;                   // tcp console port (0 = none)
+const uint16_t txWsPort = 81;                    // websocket port (0 = none)
+const uint32_t txPollTime = 10;                  // how often the task checks for text (ms)
+const uint32_t txWsHandshakeTime = 3000;         // a websocket connection which has not sent its request by then is closed (ms)
+//  ------------------------------------------------------------------
+
+#include <stdarg.h>
+#include <WiFi.h>
+#include <lwip/sockets.h>
+#include <mbedtls/sha1.h>
+#include <mbedtls/base64.h>
+
+#define TX_PAD 1                                 // header flag, space skipped at the end of the ring
+
+// forward declarations
+bool txSetup();
+void txWrite(const char *text, size_t len);
+void txPrintf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+String txStatus();
+
+
+static uint8_t txRing[txRingSize] __attribute__((aligned(4)));      // text, each entry has a header: length << 16 | size of entry | TX_PAD
+static uint32_t txHead = 0;                      // space claimed up to (counts up for ever, position = txHead % txRingSize)
+static uint32_t txTail = 0;                      // sent up to
+TaskHandle_t txTaskHandle = NULL;
+WiFiServer *txTcpServer = NULL;
+WiFiServer *txWsServer = NULL;
+WiFiClient txTcpClient;
+WiFiClient txWsClient;
+bool txWsOpen = 0;                               // websocket handshake done
+bool txWsWaiting = 0;                            // websocket connection waiting for its handshake
+uint32_t txWsStarted = 0;                        // millis() when it was accepted
+static char txWsLine[100];                       // line of the handshake request being read (only the start of long ones)
+static uint8_t txWsLineLen = 0;
+static char txWsKey[40];                         // its Sec-WebSocket-Key
+
+// stats
+uint32_t txBytes = 0;                            // bytes added
+uint32_t txDropped = 0;                          // bytes dropped as the ring was full
+uint32_t txTcpDropped = 0;                       // bytes the tcp console had no room for
+uint32_t txWsDropped = 0;                        // bytes the websocket had no room for
+
+
+// ----------------------------------------------------------------
+//                          -add text
+// ----------------------------------------------------------------
+
+void txWrite(const char *text, size_t len) {
+    if (len == 0) return;
+    if (len > txLineMax) len = txLineMax;
+    if (!txTaskHandle) {                                      // not started yet
+        if (txSerial) Serial.write((const uint8_t *)text, len);
+        return;
+    }
+
+    // claim space, with padding if it would go past the end of the ring
+    uint32_t need = (4 + len + 3) & ~3;
+    uint32_t head = __atomic_load_n(&txHead, __ATOMIC_ACQUIRE);
+    uint32_t pad, next;
+    do {
+        uint32_t pos = head & (txRingSize - 1);
+        pad = (pos + need > txRingSize) ? txRingSize - pos : 0;
+        next = head + pad + need;
+        if (next - __atomic_load_n(&txTail, __ATOMIC_ACQUIRE) > txRingSize) {
+            __atomic_add_fetch(&txDropped, len, __ATOMIC_RELAXED);
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(&txHead, &head, next, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    if (pad) __atomic_store_n((uint32_t *)(txRing + (head & (txRingSize - 1))), pad | TX_PAD, __ATOMIC_RELEASE);
+    uint32_t pos = (head + pad) & (txRingSize - 1);
+    memcpy(txRing + pos + 4, text, len);
+    __atomic_store_n((uint32_t *)(txRing + pos), (len << 16) | need, __ATOMIC_RELEASE);      // now it can be sent
+    __atomic_add_fetch(&txBytes, len, __ATOMIC_RELAXED);
+}
+
+
+void txPrintf(const char *fmt, ...) {
+    char buf[txLineMax];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len > 0) txWrite(buf, min((size_t)len, sizeof(buf) - 1));
+}
+
+
+// ----------------------------------------------------------------
+//                     -consoles (tcp/websocket)
+// ----------------------------------------------------------------
+
+// send without waiting, returns bytes sent (-1 if the connection has gone)
+static int txSend(WiFiClient &client, const uint8_t *buf, size_t len) {
+    int sent = send(client.fd(), buf, len, MSG_DONTWAIT);
+    if (sent < 0) return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    return sent;
+}
+
+
+// read what has arrived of the websocket handshake request without waiting for more, returns 1 once the
+//   request has ended (with txWsKey set if it had one)
+static bool txWsRequest(WiFiClient &client) {
+    int c;
+    while (client.available() && (c = client.read()) >= 0) {
+        if (c == '\r') continue;
+        if (c != '\n') {
+            if (txWsLineLen < sizeof(txWsLine) - 1) txWsLine[txWsLineLen++] = c;
+            continue;
+        }
+        if (txWsLineLen == 0) return 1;                       // blank line, end of the request
+        txWsLine[txWsLineLen] = 0;
+        txWsLineLen = 0;
+        if (strncmp(txWsLine, "Sec-WebSocket-Key:", 18) == 0) {
+            const char *key = txWsLine + 18;
+            while (*key == ' ') key++;
+            strlcpy(txWsKey, key, sizeof(txWsKey));
+        }
+    }
+    return 0;
+}
+
+
+// complete the websocket handshake   see https://datatracker.ietf.org/doc/html/rfc6455#section-4.2.2
+static bool txWsHandshake(WiFiClient &client) {
+    if (txWsKey[0] == 0) return 0;
+    String key = String(txWsKey) + "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+    uint8_t hash[20];
+    unsigned char accept[32];
+    size_t len = 0;
+    mbedtls_sha1_ret((const unsigned char *)key.c_str(), key.length(), hash);
+    mbedtls_base64_encode(accept, sizeof(accept) - 1, &len, hash, sizeof(hash));
+    accept[len] = 0;
+    client.print("HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: ");
+    client.print((const char *)accept);
+    client.print("\r\n\r\n");
+    return 1;
+}
+
+
+// new connections replace the one there was
+static void txAccept() {
+    WiFiServer *tcpServer = __atomic_load_n(&txTcpServer, __ATOMIC_ACQUIRE);
+    WiFiServer *wsServer = __atomic_load_n(&txWsServer, __ATOMIC_ACQUIRE);
+    if (tcpServer) {
+        WiFiClient c = tcpServer->available();
+        if (c) {
+            txTcpClient.stop();
+            txTcpClient = c;
+            txTcpClient.setNoDelay(1);
+            txTcpClient.printf("%s %s console\r\n", stitle, sversion);
+        }
+    }
+    if (wsServer) {
+        WiFiClient c = wsServer->available();
+        if (c) {
+            txWsClient.stop();
+            txWsClient = c;
+            txWsOpen = 0;
+            txWsWaiting = 1;
+            txWsStarted = millis();
+            txWsLineLen = 0;
+            txWsKey[0] = 0;
+        }
+    }
+    if (txWsWaiting) {                                        // handshake under way
+        if (txWsRequest(txWsClient)) {
+            txWsOpen = txWsHandshake(txWsClient);
+            if (!txWsOpen) txWsClient.stop();
+            txWsWaiting = 0;
+        } else if ((unsigned long)(millis() - txWsStarted) > txWsHandshakeTime || !txWsClient.connected()) {
+            txWsClient.stop();
+            txWsWaiting = 0;
+        }
+    }
+    if (txWsOpen) {
+        while (txWsClient.available()) txWsClient.read();      // nothing is expected from the browser
+        if (!txWsClient.connected()) txWsOpen = 0;
+    }
+}
+
+
+// send to the consoles which are connected
+static void txToConsoles(uint8_t *frame, size_t len) {
+    const uint8_t *text = frame + 4;                          // room for a websocket frame header in front
+    if (txTcpClient && txTcpClient.connected()) {
+        int sent = txSend(txTcpClient, text, len);
+        if (sent < 0) txTcpClient.stop();
+        else txTcpDropped += len - sent;
+    }
+    if (txWsOpen) {
+        // one unmasked text frame
+        uint8_t *start = frame + 2;
+        start[0] = 0x81;
+        start[1] = len;
+        if (len > 125) {
+            start = frame;
+            start[0] = 0x81;
+            start[1] = 126;
+            start[2] = len >> 8;
+            start[3] = len & 0xFF;
+        }
+        size_t frameLen = text + len - start;
+        int sent = txSend(txWsClient, start, frameLen);
+        if (sent == 0) txWsDropped += len;
+        else if (sent != (int)frameLen) {                     // part of a frame can not be followed by anything else
+            txWsClient.stop();
+            txWsOpen = 0;
+        }
+    }
+}
+
+
+// ----------------------------------------------------------------
+//                       -send the text on
+// ----------------------------------------------------------------
+
+static void txTask(void *) {
+    uint8_t frame[4 + 1024];                                  // websocket header + text
+    for (;;) {
+        txAccept();
+        size_t len = 0;
+        uint32_t head = __atomic_load_n(&txHead, __ATOMIC_ACQUIRE);
+        while (txTail != head) {
+            uint32_t pos = txTail & (txRingSize - 1);
+            uint32_t *hdr = (uint32_t *)(txRing + pos);
+            uint32_t h = __atomic_load_n(hdr, __ATOMIC_ACQUIRE);
+            if (h == 0) break;                                // still being written
+            uint32_t size = h & 0xFFFC;
+            uint32_t textLen = h >> 16;
+            if (!(h & TX_PAD)) {
+                if (len + textLen > sizeof(frame) - 4) break;
+                memcpy(frame + 4 + len, txRing + pos + 4, textLen);
+                len += textLen;
+            }
+            memset(txRing + pos, 0, size);                   // so it is not taken as a header when reused
+            __atomic_store_n(&txTail, txTail + size, __ATOMIC_RELEASE);
+        }
+        if (len == 0) {
+            vTaskDelay(pdMS_TO_TICKS(txPollTime));
+            continue;
+        }
+        if (txSerial) Serial.write(frame + 4, len);
+        txToConsoles(frame, len);
+    }
+}
+
+
+// ----------------------------------------------------------------
+//                          -start it
+// ----------------------------------------------------------------
+// called from setup, the consoles are started once wifi is connected (call it again then), each server is
+//   only handed to the task once it has been started
+
+bool txSetup() {
+    if (!txTaskHandle && xTaskCreate(txTask, "logtx", 4096, NULL, 1, &txTaskHandle) != pdPASS) {
+        Serial.println("Error: Unable to start log transport task");
+        return 0;
+    }
+    if (WiFi.status() == WL_CONNECTED) {
+        if (txTcpPort && !txTcpServer) {
+            WiFiServer *server = new WiFiServer(txTcpPort);
+            server->begin();
+            __atomic_store_n(&txTcpServer, server, __ATOMIC_RELEASE);
+        }
+        if (txWsPort && !txWsServer) {
+            WiFiServer *server = new WiFiServer(txWsPort);
+            server->begin();
+            __atomic_store_n(&txWsServer, server, __ATOMIC_RELEASE);
+        }
+    }
+    return 1;
+}
+
+
+// log transport status for the root web page
+String txStatus() {
+    if (!txDropped && !txTcpDropped && !txWsDropped && !txTcpClient && !txWsOpen) return "";
+    String reply = "Debug output: " + String(txBytes / 1024) + "K";
+    if (txTcpClient) reply += ", tcp console connected";
+    if (txWsOpen) reply += ", websocket connected";
+    if (txDropped || txTcpDropped || txWsDropped)
+        reply += " <font color='#FF0000'>dropped " + String(txDropped) + " bytes (ring full), " + String(txTcpDropped) + " (tcp), " + String(txWsDropped) + " (websocket)</font>";
+    return reply;
+}
+
+// ---------------------------------------------- end ----------------------------------------------
@@ -90,6 +90,13 @@ const byte gioPin = 13;                                // I/O pin (for external
 
 const int8_t MaxSpiffsImages = 6;                      // number of images to store in camera (Spiffs)
 const uint32_t maxCamStreamTime = 20;                  // max camera stream can run for (seconds)
+const uint32_t streamStillTime = 3;                    // stop a motion triggered POST stream once no movement seen for this long (seconds)
+const uint32_t prerollSeconds = 0;                     // seconds of frames from before a trigger to keep (0 = disabled, requires psram) - see preroll.h
+const uint32_t prerollMemory = 1536 * 1024;            // max psram to use for the pre-roll frames (bytes)
+const uint8_t burstFrames = 0;                         // full resolution photos captured per motion trigger (0 or 1 = single photo, requires psram) - see burst.h
+const uint32_t burstMemory = 1024 * 1024;              // psram to use for storing a burst of photos (bytes)
+const uint8_t postBatchFrames = 0;                     // POST stream frames sent per request (0 or 1 = one per request, requires psram) - see batch.h
+const uint32_t postBatchMemory = 384 * 1024;           // psram for each of the two batches of frames (bytes)
 const uint16_t Illumination_led = 4;                   // illumination LED pin
 const byte flashMode = 2;                              // 1=take picture using flash when dark, 2=use flash every time, 3=flash after capturing the image as display only
 bool ioRequiredHighToTrigger = 0;                      // If motion detection only triggers if IO input is also high
@@ -110,10 +117,14 @@ void handleDisable();
 void handleImagedata();
 void handleBootLog();
 void handleImg();
+void handleCatImg();
+void handleJournal();
+void handleConsole();
 bool capturePhotoSaveSpiffs(bool dostream);
-void RestartCamera(pixformat_t format);
+bool RestartCamera(pixformat_t format, camera_grab_mode_t grabMode = CAMERA_GRAB_WHEN_EMPTY);
+bool RestartDetection();
 void RebootCamera(pixformat_t format);
-void saveJpgFrame(bool dostream);
+bool saveJpgFrame(bool dostream);
 void saveGreyscaleFrame(String filesName);
 void ioDetected(bool iostat);
 void MotionDetected(uint16_t changes);
@@ -122,6 +133,7 @@ void handleStrPst();
 void handleJPG();
 void handleTest();
 bool checkCameraIsFree();
+static bool WipeSpiffs();
 // ---------------------------------------------------------------
 
 // global variables / constants
@@ -135,6 +147,7 @@ uint32_t TRIGGERtimer = 0;                 // used for limiting camera motion tr
 uint32_t EMAILtimer = 0;                   // used for limiting rate emails can be sent
 byte DetectionEnabled = 0;                 // flag if motion detection is enabled (0=stopped, 1=enabled, 2=paused)
 String TriggerTime = "Not yet triggered";  // Time of last motion detection as text
+uint32_t TriggerMillis = 0;                // millis() of last motion detection
 uint32_t MaintTiming = millis();           // used for timing maintenance tasks
 bool emailWhenTriggered = 0;               // If emails will be sent when motion detected
 bool ftpImages = 0;                        // if to FTP images up to server (ftp.h)
@@ -153,7 +166,10 @@ int16_t SpiffsFileCounter = 0;             // counter of last image stored
 #include <SD_MMC.h>                        // sd card - see https://randomnerdtutorials.com/esp32-cam-take-photo-save-microsd-card/
 #include <soc/soc.h>                       // Used to disable brownout detection
 #include <soc/rtc_cntl_reg.h>
+#include "logtx.h"                         // debug output to serial/tcp/websocket without waiting
+#include "logring.h"                       // the system log and the LOGx/DBG macros (before anything using them)
 #include "net.h"                           // Load the Wifi / NTP stuff
+#include "journal.h"                       // log messages, boots and motion triggers kept in Spiffs
 void log_requested(String msg, WiFiClient client);
 #include "standard.h"                      // Some standard procedures
 #include "motion.h"                        // Include motion.h file for camera/motion detection code
@@ -165,17 +181,35 @@ Led statusLed1(onboardLED, LOW);             // set up onboard LED (LOW = on) -
     #include "ota.h"                         // Over The Air updates (OTA)
 #endif
 
+#ifdef FTP_ENABLED
+    #include "ftp.h"                         // Include ftp.h file for the ftp of captured images
+#endif
+
+#include "outbound.h"                        // upload priorities and bandwidth limit
+
 #ifdef EMAIL_ENABLED
     #define _SenderName "ESP"                // name of email sender (no spaces)
     #include "email.h"
 #endif
 
-#ifdef FTP_ENABLED
-    #include "ftp.h"                         // Include ftp.h file for the ftp of captured images
+#if POST_ENABLED
+    #include "post.h"                        // Include php.h file for sending images via POST (can use a PHP script)
 #endif
 
+#include "settings.h"                        // settings kept in nvs
+#include "warmstate.h"                       // motion detection state kept over a restart in rtc memory
+#include "imgstore.h"                        // stored images kept in a flash partition
+#include "catalog.h"                         // list of the stored images
+#include "sdcard.h"                          // sd card folders and writing
+#include "retention.h"                       // remove the oldest images before the sd card fills up
+#include "sinks.h"                           // save/send images in the background
 #if POST_ENABLED
-    #include "post.h"                        // Include php.h file for sending images via POST (can use a PHP script)
+    #include "spool.h"                       // keep images which failed to POST and send them later
+#endif
+#include "preroll.h"                         // keep frames from before motion is detected
+#include "burst.h"                           // capture several photos per trigger
+#if POST_ENABLED
+    #include "batch.h"                       // send stream frames several per request
 #endif
 
 
@@ -205,201 +239,13 @@ void BlinkLed(byte Bcount) {
 }
 
 // ----------------------------------------------------------------
-//              Load settings from text file in Spiffs
-// ----------------------------------------------------------------
-// read a line of text from Spiffs file and parse an integer from it
-//     I realise this is complicating things for no real benefit but I wanted to learn to use pointers ;-)
-static void ReadLineSpiffs(File* file, String* line, uint16_t* tnum) {
-    File tfile = *file;
-    String tline = *line;
-    tline = tfile.readStringUntil('\n');
-    *tnum = tline.toInt();
-}
-
-static void LoadSettingsSpiffs() {
-    String TFileName = "/settings.txt";
-    if (!SPIFFS.exists(TFileName)) {
-        log_system_message("Settings file not found on Spiffs");
-        return;
-    }
-    File file = SPIFFS.open(TFileName, "r");
-    if (!file || file.isDirectory()) {
-        log_system_message("Unable to open settings file from Spiffs");
-        return;
-    }
-
-    log_system_message("Loading settings from Spiffs");
-
-    // read contents of file
-    String line;
-    uint16_t tnum;
-
-    ReadLineSpiffs(&file, &line, &tnum);      // ignore first line as it is just a title
-
-    // line 1 - Block_threshold
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum < 1 || tnum > 255) log_system_message("invalid Block_threshold in settings");
-    else Block_threshold = tnum;
-
-    // line 2 - min Image_thresholdL
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum < 0 || tnum > 255) log_system_message("invalid min_day_image_threshold in settings");
-    else Image_thresholdL = tnum;
-
-    // line 3 - min Image_thresholdH
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum < 0 || tnum > 255) log_system_message("invalid max_day_image_threshold in settings");
-    else Image_thresholdH = tnum;
-
-    // line 4 - target brightness level
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum < 0 || tnum > 255) log_system_message("invalid night/night brightness cuttoff in settings");
-    else targetBrightness = tnum;
-
-    // line 5 - emailWhenTriggered
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum == 0) emailWhenTriggered = 0;
-    else if (tnum == 1) emailWhenTriggered = 1;
-    else log_system_message("Invalid emailWhenTriggered in settings: " + line);
-
-    // line 6 - TriggerLimitTime
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum < 1 || tnum > 3600) log_system_message("invalid TriggerLimitTime in settings");
-    else TriggerLimitTime = tnum;
-
-    // line 7 - DetectionEnabled
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum == 2) tnum = 1;     // if it was paused restart it
-    if (tnum == 0) DetectionEnabled = 0;
-    else if (tnum == 1) DetectionEnabled = 1;
-    else log_system_message("Invalid DetectionEnabled in settings: " + line);
-
-    // line 8 - EmailLimitTime
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum < 60 || tnum > 10000) log_system_message("invalid EmailLimitTime in settings");
-    else EmailLimitTime = tnum;
-
-    // line 9 - UseFlash
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum == 0 || tnum == 1) UseFlash = (bool)tnum;
-    else log_system_message("Invalid UseFlash in settings: " + line);
-
-    // line 10 - SpiffsFileCounter
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum > MaxSpiffsImages) log_system_message("invalid SpiffsFileCounter in settings");
-    else SpiffsFileCounter = tnum;
-
-    // line 11 - cameraImageExposure
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum < 0 || tnum > 1200) log_system_message("invalid exposure in settings");
-    else cameraImageExposure = tnum;
-
-    // line 12 - cameraImageGain
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum > 31) log_system_message("invalid gain in settings");
-    else cameraImageGain = tnum;
-
-    // line 13 - tCounterTrigger
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum > 31) log_system_message("invalid consecutive detections in settings");
-    else tCounterTrigger = tnum;
-
-    // line 14 - ftpImages
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum == 0) ftpImages = 0;
-    else if (tnum == 1) ftpImages = 1;
-    else log_system_message("Invalid FTP in settings: " + line);
-
-    // line 15 - PostImages
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum == 0) PostImages = 0;
-    else if (tnum == 1) PostImages = 1;
-    else log_system_message("Invalid Post in settings: " + line);
-
-    // line 16 - cameraImageInvert
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum == 0) cameraImageInvert = 0;
-    else if (tnum == 1) cameraImageInvert = 1;
-    else log_system_message("Invalid cameraImageInvert in settings: " + line);
-
-    // line 17 - dataRefresh
-    ReadLineSpiffs(&file, &line, &tnum);
-    if (tnum < 1 || tnum > 600) log_system_message("invalid dataRefresh in settings");
-    else dataRefresh = tnum;
-
-    // Detection mask grid
-    bool gerr = 0;
-    mask_active = 0;
-    for (int y = 0; y < mask_rows; y++) {
-        for (int x = 0; x < mask_columns; x++) {
-            ReadLineSpiffs(&file, &line, &tnum);
-            if (tnum == 1) {
-                mask_frame[x][y] = 1;
-                mask_active ++;
-            }
-            else if (tnum == 0) mask_frame[x][y] = 0;
-            else gerr = 1;    // flag invalid entry
-        }
-    }
-    if (gerr) log_system_message("invalid mask entry in settings");
-    file.close();
-}
-
-// ----------------------------------------------------------------
-//              Save settings to a text file in Spiffs
+//                     Update boot log - journal
 // ----------------------------------------------------------------
-static void SaveSettingsSpiffs() {
-    String TFileName = "/settings.txt";
-    SPIFFS.remove(TFileName);   // delete old file if present
-    File file = SPIFFS.open(TFileName, "w");
-    if (!file) {
-        log_system_message("Unable to open settings file in Spiffs");
-        return;
-    }
-
-    // save settings in to file
-    file.println("CameraWifiMotion settings file " + currentTime(1));   // title
-    file.println(String(Block_threshold));
-    file.println(String(Image_thresholdL));
-    file.println(String(Image_thresholdH));
-    file.println(String(targetBrightness));
-    file.println(String(emailWhenTriggered));
-    file.println(String(TriggerLimitTime));
-    file.println(String(DetectionEnabled));
-    file.println(String(EmailLimitTime));
-    file.println(String(UseFlash));
-    file.println(String(SpiffsFileCounter));
-    file.println(String(cameraImageExposure));
-    file.println(String(cameraImageGain));
-    file.println(String(tCounterTrigger));
-    file.println(String(ftpImages));
-    file.println(String(PostImages));
-    file.println(String(cameraImageInvert));
-    file.println(String(dataRefresh));
-
-    // Detection mask grid
-    for (int y = 0; y < mask_rows; y++) {
-        for (int x = 0; x < mask_columns; x++) {
-            file.println(String(mask_frame[x][y]));
-        }
-    }
-    file.close();
-}
-
-// ----------------------------------------------------------------
-//                     Update boot log - Spiffs
-// ----------------------------------------------------------------
-// keeps a log of esp32 startups along with reasons why it was restarted
+// keeps a log of esp32 startups along with reasons why it was restarted (as JRN_BOOT records in the journal)
 static void UpdateBootlogSpiffs(String Info) {
-    if (serialDebug) Serial.println("Updating bootlog: " + Info);
-    String TFileName = "/bootlog.txt";
-    File file = SPIFFS.open(TFileName, FILE_APPEND);
-    if (!file || file.isDirectory()) {
-        log_system_message("Error: Unable to open boot log in Spiffs");
-    } else {
-        file.println(currentTime(1) + " - " + Info);       // add entry to log file
-        file.close();
-    }
+    DBG("Updating bootlog: %s\n", Info.c_str());
+    journalWrite(JRN_BOOT, LOG_INFO, Info.c_str(), Info.length());
+    journalFlush();                                     // often just before a restart
 }
 
 // ----------------------------------------------------------------
@@ -417,7 +263,7 @@ static bool WipeSpiffs() {
     SpiffsFileCounter = 0;
     TriggerTime = "Not since Spiffs wiped";
     UpdateBootlogSpiffs("Spiffs Wiped");                           // store event in bootlog file
-    SaveSettingsSpiffs();                                          // save settings in Spiffs
+    settingsSave();                                                    // save settings in nvs
     return 1;
 }
 
@@ -437,6 +283,7 @@ void setup() {
         Serial.println("---------------------------------------");
         // Serial.setDebugOutput(true);                       // enable extra diagnostic info on serial port
     }
+    txSetup();                                             // debug output sent on by a background task (logtx.h)
 
     // Spiffs - see: https://circuits4you.com/2018/01/31/example-of-esp8266-flash-file-system-spiffs/
     if (!SPIFFS.begin(true)) {
@@ -446,12 +293,11 @@ void setup() {
         delay(5000);
     } else {
         //delay(500);
-        if (serialDebug) {
-            Serial.print(("SPIFFS mounted successfully: "));
-            Serial.printf("total bytes: %d , used: %d \n", SPIFFS.totalBytes(), SPIFFS.usedBytes());
-        }
-        LoadSettingsSpiffs();     // Load settings from text file in Spiffs
+        DBG("SPIFFS mounted successfully: total bytes: %u , used: %u\n", (unsigned)SPIFFS.totalBytes(), (unsigned)SPIFFS.usedBytes());
+        journalSetup();           // find the end of the journal in Spiffs
+        settingsLoad();           // Load settings from nvs (or the old settings.txt in Spiffs)
     }
+    imgStoreSetup();                              // flash partition for the stored images (see imgstore.h)
 
     // sd card
     SD_Present = 0;
@@ -469,6 +315,8 @@ void setup() {
           SD_Present = 1;                           // flag working sd card found
         }
     }
+    catalogSetup();                               // list of stored images (index file on sd card or Spiffs)
+    retentionSetup();                             // removes the oldest images from the sd card
 #if POST_ENABLED
     int pp = PostServerName.indexOf(":");
     if(pp != -1) {
@@ -476,6 +324,10 @@ void setup() {
         PostServerName.remove(pp);
     }
     log_system_message("Will post images to " + PostServerName + ":" +String(PostServerPort));
+    dnsPrefetch(PostServerName.c_str());     // keep the servers addresses ready in the dns cache
+#endif
+#ifdef FTP_ENABLED
+    dnsPrefetch(ftp_server);
 #endif
 
     // configure the flash/illumination LED
@@ -492,6 +344,7 @@ void setup() {
     digitalWrite(onboardLED, HIGH);   // off
 
     startWifiManager();                      // Connect to wifi (procedure is in wifi.h)
+    txSetup();                               // start the tcp/websocket consoles
     WiFi.mode(WIFI_STA);     // turn off access point - options are WIFI_AP, WIFI_STA, WIFI_AP_STA or WIFI_OFF
 
     // set up web page request handling
@@ -505,7 +358,10 @@ void setup() {
     server.on("/capture", handleCapture);    // capture an image
     server.on("/images", handleImages);      // display images
     server.on("/img", handleImg);            // latest captured image
-    server.on("/bootlog", handleBootLog);    // display boot log (stored in Spiffs)
+    server.on("/catimg", handleCatImg);      // image from the catalog (flash or sd card)
+    server.on("/bootlog", handleBootLog);    // display boot log (from the journal)
+    server.on("/journal", handleJournal);    // download the journal (see misc/journal/jrndump.cpp)
+    server.on("/console", handleConsole);    // debug output via a websocket (logtx.h)
     server.on("/imagedata", handleImagedata);// show raw image data
     server.on("/stream", handleStream);      // stream live image
     server.on("/strpst", handleStrPst);      // Post stream live image
@@ -522,17 +378,28 @@ void setup() {
     if (!psramFound()) log_system_message("Warning: No PSRam detected - will limit size of images");
 
     // start web server
-    if (serialDebug) Serial.println(("Starting web server"));
+    DBG("Starting web server\n");
     server.begin();
 
     // set up camera
-    bool tRes = setupCameraHardware(PIXFORMAT_GRAYSCALE);
+    sinksSetup();                                              // tasks which save/send captured images
+#if POST_ENABLED
+    spoolSetup();
+#endif
+    prerollSetup();                                            // psram for the pre-roll and bursts is allocated before the camera frame buffers
+    burstSetup();
+#if POST_ENABLED
+    batchSetup();
+#endif
+    warmRestore();                                             // exposure, gain and the last frame from before a restart
+    bool tRes = setupCameraHardware(detectionFormat, CAMERA_GRAB_LATEST);
+    if (tRes && detectionFormat == PIXFORMAT_JPEG) tRes = cameraFrameSize(FRAME_SIZE_PREROLL);
     if (!tRes) {      // reboot camera
         delay(500);
-        if (serialDebug) Serial.println("Problem starting camera - rebooting it");
-        RestartCamera(PIXFORMAT_GRAYSCALE);                    // restart camera back to greyscale mode for motion detection
+        LOGW("Problem starting camera - rebooting it");
+        RestartDetection();                                    // restart camera back to motion detection mode
     } else {
-        if (serialDebug) Serial.println(("Camera initialised ok"));
+        DBG("Camera initialised ok\n");
     }
 
     // Finished connecting to network
@@ -544,6 +411,7 @@ void setup() {
     UpdateBootlogSpiffs("Booted");                   // store time of boot in bootlog
 
     TRIGGERtimer = millis();                         // reset the retrigger timer to stop instant triggering of motion detection
+    if (warmRestored) TRIGGERtimer -= TriggerLimitTime * 1000;      // the frame to compare with is known so it can trigger straight away
 
     log_system_message("Setup complete");
 }
@@ -585,7 +453,7 @@ void handleDefault() {
             mask_frame[x][y] = 1;
     mask_active = 12;
 
-    SaveSettingsSpiffs();                      // save settings in Spiffs
+    settingsSave();                                // save settings in nvs
     TRIGGERtimer = millis();                   // reset last image captured timer (to prevent instant trigger)
 
     String message = "reset to default";
@@ -604,19 +472,19 @@ void rootButtons() {
     if (server.hasArg("email")) {
         if(log_state("Email when motion detected ", emailWhenTriggered = !emailWhenTriggered))
             EMAILtimer = 0;
-        SaveSettingsSpiffs();     // save settings in Spiffs
+        settingsSave();     // save settings in nvs
     }
 
     // FTP was clicked -  FTP images when triggered
     if (server.hasArg("ftp")) {
         log_state("FTP when motion detected ", ftpImages = !ftpImages);
-        SaveSettingsSpiffs();     // save settings in Spiffs
+        settingsSave();     // save settings in nvs
     }
 
     // Post was clicked -  send images via POST upload
     if (server.hasArg("post")) {
         log_state("POST when motion detected ", PostImages = !PostImages);
-        SaveSettingsSpiffs();     // save settings in Spiffs
+        settingsSave();     // save settings in nvs
     }
 
    // if wipeS was entered  - clear Spiffs
@@ -638,7 +506,7 @@ void rootButtons() {
         if (val >= 0 && val < 256 && val != targetBrightness) {
           log_system_message("Target brightness changed to " + Tvalue );
           targetBrightness = val;
-          SaveSettingsSpiffs();     // save settings in Spiffs
+          settingsSave();     // save settings in nvs
         }
     }
 
@@ -649,7 +517,7 @@ void rootButtons() {
         if (val > 0 && val < 256 && val != Block_threshold) {
             log_system_message("Block_threshold changed to " + Tvalue );
             Block_threshold = val;
-            SaveSettingsSpiffs();     // save settings in Spiffs
+            settingsSave();     // save settings in nvs
         }
     }
 
@@ -660,7 +528,7 @@ void rootButtons() {
         if (val >= 0 && val < 192 && val != Image_thresholdL) {
             log_system_message("Min_day_image_threshold changed to " + Tvalue );
             Image_thresholdL = val;
-            SaveSettingsSpiffs();     // save settings in Spiffs
+            settingsSave();     // save settings in nvs
         }
     }
 
@@ -671,7 +539,7 @@ void rootButtons() {
         if (val > 0 && val <= 192 && val != Image_thresholdH) {
             log_system_message("Max_day_image_threshold changed to " + Tvalue );
             Image_thresholdH = val;
-            SaveSettingsSpiffs();     // save settings in Spiffs
+            settingsSave();     // save settings in nvs
         }
     }
 
@@ -684,7 +552,7 @@ void rootButtons() {
             if (val >= 0 && val <= 1200 && val != cameraImageExposure) {
               log_system_message("Camera exposure changed to " + Tvalue );
               cameraImageExposure = val;
-              SaveSettingsSpiffs();         // save settings in Spiffs
+              settingsSave();                   // save settings in nvs
               TRIGGERtimer = millis();      // reset last image captured timer (to prevent instant trigger)
             }
         }
@@ -698,7 +566,7 @@ void rootButtons() {
             if (val >= 0 && val <= 31 && val != cameraImageGain) {
                 log_system_message("Camera gain changed to " + Tvalue );
                 cameraImageGain = val;
-                SaveSettingsSpiffs();        // save settings in Spiffs
+                settingsSave();                  // save settings in nvs
                 TRIGGERtimer = millis();     // reset last image captured timer (to prevent instant trigger)
             }
         }
@@ -713,7 +581,7 @@ void rootButtons() {
             if (val > 0 && val <= 600 && val != dataRefresh) {
                 log_system_message("Date refresh rate changed to " + Tvalue );
                 dataRefresh = val;
-                SaveSettingsSpiffs();        // save settings in Spiffs
+                settingsSave();                  // save settings in nvs
                 TRIGGERtimer = millis();     // reset last image captured timer (to prevent instant trigger)
             }
         }
@@ -727,7 +595,7 @@ void rootButtons() {
 //            if (val >= -2 && val <= 2 && val != cameraImageBrightness) {
 //              log_system_message("Camera brightness changed to " + Tvalue );
 //              cameraImageBrightness = val;
-//              SaveSettingsSpiffs();        // save settings in Spiffs
+//              settingsSave();                  // save settings in nvs
 //              TRIGGERtimer = millis();     // reset last image captured timer (to prevent instant trigger)
 //            }
 //          }
@@ -741,7 +609,7 @@ void rootButtons() {
 //            if (val >= -2 && val <= 2 && val != cameraImageContrast) {
 //              log_system_message("Camera contrast changed to " + Tvalue );
 //              cameraImageContrast = val;
-//              SaveSettingsSpiffs();        // save settings in Spiffs
+//              settingsSave();                  // save settings in nvs
 //              TRIGGERtimer = millis();     // reset last image captured timer (to prevent instant trigger)
 //            }
 //          }
@@ -754,7 +622,7 @@ void rootButtons() {
         if (server.hasArg("invert")) tStore = 1;
         if (tStore != cameraImageInvert) {     // value has changed
             cameraImageInvert = tStore;
-            SaveSettingsSpiffs();
+            settingsSave();
             log_system_message("Invert image changed to " + String(cameraImageInvert));
         }
     }
@@ -779,7 +647,7 @@ void rootButtons() {
         }
         if (maskChanged) {
             Image_thresholdH = mask_active * blocksPerMaskUnit;      // reset max trigger setting to max possible
-            SaveSettingsSpiffs();                                       // save settings in Spiffs
+            settingsSave();                                                 // save settings in nvs
             log_system_message("Detection mask updated");
         }
     }
@@ -791,7 +659,7 @@ void rootButtons() {
         if (val > 59 && val < 10000 && val != EmailLimitTime) {
             log_system_message("EmailLimitTime changed to " + Tvalue + " seconds");
             EmailLimitTime = val;
-            SaveSettingsSpiffs();     // save settings in Spiffs
+            settingsSave();     // save settings in nvs
         }
     }
 
@@ -802,7 +670,7 @@ void rootButtons() {
         if (val > 0 && val < 3600 && val != TriggerLimitTime) {
             log_system_message("Triggertime changed to " + Tvalue + " seconds");
             TriggerLimitTime = val;
-            SaveSettingsSpiffs();     // save settings in Spiffs
+            settingsSave();     // save settings in nvs
         }
     }
 
@@ -813,7 +681,7 @@ void rootButtons() {
         if (val > 0 && val <= 100 && val != tCounterTrigger) {
             log_system_message("Consecutive detections required changed to " + Tvalue);
             tCounterTrigger = val;
-            SaveSettingsSpiffs();     // save settings in Spiffs
+            settingsSave();     // save settings in nvs
         }
     }
 
@@ -838,7 +706,7 @@ void rootButtons() {
     // if button "flash" was pressed  - toggle flash enabled
     if (server.hasArg("flash")) {
         log_state("Flash ", UseFlash = !UseFlash);
-        SaveSettingsSpiffs();     // save settings in Spiffs
+        settingsSave();     // save settings in nvs
     }
 
     // if button "toggle motion detection" was pressed
@@ -849,7 +717,7 @@ void rootButtons() {
         } else {
             digitalWrite(onboardLED, HIGH);   // indicator led off
         }
-        SaveSettingsSpiffs();                                     // save settings in Spiffs
+        settingsSave();                                               // save settings in nvs
     }
 }   // root buttons
 
@@ -876,6 +744,8 @@ void handleRoot() {
     client.println("<br><span id='ul3'></span>");
     client.println("<br><span id='ul4'></span>");
     client.println("<br><span id='ul5'></span>");
+    client.println("<br><span id='ul6'></span>");
+    client.println("<br><span id='ul7'></span>");
 
     // Javascript - to periodically update the above info lines from http://x.x.x.x/data
 
@@ -1051,6 +921,11 @@ void handleData(){
     reply += "Image brightness: " + String(AveragePix);
     reply += " - Exposure: " + String((int)cameraImageExposure);
     reply += " - Gain: " +String((int)cameraImageGain);
+    reply += " - Frame buffers: " + String(camFrameBuffers);
+    if (camFpsTime[CAMERA_GRAB_LATEST]) reply += " - Stream: " + String(camFps(CAMERA_GRAB_LATEST), 1) + "fps";
+    if (camFpsTime[CAMERA_GRAB_WHEN_EMPTY]) reply += " - Fifo: " + String(camFps(CAMERA_GRAB_WHEN_EMPTY), 1) + "fps";
+    if (burstEnabled) reply += " - Burst: " + String(burstInterval) + "ms apart, " + String(burstLatency) + "ms from trigger";
+    if (preroll.size()) reply += " - Pre-roll: " + String(preroll.count()) + " frames " + String(preroll.used() / 1024) + "K " + String(prerollFps(), 1) + "fps";
     reply += ",";
 
     // line4 - sd card
@@ -1086,6 +961,36 @@ void handleData(){
 
     //  if system disabled
     if (disableAllFunctions) reply += " {<font color='#FF0000'>ALL FUNCTIONS DISABLED</font>}&ensp;";
+    reply += ",";
+
+    // line6 - image sinks
+    reply += sinksStatus();
+    reply += ",";
+
+    // line7 - image store, POST / FTP uploads and emails
+#if POST_ENABLED
+    String batchLine = "";
+    if (batchSent) batchLine = "Batched stream: " + String(batchSent) + " requests, " + String(batchFramesSent / batchSent) + " frames per request, stream waited " + String(batchWaitTime) + "ms for uploads";
+#endif
+    String lines[] = {
+        settingsStatus(), warmStatus(), journalStatus(), txStatus(), imgStoreStatus(), catalogStatus(), sdStatus(), retentionStatus(),
+#if POST_ENABLED
+        postStatus(), batchLine, spoolStatus(),
+#endif
+#ifdef FTP_ENABLED
+        ftpStatus(),
+#endif
+#ifdef EMAIL_ENABLED
+        emailStatus(),
+#endif
+        dnsStatus(), outboundStatus()};
+    bool first = 1;
+    for (String &line : lines) {
+        if (line == "") continue;
+        if (!first) reply += "<br>";
+        reply += line;
+        first = 0;
+    }
 
     server.send(200, "text/plain", reply); //Send millis value only to client ajax request
 }
@@ -1141,7 +1046,7 @@ void handleImages(){
     if (server.hasArg("button")) {
         String Bvalue = server.arg("button");   // read value
         int val = Bvalue.toInt();
-        if (serialDebug) Serial.println("Button " + Bvalue + " was pressed");
+        DBG("Button %s was pressed\n", Bvalue.c_str());
         ImageToShow = val;     // select which image to display when /img called
     }
 
@@ -1165,17 +1070,26 @@ void handleImages(){
         client.printf("' name='button' value='%d' type='submit'>\n", i);
     }
 
-    // Insert image time info. from text file
-    String TFileName = "/" + String(ImageToShow) + ".txt";
-    File file = SPIFFS.open(TFileName, "r");
-    if (!file || file.isDirectory()) {
-        client.printf("%s<BR>File not found%s\n", colRed, colEnd);
+    // Insert image time info. from the image store or text file
+    imgRecord_t rec;
+    if (imgStoreReady()) {
+        if (!imgStoreFind(String(ImageToShow), &rec)) {
+            client.printf("%s<BR>Image not found%s\n", colRed, colEnd);
+        } else {
+            client.print("<BR>" + (rec.h.time ? currentTime(1, rec.h.time) : String("Time Unknown")) + "\n");
+        }
     } else {
-        String line = file.readStringUntil('\n');      // read first line of text file
-        tstr = "<BR>" + line + "\n";
-        client.print(tstr);
+        String TFileName = "/" + String(ImageToShow) + ".txt";
+        File file = SPIFFS.open(TFileName, "r");
+        if (!file || file.isDirectory()) {
+            client.printf("%s<BR>File not found%s\n", colRed, colEnd);
+        } else {
+            String line = file.readStringUntil('\n');      // read first line of text file
+            tstr = "<BR>" + line + "\n";
+            client.print(tstr);
+        }
+        file.close();
     }
-    file.close();
 
     // button to show small version of image in popup window
     client.printf("%s<BR><a href='#' id='stdLink' target='popup' onclick=\"window.open('/img?pic=%d'", colBlue, (ImageToShow + 100));
@@ -1184,8 +1098,30 @@ void handleImages(){
     // insert image in to html
     client.printf("<BR><img id='img' alt='Camera Image' onerror='QpageRefresh();' width='%d%s' src='/img?pic=%d'>\n", ImageWidthSetting, "%", ImageToShow);
 
-    // close html page
     client.write("</form>");                            // buttons
+
+    // list of the images in the catalog, newest first (catalog.h)
+    const uint16_t perPage = 40;
+    uint32_t page = server.hasArg("page") ? server.arg("page").toInt() : 0;
+    if (catalogLast()) {
+        client.printf("<H2>Image Catalog</H2>\n<table><tr><th>No.</th><th>Time</th><th>Name</th><th>Size</th><th>Motion</th><th>Stored</th></tr>\n");
+        uint32_t newest = (page * perPage < catalogLast()) ? catalogLast() - page * perPage : 0;
+        catEntry_t e;
+        for (uint32_t seq = newest; seq > 0 && seq + perPage > newest && seq >= catalogFirst(); seq--) {
+            if (!catalogGet(seq, &e)) continue;
+            bool inFlash = catalogInFlash(e);
+            if (!inFlash && !(e.where & CAT_SD)) continue;
+            client.printf("<tr><td><a href='/catimg?seq=%u'>%u</a></td>", e.seq, e.seq);
+            client.print("<td>" + (e.time ? currentTime(1, e.time) : String("Time Unknown")) + "</td>");
+            client.printf("<td>%s</td><td>%uK</td><td>%u</td><td>%s%s</td></tr>\n", e.name, e.size / 1024, e.score,
+                          inFlash ? "flash " : "", (e.where & CAT_SD) ? "sd" : "");
+        }
+        client.write("</table>\n");
+        if (page > 0) client.printf("<a href='/images?page=%u'>newer</a> ", page - 1);
+        if (newest > perPage && newest - perPage >= catalogFirst()) client.printf("<a href='/images?page=%u'>older</a>", page + 1);
+    }
+
+    // close html page
     webfooter(client);                                  // html page footer
     delay(3);
     client.stop();
@@ -1278,7 +1214,16 @@ void handleImagedata() {
 // ----------------------------------------------------------------
 //   -bootlog web page requested    i.e. http://x.x.x.x/bootlog
 // ----------------------------------------------------------------
-// display boot log from Spiffs
+// display the boot records from the journal
+static bool bootLogLine(const jrnRecord_t &r, const uint8_t *data, void *ctx) {
+    if (r.type != JRN_BOOT) return 1;
+    WiFiClient *client = (WiFiClient *)ctx;
+    if (r.time) client->print(currentTime(1, r.time));
+    else client->printf("+%us", r.ms / 1000);
+    client->printf(" - boot %u - %.*s<BR>\n", r.boot, r.len, (const char *)data);
+    return 1;
+}
+
 void handleBootLog() {
     WiFiClient client = server.client();          // open link with client
     log_requested("Boot log page", client);
@@ -1286,18 +1231,9 @@ void handleBootLog() {
 
     // build the html for /bootlog page
     client.write("<P>\n<br>SYSTEM BOOT LOG<br><br>\n");
-    // show contents of bootlog.txt in Spiffs
-    File file = SPIFFS.open("/bootlog.txt", "r");
-    if (!file || file.isDirectory()) {
+    if (!journalEach(bootLogLine, &client)) {
         client.printf("%sNo Boot Log Available%s <BR>\n", colRed, colEnd);
-    } else {
-        String line;
-        while(file.available()){
-            line = file.readStringUntil('\n');      // read first line of text file
-            client.print(line + "<BR>\n");
-        }
     }
-    file.close();
     client.write("<BR><BR>");
     // close html page
     webfooter(client);                                            // html page footer
@@ -1305,6 +1241,66 @@ void handleBootLog() {
     client.stop();
 }
 
+// ----------------------------------------------------------------
+//   -journal requested    i.e. http://x.x.x.x/journal
+// ----------------------------------------------------------------
+// the journal segments as they are in Spiffs, decode with misc/journal/jrndump.cpp
+void handleJournal() {
+    WiFiClient client = server.client();          // open link with client
+    log_requested("Journal", client);
+    client.print("HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+                 "Content-Disposition: attachment; filename=camera.jrn\r\nConnection: close\r\n\r\n");
+    journalSend(client);
+    delay(3);
+    client.stop();
+}
+
+// ----------------------------------------------------------------
+//     -console web page requested    i.e. http://x.x.x.x/console
+// ----------------------------------------------------------------
+
+void handleConsole() {
+    WiFiClient client = server.client();
+    log_requested("Console", client);
+    webheader(client);
+    client.printf("<P><br>CONSOLE (websocket port %u)<br><br>\n", txWsPort);
+    client.print("<pre id='con' style='height:70vh;overflow:auto;text-align:left'></pre>\n"
+                 "<script>\n"
+                 "  const con = document.getElementById('con');\n"
+                 "  function connect() {\n"
+                 "    const ws = new WebSocket('ws://' + location.hostname + ':" + String(txWsPort) + "/');\n"
+                 "    ws.onmessage = e => {\n"
+                 "      const end = con.scrollTop + con.clientHeight >= con.scrollHeight - 5;\n"
+                 "      con.textContent = (con.textContent + e.data).slice(-50000);\n"
+                 "      if (end) con.scrollTop = con.scrollHeight;\n"
+                 "    };\n"
+                 "    ws.onclose = () => setTimeout(connect, 2000);\n"
+                 "  }\n"
+                 "  connect();\n"
+                 "</script>\n");
+    webfooter(client);
+    delay(3);
+    client.stop();
+}
+
+
+// ----------------------------------------------------------------
+//                -send an image from the image store
+// ----------------------------------------------------------------
+static void sendStoredImage(const imgRecord_t &rec) {
+    uint8_t buf[1024];
+    server.setContentLength(rec.h.len);
+    server.send(200, "image/jpeg", "");
+    for (uint32_t pos = 0; pos < rec.h.len; pos += sizeof(buf)) {
+        size_t n = min((uint32_t)sizeof(buf), rec.h.len - pos);
+        if (!imgStoreRead(rec, pos, buf, n)) {                // overwritten by a new image meanwhile
+            LOGE("Error sending stored image %s", rec.h.name);
+            break;
+        }
+        server.sendContent((const char *)buf, n);
+    }
+}
+
 // ----------------------------------------------------------------
 //  last stored image page requested     i.e. http://x.x.x.x/img
 // ----------------------------------------------------------------
@@ -1321,70 +1317,116 @@ void handleImg() {
     }
     if (ImageToShow == 0) ImageToShow = SpiffsFileCounter;   // set to most recent image
 
-    String TFileName = "/" + String(ImageToShow) + JPGX;
+    String ImageName = String(ImageToShow);
 
     if (ImageToShow > 100) {               // show small image    e.g. 101 = '1s.jpg'
         ImageToShow = ImageToShow - 100;
-        TFileName = "/" + String(ImageToShow) + "s.jpg";
+        ImageName = String(ImageToShow) + "s";
     }
+    String TFileName = "/" + ImageName + JPGX;
 
     if (ImageToShow == (MaxSpiffsImages + 1)) {           // live greyscale image requested ("grey")
-        saveGreyscaleFrame("grey");                         // capture live greyscale image
-        TFileName = "/grey.jpg";
+        handleJPG();                                        // send live greyscale image
+        return;
     } else {
       log_system_message("Displaying stored image: " + String(ImageToShow));
     }
 
+    // send image from the image store
+    if (imgStoreReady()) {
+        imgRecord_t rec;
+        if (!imgStoreFind(ImageName, &rec)) {
+            LOGE("Error reading %s from the image store", ImageName.c_str());
+            server.send(404, "text/plain", "Image not found");
+            return;
+        }
+        sendStoredImage(rec);
+        return;
+    }
+
     // send image file
     File f = SPIFFS.open(TFileName, "r");                         // read file from spiffs
     if (!f) {
-        if (serialDebug) {
-          Serial.println("Error reading " + TFileName);
-        }
+        LOGE("Error reading %s", TFileName.c_str());
     } else {
         size_t sent = server.streamFile(f, "image/jpeg");     // send file to web page
-        if (!sent && serialDebug) {
-            Serial.println("Error sending " + TFileName);
-        }
+        if (!sent) LOGE("Error sending %s", TFileName.c_str());
         f.close();
     }
 }
 
 // ----------------------------------------------------------------
-//        capture images - store in Spiffs/SD card and FTP
+//   image from the catalog requested     i.e. http://x.x.x.x/catimg?seq=123
 // ----------------------------------------------------------------
-// check file saved to spiffs ok - by making sure file exists and is greater than 100 bytes
-bool checkPhoto(fs::FS &fs, String IFileName) {
-    File f_pic = fs.open( IFileName );
-    uint16_t pic_sz = f_pic.size();
-    bool tres = ( pic_sz > 100 );
-    if (!tres) log_system_message("Error: Problem detected verifying image stored in Spiffs");
-    f_pic.close();
-    return (tres);
+// sent from the image store if it still has it, otherwise from the sd card
+void handleCatImg() {
+    catEntry_t e;
+    uint32_t seq = server.hasArg("seq") ? server.arg("seq").toInt() : catalogLast();
+    if (!catalogGet(seq, &e)) {
+        server.send(404, "text/plain", "Image not in the catalog");
+        return;
+    }
+    imgRecord_t rec;
+    if ((e.where & CAT_FLASH) && imgStoreFind(e.slot, &rec) && rec.h.seq == e.flashSeq) {
+        sendStoredImage(rec);
+        return;
+    }
+    File f;
+    if ((e.where & CAT_SD) && SD_Present) {
+        f = SD_MMC.open(sdFileName(e.name), "r");
+        if (!f) {                                                 // saved before there was a folder for each hour
+            String FileName = "/" + String(e.name) + JPGX;
+            FileName.replace(":", "_");
+            f = SD_MMC.open(FileName, "r");
+        }
+    }
+    if (!f) {
+        server.send(404, "text/plain", "Image no longer stored");
+        return;
+    }
+    server.streamFile(f, "image/jpeg");
+    f.close();
 }
 
 // ----------------------------------------------------------------
 //              -restart the camera in different mode
 // ----------------------------------------------------------------
 // switches camera mode - format = PIXFORMAT_GRAYSCALE or PIXFORMAT_JPEG
-void RestartCamera(pixformat_t format) {
+//     grabMode (jpg only) = CAMERA_GRAB_LATEST for streaming/trigger photos, CAMERA_GRAB_WHEN_EMPTY for bursts (fifo)
+// returns 0 if the camera was left as it was because its frame buffers are still being saved
+bool RestartCamera(pixformat_t format, camera_grab_mode_t grabMode) {
+    if (!sinksWaitForFrames(10000)) {      // esp_camera_deinit would free frame buffers the sinks are still using
+        log_system_message("Error: camera mode not changed as its frame buffers are still being saved");
+        return 0;
+    }
     esp_camera_deinit();
-    bool ok = setupCameraHardware(format);
+    bool ok = setupCameraHardware(format, grabMode);
     if (ok) {
-        if (serialDebug) Serial.println("Camera mode switched ok");
+        DBG("Camera mode switched ok\n");
     } else {
         // failed so try again
         esp_camera_deinit();
         delay(50);
-        ok = setupCameraHardware(format); //esp_camera_init(&config);
+        ok = setupCameraHardware(format, grabMode); //esp_camera_init(&config);
         if (ok) {
-            if (serialDebug) Serial.println("Camera mode switched ok - 2nd attempt");
+            LOGW("Camera mode switched ok - 2nd attempt");
         } else {
             UpdateBootlogSpiffs("Camera failed to restart so rebooting camera");        // store in bootlog
-            RebootCamera(format);
+            RebootCamera(format);                                                       // restarts the esp32 if that fails
+            ok = 1;
         }
     }
     TRIGGERtimer = millis();        // reset last image captured timer (to prevent instant trigger)
+    return ok;
+}
+
+// restart the camera in the mode used for motion detection (greyscale, or small jpg frames if keeping a pre-roll)
+bool RestartDetection() {
+    if (detectionFormat == PIXFORMAT_JPEG) {
+        if (!RestartCamera(PIXFORMAT_JPEG, CAMERA_GRAB_LATEST)) return 0;
+        return cameraFrameSize(FRAME_SIZE_PREROLL);
+    }
+    return RestartCamera(PIXFORMAT_GRAYSCALE);
 }
 
 bool capturePhotoSaveSpiffs(bool dostream) {
@@ -1393,24 +1435,37 @@ bool capturePhotoSaveSpiffs(bool dostream) {
     // increment image count
     SpiffsFileCounter++;
     if (SpiffsFileCounter > MaxSpiffsImages) SpiffsFileCounter = 1;   // reset counter
-    //SaveSettingsSpiffs();     // save settings in Spiffs
-
-    // first quickly grab a greyscale image
-    saveGreyscaleFrame(String(SpiffsFileCounter) + "s");
-    // Capture a high res image
-    RestartCamera(PIXFORMAT_JPEG);      // restart camera in jpg mode to take a photo (uses greyscale mode for motion detection)
+    //settingsSave();     // save settings in nvs
+
+    bool burst = dostream && burstReady();                  // motion triggered burst of photos (see burst.h)
+    bool ready = 1;                                         // camera is in photo mode
+    if (detectionFormat == PIXFORMAT_JPEG) {
+        // already in jpg mode (pre-roll) so use the newest frame as the pre capture image and just change the frame size
+        prerollSaveLatest(String(SpiffsFileCounter) + "s");
+        if (burst) ready = RestartCamera(PIXFORMAT_JPEG, CAMERA_GRAB_WHEN_EMPTY);
+        else if (!cameraFrameSize(photoFrameSize)) ready = RestartCamera(PIXFORMAT_JPEG, CAMERA_GRAB_LATEST);
+    } else {
+        // first quickly grab a greyscale image
+        saveGreyscaleFrame(String(SpiffsFileCounter) + "s");
+        // Capture a high res image
+        ready = RestartCamera(PIXFORMAT_JPEG, burst ? CAMERA_GRAB_WHEN_EMPTY : CAMERA_GRAB_LATEST);      // restart camera in jpg mode to take a photo (uses greyscale mode for motion detection)
+    }
 
     bool ok = 0;          // Boolean to indicate if the picture has been taken correctly
-    byte TryCount = 0;    // attempt counter to limit retries
-    do {                  // try up to 3 times to capture/save image
-        TryCount++;
-        if (serialDebug)
-            Serial.println("Taking a photo... attempt #" + String(TryCount));
-        saveJpgFrame(dostream);                                 // capture and save/ftp image
-        ok = checkPhoto(SPIFFS, "/" + String(SpiffsFileCounter) + JPGX);     // check if file has been correctly saved in SPIFFS
-    } while ( !ok && TryCount < 3);                                            // if there was a problem taking photo try again
+    if (!ready) {
+        // camera still in detection mode, no photo this time
+    } else if (burst) {
+        ok = burstCapture();
+    } else {
+        byte TryCount = 0;    // attempt counter to limit retries
+        do {                  // try up to 3 times to capture image
+            TryCount++;
+            DBG("Taking a photo... attempt #%u\n", TryCount);
+            ok = saveJpgFrame(dostream);                            // capture image and hand it to the sinks
+        } while ( !ok && TryCount < 3);                                            // if there was a problem taking photo try again
+    }
 
-    RestartCamera(PIXFORMAT_GRAYSCALE);                                        // restart camera back to greyscale mode for motion detection
+    if (ready) RestartDetection();                                             // restart camera back to motion detection mode
 
     TRIGGERtimer = millis();                                                   // reset retrigger timer to stop instant motion trigger
     if (DetectionEnabled == 2) DetectionEnabled = 1;                           // restart paused motion detecting
@@ -1423,6 +1478,7 @@ bool capturePhotoSaveSpiffs(bool dostream) {
 //      restart camera in motion mode, capture a test frame to check it is now responding ok
 //      format = PIXFORMAT_GRAYSCALE or PIXFORMAT_JPEG
 void RebootCamera(pixformat_t format) {
+    camera_grab_mode_t grabMode = camGrabMode;
     log_system_message("ERROR: Problem with camera detected so resetting it");
     // turn camera off then back on
     digitalWrite(PWDN_GPIO_NUM, HIGH);
@@ -1434,49 +1490,95 @@ void RebootCamera(pixformat_t format) {
     // try capturing a frame, if still problem reboot esp32
     if (!capture_still()) {
         UpdateBootlogSpiffs("Camera failed to reboot so rebooting esp32");    // store in bootlog
+        warmSave();                                                           // carry on detecting after the restart (warmstate.h)
         delay(500);
         ESP.restart();
         delay(5000);      // restart will fail without this delay
     }
-    if (format == PIXFORMAT_JPEG) RestartCamera(PIXFORMAT_JPEG);                  // if jpg mode required restart camera again
+    if (format == PIXFORMAT_JPEG) RestartCamera(PIXFORMAT_JPEG, grabMode);        // if jpg mode required restart camera again
 }
 
-void sendStream(WiFiClient mclient) {
+// ----------------------------------------------------------------
+//                 -send a stream of images via POST
+// ----------------------------------------------------------------
+// untilStill = keep motion detection running on the streamed frames and only carry on streaming while there is
+//              still movement (up to maxCamStreamTime), otherwise stream for the full maxCamStreamTime
+//     eventName = name the images are part of (default = current time)
+void sendStream(bool untilStill = false, String eventName = "") {
     camera_fb_t *fb = NULL;
-    String Filename = currentTime(0) + "-L";            // file name for FTP/POST
-    String result = "None yet";
+    if (eventName == "") eventName = currentTime(0);
+    String Filename = eventName + "-L";                 // file name for FTP/POST
+    String result = "time limit reached";
     int frame_num = 0;
+    uint16_t saved_frame[H][W];                         // greyscale reference frame (restored afterwards so detection carries on where it left off)
+    bool haveRef = 0;                                   // flag if a jpg reference frame has been captured yet
     log_system_message("Remote video stream started");
+    uint32_t streamStart = millis();
+    uint32_t lastMotion = streamStart;                  // time movement was last seen in the stream
     uint32_t streamStop = (unsigned long)millis() + (maxCamStreamTime * 1000);              // time limit for stream
+    bool batched = batchReady();                        // send several frames per request
+    if (batched) batchStart();
+    if (untilStill) memcpy(saved_frame, prev_frame, sizeof(saved_frame));
     while (millis() < streamStop) {
         fb = esp_camera_fb_get();
         if (!fb) {
-            if (serialDebug) {
-            Serial.println("Camera capture failed - rebooting camera");
-            }
+            LOGW("Camera capture failed - rebooting camera");
             RebootCamera(PIXFORMAT_JPEG);
             fb = esp_camera_fb_get();
         }
         if(fb) { // Success
-            result = postImage(mclient, fb->buf, fb->len, Filename + String(++frame_num) + JPGX);
-            esp_camera_fb_return(fb);
-            if (result.indexOf("has been uploaded") == -1) break;
-        } else {
-            if (serialDebug) {
-                Serial.println("Capture of image failed");
+            if (untilStill && capture_jpeg_blocks(fb)) {             // check this frame for movement
+                if (haveRef) {
+                    uint16_t changes = motion_detect();
+                    if (changes >= Image_thresholdL && changes <= Image_thresholdH) lastMotion = millis();
+                }
+                update_frame();
+                haveRef = 1;
             }
+            String FrameName = Filename + String(++frame_num) + JPGX;
+            if (batched) {                                   // copied to a batch which is sent in the background (see batch.h)
+                bool ok = batchAdd(fb, FrameName);
+                esp_camera_fb_return(fb);
+                if (!ok) {
+                    result = "batched upload failed";
+                    break;
+                }
+            } else {
+                int status = postImage(fb->buf, fb->len, FrameName, OUT_STREAM);
+                if (status / 100 != 2) spoolFailed(fb->buf, fb->len, FrameName, status);      // keep the frame to send later (unless rejected)
+                esp_camera_fb_return(fb);
+                if (status / 100 != 2) {
+                    result = "upload failed (status " + String(status) + ")";
+                    break;
+                }
+            }
+            if (untilStill && (unsigned long)(millis() - lastMotion) >= (streamStillTime * 1000)) {
+                result = "no movement for " + String(streamStillTime) + " seconds";
+                break;
+            }
+        } else {
+            LOGE("Capture of image failed");
+            result = "capture failed";
             break;
         }
     }
-    log_system_message("Remote video stream end:" + result);
+    if (batched && !batchFinish() && result.indexOf("failed") == -1) result = "batched upload failed";
+    if (untilStill) {
+        memcpy(prev_frame, saved_frame, sizeof(prev_frame));
+        tCounter = 0;
+    }
+    camFpsRecord(frame_num, millis() - streamStart);
+    log_system_message("Remote video stream end (" + String(frame_num) + " frames in " + String((millis() - streamStart) / 1000) + "s):" + result);
 }
 
 // ----------------------------------------------------------------
 //              Save jpg in spiffs/sd card and FTP/POST
 // ----------------------------------------------------------------
-// filesName = name of jpg to save as in spiffs
-void saveJpgFrame(bool dostream = false) {
-    String BaseFilename = currentTime(0) + "-L" + JPGX;                       // file name for FTP/POST
+// the photo is handed to the image sinks (sinks.h) which save/send it in the background
+// dostream = this is a motion triggered event so also save the pre-roll, email and stream via POST
+// returns 0 if no image could be captured
+bool saveJpgFrame(bool dostream = false) {
+    String EventName = currentTime(0);                                        // name shared by all the images of this event
 
     // turn flash on if required
     if (UseFlash) {
@@ -1486,8 +1588,7 @@ void saveJpgFrame(bool dostream = false) {
     // grab frame
     camera_fb_t *fb = esp_camera_fb_get();            // capture frame from camera
     if (!fb) {
-        if (serialDebug)
-          Serial.println("Camera capture failed - rebooting camera");
+        LOGW("Camera capture failed - rebooting camera");
         RebootCamera(PIXFORMAT_JPEG);
         fb = esp_camera_fb_get();                       // try again to capture frame
     }
@@ -1495,95 +1596,46 @@ void saveJpgFrame(bool dostream = false) {
     if (UseFlash) {
         if (flashMode == 3)  { // flash after taking photo (i.e. if flashmode=3)
             digitalWrite(Illumination_led, ledON);
-        } else { // turn flash off (if flashmode 3 do this after saving to spiffs to give a delay)
+        } else {
             digitalWrite(Illumination_led, ledOFF);
         }
     }
 
-    if (fb) {        // only attempt to save the new images if one was captured ok
-        String FileName = "/" + String(SpiffsFileCounter) + JPGX;      // file name for Spiffs
-        // ------------------- save image to Spiffs -------------------
-        SPIFFS.remove(FileName);                          // delete old image file if it exists
-        File file = SPIFFS.open(FileName, FILE_WRITE);
-        if (!file) {
-            log_system_message("Failed to create file in Spiffs");
-        } else {
-            if (file.write(fb->buf, fb->len)) {
-                if (serialDebug) {
-                    Serial.print("The picture has been saved as ");
-                    Serial.print(FileName);
-                    Serial.print(" - Size: ");
-                    Serial.print(file.size());
-                    Serial.println(" bytes");
-                }
-            } else {
-                log_system_message("Error: writing image to Spiffs...will format and try again");
-                WipeSpiffs();     // format spiffs
-                // reset image counter and name
-                SpiffsFileCounter = 1;
-                FileName = "/" + String(SpiffsFileCounter) + JPGX;      // file name for Spiffs
-                file = SPIFFS.open(FileName, FILE_WRITE);
-                if (!file.write(fb->buf, fb->len)) log_system_message("Error: Still unable to write image to Spiffs");
-            }
-            file.close();
-        }
+    if (!fb) {
+        LOGE("Capture of image failed");
+        return 0;
+    }
+
+    ImageJob *job = imageJobCopy(fb, EventName + "-L", dostream ? SINK_ALL : SINK_ALL & ~SINK_EMAIL);
+    job->spiffsName = String(SpiffsFileCounter);
+    imageDispatch(job);
+
 #ifdef SAVE_IFFS_TXT
-        // save text file to spiffs with time info.
-        FileName.replace("jpg", "txt");
+    // save text file to spiffs with time info. (the image store keeps the time in the record)
+    if (!imgStoreReady()) {
+        String FileName = "/" + String(SpiffsFileCounter) + ".txt";
         SPIFFS.remove(FileName);   // delete old file with same name if present
-        file = SPIFFS.open(FileName, FILE_WRITE);
+        File file = SPIFFS.open(FileName, FILE_WRITE);
         if (!file) {
             log_system_message("Error: Failed to create date file in spiffs");
         } else {
             file.println(currentTime(1));
         }
         file.close();
+    }
 #endif
-        // turn flash off if using mode 3
-        if (UseFlash && flashMode == 3) digitalWrite(Illumination_led, ledOFF);
-        // ------------------- save image to SD Card -------------------
-        FileName = "/" + BaseFilename;
-        FileName.replace(":", "_");
-        if (SD_Present) {
-            // save image
-            file = SD_MMC.open(FileName, FILE_WRITE);
-            if (!file) {
-                log_system_message("Error: Failed to create file on sd-card: " + FileName);
-            } else {
-                if (file.write(fb->buf, fb->len)) {
-                    if (serialDebug) {
-                        Serial.println("Saved image to sd card");
-                    }
-                } else {
-                    log_system_message("Error: failed to save image to sd card");
-                }
-                file.close();
-            }
-        }
-#ifdef FTP_ENABLED
-        // ------------------ ftp images to server -------------------
-        if (ftpImages) uploadImageByFTP(fb->buf, fb->len, BaseFilename);
-#endif
+
+    if (dostream) prerollFlush(EventName);                                    // frames from before the trigger
 #if POST_ENABLED
-        if (PostImages) {
-            WiFiClient aclient = WiFiClient();
-            postImage(aclient, fb->buf, fb->len, BaseFilename);
-            esp_camera_fb_return(fb);    // dispose frame so memory can be released
-            if(dostream) sendStream(aclient);
-            aclient.stop();
-        }
-#else
-        esp_camera_fb_return(fb);    // dispose frame so memory can be released
+    if (PostImages && dostream) sendStream(true, EventName);
 #endif
-    } else {
-        if (serialDebug) {
-            Serial.println("Capture of image failed");
-        }
-    }
+    // turn flash off if using mode 3
+    if (UseFlash && flashMode == 3) digitalWrite(Illumination_led, ledOFF);
+    return 1;
 }
 
 // ----------------------------------------------------------------
-//       Save greyscale frame as jpg in spiffs/sd card/FTP/POST
+//       Save greyscale frame as jpg in spiffs/sd card/FTP
 // ----------------------------------------------------------------
 // filesName = name of jpg to save as in spiffs
 void saveGreyscaleFrame(String filesName) {
@@ -1596,45 +1648,26 @@ void saveGreyscaleFrame(String filesName) {
         log_system_message("error: failed to capture greyscale image");
         return;
     }
-    // convert greyscale to jpg
-    bool jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
+    // convert greyscale to jpg (copy if camera is already in jpg mode)
+    bool jpeg_converted;
+    if (fb->format == PIXFORMAT_JPEG) {
+        _jpg_buf_len = fb->len;
+        _jpg_buf = (uint8_t *)heap_caps_malloc(_jpg_buf_len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        jpeg_converted = (_jpg_buf != NULL);
+        if (jpeg_converted) memcpy(_jpg_buf, fb->buf, _jpg_buf_len);
+    } else {
+        jpeg_converted = frame2jpg(fb, 80, &_jpg_buf, &_jpg_buf_len);
+    }
     esp_camera_fb_return(fb);
     if (!jpeg_converted) {
         log_system_message("grey to jpg image conversion failed");
         return;
     }
-    // save image to spiffs
-    String FileName = "/" + filesName + JPGX;              // file name in spiffs
-    SPIFFS.remove(FileName);                              // delete old image file if it exists
-    File file = SPIFFS.open(FileName, FILE_WRITE);        // create new file
-    if (!file) log_system_message("Error: creating grey file on Spiffs");
-    else if (!file.write(_jpg_buf, _jpg_buf_len)) log_system_message("Error: writing grey image to Spiffs");
-    file.close();
-
-    String BaseFileName = currentTime(0) + "-S";
-    // save image to sd card
-    FileName = "/" + BaseFileName + JPGX;
-    FileName.replace(":", "_");
-    if (SD_Present) {
-        file = SD_MMC.open(FileName, FILE_WRITE);
-        if (!file) {
-            log_system_message("Error: creating grey image on sd-card");
-        } else {
-            if (file.write(_jpg_buf, _jpg_buf_len)) {
-                if (serialDebug) {
-                    Serial.println("Saved grey image to sd card");
-                }
-            } else {
-                log_system_message("Error: writing grey image to sd card");
-            }
-        }
-        file.close();
-    }
-#ifdef FTP_ENABLED
-    // ftp to server
-    if (ftpImages) uploadImageByFTP(_jpg_buf, _jpg_buf_len, BaseFilename);
-#endif
-  heap_caps_free(_jpg_buf);                        // return jpg buffer memory
+    // hand to the sinks which free the jpg buffer once saved
+    ImageJob *job = imageJob(_jpg_buf, _jpg_buf_len, currentTime(0) + "-S", SINK_SPIFFS | SINK_SD | SINK_FTP);
+    job->copy = _jpg_buf;
+    job->spiffsName = filesName;
+    imageDispatch(job);
 }
 
 // ----------------------------------------------------------------
@@ -1658,28 +1691,18 @@ void ioDetected(bool iostat) {
 // ----------------------------------------------------------------
 void MotionDetected(uint16_t changes) {
     if(!checkCameraIsFree()) return;                                        // try to avoid using camera if already in use
-    log_system_message("Camera detected motion: " + String(changes));
+    TriggerMillis = millis();
+    logPrintf(LOG_INFO, "Camera detected motion: %u", changes);
+    journalMotion(changes, mask_active * blocksPerMaskUnit, AveragePix);
+    warmTriggers++;
     TriggerTime = currentTime(0) + " - " + String(changes) + " out of " + String(mask_active * blocksPerMaskUnit);    // store time of trigger and motion detected
+    catalogScore = changes;                                                 // motion score of the images in the catalog
     int capres = capturePhotoSaveSpiffs(true);                              // capture an image
+    catalogScore = 0;
 
 #ifdef EMAIL_ENABLED
-    // send email if long enough since last motion detection (or if this is the first one)
-    if (emailWhenTriggered) {       // add "&& cameraImageGain == 0" to only email during daylight hours (i.e. Chris's setting)
-        unsigned long currentMillis = millis();        // get current time
-        if ( ((unsigned long)(currentMillis - EMAILtimer) >= (EmailLimitTime * 1000)) || (EMAILtimer == 0) ) {
-            EMAILtimer = currentMillis;    // reset timer
-
-            // send an email
-            _message[0]=0; _subject[0]=0;          // clear any existing text
-            strcat(_subject,"ESPcamera");
-            strcat(_message,"Camera triggered at ");
-            String tt=currentTime(1);
-            strcat(_message, tt.c_str());
-            if (!capres) strcat(_message, "\nNote: there was a problem detected when capturing an image");
-            sendEmail(_emailReceiver, _subject, _message);
-        }
-        else log_system_message("Too soon to send another email");
-    }
+    // the email is normally sent by the email sink along with the photo (see sinks.h), if no photo was captured add the trigger here
+    if (!capres && emailWhenTriggered) emailTrigger(currentTime(1) + " (there was a problem capturing an image)", NULL, 0, "", NULL, NULL);
 #endif
 
     TRIGGERtimer = millis();                                       // reset retrigger timer to stop instant motion trigger
@@ -1718,14 +1741,18 @@ void handleStream() {
     client.write(HEADER, hdrLen);
     client.write(BOUNDARY, bdrLen);
 
-    RestartCamera(PIXFORMAT_JPEG);                // set camera in to jpeg mode
+    bool ready = RestartCamera(PIXFORMAT_JPEG, CAMERA_GRAB_LATEST);      // set camera in to jpeg mode
 
     // send live images until client disconnects or timeout
-    uint32_t streamStop = (unsigned long)millis() + (maxCamStreamTime * 1000);              // time limit for stream
+    uint32_t streamStart = millis();
+    uint32_t frames = 0;
+    uint32_t streamStop = (unsigned long)millis() + (ready ? maxCamStreamTime * 1000 : 0);    // time limit for stream (none if the camera could not be switched to jpg)
     while (millis() < streamStop )
     {
         if (!client.connected()) break;
         fb = esp_camera_fb_get();                   // capture live image frame
+        if (!fb) break;
+        frames++;
         s = fb->len;                                // store size of image (i.e. buffer length)
         client.write(CTNTTYPE, cntLen);             // send content type html (i.e. jpg image)
         sprintf( buf, "%d\r\n\r\n", s );            // format the image's size as html
@@ -1736,11 +1763,12 @@ void handleStream() {
     }
 
     // close client connection
+    camFpsRecord(frames, millis() - streamStart);
     log_system_message("Video stream stopped");
     delay(3);
     client.stop();
 
-    RestartCamera(PIXFORMAT_GRAYSCALE);                    // restart camera back to greyscale mode for motion detection
+    if (ready) RestartDetection();                         // restart camera back to motion detection mode
     TRIGGERtimer = millis();                               // reset retrigger timer to stop instant motion trigger
     if (DetectionEnabled == 2) DetectionEnabled = 1;       // restart paused motion detecting
 }
@@ -1753,13 +1781,13 @@ void handleStrPst() {
     log_system_message("Stream post requested from: " + clientIP);
     checkCameraIsFree();
     if (DetectionEnabled == 1) DetectionEnabled = 2;
-    RestartCamera(PIXFORMAT_JPEG);
-    String message = "Streaming...";
+    bool ready = RestartCamera(PIXFORMAT_JPEG, CAMERA_GRAB_LATEST);
+    String message = ready ? "Streaming..." : "Camera busy, try again";
     server.send(404, "text/plain", message);   // send reply as plain text
-    WiFiClient mclient = WiFiClient();
-    sendStream(mclient);
-    mclient.stop();
-    RestartCamera(PIXFORMAT_GRAYSCALE);                    // restart camera back to greyscale mode for motion detection
+    if (ready) {
+        sendStream();
+        RestartDetection();                                // restart camera back to motion detection mode
+    }
     TRIGGERtimer = millis();                               // reset retrigger timer to stop instant motion trigger
     if (DetectionEnabled == 2) DetectionEnabled = 1;       // restart paused motion detecting
 }
@@ -1785,8 +1813,14 @@ void handleJPG() {
 
     // convert greyscale to JPG
     //fmt2jpg(fb->buf, fb->len, fb->width, fb->height, fb->format, 31, &jpg_buf, &jpg_size);
-    frame2jpg(fb, 31, &jpg_buf, &jpg_size);
-    if (serialDebug) Serial.printf("Converted JPG size: %d bytes \n", jpg_size);
+    bool converted = (fb->format != PIXFORMAT_JPEG);           // already jpg if keeping a pre-roll
+    if (converted) {
+        frame2jpg(fb, 31, &jpg_buf, &jpg_size);
+    } else {
+        jpg_buf = fb->buf;
+        jpg_size = fb->len;
+    }
+    DBG("Converted JPG size: %u bytes\n", (unsigned)jpg_size);
 
     // build and send html
     const char HEADER[] = "HTTP/1.1 200 OK\r\nAccess-Control-Allow-Origin: *\r\n";
@@ -1807,7 +1841,7 @@ void handleJPG() {
     delay(3);
     client.stop();
 
-    heap_caps_free(jpg_buf);                        // return jpg buffer memory
+    if (converted) heap_caps_free(jpg_buf);         // return jpg buffer memory
     esp_camera_fb_return(fb);                       // return greyscale buffer
 }
 
@@ -1835,10 +1869,7 @@ void handleTest(){
 #ifdef EMAIL_ENABLED
     client.write("<br>Sending test email<br>\n");
     // send a test email
-    _message[0]=0; _subject[0]=0;          // clear any existing text
-    strcat(_subject, stitle);
-    strcat(_message, "test email");
-    sendEmail(_emailReceiver, _subject, _message);
+    emailQueue(stitle, "test email");
 #endif
     // end html page
     webfooter(client);            // add the standard web page footer
@@ -1885,15 +1916,16 @@ static void AutoAdjustImage() {
 void loop(void){
     server.handleClient();                                                                    // service any web requests
     if (disableAllFunctions) return;                                                          // if device is disabled
-#if ENABLE_EMAIL
-    EMAILloop();                                                                              // handle emails
-#endif
 
     // camera motion detection
     if (DetectionEnabled == 1) {
-        if (!capture_still()) RebootCamera(PIXFORMAT_GRAYSCALE);                              // capture image, if problem reboot camera and try again
+        if (!capture_still()) {                                                               // capture image, if problem reboot camera and try again
+            RebootCamera(PIXFORMAT_GRAYSCALE);
+            if (detectionFormat == PIXFORMAT_JPEG) RestartDetection();
+        }
         uint16_t changes = motion_detect();                                                   // find amount of change in current image frame compared to the last one
         update_frame();                                                                       // Copy current stored frame to previous stored frame
+        warmSave();                                                                           // keep it in rtc memory in case the esp32 restarts
         if ( (changes >= Image_thresholdL) && (changes <= Image_thresholdH) ) {               // if enough change to count as motion detected
             if (tCounter >= tCounterTrigger) {                                                // only trigger if movement detected in more than one consequitive frames
                 tCounter = 0;
@@ -1906,14 +1938,10 @@ void loop(void){
                         log_system_message("Motion detected but io input low so ignored");
                     }
                 } else {
-                    if (serialDebug) {
-                        Serial.println("Too soon to re-trigger");
-                    }
+                    DBG("Too soon to re-trigger\n");
                 }
             } else {
-                if (serialDebug) {
-                    Serial.println("Not enough consecutive detections");
-                }
+                DBG("Not enough consecutive detections\n");
             }
         }
     }
@@ -1943,6 +1971,7 @@ void loop(void){
         }
         if (DetectionEnabled == 0) capture_still();         // capture a frame to get a current brightness reading
         if (targetBrightness > 0) AutoAdjustImage();        // auto adjust image sensor settings
+        if (DetectionEnabled == 0) warmSave();              // keep the exposure/gain (saved after each frame when detecting)
     }
 } // loop
 // --------------------------- E N D -----------------------------
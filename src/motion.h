@@ -19,13 +19,18 @@
  **************************************************************************************************/
 
 #include "camera_pins.h"        // see: https://randomnerdtutorials.com/esp32-cam-camera-pin-gpios/
+#include "esp_jpg_decode.h"     // used to read block brightness straight from jpg frames (see capture_jpeg_blocks)
 const bool showFrames = 0;      // if set captured frames will be shown on serial port (if serialDebug is set)
 
 // Image Settings
 #define FRAME_SIZE_MOTION FRAMESIZE_QVGA     // FRAMESIZE_ + QVGA|CIF|VGA|SVGA|XGA|SXGA|UXGA - Do not use sizes above QVGA when not JPEG
+#define FRAME_SIZE_PREROLL FRAMESIZE_VGA     // size of jpg frames used for motion detection when keeping a pre-roll (see preroll.h)
 #define FRAME_SIZE_PHOTO FRAMESIZE_XGA       // Image sizes: 160x120 (QQVGA), 128x160 (QQVGA2), 176x144 (QCIF), 240x176 (HQVGA), 320x240 (QVGA), 400x296 (CIF), 640x480 (VGA, default), 800x600 (SVGA), 1024x768 (XGA), 1280x1024 (SXGA), 1600x1200 (UXGA)
 #define BLOCK_SIZE_X 20                      // size of image blocks used for motion sensing (20)
 #define BLOCK_SIZE_Y 20
+#define FRAME_BUFFERS 3                      // jpg frame buffers to keep in psram (2 to 4) - more lets the sensor keep capturing while a frame is processed
+const uint32_t psramReserve = 1024 * 1024;   // psram which must be left free after allocating the frame buffers (bytes)
+const uint32_t heapReserve = 80 * 1024;      // heap which must be left free if there is no psram so the frame buffer has to go in the heap (bytes)
 //   ---------------------------------------------------------------------------------------------------------------------
 
 
@@ -49,6 +54,14 @@ const uint16_t blocksPerMaskUnit = 16;  // number of blocks in each of the 12 de
 // store most current motion detection reading for display on main page
 uint16_t latestChanges = 0;
 
+// frame buffer pool
+framesize_t photoFrameSize = FRAME_SIZE_PHOTO;             // photo size in use (reduced if there is not enough memory for FRAME_SIZE_PHOTO)
+camera_grab_mode_t camGrabMode = CAMERA_GRAB_WHEN_EMPTY;   // current grab mode: CAMERA_GRAB_WHEN_EMPTY = oldest frame first (fifo), CAMERA_GRAB_LATEST = newest frame only
+uint8_t camFrameBuffers = 1;                               // number of frame buffers currently in use
+uint32_t camFpsFrames[2] = { 0 };                          // frames captured in each grab mode (for measuring frame rate achieved)
+uint32_t camFpsTime[2] = { 0 };                            // time spent capturing them (ms)
+pixformat_t detectionFormat = PIXFORMAT_GRAYSCALE;         // camera mode motion detection runs in (jpg if keeping a pre-roll)
+
 // frame stores (blocks)
 uint16_t prev_frame[H][W] = { 0 };      // previously captured frame
 uint16_t current_frame[H][W] = { 0 };   // current frame
@@ -66,29 +79,72 @@ bool mask_frame[mask_columns][mask_rows] = { {1,1,1},
                                              {1,1,1} };
 
 // forward delarations
-bool setupCameraHardware(framesize_t);
+bool setupCameraHardware(pixformat_t, camera_grab_mode_t grabMode = CAMERA_GRAB_WHEN_EMPTY);
 bool capture_still();
+bool capture_jpeg_blocks(camera_fb_t *);
+static void average_blocks(uint32_t temp_frame[H][W], uint32_t pixelsPerBlock);
 float motion_detect();
 void update_frame();
 void print_frame(uint16_t frame[H][W]);
 bool block_active(uint16_t x,uint16_t y);
 esp_err_t cameraImageSettings(framesize_t);
+void prerollAdd(camera_fb_t *);             // preroll.h
+
+
+// ---------------------------------------------------------------
+//                -frame buffer pool memory budget
+// ---------------------------------------------------------------
+// works out how many jpg frame buffers can be allocated (esp_camera allocates width*height/5 bytes for each jpg buffer)
+// With psram the pool goes there and must leave psramReserve free, without psram only a single buffer is allowed in the
+// heap and the photo size is reduced until it leaves heapReserve free.
+
+static size_t jpgBufferSize(framesize_t fsize) {
+    return (size_t)resolution[fsize].width * resolution[fsize].height / 5;
+}
+
+static uint8_t frameBufferBudget() {
+    static uint8_t lastBudget = 0;                            // only log when the result changes
+    uint8_t wanted = constrain(FRAME_BUFFERS, 1, 4);
+    uint8_t count = wanted;
+
+    if (psramFound()) {
+        photoFrameSize = FRAME_SIZE_PHOTO;
+        size_t freePsram = heap_caps_get_free_size(MALLOC_CAP_SPIRAM);
+        while (count > 1 && (jpgBufferSize(photoFrameSize) * count) + psramReserve > freePsram) count--;
+    } else {
+        count = 1;
+        photoFrameSize = min(FRAME_SIZE_PHOTO, FRAMESIZE_SVGA);
+        size_t freeHeap = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+        while (photoFrameSize > FRAMESIZE_VGA && jpgBufferSize(photoFrameSize) + heapReserve > freeHeap)
+            photoFrameSize = (framesize_t)(photoFrameSize - 1);
+    }
+
+    if (count != lastBudget) {
+        if (count < wanted)
+            log_system_message("Frame buffers reduced from " + String(wanted) + " to " + String(count) + (psramFound() ? " to leave psram free" : " as no psram"));
+        lastBudget = count;
+    }
+    return count;
+}
 
 
 // ---------------------------------------------------------------
 //                     -Setup camera hardware
 // ---------------------------------------------------------------
+// grabMode only applies to jpg mode, greyscale motion detection always uses a single buffer
 
-bool setupCameraHardware(pixformat_t format) {
+bool setupCameraHardware(pixformat_t format, camera_grab_mode_t grabMode) {
     // camera configuration settings
-    camera_config_t config;
-    // if no psram found reduce image resolution
-    if(!psramFound()){
-        #define FRAME_SIZE_PHOTO FRAMESIZE_SVGA
-        config.jpeg_quality = 12;
+    camera_config_t config = {};
+    if (format == PIXFORMAT_JPEG) {
+        config.fb_count = frameBufferBudget();       // if more than one, i2s runs in continuous mode
+        config.grab_mode = grabMode;
+    } else {
         config.fb_count = 1;
+        config.grab_mode = CAMERA_GRAB_WHEN_EMPTY;
     }
-    framesize_t frame_size = format == PIXFORMAT_GRAYSCALE ? FRAME_SIZE_MOTION : FRAME_SIZE_PHOTO;
+    config.fb_location = psramFound() ? CAMERA_FB_IN_PSRAM : CAMERA_FB_IN_DRAM;
+    framesize_t frame_size = format == PIXFORMAT_GRAYSCALE ? FRAME_SIZE_MOTION : photoFrameSize;
 
     config.ledc_channel = LEDC_CHANNEL_0;
     config.ledc_timer = LEDC_TIMER_0;
@@ -111,11 +167,12 @@ bool setupCameraHardware(pixformat_t format) {
     config.xclk_freq_hz = 20000000;      // XCLK 20MHz or 10MHz for OV2640 double FPS (Experimental)
     config.pixel_format = format;        // PIXFORMAT_ + YUV422, GRAYSCALE, RGB565, JPEG, RGB888?
     config.frame_size = frame_size;      // FRAMESIZE_ + QVGA, CIF, VGA, SVGA, XGA, SXGA, UXGA
-    config.jpeg_quality = 10;            // 0-63 lower number means higher quality (can cause failed image capture if set too low at higher resolutions)
-    config.fb_count = 1;                 // if more than one, i2s runs in continuous mode. Use only with JPEG
+    config.jpeg_quality = psramFound() ? 10 : 12;   // 0-63 lower number means higher quality (can cause failed image capture if set too low at higher resolutions)
 
     esp_err_t camerr = esp_camera_init(&config);  // initialise the camera
-    if (camerr != ESP_OK) if (serialDebug) Serial.printf("ERROR: Camera init failed with error 0x%x", camerr);
+    if (camerr != ESP_OK) LOGE("Error: Camera init failed with error 0x%x", camerr);
+    camGrabMode = config.grab_mode;
+    camFrameBuffers = config.fb_count;
 
     camerr = cameraImageSettings(frame_size);       // apply camera sensor settings
 
@@ -133,7 +190,7 @@ esp_err_t cameraImageSettings(framesize_t fsize) {
     sensor_t *s = esp_camera_sensor_get();
 
     if (s == NULL) {
-        if (serialDebug) Serial.println("Error: problem getting camera sensor settings");
+        LOGE("Error: problem getting camera sensor settings");
         return ESP_ERR_NO_MEM;
     }
 
@@ -167,12 +224,12 @@ esp_err_t cameraImageSettings(framesize_t fsize) {
         s->set_bpc(s, 0);                             // black pixel correction
         s->set_wpc(s, 0);                             // white pixel correction
 #endif
-    } else if (fsize == FRAME_SIZE_PHOTO) {
+    } else if (fsize == photoFrameSize) {
         s->set_gain_ctrl(s, 1);                       // auto gain on (1 or 0)
         s->set_exposure_ctrl(s, 1);                   // auto exposure on (1 or 0)
         s->set_vflip(s, cameraImageInvert);           // Invert image (0 or 1)
     } else {
-        if (serialDebug) Serial.println("Unsupported fsize!");
+        LOGE("Error: Unsupported frame size %d", fsize);
         return ESP_ERR_CAMERA_FAILED_TO_SET_FRAME_SIZE;
     }
     cfsize = fsize;
@@ -180,6 +237,42 @@ esp_err_t cameraImageSettings(framesize_t fsize) {
 }
 
 
+// ---------------------------------------------------------------
+//               -change jpg frame size without restarting
+// ---------------------------------------------------------------
+// frame size can not be made larger than the size the camera was started with (buffers are allocated for that size)
+// frames already captured at the old size are discarded
+
+bool cameraFrameSize(framesize_t fsize) {
+    sensor_t *s = esp_camera_sensor_get();
+    if (s == NULL || s->set_framesize(s, fsize) != 0) return false;
+    for (int i = 0; i <= camFrameBuffers; i++) {
+        camera_fb_t *fb = esp_camera_fb_get();
+        if (!fb) return false;
+        bool done = (fb->width == resolution[fsize].width);
+        esp_camera_fb_return(fb);
+        if (done) break;
+    }
+    return true;
+}
+
+
+// ---------------------------------------------------------------
+//                  -frame rate achieved per grab mode
+// ---------------------------------------------------------------
+// record a run of frames captured in the current grab mode
+
+void camFpsRecord(uint32_t frames, uint32_t ms) {
+    camFpsFrames[camGrabMode] += frames;
+    camFpsTime[camGrabMode] += ms;
+}
+
+float camFps(camera_grab_mode_t mode) {
+    if (camFpsTime[mode] == 0) return 0;
+    return (camFpsFrames[mode] * 1000.0) / camFpsTime[mode];
+}
+
+
 // ---------------------------------------------------------------
 //                          -capture image
 // ---------------------------------------------------------------
@@ -199,7 +292,7 @@ bool capture_still() {
     uint32_t temp_frame[H][W] = { 0 };
 
     // capture image from camera
-    if(cfsize != FRAME_SIZE_MOTION)
+    if(cfsize != FRAME_SIZE_MOTION && detectionFormat == PIXFORMAT_GRAYSCALE)
         cameraImageSettings(FRAME_SIZE_MOTION);               // apply camera sensor settings
     camera_fb_t *frame_buffer = esp_camera_fb_get();          // capture frame from camera
     if (!frame_buffer) {                                      // if there was a problem grabbing a frame try again
@@ -207,6 +300,14 @@ bool capture_still() {
         if (!frame_buffer) return false;                      // failed to capture image
     }
 
+    // jpg frame (keeping a pre-roll)
+    if (frame_buffer->format == PIXFORMAT_JPEG) {
+        bool ok = capture_jpeg_blocks(frame_buffer);
+        if (ok) prerollAdd(frame_buffer);
+        esp_camera_fb_return(frame_buffer);
+        return ok;
+    }
+
     // down-sample image in to blocks
     for (uint32_t i = 0; i < (WIDTH * HEIGHT); i++) {         // step through all pixels in image
         const uint16_t x = i % WIDTH;                         // calculate x and y location of this pixel in the image
@@ -219,21 +320,82 @@ bool capture_still() {
 
     esp_camera_fb_return(frame_buffer);                       // return frame so memory can be released
 
-    // average the values for all pixels in each block
+    average_blocks(temp_frame, BLOCK_SIZE_X * BLOCK_SIZE_Y);
+    return true;
+}
+
+
+// ---------------------------------------------------------------
+//                   -average the block totals
+// ---------------------------------------------------------------
+// divide each blocks pixel total by the number of pixels in it and store the result as the current frame
+
+static void average_blocks(uint32_t temp_frame[H][W], uint32_t pixelsPerBlock) {
+    if (pixelsPerBlock == 0) return;
     bool frameChanged = 0;                                  // flag if any change at all since last frame (used to detect problem)
     uint16_t TempAveragePix = 0;                            // average pixel reading (used for calculating image brightness)
     for (int y = 0; y < H; y++) {
         for (int x = 0; x < W; x++) {
-            uint16_t currentBlock = temp_frame[y][x] / (BLOCK_SIZE_X * BLOCK_SIZE_Y);    // average pixel brightness in the block
+            uint16_t currentBlock = temp_frame[y][x] / pixelsPerBlock;                    // average pixel brightness in the block
             if (current_frame[y][x] != currentBlock) frameChanged = 1;
             current_frame[y][x] = currentBlock;
             TempAveragePix += currentBlock;                   // used to calculate average brightness of whole image
         }
     }
-    if (!frameChanged) log_system_message("Suspect camera problem as no change at all since previous image was captured");
+    if (!frameChanged) LOGW("Suspect camera problem as no change at all since previous image was captured");
     AveragePix = TempAveragePix / (H * W);                    // calculate the average pixel brightness in whole image
-    if (serialDebug && showFrames) print_frame(current_frame);// show captured frame on serial port for debugging
+    if (DBG_ON && showFrames) print_frame(current_frame);// show captured frame on serial port for debugging
+}
 
+
+// ---------------------------------------------------------------
+//                 -block values from a jpg frame
+// ---------------------------------------------------------------
+// Lets motion detection keep running while the camera is in jpg mode (i.e. when streaming).
+// The jpg is decoded at 1/8 scale (only the DC value of each 8x8 cell, so very quick) and the luma of the
+// decoded pixels is summed straight in to the blocks, no output image buffer is needed.
+
+typedef struct {
+    const uint8_t *jpg;                     // source jpg data
+    uint16_t width;                         // size of the decoded (scaled) image
+    uint16_t height;
+    uint32_t (*totals)[W];                  // block totals being built
+    uint16_t (*counts)[W];                  // pixels in each block (scaled image size will not always divide evenly)
+} jpeg_blocks_t;
+
+static size_t jpeg_blocks_read(void *arg, size_t index, uint8_t *buf, size_t len) {
+    jpeg_blocks_t *jb = (jpeg_blocks_t *)arg;
+    if (buf) memcpy(buf, jb->jpg + index, len);
+    return len;
+}
+
+static bool jpeg_blocks_write(void *arg, uint16_t x, uint16_t y, uint16_t w, uint16_t h, uint8_t *data) {
+    if (!data) return true;                 // start / end of image
+    jpeg_blocks_t *jb = (jpeg_blocks_t *)arg;
+    for (uint16_t iy = 0; iy < h; iy++) {
+        const uint16_t by = ((y + iy) * H) / jb->height;
+        for (uint16_t ix = 0; ix < w; ix++) {
+            const uint16_t bx = ((x + ix) * W) / jb->width;
+            const uint8_t *p = data + (iy * w + ix) * 3;
+            jb->totals[by][bx] += (p[0] + 2 * p[1] + p[2]) >> 2;     // approx. luma (same result whichever way round red/blue are)
+            jb->counts[by][bx]++;
+        }
+    }
+    return true;
+}
+
+bool capture_jpeg_blocks(camera_fb_t *fb) {
+    if (!fb || fb->format != PIXFORMAT_JPEG) return false;
+    uint32_t temp_frame[H][W] = { 0 };
+    uint16_t temp_count[H][W] = { 0 };
+    jpeg_blocks_t jb = { fb->buf, (uint16_t)(fb->width / 8), (uint16_t)(fb->height / 8), temp_frame, temp_count };
+    if (jb.width < W || jb.height < H) return false;          // frame too small to fill the blocks
+    if (esp_jpg_decode(fb->len, JPG_SCALE_8X, jpeg_blocks_read, jpeg_blocks_write, &jb) != ESP_OK) return false;
+    // bring every block to the same pixel count so they can be averaged together
+    for (int y = 0; y < H; y++)
+        for (int x = 0; x < W; x++)
+            temp_frame[y][x] = temp_count[y][x] ? (temp_frame[y][x] * 64) / temp_count[y][x] : 0;
+    average_blocks(temp_frame, 64);
     return true;
 }
 
@@ -259,12 +421,7 @@ float motion_detect() {
             // float pChange = abs(current - prev) / prev;   // original code
             if (pChange >= tThreshold) {                     // if change in block is enough to qualify as changed
                 if (block_active(x,y)) changes += 1;         // if detection mask is enabled for this block increment changed block count
-                if (serialDebug > 1) {
-                    Serial.print("diff\t");
-                    Serial.print(y);
-                    Serial.print('\t');
-                    Serial.println(x);
-                }
+                if (DBG_ON && serialDebug > 1) txPrintf("diff\t%d\t%d\n", y, x);     // logtx.h
             }
         }
     }
@@ -275,12 +432,7 @@ float motion_detect() {
     if (changes >= Image_thresholdL && changes <= Image_thresholdH) tCounter ++;
     else tCounter = 0;
 
-    if (serialDebug > 1) {
-        Serial.print("Changed ");
-        Serial.print(changes);
-        Serial.print(" out of ");
-        Serial.println(mask_active * blocksPerMaskUnit);
-    }
+    if (DBG_ON && serialDebug > 1) txPrintf("Changed %u out of %u\n", changes, mask_active * blocksPerMaskUnit);
 
     return changes;                                                 // return number of changed blocks
 }
@@ -316,16 +468,16 @@ void update_frame() {
 // For serial debugging
 
 void print_frame(uint16_t frame[H][W]) {
-    if (!serialDebug) return;
-    Serial.println("--- Current frame ----");
+    if (!DBG_ON) return;
+    txPrintf("--- Current frame ----\n");
     for (int y = 0; y < H; y++) {
-        for (int x = 0; x < W; x++) {
-            Serial.print(frame[y][x]);
-            Serial.print('\t');
-        }
-        Serial.println();
+        char line[txLineMax];
+        int len = 0;
+        for (int x = 0; x < W && len < (int)sizeof(line) - 8; x++) len += snprintf(line + len, sizeof(line) - len, "%u\t", frame[y][x]);
+        line[len++] = '\n';
+        txWrite(line, len);
     }
-    Serial.println("----------------------");
+    txPrintf("----------------------\n");
 }
 
 // ------------------------------------------------- end ----------------------------------------------------------------
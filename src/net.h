@@ -54,6 +54,8 @@ const String mDNS_name = stitle;                                         // use
 #else
       #error "wifi.h: This sketch only works with ESP8266 or ESP32"
 #endif
+#include "httpreply.h"                // HTTP reply parser (used by requestWebPage and post.h)
+#include "dnscache.h"                 // cached host name lookups
 #include <time.h>
 
 // Autoconnect
@@ -99,10 +101,11 @@ static void sendNTPpacket(const char* address) {
     packetBuffer[15] = 52;
 
     // all NTP fields have been given values, now you can send a packet requesting a timestamp:
-    // Note that Udp.begin will request automatic translation (via a DNS server) from a
-    // name (eg pool.ntp.org) to an IP address. Never use a specific IP address yourself,
-    // let the DNS give back a random server IP address
-    NTPUdp.beginPacket(address, 123); //NTP requests are to port 123
+    // Never use a specific IP address yourself, let the DNS give back a random server IP address
+    // Note: the address is cached for as long as the DNS reply allows (see dnscache.h) so the pool still rotates servers
+    IPAddress ip;
+    if (!dnsLookup(address, ip)) return;
+    NTPUdp.beginPacket(ip, 123); //NTP requests are to port 123
 
     // Get the data back
     NTPUdp.write(packetBuffer, NTP_PACKET_SIZE);
@@ -120,11 +123,7 @@ static void sendNTPpacket(const char* address) {
 
 static time_t getNTPTime() {
     // Send a UDP packet to the NTP pool address
-    if (serialDebug) {
-        Serial.print("\nSending NTP packet to ");
-        Serial.print(timeServer);
-        Serial.print(": ");
-    }
+    DBG("Sending NTP packet to %s\n", timeServer);
     sendNTPpacket(timeServer);
 
     // Wait to see if a reply is available - timeout after X seconds. At least
@@ -148,10 +147,7 @@ static time_t getNTPTime() {
         // combine the four bytes (two words) into a long integer
         // this is NTP time (seconds since Jan 1 1900)
         unsigned long secsSince1900 = highWord << 16 | lowWord;     // shift highword 16 binary places to the left then combine with lowword
-        if (serialDebug) {
-            Serial.print("Seconds since Jan 1 1900 = ");
-            Serial.println(secsSince1900);
-        }
+        DBG("Seconds since Jan 1 1900 = %lu\n", secsSince1900);
 
         // now convert NTP time into everyday time:
 
@@ -170,7 +166,7 @@ static time_t getNTPTime() {
     }
 
     // Failed to get an NTP/UDP response
-    if (serialDebug) Serial.println("No NTP response received");
+    LOGW("Warning: No NTP response received");
     setSyncInterval(_resyncErrorSeconds);       // try more frequently until a response is received
 
     return 0;
@@ -188,13 +184,13 @@ void startWifiManager() {
     ACconfig.autoReconnect = true;              // Enable saved past credential by autoReconnect option, even once it is disconnected.
 
     // connect to wifi with Autoconnect
-    if (serialDebug) Serial.println("Connecting to wifi...");
+    DBG("Connecting to wifi...\n");
     portal.config(ACconfig);
     if (portal.begin()) {
-        if (serialDebug) Serial.println("WiFi connected: " + WiFi.localIP().toString());
+        DBG("WiFi connected: %s\n", WiFi.localIP().toString().c_str());
         wifiok = 1;
     } else {
-        if (serialDebug) Serial.print("Wifi connection failed so rebooting: ");
+        DBG("Wifi connection failed so rebooting\n");
         delay(1000);
         ESP.restart();
         delay(5000);           // restart will fail without this delay
@@ -212,11 +208,15 @@ void startWifiManager() {
 
     // Set up mDNS responder:
     if (MDNS.begin(mDNS_name.c_str())) {
-        if (serialDebug) Serial.println("mDNS responder started ok");
+        DBG("mDNS responder started ok\n");
     } else {
-        if (serialDebug) Serial.println("Error setting up mDNS responder");
+        LOGE("Error setting up mDNS responder");
     }
 
+    // start the dns cache
+    dnsSetup();
+    dnsPrefetch(timeServer);
+
     // start NTP (Time)
     NTPUdp.begin(localPort);
     setSyncProvider(getNTPTime);              // the function that gets the time from NTP
@@ -229,9 +229,10 @@ void startWifiManager() {
 //          -Return current time and date as a string
 // ----------------------------------------------------------------
 // Notes: two formats available, for British summer time
+//        t = time to show instead of the current time (e.g. when a stored image was taken)
 
-String currentTime(int dFormat = 1){
-    time_t t=now();     // get current time
+String currentTime(int dFormat = 1, time_t t = 0){
+    if (t == 0) t=now();     // get current time
     String ttime;
     int tstore;
 
@@ -331,77 +332,63 @@ bool IsBST() {
 //   @param    port         ip port to use (usually 80)
 //   @param    maxChars     maximum number of chars to receive
 //   @param    cuttoffText  ignore all in reply before this text
-//   @return   the reply as a string
+//   @param    status       if supplied is set to the HTTP status code of the reply (0 = no reply)
+//   @return   the body of the reply as a string
 //   Example usage: requestWebPage("192.168.1.166", "/log", 80, 600, "");
 
-String requestWebPage(String ip, String page, int port, int maxChars, String cuttoffText = ""){
+String requestWebPage(String ip, String page, int port, int maxChars, String cuttoffText = "", int *status = NULL){
 
     uint32_t maxWaitTime = 3000;            // max time to wait for reply (ms)
 
-    char received[maxChars + 1];            // temp store for incoming character data
-    int received_counter = 0;               // counter of number of characters which have been received
+    char received[maxChars + 1];            // store for the body of the reply
+    HttpReply reply(received, sizeof(received));
+    if (status) *status = 0;
 
     if (!page.startsWith("/")) page = "/" + page;     // make sure page begins with "/"
 
-    if (serialDebug) {
-        Serial.print("requesting web page: ");
-        Serial.print(ip);
-        Serial.println(page);
-    }
+    DBG("requesting web page: %s%s\n", ip.c_str(), page.c_str());
 
     WiFiClient client;
 
     // Connect to the site
-    if (!client.connect(ip.c_str() , port)) {
-        if (serialDebug) Serial.println("Web client connection failed");
+    IPAddress addr;
+    if (!dnsLookup(ip.c_str(), addr) || !client.connect(addr, port)) {
+        DBG("Web client connection failed\n");
         return "web client connection failed";
     }
-    if (serialDebug) Serial.println("Connected to host - sending request...");
+    DBG("Connected to host - sending request...\n");
 
     // send request - A basic request looks something like: "GET /index.html HTTP/1.1\r\nHost: 192.168.0.4:8085\r\n\r\n"
-    client.println("GET " + page + " HTTP/1.1 ");
-    client.println("Host: " + ip );
-    client.println("User-Agent: arduino-ethernet");
-    client.println("Connection: close");
-    client.println();    // needed to end HTTP header
-
-    if (serialDebug) Serial.println("Request sent - waiting for reply...");
-
-    // Wait for a response
-    uint32_t ttimer = millis();
-    while ( client.connected() && !client.available() && (uint32_t)(millis() - ttimer) < maxWaitTime ) {
-        delay(10);
-    }
-    if ( ((uint32_t)(millis() - ttimer) > maxWaitTime ) && serialDebug) Serial.println("-Timed out");
+    client.print("GET " + page + " HTTP/1.1\r\n"
+                 "Host: " + ip + "\r\n"
+                 "User-Agent: arduino-ethernet\r\n"
+                 "Connection: close\r\n\r\n");
+
+    DBG("Request sent - waiting for reply...\n");
 
     // read the response
-    while ( client.connected() && client.available() && received_counter < maxChars ) {
-        delay(4);
-        received[received_counter] = char(client.read());     // read one character
-        received_counter+=1;
-    }
-    received[received_counter] = '\0';     // end of string marker
+    if (!reply.read(client, maxWaitTime)) DBG("-Timed out\n");
+    if (status) *status = reply.status;
 
-    if (serialDebug) {
-        Serial.println("--------received web page-----------");
-        Serial.println(received);
-        Serial.println("------------------------------------");
-        Serial.flush();     // wait for serial data to finish sending
+    if (DBG_ON) {
+        txPrintf("--------received web page (status %d)-----------\n", (int)reply.status);
+        for (size_t i = 0, n = strlen(received); i < n; i += txLineMax) txWrite(received + i, min(n - i, (size_t)txLineMax));
+        txPrintf("\n------------------------------------\n");
     }
 
     client.stop();    // close connection
-    if (serialDebug) Serial.println("Connection closed");
+    DBG("Connection closed\n");
 
     // if cuttoffText was supplied then only return the text following this
     if (cuttoffText != "") {
         char* locus = strstr(received,cuttoffText.c_str());    // locus = pointer to the found text
         if (locus) {                                           // if text was found
-            if (serialDebug) Serial.println("The text '" + cuttoffText + "' was found in reply");
+            DBG("The text '%s' was found in reply\n", cuttoffText.c_str());
             return locus;                                        // return the reply text following 'cuttoffText'
-        } else if (serialDebug) Serial.println("The text '" + cuttoffText + "' WAS NOT found in reply");
+        } else DBG("The text '%s' WAS NOT found in reply\n", cuttoffText.c_str());
     }
 
-    return received;        // return the full reply text
+    return received;        // return the body of the reply
 
 }  // requestWebPage
 
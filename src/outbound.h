@@ -0,0 +1,111 @@
+/**************************************************************************************************
+ *
+ *         Outbound scheduler - shares the uplink between uploads by priority with a bandwidth limit
+ *
+ *      Everything sent over the network (POST, FTP, email) asks for permission first with outboundAcquire().
+ *      Waiting uploads are let through in priority order - photos of a new event first, then stream frames,
+ *      then the backlog from the upload spool - so a stream or a spool being emptied never holds up a new
+ *      trigger photo.
+ *
+ *      With outboundMaxRate set the total rate is also limited using a token bucket: tokens (bytes) are added
+ *      at outboundMaxRate per second up to outboundBurst, an upload may start while there are tokens left and
+ *      takes its size from them (the count can go negative, later uploads then wait until it has recovered).
+ *
+ **************************************************************************************************/
+
+// usage:   outboundAcquire(OUT_STREAM, len);          // waits until this upload may go
+//          ... send ...
+//          outboundRelease(OUT_STREAM, len);
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const uint32_t outboundMaxRate = 0;              // max upload rate for all images (bytes per second, 0 = no limit)
+const uint32_t outboundBurst = 64 * 1024;        // bytes which can be sent at full speed before the limit applies
+//  ------------------------------------------------------------------
+
+// priority classes (highest first)
+#define OUT_EVENT   0                            // photos of a motion trigger
+#define OUT_STREAM  1                            // stream and pre-roll frames
+#define OUT_BACKLOG 2                            // upload spool
+#define OUT_CLASSES 3
+
+// forward declarations
+void outboundAcquire(uint8_t prio, size_t bytes);
+void outboundRelease(uint8_t prio, size_t bytes);
+String outboundStatus();
+
+
+portMUX_TYPE outMux = portMUX_INITIALIZER_UNLOCKED;
+volatile uint8_t outWaiting[OUT_CLASSES] = {0};  // uploads waiting to start in each class
+int32_t outTokens = outboundBurst;               // token bucket (bytes)
+uint32_t outLastRefill = 0;
+
+// stats per class
+uint32_t outSent[OUT_CLASSES] = {0};             // uploads
+uint32_t outBytes[OUT_CLASSES] = {0};            // bytes uploaded
+uint32_t outWaitTime[OUT_CLASSES] = {0};         // total time uploads spent waiting for their turn (ms)
+uint32_t outMaxWait[OUT_CLASSES] = {0};
+
+
+// add tokens for the time since last refill (outMux must be held)
+static void outboundRefill() {
+    uint32_t now = millis();
+    uint32_t ms = now - outLastRefill;
+    if (ms == 0) return;
+    outLastRefill = now;
+    int64_t tokens = (int64_t)outTokens + (int64_t)outboundMaxRate * ms / 1000;
+    outTokens = (int32_t)min(tokens, (int64_t)outboundBurst);
+}
+
+
+// ----------------------------------------------------------------
+//             -wait until an upload is allowed to start
+// ----------------------------------------------------------------
+// prio = OUT_xxx, bytes = size of the upload
+void outboundAcquire(uint8_t prio, size_t bytes) {
+    uint32_t startTime = millis();
+    portENTER_CRITICAL(&outMux);
+    outWaiting[prio]++;
+    portEXIT_CRITICAL(&outMux);
+    for (;;) {
+        bool go = 1;
+        portENTER_CRITICAL(&outMux);
+        for (uint8_t p = 0; p < prio; p++) if (outWaiting[p]) go = 0;       // a higher priority upload is waiting
+        if (go && outboundMaxRate) {
+            outboundRefill();
+            if (outTokens > 0) outTokens -= (int32_t)min(bytes, (size_t)INT32_MAX);
+            else go = 0;
+        }
+        if (go) outWaiting[prio]--;
+        portEXIT_CRITICAL(&outMux);
+        if (go) break;
+        delay(5);
+    }
+    uint32_t waited = millis() - startTime;
+    outWaitTime[prio] += waited;
+    if (waited > outMaxWait[prio]) outMaxWait[prio] = waited;
+}
+
+
+// an upload has finished
+void outboundRelease(uint8_t prio, size_t bytes) {
+    outSent[prio]++;
+    outBytes[prio] += bytes;
+}
+
+
+// status for the root web page
+String outboundStatus() {
+    const char *names[OUT_CLASSES] = {"event", "stream", "backlog"};
+    String reply = "";
+    for (uint8_t p = 0; p < OUT_CLASSES; p++) {
+        if (outSent[p] == 0) continue;
+        reply += (reply == "") ? "Uplink" : "";
+        reply += String(" - ") + names[p] + " " + String(outBytes[p] / 1024) + "K";
+        reply += " wait avg " + String(outWaitTime[p] / outSent[p]) + "ms max " + String(outMaxWait[p]) + "ms";
+    }
+    if (reply != "" && outboundMaxRate) reply += " (limit " + String(outboundMaxRate / 1024) + "K/s)";
+    return reply;
+}
+
+// ---------------------------------------------- end ----------------------------------------------
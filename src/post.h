@@ -9,96 +9,287 @@
  **************************************************************************************************/
 
 
-String postImage(WiFiClient, uint16_t*, size_t, String);
+#include <algorithm>
+
+// forward declarations
+int postImages(uint8_t* const[], const size_t[], const String[], uint8_t, uint8_t);
+int postImage(uint8_t*, size_t, String, uint8_t);
+String postStatus();
 
 //  ----------------------  s e t t i n g s --------------------------
 const String PostServerPath = "/upload";         // the php script file location
+const uint8_t postPoolSize = 2;                  // connections kept open to the server (the POST sink and a stream can upload at the same time)
+const uint8_t postMaxBatch = 16;                 // max images sent in one request by postImages()
+const uint32_t postIdleTimeout = 4000;           // close a kept open connection if unused for this long (ms), servers usually drop them after 5s
 //  ------------------------------------------------------------------
 
 
 // ----------------------------------------------------------------
-//                        send photo via POST
+//                  -pool of keep-alive connections
 // ----------------------------------------------------------------
-// pass image frame buffer pointer, length, file name to use
+// HTTP/1.1 connections to the POST server are kept open and reused for the following uploads, this saves the
+// DNS lookup, TCP handshake and slow start for every image.  A connection the server has closed (or half closed)
+// while it was idle is spotted before it is used and a new one opened, if a reused connection fails part way
+// through sending the upload is retried once on a new connection.
+
+struct postConn_t {
+    WiFiClient client;
+    bool inUse;
+    bool open;                                   // if left open for reuse
+    uint32_t lastUsed;                           // millis() when last request on it completed
+};
+postConn_t postPool[postPoolSize];
+portMUX_TYPE postMux = portMUX_INITIALIZER_UNLOCKED;
+
+// upload stats
+uint32_t postUploads = 0;                        // images uploaded ok
+uint32_t postFailures = 0;                       // images which failed to upload
+uint32_t postConnects = 0;                       // new connections opened
+uint32_t postReuses = 0;                         // uploads which reused an open connection
+uint32_t postStale = 0;                          // kept open connections found closed by the server
+volatile uint8_t postActive = 0;                 // uploads in progress
+int postLastStatus = 0;                          // HTTP status code of the latest upload (0 = no reply)
+uint32_t postTotalTime = 0;                      // time taken by the uploads added up (ms), overlapping uploads are counted twice
+uint32_t postBusyTime = 0;                       // time there was at least one upload in progress (ms)
+uint32_t postBusyStart = 0;
+const uint8_t postLatencySamples = 100;
+uint16_t postLatency[postLatencySamples];        // latest upload times (ms) for the p99 figure
+uint8_t postLatencyCount = 0;
+uint8_t postLatencyPos = 0;
+
+
+// get a free connection from the pool (waits if they are all in use)
+static postConn_t *postAcquire() {
+    for (int wait = 0; wait < 500; wait++) {
+        postConn_t *conn = NULL;
+        portENTER_CRITICAL(&postMux);
+        for (uint8_t i = 0; i < postPoolSize; i++) {
+            if (postPool[i].inUse) continue;
+            if (!conn || postPool[i].lastUsed > conn->lastUsed) conn = &postPool[i];     // most recently used is most likely still open
+        }
+        if (conn) conn->inUse = 1;
+        portEXIT_CRITICAL(&postMux);
+        if (conn) return conn;
+        delay(20);
+    }
+    return NULL;
+}
+
+static void postRelease(postConn_t *conn, bool keepOpen) {
+    if (!keepOpen) conn->client.stop();
+    conn->open = keepOpen;
+    conn->lastUsed = millis();
+    conn->inUse = 0;
+}
+
+
+// make sure the connection is open, returns 1 if an already open connection is being reused
+//   Note: WiFiClient.connected() peeks at the socket so it also spots a connection the server has closed
+static bool postConnect(postConn_t *conn, bool *ok) {
+    *ok = 1;
+    if (conn->open) {
+        conn->open = 0;
+        if (!conn->client.connected()) {
+            postStale++;                         // closed by the server while idle
+        } else if ((unsigned long)(millis() - conn->lastUsed) >= postIdleTimeout) {
+            // idle too long, the server may be about to close it
+        } else if (conn->client.available()) {
+            postStale++;                         // data waiting that is not a reply to anything (e.g. a timeout message)
+        } else {
+            postReuses++;
+            return 1;
+        }
+        conn->client.stop();
+    }
+    DBG("Connecting to server: %s:%d\n", PostServerName.c_str(), PostServerPort);
+    IPAddress ip;
+    *ok = dnsLookup(PostServerName.c_str(), ip) && conn->client.connect(ip, PostServerPort);
+    if (*ok) {
+        conn->client.setNoDelay(true);
+        postConnects++;
+    }
+    return 0;
+}
+
+
+// write all of a buffer, as few calls as the socket allows (returns bytes written)
+static size_t postWriteAll(WiFiClient &client, const uint8_t *buf, size_t len) {
+    size_t sent = 0;
+    uint32_t lastProgress = millis();
+    while (sent < len) {
+        size_t n = client.write(buf + sent, len - sent);
+        if (n > 0) {
+            sent += n;
+            lastProgress = millis();
+        } else {
+            if (!client.connected() || (unsigned long)(millis() - lastProgress) > 5000) break;
+            delay(1);
+        }
+    }
+    return sent;
+}
 
-String postImage(WiFiClient client, uint8_t* fbBuf, size_t fbLen, String fName = "cwm") {
-    String getAll;
-    String getBody;
+
+// count the uploads in progress and the time there were any
+static void postBusy(bool starting) {
+    portENTER_CRITICAL(&postMux);
+    if (starting) {
+        if (postActive++ == 0) postBusyStart = millis();
+    } else {
+        if (--postActive == 0) postBusyTime += millis() - postBusyStart;
+    }
+    portEXIT_CRITICAL(&postMux);
+}
+
+
+// keep the latest upload times
+static void postRecordTime(uint32_t ms) {
+    postTotalTime += ms;
+    postLatency[postLatencyPos] = min(ms, (uint32_t)0xFFFF);
+    postLatencyPos = (postLatencyPos + 1) % postLatencySamples;
+    if (postLatencyCount < postLatencySamples) postLatencyCount++;
+}
+
+
+// ----------------------------------------------------------------
+//                   send photos via POST
+// ----------------------------------------------------------------
+// sends one or more images in a single multipart request
+//   bufs/lens/names = the images and the file names to use, count = number of images
+//   prio = OUT_xxx priority of the upload (see outbound.h)
+//   returns the HTTP status code of the reply (2xx = uploaded ok, 0 = no reply)
+// Note: a batch of images (count > 1) is sent as "imageFile[]" so the server script gets them all (see bottom of file)
+//       each part also gives its length, PHP ignores this but misc/ingest/ingestd uses it
+
+int postImages(uint8_t* const bufs[], const size_t lens[], const String names[], uint8_t count, uint8_t prio) {
+    char replyBody[128];                         // start of the reply text (for the log)
+    HttpReply reply(replyBody, sizeof(replyBody));
+    String error = "";
     long startTime = millis();
-    long startTimer = 0;
-    if (serialDebug)
-        Serial.println("Connecting to server: " + PostServerName + ":" + PostServerPort);
-    if (client.connected() || client.connect(PostServerName.c_str(), PostServerPort)) {
+    count = min(count, postMaxBatch);
+    char fName[48];                              // for the log
+    snprintf(fName, sizeof(fName), (count > 1) ? "%s +%u" : "%s", names[0].c_str(), count - 1);
+
 #define LBOUND "1234567890009876564321"
-        if (serialDebug)
-            Serial.println("Connection successful");
-        String head = "--"LBOUND"\r\n"
-            "Content-Disposition: form-data; name=\"imageFile\"; filename=\"" + fName + "\"\r\n"
-            "Content-Type: image/jpeg\r\n\r\n";
-        String tail = "\r\n--"LBOUND"--\r\n";
-
-        uint16_t imageLen = fbLen;
-        uint16_t extraLen = head.length() + tail.length();
-        uint16_t totalLen = imageLen + extraLen;
-
-        client.println("POST " + PostServerPath + " HTTP/1.1");
-        client.println("Host: " + PostServerName);
-        client.println("Content-Length: " + String(totalLen));
-        client.println("Content-Type: multipart/form-data; boundary="LBOUND);
-        client.println();
-        client.print(head);
-#undef LBOUND
-        // send image from buffer
-        for (size_t n=0; n<fbLen; n=n+1024) {
-            if (n+1024 < fbLen) {
-                client.write(fbBuf, 1024);
-                fbBuf += 1024;
-            }
-            else if (fbLen%1024>0) {
-                size_t remainder = fbLen%1024;
-                client.write(fbBuf, remainder);
-            }
+    const char *field = (count > 1) ? "imageFile[]" : "imageFile";
+    String tail = "--"LBOUND"--\r\n";
+    size_t imagesLen = 0;
+    size_t totalLen = tail.length();             // 32 bit so images over 64K are fine
+    String heads[postMaxBatch];                  // multipart head of each image
+    for (uint8_t i = 0; i < count; i++) {
+        heads[i] = "--"LBOUND"\r\n"
+            "Content-Disposition: form-data; name=\"" + String(field) + "\"; filename=\"" + names[i] + "\"\r\n"
+            "Content-Type: image/jpeg\r\n"
+            "Content-Length: " + String(lens[i]) + "\r\n\r\n";          // lets misc/ingest/ingestd splice the image straight to disk
+        imagesLen += lens[i];
+        totalLen += heads[i].length() + lens[i] + 2;
+    }
+
+    outboundAcquire(prio, imagesLen);            // wait for higher priority uploads and the bandwidth limit
+    postConn_t *conn = postAcquire();
+    if (!conn) {
+        logPrintf(LOG_ERROR, "Error sending image '%s' via POST - no free connection", fName);
+        outboundRelease(prio, 0);
+        postFailures += count;
+        return 0;
+    }
+    WiFiClient &client = conn->client;
+    postBusy(1);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool connected;
+        bool reused = postConnect(conn, &connected);
+        if (!connected) {
+            error = "connection to " + PostServerName +  " failed";
+            break;
+        }
+        DBG("%s\n", reused ? "Reusing connection" : "Connection successful");
+
+        // request headers and first multipart head go in one write so they are not sent as lots of tiny packets
+        reply.reset();
+        String request = "POST " + PostServerPath + " HTTP/1.1\r\n"
+            "Host: " + PostServerName + "\r\n"
+            "Connection: keep-alive\r\n"
+            "Content-Length: " + String(totalLen) + "\r\n"
+            "Content-Type: multipart/form-data; boundary="LBOUND"\r\n\r\n" + heads[0];
+        client.write((const uint8_t *)request.c_str(), request.length());
+        // send images straight from their buffers in as large writes as the socket will take
+        size_t sent = 0;
+        size_t expected = 0;
+        for (uint8_t i = 0; i < count; i++) {
+            if (i > 0) client.write((const uint8_t *)heads[i].c_str(), heads[i].length());
+            sent += postWriteAll(client, bufs[i], lens[i]);
+            expected += lens[i];
+            if (sent < expected) break;
+            client.write((const uint8_t *)"\r\n", 2);
         }
         client.print(tail);
-
-        int timoutTimer = 5000;
-        startTimer = millis();
-        boolean state = false;
+        if (reused && sent < imagesLen) {        // server had closed the connection so try again on a new one
+            client.stop();
+            postStale++;
+            continue;
+        }
+        if (sent < imagesLen) {
+            error = "only sent " + String(sent) + " of " + String(imagesLen) + " bytes";
+            break;
+        }
 
         // receive reply from server
-        while ((startTimer + timoutTimer) > millis()) {
-            while (client.available()) {
-                char c = client.read();
-                if (c == '\n') {
-                    if (getAll.length()==0) state=true;
-                    getAll = "";
-                } else if (c != '\r') {
-                  getAll += String(c);
-                }
-                if (state==true) getBody += String(c);
-                startTimer = millis();
-            }
-            if (getBody.length()>0) break;
-            if (serialDebug) Serial.print(".");
-            delay(30);
-        }
-        if (serialDebug) {
-            Serial.println();
-            Serial.println(getBody);
+        reply.read(client, 5000);
+        if (reused && reply.status == 0 && !client.connected()) {      // closed by the server before replying
+            client.stop();
+            postStale++;
+            continue;
         }
-    } else {
-        getBody = "POST error-Connection to " + PostServerName +  " failed";
-        if (serialDebug) Serial.println(getBody);
+        if (!reply.complete) error = reply.status ? "incomplete reply" : "no reply";
+        DBG("POST reply %d: %s\n", (int)reply.status, replyBody);
+        break;
     }
+#undef LBOUND
+    postRelease(conn, reply.complete && reply.keepAlive && client.connected());
+    postLastStatus = reply.status;
+    postBusy(0);
+    outboundRelease(prio, imagesLen);
 
     // log result
-    if (getBody.indexOf("has been uploaded") == -1) {
-        log_system_message("Error sending image '" + fName + "' via POST");
+    if (reply.status / 100 != 2) {
+        postFailures += count;
+        if (error == "") error = "status " + String(reply.status) + " " + String(replyBody);
+        logPrintf(LOG_ERROR, "Error sending image '%s' via POST - %s", fName, error.c_str());
     } else {
-        log_system_message("Image '" + fName + "' sent via POST in " + String(startTimer-startTime) + "ms");
+        postUploads += count;
+        postRecordTime(millis() - startTime);
+        logPrintf(LOG_INFO, "Image '%s' sent via POST in %lums", fName, millis() - startTime);
     }
 
-    return getBody;
+    return reply.status;
+}
+
+
+// send a single photo via POST
+//   pass image frame buffer pointer, length, file name to use
+int postImage(uint8_t* fbBuf, size_t fbLen, String fName = "cwm", uint8_t prio = OUT_EVENT) {
+    return postImages(&fbBuf, &fbLen, &fName, 1, prio);
+}
+
+
+// upload stats for the root web page
+String postStatus() {
+    if (postUploads + postFailures == 0) return "";
+    uint16_t sorted[postLatencySamples];
+    memcpy(sorted, postLatency, postLatencyCount * sizeof(uint16_t));
+    std::sort(sorted, sorted + postLatencyCount);
+    uint8_t p99 = postLatencyCount ? (postLatencyCount * 99 + 99) / 100 - 1 : 0;
+    String reply = "POST: " + String(postUploads) + " uploaded";
+    if (postFailures) reply += " <font color='#FF0000'>" + String(postFailures) + " failed</font>";
+    if (postUploads) {
+        reply += " - " + String(postUploads * 1000.0 / max(postBusyTime, (uint32_t)1), 1) + " uploads/s while uploading";
+        reply += ", mean " + String(postTotalTime / postUploads) + "ms per image";
+        reply += ", p99 " + String(postLatencyCount ? sorted[p99] : 0) + "ms";
+    }
+    reply += " - last status " + String(postLastStatus);
+    reply += " - connections: " + String(postConnects) + " opened, " + String(postReuses) + " reused, " + String(postStale) + " closed by server";
+    return reply;
 }
 
 
@@ -180,7 +371,9 @@ PHP script to receive images from the ESP32Cam:
     }
 
     // Check if $uploadOk is set to 0 by an error
+    // Note: the camera checks the HTTP status code so failures must not return 200
     if ($uploadOk == 0) {
+        http_response_code(422);
         echo "Sorry, your file was not uploaded.";
         // if everything is ok, try to upload file
     }
@@ -189,11 +382,50 @@ PHP script to receive images from the ESP32Cam:
             echo "The file ". basename( $_FILES["imageFile"]["name"]). " has been uploaded.";
         }
         else {
+            http_response_code(500);
             echo "Sorry, there was an error uploading your file.";
         }
     }
     ?>
 
 
+--------------------------------------------------------------------------------------
+
+
+PHP script to receive batches of images (when postBatchFrames > 1, see batch.h) - also accepts single images:
+
+
+    <?php
+    $files = $_FILES["imageFile"];
+    if (!is_array($files["name"])) {                    // single image, treat as a batch of one
+        foreach ($files as $key => $value) $files[$key] = array($value);
+    }
+    $failed = 0;
+    for ($i = 0; $i < count($files["name"]); $i++) {
+        $name = basename($files["name"][$i]);
+        $type = strtolower(pathinfo($name, PATHINFO_EXTENSION));
+        if ($files["error"][$i] != UPLOAD_ERR_OK || $files["size"][$i] > 500000 || $type != "jpg" ||
+            !move_uploaded_file($files["tmp_name"][$i], "./" . $name)) {
+            echo "Sorry, " . $name . " was not uploaded.\n";
+            $failed++;
+        }
+    }
+    if ($failed) http_response_code(422);
+    else echo count($files["name"]) . " files have been uploaded.";
+    ?>
+
+
+--------------------------------------------------------------------------------------
+
+
+For a busy server (lots of cameras, streams or batches) misc/ingest/ingestd.cpp can be used instead of PHP, it is a
+small stand alone server for Linux which accepts both the above and stores the images in a folder per hour:
+
+    g++ -O2 -std=c++17 -pthread -o ingestd misc/ingest/ingestd.cpp
+    ./ingestd -p 8080 -d /srv/camera-images                 (then set PostServerPort to 8080, any PostServerPath will do)
+
+misc/ingest/loadgen.cpp simulates cameras uploading to it (or to a PHP server) and reports the throughput.
+
+
 --------------------------------------------------------------------------------------
                                      * end */
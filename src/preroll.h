@@ -0,0 +1,241 @@
+/**************************************************************************************************
+ *
+ *                 Pre-roll - keep the last few seconds of jpg frames in psram
+ *
+ *      By the time motion has been detected and the camera switched to take a photo whatever triggered it
+ *      is often already leaving the picture.  With pre-roll enabled (prerollSeconds > 0, requires psram)
+ *      motion detection runs on small jpg frames instead of greyscale ones (see capture_jpeg_blocks in motion.h)
+ *      and every frame is also kept in a ring in psram.  When motion is detected the frames from before the
+ *      trigger are saved to sd card / sent via POST along with the photo and stream as one event.
+ *
+ *      The ring is a single psram allocation made at startup so there is no allocation per frame, each frame
+ *      is stored as a small header followed by the jpg data and the oldest frames are dropped to make room.
+ *      When flushed the frames are handed to the image sinks (sinks.h) straight from the ring, which is left
+ *      frozen (no new frames added) until the sinks have finished with them.
+ *
+ **************************************************************************************************/
+
+// forward declarations
+bool prerollSetup();
+void prerollAdd(camera_fb_t *fb);
+void prerollFlush(String eventName);
+bool prerollSaveLatest(String fileName);
+
+
+// ----------------------------------------------------------------
+//                      -ring of jpg frames
+// ----------------------------------------------------------------
+// usage:   FrameRing ring;
+//          ring.begin(1024 * 1024);                        // allocate 1MB of psram
+//          ring.push(fb->buf, fb->len, millis());          // store a frame (drops oldest frames if required)
+//          ring.get(0, &buf, &len, &ms);                   // oldest frame
+
+class FrameRing {
+
+    private:
+    struct rec_t {
+        uint32_t len;                                      // jpg data length (WRAP = rest of arena unused, continue from start)
+        uint32_t ms;                                       // millis() when captured
+    };
+    static const uint32_t WRAP = 0xFFFFFFFF;
+    uint8_t *_arena = NULL;                                // psram store
+    size_t _size = 0;                                      // size of the store
+    size_t _head = 0;                                      // where the next frame will be written
+    size_t _tail = 0;                                      // oldest frame
+    uint16_t _count = 0;                                   // number of frames stored
+    size_t _used = 0;                                      // bytes of jpg data stored
+
+    static size_t recSize(size_t len) {                    // space used by a frame (header + data, 4 byte aligned)
+        return (sizeof(rec_t) + len + 3) & ~(size_t)3;
+    }
+
+    size_t wrapped(size_t pos) {                           // position of the record stored at/after pos
+        if (pos + sizeof(rec_t) > _size || ((rec_t *)(_arena + pos))->len == WRAP) return 0;
+        return pos;
+    }
+
+    public:
+    bool begin(size_t bytes) {
+        if (_arena) return 1;
+        _arena = (uint8_t *)heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        if (!_arena) return 0;
+        _size = bytes;
+        clear();
+        return 1;
+    }
+
+    void clear() {
+        _head = _tail = 0;
+        _count = 0;
+        _used = 0;
+    }
+
+    void dropOldest() {
+        if (_count == 0) return;
+        _tail = wrapped(_tail);
+        rec_t *r = (rec_t *)(_arena + _tail);
+        _used -= r->len;
+        _tail += recSize(r->len);
+        if (--_count == 0) clear();
+        else _tail = wrapped(_tail);
+    }
+
+    // store a frame, dropping the oldest frames if there is not enough room
+    bool push(const uint8_t *buf, size_t len, uint32_t ms) {
+        size_t need = recSize(len);
+        if (!_arena || need > _size) return 0;
+        while (_count > 0) {
+            if (_head > _tail) {                           // free space is from head to end of arena, then start of arena to tail
+                if (_size - _head >= need) break;
+                if (_tail >= need) {                       // room at the start so wrap round
+                    if (_size - _head >= sizeof(rec_t)) ((rec_t *)(_arena + _head))->len = WRAP;
+                    _head = 0;
+                    break;
+                }
+            } else if (_head < _tail) {                    // free space is from head to tail
+                if (_tail - _head >= need) break;
+            }
+            dropOldest();                                  // full (head == tail) or not enough room
+        }
+        rec_t *r = (rec_t *)(_arena + _head);
+        r->len = len;
+        r->ms = ms;
+        memcpy(_arena + _head + sizeof(rec_t), buf, len);
+        _head += need;
+        _count++;
+        _used += len;
+        return 1;
+    }
+
+    // if a frame would fit without dropping any
+    bool fits(size_t len) {
+        size_t need = recSize(len);
+        if (!_arena || need > _size) return 0;
+        if (_count == 0) return 1;
+        if (_head > _tail) return _size - _head >= need || _tail >= need;
+        if (_head < _tail) return _tail - _head >= need;
+        return 0;                                          // full
+    }
+
+    // store a frame only if it fits without dropping any
+    bool tryPush(const uint8_t *buf, size_t len, uint32_t ms) {
+        return fits(len) && push(buf, len, ms);
+    }
+
+    // frame n (0 = oldest)
+    bool get(uint16_t n, const uint8_t **buf, size_t *len, uint32_t *ms) {
+        if (n >= _count) return 0;
+        size_t pos = wrapped(_tail);
+        for (uint16_t i = 0; i < n; i++) pos = wrapped(pos + recSize(((rec_t *)(_arena + pos))->len));
+        rec_t *r = (rec_t *)(_arena + pos);
+        *buf = _arena + pos + sizeof(rec_t);
+        *len = r->len;
+        *ms = r->ms;
+        return 1;
+    }
+
+    uint32_t oldestTime() {
+        return _count ? ((rec_t *)(_arena + wrapped(_tail)))->ms : 0;
+    }
+
+    uint16_t count() { return _count; }
+    size_t used() { return _used; }
+    size_t size() { return _size; }
+};
+
+
+// ----------------------------------------------------------------
+//                        -pre-roll of frames
+// ----------------------------------------------------------------
+
+FrameRing preroll;
+uint32_t prerollFrames = 0;                                // frames added since startup
+uint32_t prerollLast = 0;                                  // time newest frame was added
+volatile uint16_t prerollPending = 0;                      // frames still being saved by the sinks (ring is frozen until 0)
+
+
+// allocate the ring and switch motion detection to jpg frames, called from setup before the camera is started
+bool prerollSetup() {
+    if (prerollSeconds == 0) return 0;
+    if (!psramFound()) {
+        log_system_message("Pre-roll disabled as no psram");
+        return 0;
+    }
+    size_t bytes = min(prerollMemory, (uint32_t)(heap_caps_get_free_size(MALLOC_CAP_SPIRAM) / 2));
+    if (!preroll.begin(bytes)) {
+        log_system_message("Error: Unable to allocate pre-roll store");
+        return 0;
+    }
+    detectionFormat = PIXFORMAT_JPEG;
+    log_system_message("Pre-roll of " + String(prerollSeconds) + " seconds enabled using " + String(bytes / 1024) + "K psram");
+    return 1;
+}
+
+
+// add a frame to the pre-roll (called for every jpg frame used for motion detection)
+void prerollAdd(camera_fb_t *fb) {
+    if (!preroll.size() || prerollPending) return;
+    uint32_t ms = millis();
+    while (preroll.count() && (uint32_t)(ms - preroll.oldestTime()) > (prerollSeconds * 1000)) preroll.dropOldest();     // only keep prerollSeconds
+    if (!preroll.push(fb->buf, fb->len, ms)) return;
+    prerollFrames++;
+    prerollLast = ms;
+}
+
+
+// sustained frame rate of the frames currently held in the pre-roll
+float prerollFps() {
+    uint32_t ms = prerollLast - preroll.oldestTime();
+    if (preroll.count() < 2 || ms == 0) return 0;
+    return ((preroll.count() - 1) * 1000.0) / ms;
+}
+
+
+// save the newest frame in Spiffs (used as the pre capture image)
+bool prerollSaveLatest(String fileName) {
+    const uint8_t *buf;
+    size_t len;
+    uint32_t ms;
+    if (prerollPending || !preroll.get(preroll.count() - 1, &buf, &len, &ms)) return 0;
+    uint8_t *copy = (uint8_t *)heap_caps_malloc(len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);     // the ring carries on changing
+    if (!copy) return 0;
+    memcpy(copy, buf, len);
+    ImageJob *job = imageJob(copy, len, currentTime(0) + "-S", SINK_SPIFFS);
+    job->copy = copy;
+    job->spiffsName = fileName;
+    return imageDispatch(job);
+}
+
+
+// called by the sinks as they finish with each frame, the last one empties and unfreezes the ring
+static void prerollRelease(ImageJob *) {
+    portENTER_CRITICAL(&sinkMux);
+    bool last = (prerollPending == 1);
+    if (!last) prerollPending--;
+    portEXIT_CRITICAL(&sinkMux);
+    if (!last) return;
+    preroll.clear();                                       // before unfreezing so detection can not add to it meanwhile
+    prerollPending = 0;
+}
+
+
+// save/send the frames from before the trigger as part of the event 'eventName' (to sd card and POST)
+void prerollFlush(String eventName) {
+    uint16_t frames = preroll.count();
+    if (frames == 0 || prerollPending) return;
+    prerollPending = frames + 1;                           // held until all frames have been dispatched
+    for (uint16_t n = 0; n < frames; n++) {
+        const uint8_t *buf;
+        size_t len;
+        uint32_t ms;
+        preroll.get(n, &buf, &len, &ms);
+        ImageJob *job = imageJob(buf, len, eventName + "-P" + String(n + 1), SINK_SD | SINK_POST);
+        job->priority = OUT_STREAM;
+        job->release = prerollRelease;
+        imageDispatch(job);
+    }
+    prerollRelease(NULL);
+    logPrintf(LOG_INFO, "Pre-roll of %u frames queued to be saved", frames);
+}
+
+// ---------------------------------------------- end ----------------------------------------------
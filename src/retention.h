@@ -0,0 +1,364 @@
+/**************************************************************************************************
+ *
+ *            SD card retention - removes the oldest images so the sd card never fills up
+ *
+ *      A background task checks how full the sd card is and once it is over retentionHighWater removes
+ *      images, oldest first, until it is under retentionLowWater.  Images without motion (captures,
+ *      greyscale images) go first, then those from motion triggers.  Images can also be given a max age.
+ *
+ *      The images are found from the catalog (catalog.h), there is a cursor for each kind of image at the
+ *      oldest one still on the sd card so finding the next to remove does not search anything.  The catalog
+ *      only holds a fixed number of entries, older images are still on the card but no longer in it.  When
+ *      the card is full these go first: the images in the root folder (saved before there was a folder for
+ *      each hour), then the oldest hour folders one at a time up to the folder of the oldest image in the
+ *      catalog.  The folder being gone through is kept open between steps and the sweep carries on from it,
+ *      so even a root folder with tens of thousands of files is only read once and a little at a time.  A
+ *      pre-roll frame saved in a clip file (sdClipFiles) is removed with the whole clip.
+ *
+ *      The work is done retentionSlice ms at a time with a pause between so it never holds up the sd card
+ *      for long while images are being saved.  Empty hour/day folders are removed as it goes.
+ *
+ **************************************************************************************************/
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const uint8_t retentionHighWater = 90;           // start removing images when the sd card is this full (percent)
+const uint8_t retentionLowWater = 80;            // until it is down to this
+const bool retentionOtherFirst = 1;              // remove images without motion before any from motion triggers
+const uint16_t retentionMaxDaysOther = 0;        // remove images without motion older than this (days, 0 = keep)
+const uint16_t retentionMaxDaysMotion = 0;       // remove motion images older than this (days, 0 = keep)
+const uint16_t retentionPending = 16;            // the newest entries may still be waiting to be saved
+const uint32_t retentionInterval = 60000;        // check the sd card every (ms)
+const uint32_t retentionSlice = 100;             // work for up to this long at a time (ms)
+const uint32_t retentionPause = 200;             // then pause for (ms)
+const uint8_t retentionSweepBatch = 32;          // root folder entries read at a time when looking for old images
+//  ------------------------------------------------------------------
+
+#define RET_OTHER  0                             // cursor for images without motion
+#define RET_MOTION 1
+
+// forward declarations
+bool retentionSetup();
+void retentionWake(bool checkSpace = 0);
+String retentionStatus();
+
+
+TaskHandle_t retentionTaskHandle = NULL;
+uint32_t retCursor[2] = {0, 0};                  // oldest catalog entry of each kind which may still be on the sd card
+uint64_t retUsed = 0;                            // sd card bytes used (from the last check, less the images removed since)
+uint64_t retTotal = 0;
+String retLastFolder = "";                       // folder of the last image removed
+bool retFull = 0;                                // removing images to get under the low water mark
+volatile bool retCheckNow = 0;                   // check how full the sd card is when next woken
+File retSweepDir;                                // folder the sweep is going through (kept open between steps)
+String retSweepFolder = "/";                     // its path, "/" = the root folder
+String retSweepYear = "";                        // oldest year folder found in the root folder so far
+bool retSweepDone = 0;                           // nothing older than the catalog left this pass
+
+// stats
+uint32_t retRemoved = 0;
+uint32_t retRemovedKB = 0;
+uint32_t retSwept = 0;                           // files removed which were older than the catalog
+uint32_t retClips = 0;                           // clip files removed
+uint32_t retPasses = 0;                          // times the sd card was over the high water mark
+uint32_t retLastPass = 0;                        // time taken by the last pass (ms)
+uint32_t retFailures = 0;
+
+
+// next catalog entry of a kind on the sd card (0 = none), moves the cursor past ones which are not
+//   it stops at one of the newest entries not on the card yet as it may be about to be saved there
+static uint32_t retentionNext(uint8_t kind, catEntry_t *e) {
+    uint32_t &seq = retCursor[kind];
+    if (seq < catalogFirst()) seq = catalogFirst();
+    for (; seq <= catalogLast(); seq++) {
+        if (!catalogGet(seq, e) || !(e->where & CAT_SD)) {
+            if (seq + retentionPending > catalogLast()) return 0;
+            continue;
+        }
+        if ((e->score > 0) == (kind == RET_MOTION)) return seq;
+    }
+    return 0;
+}
+
+
+// remove the folders of the previous image if they are now empty (rmdir fails if not)
+static void retentionTidyFolders(String folder) {
+    if (folder == retLastFolder) return;
+    String old = retLastFolder;
+    retLastFolder = folder;
+    while (old.length() > 1 && old != "/unknown" && SD_MMC.rmdir(old)) {
+        old = old.substring(0, old.lastIndexOf('/'));
+    }
+}
+
+
+static void retentionRemove(const catEntry_t &e) {
+    String FileName = sdFileName(e.name);
+    String clip = sdClipName(e.name);
+    uint64_t freed = e.size;
+    bool ok = SD_MMC.remove(FileName);
+    if (!ok) {                                   // saved before there was a folder for each hour
+        String flat = "/" + String(e.name) + JPGX;
+        flat.replace(":", "_");
+        ok = SD_MMC.remove(flat);
+    }
+    if (!ok && clip != "" && SD_MMC.exists(clip)) {           // pre-roll frame in a clip file, the clip goes with its first frame
+        File file = SD_MMC.open(clip);
+        freed = file ? file.size() : 0;
+        file.close();
+        ok = SD_MMC.remove(clip);
+        if (ok) retClips++;
+        else FileName = clip;
+    } else if (!ok) {
+        freed = 0;
+        ok = !SD_MMC.exists(FileName);           // already gone (e.g. the rest of a clip removed before)
+    }
+    if (!ok) {
+        freed = 0;
+        retFailures++;
+        log_system_message("Error: unable to remove " + FileName + " from sd card");
+    }
+    catalogRemoved(e.seq, CAT_SD);               // either way so it is not tried again
+    retentionTidyFolders(sdFolder(e.name));
+    retUsed -= min(retUsed, freed);
+    retRemoved++;
+    retRemovedKB += freed / 1024;
+}
+
+
+// ----------------------------------------------------------------
+//                 -images older than the catalog
+// ----------------------------------------------------------------
+
+// folder of the oldest image in the catalog with a known time, images in older folders are not in it ("" = none)
+static String retentionCatalogStart() {
+    catEntry_t e = {};
+    for (uint32_t seq = catalogFirst(); seq && seq <= catalogLast(); seq++) {
+        catalogGet(seq, &e);                     // (removed entries still give their name)
+        if (e.seq == seq && e.time) return sdFolder(e.name);
+    }
+    return "";
+}
+
+
+// if a folder name is part of a date  i.e. "2026" (digits = 4) or "10" (digits = 2)
+static bool retentionDated(const String &n, uint8_t digits) {
+    if (n.length() != digits) return 0;
+    for (uint8_t i = 0; i < digits; i++) {
+        if (!isdigit(n.c_str()[i])) return 0;
+    }
+    return 1;
+}
+
+
+// oldest month/day/hour folder in a folder ("" = none), these only hold a few folders each
+static String retentionOldestIn(String folder) {
+    File dir = SD_MMC.open(folder);
+    if (!dir || !dir.isDirectory()) return "";
+    String oldest = "";
+    for (File f = dir.openNextFile(); f; f = dir.openNextFile()) {
+        String n = f.name();
+        n = n.substring(n.lastIndexOf('/') + 1);
+        if (f.isDirectory() && retentionDated(n, 2) && (oldest == "" || n.compareTo(oldest) < 0)) oldest = n;
+        f.close();
+    }
+    dir.close();
+    return oldest;
+}
+
+
+// start the sweep again from the root folder (at the start and end of each pass)
+static void retentionSweepReset() {
+    if (retSweepDir) retSweepDir.close();
+    retSweepFolder = "/";
+    retSweepYear = "";
+    retSweepDone = 0;
+}
+
+
+static bool retentionSweepFile(String path, uint64_t size) {
+    if (!SD_MMC.remove(path)) {
+        retFailures++;
+        retSweepDone = 1;
+        log_system_message("Error: unable to remove " + path + " from sd card");
+        return 0;
+    }
+    retUsed -= min(retUsed, size);
+    retSwept++;
+    retRemovedKB += size / 1024;
+    return 1;
+}
+
+
+// a few entries of the root folder: images saved there are removed and the oldest year folder is found
+static bool retentionSweepRoot() {
+    if (!retSweepDir) {
+        retSweepDir = SD_MMC.open("/");
+        retSweepYear = "";
+        if (!retSweepDir) {
+            retSweepDone = 1;
+            return 0;
+        }
+    }
+    for (uint8_t i = 0; i < retentionSweepBatch; i++) {
+        File f = retSweepDir.openNextFile();
+        if (!f) {                                // all read, carry on from the oldest year folder
+            retSweepDir.close();
+            if (retSweepYear == "") {
+                retSweepDone = 1;
+                return 0;
+            }
+            retSweepFolder = "/" + retSweepYear;
+            return 1;
+        }
+        String path = f.name();
+        String n = path.substring(path.lastIndexOf('/') + 1);
+        bool isDir = f.isDirectory();
+        uint64_t size = isDir ? 0 : f.size();
+        f.close();
+        if (isDir && retentionDated(n, 4) && (retSweepYear == "" || n.compareTo(retSweepYear) < 0)) retSweepYear = n;
+        if (!isDir && n.endsWith(JPGX)) return retentionSweepFile("/" + n, size);
+    }
+    return 1;
+}
+
+
+// remove one file (or empty folder) older than the catalog, returns 0 if there are none or it failed
+static bool retentionSweep() {
+    if (retSweepDone) return 0;
+    if (retSweepFolder == "/") return retentionSweepRoot();
+    if (!retSweepDir) {                          // on to the oldest hour folder below where the sweep is
+        String limit = retentionCatalogStart();
+        uint8_t depth = 0;
+        for (uint16_t i = 0; i < retSweepFolder.length(); i++) if (retSweepFolder.c_str()[i] == '/') depth++;
+        for (String sub; depth < 4 && (sub = retentionOldestIn(retSweepFolder)) != ""; depth++) retSweepFolder += "/" + sub;
+        if (limit == "" || retSweepFolder.compareTo(limit) >= 0 || limit.startsWith(retSweepFolder + "/")) {
+            retSweepDone = 1;
+            return 0;
+        }
+        retSweepDir = SD_MMC.open(retSweepFolder);
+        if (!retSweepDir) {
+            retSweepDone = 1;
+            return 0;
+        }
+    }
+    File f = retSweepDir.openNextFile();
+    if (!f) {                                    // emptied, carry on from the folder above (the root folder after a year)
+        retSweepDir.close();
+        if (!SD_MMC.rmdir(retSweepFolder)) {
+            retFailures++;
+            retSweepDone = 1;
+            log_system_message("Error: unable to remove folder " + retSweepFolder + " from sd card");
+            return 0;
+        }
+        retSweepFolder = retSweepFolder.substring(0, retSweepFolder.lastIndexOf('/'));
+        if (retSweepFolder == "") retSweepFolder = "/";
+        return 1;
+    }
+    String path = f.name();
+    path = retSweepFolder + "/" + path.substring(path.lastIndexOf('/') + 1);
+    bool isDir = f.isDirectory();
+    uint64_t size = f.size();
+    f.close();
+    if (isDir) {
+        retFailures++;
+        retSweepDone = 1;
+        log_system_message("Error: unable to remove " + path + " from sd card");
+        return 0;
+    }
+    return retentionSweepFile(path, size);
+}
+
+
+// one time slice of work, returns 1 if there is more to do
+static bool retentionSliceWork() {
+    uint32_t startTime = millis();
+    uint32_t t = now();
+    while ((unsigned long)(millis() - startTime) < retentionSlice) {
+        if (retFull && retUsed <= retTotal * retentionLowWater / 100) {
+            retFull = 0;
+            retentionSweepReset();
+        }
+        if (retFull && retentionSweep()) continue;                // images older than the catalog go first
+
+        catEntry_t o, m;
+        uint32_t os = retentionNext(RET_OTHER, &o);
+        uint32_t ms = retentionNext(RET_MOTION, &m);
+        if (!os && !ms) {
+            if (retFull) log_system_message("SD card is full but there are no more images to remove");
+            retFull = 0;
+            retentionSweepReset();
+            return 0;
+        }
+        catEntry_t &oldest = (!ms || (os && os < ms)) ? o : m;
+
+        if (os && retentionMaxDaysOther && o.time && o.time + retentionMaxDaysOther * 86400UL < t) retentionRemove(o);
+        else if (ms && retentionMaxDaysMotion && m.time && m.time + retentionMaxDaysMotion * 86400UL < t) retentionRemove(m);
+        else if (retFull) retentionRemove((retentionOtherFirst && os) ? o : oldest);
+        else return 0;
+    }
+    return 1;
+}
+
+
+static void retentionTask(void *) {
+    uint32_t lastCheck = 0;
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(retentionInterval));
+        if (!SD_Present) continue;
+        if (retCheckNow || lastCheck == 0 || (unsigned long)(millis() - lastCheck) >= retentionInterval) {
+            retCheckNow = 0;
+            lastCheck = millis();
+            retTotal = SD_MMC.totalBytes();
+            retUsed = SD_MMC.usedBytes();
+            if (!retFull && retUsed > retTotal * retentionHighWater / 100) {
+                retFull = 1;
+                retPasses++;
+                retentionSweepReset();
+                log_system_message("SD card " + String((uint32_t)(retUsed * 100 / retTotal)) + "% full, removing the oldest images");
+            }
+        }
+        uint32_t startTime = millis();
+        bool wasFull = retFull;
+        while (retentionSliceWork()) vTaskDelay(pdMS_TO_TICKS(retentionPause));
+        if (wasFull) retLastPass = millis() - startTime;
+    }
+}
+
+
+// ----------------------------------------------------------------
+//                         -start the task
+// ----------------------------------------------------------------
+// called from setup after the catalog has been loaded
+
+bool retentionSetup() {
+    if (!SD_Present) return 1;
+    if (xTaskCreate(retentionTask, "retention", 4096, NULL, 1, &retentionTaskHandle) != pdPASS) {
+        log_system_message("Error: Unable to start sd card retention task");
+        return 0;
+    }
+    return 1;
+}
+
+
+// called after each image is saved to the sd card so images past their max age are removed as they go,
+//   checkSpace = check how full the sd card is now (e.g. when a file could not be created)
+void retentionWake(bool checkSpace) {
+    if (checkSpace) retCheckNow = 1;
+    if (retentionTaskHandle) xTaskNotifyGive(retentionTaskHandle);
+}
+
+
+// retention status for the root web page
+String retentionStatus() {
+    if (retRemoved == 0 && retSwept == 0 && retTotal == 0) return "";
+    String reply = "SD retention: " + String((uint32_t)(retTotal ? retUsed * 100 / retTotal : 0)) + "% used";
+    if (retRemoved || retSwept) reply += ", " + String(retRemoved + retSwept) + " images removed (" + String(retRemovedKB / 1024) + "MB)";
+    if (retSwept) reply += ", " + String(retSwept) + " older than the catalog";
+    if (retClips) reply += ", " + String(retClips) + " clips";
+    if (retPasses) reply += ", last pass " + String(retLastPass) + "ms";
+    if (retFailures) reply += " <font color='#FF0000'>" + String(retFailures) + " could not be removed</font>";
+    return reply;
+}
+
+// ---------------------------------------------- end ----------------------------------------------
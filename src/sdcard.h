@@ -0,0 +1,219 @@
+/**************************************************************************************************
+ *
+ *                  SD card - folder for each hour, large aligned writes and clip files
+ *
+ *      Images were all saved in the root folder of the sd card, FAT has to search the whole folder each time
+ *      a file is created so this gets slower and slower once there are thousands of them.  They now go in a
+ *      folder for each hour:   /2026/10/18/12/2026-10-18T12_00_00Z-L.jpg
+ *
+ *      The images are in psram which the sd card driver can not use for DMA, given a psram buffer it copies
+ *      and writes one 512 byte sector at a time.  Images are copied in to a buffer in internal ram instead
+ *      and written sdWriteChunk bytes at a time, a factor of the FAT cluster size so as files start on a
+ *      cluster each write is one multi-sector write within a cluster.
+ *
+ *      With sdClipFiles set the frames from before a trigger (pre-roll, see preroll.h) are put one after the
+ *      other in one clip file per event (<event>-P.mjpg) instead of a file each.  The clip is made
+ *      sdClipPrealloc long when it is created so its clusters are allocated together, and cut to the length
+ *      used when the next clip is started (a clip being written when the esp32 restarts keeps its spare space).
+ *
+ **************************************************************************************************/
+
+// usage:   sdSaveImage("2026-10-18T12:00:00Z-L", buf, len);
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const size_t sdWriteChunk = 8192;                // bytes per write to the card (a multiple of 512, best a factor of the cluster size)
+bool sdClipFiles = 0;                            // put the pre-roll frames of an event in one clip file
+const uint32_t sdClipPrealloc = 1024 * 1024;     // space allocated for a new clip file (bytes)
+//  ------------------------------------------------------------------
+
+#include <unistd.h>                              // truncate()
+
+// forward declarations
+String sdFolder(String name);
+String sdFileName(String name);
+bool sdInClip(String name);
+String sdClipName(String name);
+bool sdSaveImage(String name, const uint8_t *buf, size_t len);
+String sdStatus();
+void retentionWake(bool checkSpace);             // retention.h
+
+
+uint8_t *sdChunk = NULL;                         // dma capable buffer for writing to the card
+String sdLastFolder = "";                        // folder which is known to exist
+String sdClipEvent = "";                         // event of the open clip file
+String sdClipPath = "";
+uint32_t sdClipPos = 0;                          // bytes written to it
+
+// stats
+uint32_t sdFiles = 0;
+uint32_t sdKBytes = 0;
+uint32_t sdWriteTime = 0;                        // time spent writing images (ms)
+uint32_t sdMaxTime = 0;                          // longest time to write an image (ms)
+uint32_t sdFolders = 0;                          // folders created
+uint32_t sdClips = 0;
+
+
+// folder on the sd card for an image  e.g. "2026-10-18T12:00:00Z-L" goes in /2026/10/18/12
+//   images from when the time was not known go in /unknown
+String sdFolder(String name) {
+    const uint8_t digits[] = {0, 1, 2, 3, 5, 6, 8, 9, 11, 12};     // YYYY-MM-DDTHH
+    if (name.length() < 13) return "/unknown";
+    for (uint8_t i = 0; i < sizeof(digits); i++) {
+        if (!isdigit(name.c_str()[digits[i]])) return "/unknown";
+    }
+    return "/" + name.substring(0, 4) + "/" + name.substring(5, 7) + "/" + name.substring(8, 10) + "/" + name.substring(11, 13);
+}
+
+
+// file name on the sd card of an image
+String sdFileName(String name) {
+    String FileName = sdFolder(name) + "/" + name + JPGX;
+    FileName.replace(":", "_");
+    return FileName;
+}
+
+
+// clip file a pre-roll frame goes in (pre-roll frames are named <event>-P<n>), "" if it is not a pre-roll frame
+String sdClipName(String name) {
+    int p = name.lastIndexOf("-P");
+    if (p <= 0 || !isdigit(name.c_str()[p + 2])) return "";
+    String event = name.substring(0, p);
+    String path = sdFolder(event) + "/" + event + "-P.mjpg";
+    path.replace(":", "_");
+    return path;
+}
+
+
+// if this image goes in a clip file rather than a file of its own
+bool sdInClip(String name) {
+    return sdClipFiles && sdClipName(name) != "";
+}
+
+
+// create a folder and those above it
+static bool sdMakeFolder(String folder) {
+    if (folder == sdLastFolder) return 1;
+    for (int p = folder.indexOf('/', 1); ; p = folder.indexOf('/', p + 1)) {
+        String part = (p < 0) ? folder : folder.substring(0, p);
+        if (!SD_MMC.exists(part)) {
+            if (!SD_MMC.mkdir(part)) {
+                log_system_message("Error: unable to create folder on sd card: " + part);
+                return 0;
+            }
+            sdFolders++;
+        }
+        if (p < 0) break;
+    }
+    sdLastFolder = folder;
+    return 1;
+}
+
+
+// write an image to an open file through the internal ram buffer
+static bool sdWriteData(File &file, const uint8_t *buf, size_t len) {
+    if (!sdChunk) sdChunk = (uint8_t *)heap_caps_malloc(sdWriteChunk, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+    if (!sdChunk) return (file.write(buf, len) == len);              // no memory for it, write straight from psram
+    for (size_t pos = 0; pos < len; pos += sdWriteChunk) {
+        size_t n = min(sdWriteChunk, len - pos);
+        memcpy(sdChunk, buf + pos, n);
+        if (file.write(sdChunk, n) != n) return 0;
+    }
+    return 1;
+}
+
+
+// ----------------------------------------------------------------
+//                          -clip files
+// ----------------------------------------------------------------
+
+// cut the clip file to the length used
+static void sdClipClose() {
+    if (sdClipPath == "") return;
+    if (truncate(("/sdcard" + sdClipPath).c_str(), sdClipPos) != 0) log_system_message("Error: unable to trim clip file " + sdClipPath);
+    sdClipPath = "";
+    sdClipEvent = "";
+}
+
+
+static bool sdClipAdd(String name, const uint8_t *buf, size_t len) {
+    String event = name.substring(0, name.lastIndexOf("-P"));
+    if (event != sdClipEvent) {
+        sdClipClose();
+        String path = sdClipName(name);
+        if (!sdMakeFolder(sdFolder(event))) return 0;
+        File file = SD_MMC.open(path, FILE_WRITE);
+        if (!file) {
+            log_system_message("Error: Failed to create clip file on sd-card: " + path);
+            return 0;
+        }
+        file.seek(sdClipPrealloc - 1);                          // writing past the end allocates the clusters in between
+        file.write((uint8_t)0);
+        file.close();
+        sdClipEvent = event;
+        sdClipPath = path;
+        sdClipPos = 0;
+        sdClips++;
+    }
+    File file = SD_MMC.open(sdClipPath, "r+");
+    bool ok = file && file.seek(sdClipPos) && sdWriteData(file, buf, len);
+    file.close();
+    if (!ok) {
+        log_system_message("Error: failed to add frame to clip file " + sdClipPath);
+        return 0;
+    }
+    sdClipPos += len;
+    return 1;
+}
+
+
+// ----------------------------------------------------------------
+//                         -save an image
+// ----------------------------------------------------------------
+// name = image name without extension  e.g. "2026-10-18T12:00:00Z-L"
+
+bool sdSaveImage(String name, const uint8_t *buf, size_t len) {
+    uint32_t startTime = millis();
+    bool ok;
+    String FileName;
+    if (sdInClip(name)) {
+        ok = sdClipAdd(name, buf, len);
+        FileName = sdClipPath;
+    } else {
+        FileName = sdFileName(name);
+        if (!sdMakeFolder(sdFolder(name))) return 0;
+        File file = SD_MMC.open(FileName, FILE_WRITE);
+        if (!file) {
+            log_system_message("Error: Failed to create file on sd-card: " + FileName);
+            sdLastFolder = "";                                     // the card may have been changed
+            retentionWake(1);                                      // or be full
+            return 0;
+        }
+        ok = sdWriteData(file, buf, len);
+        file.close();
+        if (!ok) log_system_message("Error: failed to save image to sd card");
+    }
+    uint32_t ms = millis() - startTime;
+    if (ok) {
+        sdFiles++;
+        sdKBytes += len / 1024;
+        sdWriteTime += ms;
+        if (ms > sdMaxTime) sdMaxTime = ms;
+        DBG("Saved image to sd card: %s in %ums\n", FileName.c_str(), ms);
+        retentionWake(0);
+    }
+    return ok;
+}
+
+
+// sd card status for the root web page
+String sdStatus() {
+    if (sdFiles == 0) return "";
+    String reply = "SD card: " + String(sdFiles) + " images " + String(sdKBytes) + "K";
+    if (sdWriteTime) reply += " at " + String(sdKBytes * 1000.0 / sdWriteTime, 1) + "K/s";
+    reply += " max " + String(sdMaxTime) + "ms, " + String(sdFolders) + " folders created";
+    if (sdClips) reply += ", " + String(sdClips) + " clips";
+    return reply;
+}
+
+// ---------------------------------------------- end ----------------------------------------------
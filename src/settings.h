@@ -0,0 +1,358 @@
+/**************************************************************************************************
+ *
+ *                  Settings - kept as one binary record in nvs (esp32 non volatile storage)
+ *
+ *      The settings used to be a text file in Spiffs with one value per line in a fixed order, it was removed
+ *      and written again each time a setting was changed from the web page, and read back a line at a time at
+ *      boot.  They are now one packed record:
+ *
+ *          magic, version, length of the data, crc of the data   followed by the settings
+ *
+ *      stored as a blob in nvs.  Nvs writes the new copy before it marks the old one as erased so there is no
+ *      time where the settings are missing if the power fails, it is read back in microseconds and a save
+ *      which changes nothing does not write to the flash at all.
+ *
+ *      New settings are added to the end of settingsRecord_t and settingsVersion increased, a record saved
+ *      by an older version is shorter, the settings it does not have keep their defaults and it is saved
+ *      again in the new format.  If there is no record but there is a settings.txt in Spiffs that is loaded
+ *      instead, saved as a record and renamed to settings.old.
+ *
+ **************************************************************************************************/
+
+// usage:   settingsLoad();       // in setup once Spiffs is mounted
+//          settingsSave();       // whenever a setting is changed
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const char settingsNamespace[] = "camera";       // nvs namespace
+const char settingsKey[] = "settings";           // nvs key of the record
+const char settingsTextFile[] = "/settings.txt"; // the old settings file
+//  ------------------------------------------------------------------
+
+#include <Preferences.h>
+#include <rom/crc.h>
+
+#define SETTINGS_MAGIC 0x5453                    // "ST"
+#define SETTINGS_VERSION 1
+
+// flags
+#define SET_EMAIL     0x01                       // emailWhenTriggered
+#define SET_DETECTION 0x02                       // DetectionEnabled
+#define SET_FLASH     0x04                       // UseFlash
+#define SET_FTP       0x08                       // ftpImages
+#define SET_POST      0x10                       // PostImages
+#define SET_INVERT    0x20                       // cameraImageInvert
+
+struct settingsHeader_t {
+    uint16_t magic;
+    uint8_t version;
+    uint8_t size;                                // bytes of settings after the header
+    uint32_t crc;                                // crc32 of them
+} __attribute__((packed));
+
+struct settingsRecord_t {
+    settingsHeader_t h;
+    // version 1
+    uint16_t blockThreshold;
+    uint16_t imageThresholdL;
+    uint16_t imageThresholdH;
+    uint16_t targetBrightness;
+    uint16_t triggerLimitTime;
+    uint16_t emailLimitTime;
+    uint16_t exposure;
+    uint16_t gain;
+    uint16_t counterTrigger;
+    uint16_t dataRefresh;
+    int16_t spiffsFileCounter;
+    uint16_t flags;                              // SET_xxx
+    uint16_t mask;                               // detection mask, bit (y * mask_columns + x)
+} __attribute__((packed));
+
+// forward declarations
+void settingsLoad();
+void settingsSave();
+String settingsStatus();
+
+
+settingsRecord_t settingsSaved;                  // the record in nvs
+uint32_t settingsLoadTime = 0;                   // time taken to load the settings at boot (us)
+uint32_t settingsWrites = 0;
+uint32_t settingsFailures = 0;
+String settingsSource = "defaults";              // where the settings were loaded from
+
+
+// record of the current settings
+static void settingsFill(settingsRecord_t &r) {
+    memset(&r, 0, sizeof(r));
+    r.blockThreshold = Block_threshold;
+    r.imageThresholdL = Image_thresholdL;
+    r.imageThresholdH = Image_thresholdH;
+    r.targetBrightness = targetBrightness;
+    r.triggerLimitTime = TriggerLimitTime;
+    r.emailLimitTime = EmailLimitTime;
+    r.exposure = cameraImageExposure;
+    r.gain = cameraImageGain;
+    r.counterTrigger = tCounterTrigger;
+    r.dataRefresh = dataRefresh;
+    r.spiffsFileCounter = SpiffsFileCounter;
+    r.flags = (emailWhenTriggered ? SET_EMAIL : 0) | (DetectionEnabled ? SET_DETECTION : 0) | (UseFlash ? SET_FLASH : 0) |
+              (ftpImages ? SET_FTP : 0) | (PostImages ? SET_POST : 0) | (cameraImageInvert ? SET_INVERT : 0);
+    for (int y = 0; y < mask_rows; y++)
+        for (int x = 0; x < mask_columns; x++)
+            if (mask_frame[x][y]) r.mask |= 1 << (y * mask_columns + x);
+    r.h.magic = SETTINGS_MAGIC;
+    r.h.version = SETTINGS_VERSION;
+    r.h.size = sizeof(r) - sizeof(r.h);
+    r.h.crc = crc32_le(0, (const uint8_t *)&r + sizeof(r.h), r.h.size);
+}
+
+
+// set the settings from a record
+static void settingsApply(const settingsRecord_t &r) {
+    Block_threshold = r.blockThreshold;
+    Image_thresholdL = r.imageThresholdL;
+    Image_thresholdH = r.imageThresholdH;
+    targetBrightness = r.targetBrightness;
+    TriggerLimitTime = r.triggerLimitTime;
+    EmailLimitTime = r.emailLimitTime;
+    cameraImageExposure = r.exposure;
+    cameraImageGain = r.gain;
+    tCounterTrigger = r.counterTrigger;
+    dataRefresh = r.dataRefresh;
+    if (r.spiffsFileCounter >= 0 && r.spiffsFileCounter <= MaxSpiffsImages) SpiffsFileCounter = r.spiffsFileCounter;
+    emailWhenTriggered = r.flags & SET_EMAIL;
+    DetectionEnabled = (r.flags & SET_DETECTION) ? 1 : 0;      // if it was paused restart it
+    UseFlash = r.flags & SET_FLASH;
+    ftpImages = r.flags & SET_FTP;
+    PostImages = r.flags & SET_POST;
+    cameraImageInvert = r.flags & SET_INVERT;
+    mask_active = 0;
+    for (int y = 0; y < mask_rows; y++) {
+        for (int x = 0; x < mask_columns; x++) {
+            mask_frame[x][y] = (r.mask >> (y * mask_columns + x)) & 1;
+            mask_active += mask_frame[x][y];
+        }
+    }
+}
+
+
+// ----------------------------------------------------------------
+//                -load the old settings.txt file
+// ----------------------------------------------------------------
+// read a line of text from Spiffs file and parse an integer from it
+//     I realise this is complicating things for no real benefit but I wanted to learn to use pointers ;-)
+static void ReadLineSpiffs(File* file, String* line, uint16_t* tnum) {
+    File tfile = *file;
+    String tline = *line;
+    tline = tfile.readStringUntil('\n');
+    *tnum = tline.toInt();
+}
+
+static bool settingsLoadText() {
+    if (!SPIFFS.exists(settingsTextFile)) return 0;
+    File file = SPIFFS.open(settingsTextFile, "r");
+    if (!file || file.isDirectory()) {
+        log_system_message("Unable to open settings file from Spiffs");
+        return 0;
+    }
+
+    log_system_message("Loading settings from Spiffs");
+
+    // read contents of file
+    String line;
+    uint16_t tnum;
+
+    ReadLineSpiffs(&file, &line, &tnum);      // ignore first line as it is just a title
+
+    // line 1 - Block_threshold
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum < 1 || tnum > 255) log_system_message("invalid Block_threshold in settings");
+    else Block_threshold = tnum;
+
+    // line 2 - min Image_thresholdL
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum < 0 || tnum > 255) log_system_message("invalid min_day_image_threshold in settings");
+    else Image_thresholdL = tnum;
+
+    // line 3 - min Image_thresholdH
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum < 0 || tnum > 255) log_system_message("invalid max_day_image_threshold in settings");
+    else Image_thresholdH = tnum;
+
+    // line 4 - target brightness level
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum < 0 || tnum > 255) log_system_message("invalid night/night brightness cuttoff in settings");
+    else targetBrightness = tnum;
+
+    // line 5 - emailWhenTriggered
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum == 0) emailWhenTriggered = 0;
+    else if (tnum == 1) emailWhenTriggered = 1;
+    else log_system_message("Invalid emailWhenTriggered in settings: " + line);
+
+    // line 6 - TriggerLimitTime
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum < 1 || tnum > 3600) log_system_message("invalid TriggerLimitTime in settings");
+    else TriggerLimitTime = tnum;
+
+    // line 7 - DetectionEnabled
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum == 2) tnum = 1;     // if it was paused restart it
+    if (tnum == 0) DetectionEnabled = 0;
+    else if (tnum == 1) DetectionEnabled = 1;
+    else log_system_message("Invalid DetectionEnabled in settings: " + line);
+
+    // line 8 - EmailLimitTime
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum < 60 || tnum > 10000) log_system_message("invalid EmailLimitTime in settings");
+    else EmailLimitTime = tnum;
+
+    // line 9 - UseFlash
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum == 0 || tnum == 1) UseFlash = (bool)tnum;
+    else log_system_message("Invalid UseFlash in settings: " + line);
+
+    // line 10 - SpiffsFileCounter
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum > MaxSpiffsImages) log_system_message("invalid SpiffsFileCounter in settings");
+    else SpiffsFileCounter = tnum;
+
+    // line 11 - cameraImageExposure
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum < 0 || tnum > 1200) log_system_message("invalid exposure in settings");
+    else cameraImageExposure = tnum;
+
+    // line 12 - cameraImageGain
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum > 31) log_system_message("invalid gain in settings");
+    else cameraImageGain = tnum;
+
+    // line 13 - tCounterTrigger
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum > 31) log_system_message("invalid consecutive detections in settings");
+    else tCounterTrigger = tnum;
+
+    // line 14 - ftpImages
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum == 0) ftpImages = 0;
+    else if (tnum == 1) ftpImages = 1;
+    else log_system_message("Invalid FTP in settings: " + line);
+
+    // line 15 - PostImages
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum == 0) PostImages = 0;
+    else if (tnum == 1) PostImages = 1;
+    else log_system_message("Invalid Post in settings: " + line);
+
+    // line 16 - cameraImageInvert
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum == 0) cameraImageInvert = 0;
+    else if (tnum == 1) cameraImageInvert = 1;
+    else log_system_message("Invalid cameraImageInvert in settings: " + line);
+
+    // line 17 - dataRefresh
+    ReadLineSpiffs(&file, &line, &tnum);
+    if (tnum < 1 || tnum > 600) log_system_message("invalid dataRefresh in settings");
+    else dataRefresh = tnum;
+
+    // Detection mask grid
+    bool gerr = 0;
+    mask_active = 0;
+    for (int y = 0; y < mask_rows; y++) {
+        for (int x = 0; x < mask_columns; x++) {
+            ReadLineSpiffs(&file, &line, &tnum);
+            if (tnum == 1) {
+                mask_frame[x][y] = 1;
+                mask_active ++;
+            }
+            else if (tnum == 0) mask_frame[x][y] = 0;
+            else gerr = 1;    // flag invalid entry
+        }
+    }
+    if (gerr) log_system_message("invalid mask entry in settings");
+    file.close();
+    return 1;
+}
+
+
+// ----------------------------------------------------------------
+//                       -load the settings
+// ----------------------------------------------------------------
+// called from setup once Spiffs is mounted
+
+void settingsLoad() {
+    uint32_t startTime = micros();
+    settingsFill(settingsSaved);                            // the defaults, for any settings the record does not have
+    uint8_t buf[256];                                       // room for a record from a later version
+    Preferences prefs;
+    size_t len = 0;
+    if (prefs.begin(settingsNamespace, true)) {
+        len = prefs.getBytes(settingsKey, buf, sizeof(buf));
+        prefs.end();
+    }
+
+    settingsHeader_t h;
+    memcpy(&h, buf, sizeof(h));
+    if (len >= sizeof(h) && h.magic == SETTINGS_MAGIC && sizeof(h) + h.size <= len &&
+        crc32_le(0, buf + sizeof(h), h.size) == h.crc) {
+        settingsRecord_t r = settingsSaved;
+        memcpy((uint8_t *)&r + sizeof(h), buf + sizeof(h), min((size_t)h.size, sizeof(r) - sizeof(h)));
+        settingsApply(r);
+        settingsLoadTime = micros() - startTime;
+        settingsSource = "nvs";
+        if (h.version < SETTINGS_VERSION) {
+            log_system_message("Settings record is version " + String(h.version) + ", updating it");
+            settingsSaved.h.magic = 0;                      // force it to be written
+            settingsSave();
+        } else {
+            settingsFill(settingsSaved);
+        }
+        return;
+    }
+    if (len) log_system_message("Error: settings record in nvs is not valid, using defaults");
+
+    // no record yet, bring over the settings from the old text file
+    if (settingsLoadText()) {
+        settingsSource = "settings.txt";
+        settingsSaved.h.magic = 0;
+        settingsSave();
+        if (settingsWrites) {
+            SPIFFS.remove("/settings.old");
+            SPIFFS.rename(settingsTextFile, "/settings.old");
+        }
+    } else {
+        log_system_message("No settings found, using defaults");
+    }
+    settingsLoadTime = micros() - startTime;
+}
+
+
+// ----------------------------------------------------------------
+//                       -save the settings
+// ----------------------------------------------------------------
+
+void settingsSave() {
+    settingsRecord_t r;
+    settingsFill(r);
+    if (memcmp(&r, &settingsSaved, sizeof(r)) == 0) return;          // nothing has changed
+    Preferences prefs;
+    bool ok = prefs.begin(settingsNamespace, false) && prefs.putBytes(settingsKey, &r, sizeof(r)) == sizeof(r);
+    prefs.end();
+    if (!ok) {
+        settingsFailures++;
+        log_system_message("Error: unable to save settings to nvs");
+        return;
+    }
+    settingsSaved = r;
+    settingsWrites++;
+}
+
+
+// settings status for the root web page
+String settingsStatus() {
+    String reply = "Settings: from " + settingsSource + " in " + String(settingsLoadTime) + "us, " + String(settingsWrites) + " saved";
+    if (settingsFailures) reply += " <font color='#FF0000'>" + String(settingsFailures) + " could not be saved</font>";
+    return reply;
+}
+
+// ---------------------------------------------- end ----------------------------------------------
@@ -0,0 +1,382 @@
+/**************************************************************************************************
+ *
+ *                  Image sinks - save/send captured images in the background
+ *
+ *      A captured image is stored in Spiffs, on the sd card, sent via FTP / POST and emailed.  Doing these one
+ *      after the other meant the camera was not back detecting motion until the slowest of them (usually a
+ *      network upload) had finished.  Each destination is now a 'sink' with its own queue and task, an image is
+ *      handed to all the sinks which want it at once and they work on it in parallel while detection carries on.
+ *
+ *      An image (ImageJob) counts how many sinks are still using it and the last one to finish releases it
+ *      (returns the camera frame buffer, frees the copy or calls the owners release function).
+ *
+ *      Note: a job holding a camera frame buffer must be finished with before the camera is restarted, see
+ *            sinksWaitForFrames() - so where possible jobs are given a copy of the image in psram instead.
+ *
+ **************************************************************************************************/
+
+// usage:   ImageJob *job = imageJobCopy(fb, eventName + "-L", SINK_ALL);     // copy of the photo (returns fb)
+//          job->spiffsName = String(SpiffsFileCounter);                        // also store it in Spiffs as the trigger image
+//          imageDispatch(job);                                                 // hand it to the sinks
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const uint8_t sinkQueueLength = 64;                // images each sink can have waiting (a pre-roll flush queues one per frame)
+//  ------------------------------------------------------------------
+
+// sinks an image is to be sent to
+#define SINK_SPIFFS 0x01
+#define SINK_SD     0x02
+#define SINK_FTP    0x04
+#define SINK_POST   0x08
+#define SINK_EMAIL  0x10
+#define SINK_ALL    0x1F
+
+
+struct ImageJob {
+    const uint8_t *buf;                            // jpg data
+    size_t len;
+    String name;                                   // file name for sd card/FTP/POST without extension  e.g. "2023-02-16T12:00:00Z-L"
+    String spiffsName;                             // file name in Spiffs without extension ("" = not stored in Spiffs)
+    uint8_t sinks;                                 // SINK_xxx flags of where the image is to go
+    uint8_t priority;                              // upload priority OUT_xxx (see outbound.h)
+    uint32_t queued;                               // millis() when handed to the sinks
+    camera_fb_t *fb;                               // camera frame buffer to return when finished with
+    uint8_t *copy;                                 // allocated copy of the image to free when finished with
+    void (*release)(ImageJob *);                   // called when finished with (instead of the above)
+    uint8_t refs;                                  // number of sinks still using the image
+    uint16_t score;                                // motion score for the catalog (catalog.h)
+    uint32_t catSeq;                               // catalog no. (0 = not catalogued)
+};
+
+// forward declarations
+ImageJob *imageJob(const uint8_t *buf, size_t len, String name, uint8_t sinks);
+ImageJob *imageJobCopy(camera_fb_t *fb, String name, uint8_t sinks);
+bool imageDispatch(ImageJob *job);
+bool sinksSetup();
+bool sinksWaitForFrames(uint32_t timeout);
+String sinksStatus();
+bool spoolFailed(const uint8_t *buf, size_t len, String fName, int status);      // spool.h
+
+portMUX_TYPE sinkMux = portMUX_INITIALIZER_UNLOCKED;  // guards the image reference counts
+volatile uint8_t sinkFramesHeld = 0;               // number of jobs holding a camera frame buffer
+
+
+// ----------------------------------------------------------------
+//                      -a destination for images
+// ----------------------------------------------------------------
+
+class ImageSink {
+
+    public:
+    const char *name;
+    uint8_t flag;                                  // SINK_xxx
+    uint32_t saved = 0;                            // images handled ok
+    uint32_t failed = 0;                           // images which failed or were dropped as the queue was full
+    uint32_t lastTime = 0;                         // time from the latest image being dispatched until this sink had finished with it (ms)
+    uint32_t maxTime = 0;
+    uint32_t totalTime = 0;
+
+    ImageSink(const char *sinkName, uint8_t sinkFlag, bool (*writer)(ImageJob *)) {
+        name = sinkName;
+        flag = sinkFlag;
+        _write = writer;
+    }
+
+    bool begin(uint32_t stackSize) {
+        if (_queue) return 1;
+        _queue = xQueueCreate(sinkQueueLength, sizeof(ImageJob *));
+        if (!_queue) return 0;
+        return (xTaskCreate(task, name, stackSize, this, 1, NULL) == pdPASS);
+    }
+
+    // queue an image (does not wait if the queue is full)
+    bool add(ImageJob *job) {
+        if (_queue && xQueueSend(_queue, &job, 0) == pdTRUE) return 1;
+        failed++;
+        logPrintf(LOG_ERROR, "Error: %s queue full, image '%s' dropped", name, job->name.c_str());
+        return 0;
+    }
+
+    uint8_t waiting() { return _queue ? uxQueueMessagesWaiting(_queue) : 0; }
+
+    private:
+    QueueHandle_t _queue = NULL;
+    bool (*_write)(ImageJob *);
+
+    static void task(void *param) {
+        ImageSink *sink = (ImageSink *)param;
+        ImageJob *job;
+        for (;;) {
+            if (xQueueReceive(sink->_queue, &job, portMAX_DELAY) != pdTRUE) continue;
+            bool ok = sink->_write(job);
+            uint32_t ms = millis() - job->queued;
+            if (ok) sink->saved++;
+            else sink->failed++;
+            sink->lastTime = ms;
+            sink->totalTime += ms;
+            if (ms > sink->maxTime) sink->maxTime = ms;
+            imageRelease(job);
+        }
+    }
+
+    public:
+    // called by each sink when it has finished with an image, the last one frees it
+    static void imageRelease(ImageJob *job) {
+        portENTER_CRITICAL(&sinkMux);
+        bool last = (--job->refs == 0);
+        portEXIT_CRITICAL(&sinkMux);
+        if (!last) return;
+        if (job->release) job->release(job);
+        else if (job->fb) esp_camera_fb_return(job->fb);
+        if (job->fb) {
+            portENTER_CRITICAL(&sinkMux);
+            sinkFramesHeld--;
+            portEXIT_CRITICAL(&sinkMux);
+        }
+        if (job->copy) heap_caps_free(job->copy);
+        delete job;
+    }
+};
+
+
+// ----------------------------------------------------------------
+//                         -sink writers
+// ----------------------------------------------------------------
+
+// Spiffs - written to the image store (imgstore.h) if there is an image partition otherwise to Spiffs
+//   Spiffs is not formatted if the write fails (as it was before the sinks) as the journal, spool and catalog
+//   may have files open in it, the image just fails (and is counted) - it can be formatted from the web page
+static bool spiffsWrite(ImageJob *job) {
+    if (imgStoreReady()) {
+        uint32_t seq;
+        bool ok = imgStoreWrite(job->spiffsName, job->buf, job->len, &seq);
+        if (ok) catalogStored(job->catSeq, CAT_FLASH, seq);
+        if (ok) DBG("The picture has been stored as %s - Size: %u bytes\n", job->spiffsName.c_str(), (unsigned)job->len);
+        return ok;
+    }
+    String FileName = "/" + job->spiffsName + JPGX;
+    SPIFFS.remove(FileName);                               // delete old image file if it exists
+    File file = SPIFFS.open(FileName, FILE_WRITE);
+    bool ok = file && file.write(job->buf, job->len) == job->len;
+    file.close();
+    if (!ok) {
+        SPIFFS.remove(FileName);                           // not left part written
+        logPrintf(LOG_ERROR, "Error: unable to write image %s to Spiffs", FileName.c_str());
+        return 0;
+    }
+    DBG("The picture has been saved as %s - Size: %u bytes\n", FileName.c_str(), (unsigned)job->len);
+    return 1;
+}
+
+
+// sd card - see sdcard.h
+static bool sdWrite(ImageJob *job) {
+    bool ok = sdSaveImage(job->name, job->buf, job->len);
+    if (ok) catalogStored(job->catSeq, CAT_SD, 0);
+    return ok;
+}
+
+#ifdef FTP_ENABLED
+static bool ftpWrite(ImageJob *job) {
+    outboundAcquire(job->priority, job->len);
+    bool ok = uploadImageByFTP((uint8_t *)job->buf, job->len, job->name);
+    outboundRelease(job->priority, ok ? job->len : 0);
+    return ok;
+}
+#endif
+
+#if POST_ENABLED
+static bool postWrite(ImageJob *job) {
+    int status = postImage((uint8_t *)job->buf, job->len, job->name + JPGX, job->priority);
+    if (status / 100 == 2) return 1;
+    spoolFailed(job->buf, job->len, job->name + JPGX, status);        // keep it to send later (unless rejected)
+    return 0;
+}
+#endif
+
+#ifdef EMAIL_ENABLED
+// the photo is attached to the next trigger email (see emailTrigger in email.h)
+static void emailJobRelease(void *job) {
+    ImageSink::imageRelease((ImageJob *)job);
+}
+
+static bool emailWrite(ImageJob *job) {
+    String tt = job->name.substring(0, job->name.lastIndexOf('-'));       // event name is the time it was triggered
+    if (!job->copy) {                                                     // not ours to hold on to, email.h keeps a copy
+        emailTrigger(tt, job->buf, job->len, job->name + JPGX, NULL, NULL);
+        return 1;
+    }
+    portENTER_CRITICAL(&sinkMux);                                         // our own copy so the email can hold on to it
+    job->refs++;
+    portEXIT_CRITICAL(&sinkMux);
+    if (!emailTrigger(tt, job->buf, job->len, job->name + JPGX, emailJobRelease, job)) ImageSink::imageRelease(job);
+    return 1;
+}
+#endif
+
+
+ImageSink spiffsSink("Spiffs", SINK_SPIFFS, spiffsWrite);
+ImageSink sdSink("SD", SINK_SD, sdWrite);
+#ifdef FTP_ENABLED
+ImageSink ftpSink("FTP", SINK_FTP, ftpWrite);
+#endif
+#if POST_ENABLED
+ImageSink postSink("POST", SINK_POST, postWrite);
+#endif
+#ifdef EMAIL_ENABLED
+ImageSink emailSink("Email", SINK_EMAIL, emailWrite);
+#endif
+
+ImageSink *imageSinks[] = {
+    &spiffsSink,
+    &sdSink,
+#ifdef FTP_ENABLED
+    &ftpSink,
+#endif
+#if POST_ENABLED
+    &postSink,
+#endif
+#ifdef EMAIL_ENABLED
+    &emailSink,
+#endif
+};
+const uint8_t imageSinkCount = sizeof(imageSinks) / sizeof(imageSinks[0]);
+
+
+// ----------------------------------------------------------------
+//                          -sink tasks
+// ----------------------------------------------------------------
+// called from setup
+
+bool sinksSetup() {
+    bool ok = spiffsSink.begin(4096) && sdSink.begin(4096);
+#ifdef FTP_ENABLED
+    ok = ok && ftpSink.begin(6144);
+#endif
+#if POST_ENABLED
+    ok = ok && postSink.begin(6144);
+#endif
+#ifdef EMAIL_ENABLED
+    ok = ok && emailSink.begin(4096) && emailSetup();
+#endif
+    if (!ok) log_system_message("Error: Unable to start image sink tasks");
+    return ok;
+}
+
+
+// sinks which are currently enabled
+uint8_t sinksEnabled(uint8_t wanted) {
+    uint8_t enabled = SINK_SPIFFS;
+    if (SD_Present) enabled |= SINK_SD;
+    if (ftpImages) enabled |= SINK_FTP;
+    if (PostImages) enabled |= SINK_POST;
+#ifdef EMAIL_ENABLED
+    if (emailWhenTriggered) enabled |= SINK_EMAIL;          // add "&& cameraImageGain == 0" to only email during daylight hours
+                                                            // triggers within EmailLimitTime are gathered in to one email (email.h)
+#endif
+    return enabled & wanted;
+}
+
+
+// ----------------------------------------------------------------
+//                          -image jobs
+// ----------------------------------------------------------------
+
+// image in a buffer owned by the caller (set job->release to find out when it is no longer needed)
+ImageJob *imageJob(const uint8_t *buf, size_t len, String name, uint8_t sinks) {
+    ImageJob *job = new ImageJob;
+    job->buf = buf;
+    job->len = len;
+    job->name = name;
+    job->spiffsName = "";
+    job->sinks = sinks;
+    job->priority = OUT_EVENT;
+    job->queued = 0;
+    job->fb = NULL;
+    job->copy = NULL;
+    job->release = NULL;
+    job->refs = 0;
+    job->score = catalogScore;
+    job->catSeq = 0;
+    return job;
+}
+
+
+// camera frame, copied to psram and the frame buffer returned straight away so the camera can be restarted
+//   if there is no memory for a copy the job keeps the frame buffer (see sinksWaitForFrames)
+ImageJob *imageJobCopy(camera_fb_t *fb, String name, uint8_t sinks) {
+    ImageJob *job = imageJob(fb->buf, fb->len, name, sinks);
+    uint8_t *copy = NULL;
+    if (psramFound()) copy = (uint8_t *)heap_caps_malloc(fb->len, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (copy) {
+        memcpy(copy, fb->buf, fb->len);
+        job->buf = job->copy = copy;
+        esp_camera_fb_return(fb);
+    } else {
+        job->fb = fb;
+    }
+    return job;
+}
+
+
+// hand an image to all the sinks it is for, it is released once they have all finished with it
+//   returns 0 if no sink would take it
+bool imageDispatch(ImageJob *job) {
+    uint8_t sinks = sinksEnabled(job->sinks);
+    if (job->spiffsName == "") sinks &= ~SINK_SPIFFS;
+    if ((sinks & SINK_SPIFFS) || ((sinks & SINK_SD) && !sdInClip(job->name))) {
+        job->catSeq = catalogAdd(job->name, job->spiffsName, job->len, job->score);
+    }
+    job->queued = millis();
+    job->refs = 1;                                  // held until all sinks have been given it
+    if (job->fb) {
+        portENTER_CRITICAL(&sinkMux);
+        sinkFramesHeld++;
+        portEXIT_CRITICAL(&sinkMux);
+    }
+    uint8_t taken = 0;
+    for (uint8_t i = 0; i < imageSinkCount; i++) {
+        ImageSink *sink = imageSinks[i];
+        if (!(sinks & sink->flag)) continue;
+        portENTER_CRITICAL(&sinkMux);
+        job->refs++;
+        portEXIT_CRITICAL(&sinkMux);
+        if (sink->add(job)) taken++;
+        else ImageSink::imageRelease(job);
+    }
+    ImageSink::imageRelease(job);
+    return (taken > 0 || sinks == 0);
+}
+
+
+// wait for jobs holding camera frame buffers to finish (before the camera is restarted)
+bool sinksWaitForFrames(uint32_t timeout) {
+    uint32_t startTime = millis();
+    while (sinkFramesHeld > 0) {
+        if ((unsigned long)(millis() - startTime) > timeout) {
+            log_system_message("Error: timed out waiting for images to be saved");
+            return 0;
+        }
+        delay(10);
+    }
+    return 1;
+}
+
+
+// status of the sinks for the root web page
+String sinksStatus() {
+    String reply = "";
+    for (uint8_t i = 0; i < imageSinkCount; i++) {
+        ImageSink *sink = imageSinks[i];
+        if (sink->saved + sink->failed == 0) continue;
+        reply += (reply == "") ? "Image sinks: " : " - ";
+        reply += String(sink->name) + " " + String(sink->saved) + " ok";
+        if (sink->failed) reply += " <font color='#FF0000'>" + String(sink->failed) + " failed</font>";
+        reply += " avg " + String(sink->totalTime / (sink->saved + sink->failed)) + "ms max " + String(sink->maxTime) + "ms";
+        if (sink->waiting()) reply += " (" + String(sink->waiting()) + " waiting)";
+    }
+    return reply;
+}
+
+// ---------------------------------------------- end ----------------------------------------------
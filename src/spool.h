@@ -0,0 +1,253 @@
+/**************************************************************************************************
+ *
+ *              Upload spool - keep images which failed to POST and send them later
+ *
+ *      If an image can not be sent via POST (wifi down, server not responding) it is written to a spool folder
+ *      on the sd card (or in Spiffs if there is no sd card, limited to spoolMaxSpiffs bytes) instead of being
+ *      lost.  A background task sends the spooled images, oldest first, once the server can be reached again.
+ *      After a failure it waits before trying again, doubling the wait each time (up to spoolMaxBackoff).
+ *
+ *      Only an image which could not be sent or which the server could not take just then (no reply or a 5xx
+ *      status) is spooled.  A 4xx (e.g. 413 too large, 422 not stored) means the server will never take it, so
+ *      it is dropped and counted instead of being retried for ever and holding up the images behind it, and
+ *      the images of a batch which was partly stored are not sent twice.
+ *
+ *      The spool only sends when no other upload is in progress or waiting, and at most one image every
+ *      spoolDrainInterval, so it never holds up the images of a new trigger.
+ *
+ *      Each spooled image is a file "/spool/<sequence number>.spl" holding the upload file name on the
+ *      first line followed by the jpg data, the files survive a restart.
+ *
+ **************************************************************************************************/
+
+// forward declarations
+bool spoolSetup();
+bool spoolAdd(const uint8_t *buf, size_t len, String fName);
+bool spoolFailed(const uint8_t *buf, size_t len, String fName, int status);
+String spoolStatus();
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const char spoolDir[] = "/spool";
+const uint16_t spoolMaxFiles = 500;              // max images in the spool (oldest are dropped)
+const uint32_t spoolMaxSpiffs = 192 * 1024;      // max size of the spool when stored in Spiffs (bytes), Spiffs is 384K (esp32cam-custom.csv)
+const uint32_t spoolDrainInterval = 1000;        // min time between sending spooled images (ms)
+const uint32_t spoolMinBackoff = 5000;           // wait after a failed send (ms), doubles with each failure
+const uint32_t spoolMaxBackoff = 300000;
+//  ------------------------------------------------------------------
+
+
+fs::FS *spoolFS = NULL;                          // where the spool is kept (sd card or Spiffs)
+SemaphoreHandle_t spoolMutex = NULL;
+uint32_t spoolHead = 1;                          // sequence number for the next image
+uint32_t spoolTail = 1;                          // oldest image
+uint32_t spoolBytes = 0;                         // size of the spooled images (approximate after a restart)
+
+// stats
+uint32_t spoolAdded = 0;                         // images added to the spool
+uint32_t spoolSent = 0;                          // spooled images sent ok
+uint32_t spoolDropped = 0;                       // images dropped as the spool was full or could not be written
+uint32_t spoolRejected = 0;                      // images dropped as the server rejected them (4xx)
+uint32_t spoolSendFailures = 0;
+uint32_t spoolBackoff = 0;                       // current wait after a failure (ms)
+uint32_t spoolDrainStart = 0;                    // time the current run of sending spooled images started
+uint32_t spoolDrainCount = 0;                    // images sent in the current run
+
+
+static String spoolFileName(uint32_t seq) {
+    char name[32];
+    snprintf(name, sizeof(name), "%s/%08u.spl", spoolDir, seq);
+    return String(name);
+}
+
+uint32_t spoolCount() { return spoolHead - spoolTail; }
+
+// is an upload which failed with this status worth trying again (0 = nothing sent or no reply)
+static bool spoolRetryable(int status) {
+    return status == 0 || status / 100 == 5;
+}
+
+
+// remove the oldest image from the spool (spoolMutex must be held)
+static void spoolDropOldest() {
+    if (spoolCount() == 0) return;
+    String FileName = spoolFileName(spoolTail);
+    File file = spoolFS->open(FileName, FILE_READ);
+    if (file) {
+        spoolBytes -= min(spoolBytes, (uint32_t)file.size());
+        file.close();
+    }
+    spoolFS->remove(FileName);
+    spoolTail++;
+}
+
+
+// ----------------------------------------------------------------
+//                      -add image to the spool
+// ----------------------------------------------------------------
+// fName = file name to use when it is sent
+bool spoolAdd(const uint8_t *buf, size_t len, String fName) {
+    if (!spoolFS || xSemaphoreTake(spoolMutex, pdMS_TO_TICKS(5000)) != pdTRUE) {
+        spoolDropped++;
+        return 0;
+    }
+    // make room
+    while (spoolCount() >= spoolMaxFiles) { spoolDropOldest(); spoolDropped++; }
+    if (spoolFS == &SPIFFS) {
+        while (spoolCount() && spoolBytes + len > spoolMaxSpiffs) { spoolDropOldest(); spoolDropped++; }
+    }
+    String FileName = spoolFileName(spoolHead);
+    File file = spoolFS->open(FileName, FILE_WRITE);
+    bool ok = file && file.print(fName + "\n") && file.write(buf, len) == len;
+    file.close();
+    if (ok) {
+        spoolHead++;
+        spoolBytes += len;
+        spoolAdded++;
+    } else {
+        spoolFS->remove(FileName);
+        spoolDropped++;
+    }
+    xSemaphoreGive(spoolMutex);
+    if (ok) log_system_message("Image '" + fName + "' spooled to send later (" + String(spoolCount()) + " waiting)");
+    else log_system_message("Error: unable to spool image '" + fName + "'");
+    return ok;
+}
+
+
+// an upload failed with this status: spool the image, or drop it if the server has rejected it
+bool spoolFailed(const uint8_t *buf, size_t len, String fName, int status) {
+    if (spoolRetryable(status)) return spoolAdd(buf, len, fName);
+    spoolRejected++;
+    log_system_message("Error: image '" + fName + "' rejected by the server (status " + String(status) + "), not spooled");
+    return 0;
+}
+
+
+// ----------------------------------------------------------------
+//                  -send the oldest spooled image
+// ----------------------------------------------------------------
+// returns 1 if sent ok (or the entry was unreadable or rejected by the server and has been discarded)
+static bool spoolSendOldest() {
+    if (xSemaphoreTake(spoolMutex, pdMS_TO_TICKS(5000)) != pdTRUE) return 0;
+    uint32_t seq = spoolTail;
+    String FileName = spoolFileName(seq);
+    File file = spoolFS->open(FileName, FILE_READ);
+    String fName = file ? file.readStringUntil('\n') : "";
+    size_t len = file ? file.size() - file.position() : 0;
+    uint8_t *buf = NULL;
+    if (len) buf = (uint8_t *)heap_caps_malloc(len, psramFound() ? (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT) : MALLOC_CAP_8BIT);
+    bool readOk = buf && file.read(buf, len) == len;
+    file.close();
+    xSemaphoreGive(spoolMutex);
+
+    if (!readOk) {
+        if (buf) heap_caps_free(buf);
+        if (!buf && len) return 0;                 // out of memory, try again later
+        log_system_message("Error: discarding unreadable spooled image " + FileName);
+        xSemaphoreTake(spoolMutex, portMAX_DELAY);
+        if (spoolTail == seq) spoolDropOldest();
+        xSemaphoreGive(spoolMutex);
+        return 1;
+    }
+
+    int status = postImage(buf, len, fName, OUT_BACKLOG);
+    heap_caps_free(buf);
+    bool ok = (status / 100 == 2);
+    bool rejected = !ok && !spoolRetryable(status);
+    if (ok || rejected) {
+        xSemaphoreTake(spoolMutex, portMAX_DELAY);
+        if (spoolTail == seq) spoolDropOldest();     // unless it was dropped to make room meanwhile
+        xSemaphoreGive(spoolMutex);
+    }
+    if (ok) spoolSent++;
+    if (rejected) {
+        spoolRejected++;
+        log_system_message("Error: spooled image '" + fName + "' rejected by the server (status " + String(status) + "), dropped");
+    }
+    return ok || rejected;
+}
+
+
+// ----------------------------------------------------------------
+//                  -background task sending the spool
+// ----------------------------------------------------------------
+static void spoolTask(void *) {
+    uint32_t nextAttempt = 0;
+    for (;;) {
+        vTaskDelay(pdMS_TO_TICKS(spoolDrainInterval));
+        if (spoolCount() == 0 || !PostImages || WiFi.status() != WL_CONNECTED) {
+            spoolDrainCount = 0;
+            continue;
+        }
+        if (spoolBackoff && (int32_t)(millis() - nextAttempt) < 0) continue;
+        if (postActive || postSink.waiting()) continue;      // live images go first
+        if (spoolDrainCount == 0) spoolDrainStart = millis();
+        if (spoolSendOldest()) {
+            spoolDrainCount++;
+            spoolBackoff = 0;
+            if (spoolCount() == 0) log_system_message("Upload spool empty, " + String(spoolDrainCount) + " images sent");
+        } else {
+            spoolSendFailures++;
+            spoolDrainCount = 0;
+            spoolBackoff = spoolBackoff ? min(spoolBackoff * 2, spoolMaxBackoff) : spoolMinBackoff;
+            nextAttempt = millis() + spoolBackoff;
+        }
+    }
+}
+
+
+// ----------------------------------------------------------------
+//                          -setup
+// ----------------------------------------------------------------
+// find any images left in the spool and start the task sending them, called from setup once the sd card is set up
+bool spoolSetup() {
+    spoolFS = SD_Present ? (fs::FS *)&SD_MMC : (fs::FS *)&SPIFFS;
+    spoolMutex = xSemaphoreCreateMutex();
+    if (SD_Present) SD_MMC.mkdir(spoolDir);
+
+    // find the range of sequence numbers in the spool (Spiffs has no real folders so list everything)
+    File dir = SD_Present ? SD_MMC.open(spoolDir) : SPIFFS.open("/");
+    uint32_t first = 0, last = 0;
+    if (dir && dir.isDirectory()) {
+        File file = dir.openNextFile();
+        while (file) {
+            String path = file.name();
+            if (path.endsWith(".spl")) {
+                uint32_t seq = path.substring(path.lastIndexOf('/') + 1).toInt();
+                if (seq && (first == 0 || seq < first)) first = seq;
+                if (seq > last) last = seq;
+                spoolBytes += file.size();
+            }
+            file.close();
+            file = dir.openNextFile();
+        }
+        dir.close();
+    }
+    if (first) {
+        spoolTail = first;
+        spoolHead = last + 1;
+        log_system_message(String(spoolCount()) + " images waiting in the upload spool");
+    }
+
+    if (xTaskCreate(spoolTask, "spool", 6144, NULL, 1, NULL) != pdPASS) {
+        log_system_message("Error: Unable to start upload spool task");
+        return 0;
+    }
+    return 1;
+}
+
+
+// spool status for the root web page
+String spoolStatus() {
+    if (spoolAdded + spoolCount() == 0) return "";
+    String reply = "Upload spool (" + String(spoolFS == &SPIFFS ? "Spiffs" : "SD") + "): " + String(spoolCount()) + " waiting " + String(spoolBytes / 1024) + "K";
+    reply += " - " + String(spoolSent) + " sent";
+    if (spoolDrainCount > 1) reply += " at " + String(spoolDrainCount * 60000.0 / max((uint32_t)(millis() - spoolDrainStart), (uint32_t)1), 1) + "/min";
+    if (spoolRejected) reply += " <font color='#FF0000'>" + String(spoolRejected) + " rejected</font>";
+    if (spoolDropped) reply += " <font color='#FF0000'>" + String(spoolDropped) + " dropped</font>";
+    if (spoolBackoff) reply += " - retry in " + String(spoolBackoff / 1000) + "s";
+    return reply;
+}
+
+// ---------------------------------------------- end ----------------------------------------------
@@ -23,22 +23,17 @@ const char htmlSpace[] = "&ensp;";                        // leave a space
 
 // misc variables
 static String lastClient = "n/a";                  // IP address of most recent client connected
-static const byte LogNumber = 30;                  // number of entries in the system log
-static String system_message[LogNumber + 1];       // system log message store  (suspect serial port issues caused if not +1 ???)
-static int system_message_pointer = 0;             // pointer for current system message position
+void warmSave();                                   // warmstate.h
 
 // ----------------------------------------------------------------
 //                      -log a system message
 // ----------------------------------------------------------------
+// the log is kept in logring.h, messages logged often should use logPrintf() instead
 void log_system_message(String smes) {
-    // add the new message to log
-    system_message[system_message_pointer] = currentTime(0) + " - " + smes;
-
-    // also send the message to serial
-    if (serialDebug) Serial.println("Log:" + system_message[system_message_pointer]);
-    // increment position pointer
-    system_message_pointer++;
-    if (system_message_pointer >= LogNumber) system_message_pointer = 0;
+    uint8_t level = LOG_INFO;
+    if (smes.startsWith("Error")) level = LOG_ERROR;
+    else if (smes.startsWith("Warning")) level = LOG_WARN;
+    logPrintf(level, "%s", smes.c_str());
 }
 
 // --------------------------------------------------------------------------------------
@@ -186,13 +181,23 @@ void handleLogpage() {
     // start of section
     client.println("<P><br>SYSTEM LOG<br><br>");
     // list all system messages
-    int lpos = system_message_pointer;         // most recent entry
-    for (int i=0; i < LogNumber; i++){         // count through number of entries
-        client.print(system_message[lpos]);
+    // copied first so the log is not held while a slow client takes the page
+    char tbuf[24];
+    uint8_t *copy = (uint8_t *)malloc(logArenaSize);
+    size_t copied = copy ? logCopy(copy, logArenaSize) : 0;
+    if (!copy) client.println("Not enough memory to show the log<br>");
+    for (size_t pos = 0; pos < copied; ) {                               // most recent entry first
+        const logEntry_t *e = (const logEntry_t *)(copy + pos);
+        client.print(logTime(e, tbuf, sizeof(tbuf)));
+        client.print(" - ");
+        if (e->level <= LOG_WARN) client.print(colRed);
+        client.print(e->text);
+        if (e->level <= LOG_WARN) client.print(colEnd);
         client.println("<br>");
-        if (lpos == 0) lpos = LogNumber;
-        lpos--;
+        pos += e->size;
     }
+    free(copy);
+    if (logDropped) client.printf("<br>%u earlier messages dropped<br>", logDropped);
     // close html page
     webfooter(client);                       // send html page footer
     delay(3);
@@ -207,6 +212,8 @@ void handleReboot(){
     String message = "Rebooting....";
     server.send(404, "text/plain", message);   // send reply as plain text
     // rebooting
+    journalFlush();      // write out the journal (journal.h)
+    warmSave();          // motion detection state kept in rtc memory (warmstate.h)
     delay(500);          // give time to send the above html
     ESP.restart();
     delay(5000);         // restart fails without this delay
@@ -0,0 +1,148 @@
+/**************************************************************************************************
+ *
+ *        Warm state - motion detection state kept in rtc memory over a restart of the esp32
+ *
+ *      When the camera stops responding RebootCamera() restarts the esp32, as do the watchdogs.  That lost
+ *      the frame motion is compared against, the exposure and gain learnt by AutoAdjustImage() (those in
+ *      the settings are only the last ones saved from the web page) and the trigger counters, so after a
+ *      restart it compared the first frame with an empty one and took many adjustments to get the
+ *      brightness back, false triggering meanwhile.
+ *
+ *      This state is now copied in to rtc slow memory after each frame.  Rtc memory marked RTC_NOINIT_ATTR
+ *      is not cleared by a restart (only when the power goes off), at boot the state is used again if its
+ *      crc is good and it is from this version of the sketch, so detection carries on from the first frame.
+ *      There are two copies, written in turn, so a restart part way through saving one still leaves the
+ *      other.  The log is not kept here, that is in the journal (journal.h).
+ *
+ **************************************************************************************************/
+
+// usage:   warmRestore();        // in setup before the camera is started
+//          warmSave();           // after each frame and before restarting the esp32
+
+
+//  ----------------------  s e t t i n g s --------------------------
+const uint16_t warmVersion = 1;                  // change if warmState_t changes
+//  ------------------------------------------------------------------
+
+#include <esp_attr.h>                            // RTC_NOINIT_ATTR
+#include <esp_system.h>                          // esp_reset_reason()
+#include <rom/crc.h>
+
+#define WARM_MAGIC 0x4D524157                    // "WARM"
+
+struct warmState_t {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t size;                               // sizeof(warmState_t)
+    uint32_t seq;                                // which copy is newer
+    // state
+    uint16_t prevFrame[H][W];                    // frame motion is compared against
+    uint8_t format;                              // detectionFormat it was captured in
+    uint8_t spare;
+    uint16_t averagePix;
+    uint16_t tCounter;
+    int16_t spiffsFileCounter;
+    float exposure;                              // cameraImageExposure
+    float gain;                                  // cameraImageGain
+    uint32_t triggers;                           // motion triggers since power on
+    uint32_t restarts;                           // warm restarts since power on
+    char triggerTime[64];                        // TriggerTime
+    uint32_t crc;                                // of everything above
+};
+
+// forward declarations
+bool warmRestore();
+void warmSave();
+String warmStatus();
+
+
+RTC_NOINIT_ATTR warmState_t warmCopy[2];         // in rtc slow memory, not cleared by a restart
+static uint32_t warmSeq = 0;
+bool warmRestored = 0;                           // state was restored at boot
+uint32_t warmTriggers = 0;                       // motion triggers since power on (kept over restarts)
+uint32_t warmRestarts = 0;                       // restarts since power on
+uint32_t warmSaveTime = 0;                       // time the last save took (us)
+
+
+static uint32_t warmCrc(const warmState_t &s) {
+    return crc32_le(0, (const uint8_t *)&s, offsetof(warmState_t, crc));
+}
+
+
+static bool warmValid(const warmState_t &s) {
+    return s.magic == WARM_MAGIC && s.version == warmVersion && s.size == sizeof(warmState_t) && s.crc == warmCrc(s);
+}
+
+
+// ----------------------------------------------------------------
+//                       -save the state
+// ----------------------------------------------------------------
+// writes over the older copy, the newer one is left alone until this one is complete
+
+void warmSave() {
+    uint32_t startTime = micros();
+    warmState_t &s = warmCopy[++warmSeq & 1];
+    s.magic = 0;                                 // not valid until it is all written
+    s.version = warmVersion;
+    s.size = sizeof(warmState_t);
+    s.seq = warmSeq;
+    memcpy(s.prevFrame, prev_frame, sizeof(s.prevFrame));
+    s.format = detectionFormat;
+    s.spare = 0;
+    s.averagePix = AveragePix;
+    s.tCounter = tCounter;
+    s.spiffsFileCounter = SpiffsFileCounter;
+    s.exposure = cameraImageExposure;
+    s.gain = cameraImageGain;
+    s.triggers = warmTriggers;
+    s.restarts = warmRestarts;
+    strlcpy(s.triggerTime, TriggerTime.c_str(), sizeof(s.triggerTime));
+    s.magic = WARM_MAGIC;
+    s.crc = warmCrc(s);
+    warmSaveTime = micros() - startTime;
+}
+
+
+// ----------------------------------------------------------------
+//                      -restore the state
+// ----------------------------------------------------------------
+// call once detectionFormat is known (after prerollSetup) and before the camera is started,
+// returns 1 if the state was restored
+
+bool warmRestore() {
+    esp_reset_reason_t reason = esp_reset_reason();
+    bool valid0 = warmValid(warmCopy[0]);
+    bool valid1 = warmValid(warmCopy[1]);
+    if (reason == ESP_RST_POWERON || (!valid0 && !valid1)) {         // rtc memory holds nothing (or rubbish)
+        memset(warmCopy, 0, sizeof(warmCopy));
+        return 0;
+    }
+    const warmState_t &s = (valid0 && (!valid1 || (int32_t)(warmCopy[0].seq - warmCopy[1].seq) > 0)) ? warmCopy[0] : warmCopy[1];
+
+    if (s.format == detectionFormat) {          // blocks from jpg and greyscale frames can not be compared
+        memcpy(prev_frame, s.prevFrame, sizeof(prev_frame));
+        memcpy(current_frame, s.prevFrame, sizeof(current_frame));
+    }
+    AveragePix = s.averagePix;
+    tCounter = s.tCounter;
+    if (s.spiffsFileCounter >= 0 && s.spiffsFileCounter <= MaxSpiffsImages) SpiffsFileCounter = s.spiffsFileCounter;
+    if (s.exposure >= 0 && s.exposure <= 1200) cameraImageExposure = s.exposure;
+    if (s.gain >= 0 && s.gain <= 30) cameraImageGain = s.gain;
+    TriggerTime = String(s.triggerTime);
+    warmTriggers = s.triggers;
+    warmRestarts = s.restarts + 1;
+    warmSeq = s.seq;
+    warmRestored = 1;
+    logPrintf(LOG_INFO, "Detection state restored from before the restart (exposure %d, gain %d)", (int)cameraImageExposure, (int)cameraImageGain);
+    return 1;
+}
+
+
+// warm state status for the root web page
+String warmStatus() {
+    String reply = "Warm state: " + String(warmRestored ? "restored at boot" : "cold start") + ", " + String(warmRestarts) + " restarts and " +
+                   String(warmTriggers) + " triggers since power on, saved in " + String(warmSaveTime) + "us";
+    return reply;
+}
+
+// ---------------------------------------------- end ----------------------------------------------